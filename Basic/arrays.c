@@ -3,6 +3,7 @@
 // Utility functions for BASIC arrays.
 
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include "arrays.h"
 #include "utils.h"
@@ -70,13 +71,34 @@ struct numeric_array * new_numeric_array(unsigned base, unsigned dimensions, con
   if (!init_array_size(&size, base, dimensions, max))
     return NULL;
 
-  struct numeric_array * p = ecalloc(1, sizeof *p + size.elements * sizeof p->val[0]);
+  struct numeric_array * p = ecalloc_in(MEM_ARRAYS, 1, sizeof *p + size.elements * sizeof p->val[0]);
   p->size = size;
   return p;
 }
 
 void delete_numeric_array(struct numeric_array * p) {
-  efree(p);
+  if (p && p->shares)
+    p->shares--;
+  else
+    efree(p);
+}
+
+struct numeric_array * share_numeric_array(struct numeric_array * p) {
+  if (p)
+    p->shares++;
+  return p;
+}
+
+// Return an array which only the caller owns, with the same elements.
+struct numeric_array * unshare_numeric_array(struct numeric_array * p) {
+  if (p == NULL || p->shares == 0)
+    return p;
+  size_t size = sizeof *p + p->size.elements * sizeof p->val[0];
+  struct numeric_array * copy = emalloc_in(MEM_ARRAYS, size);
+  memcpy(copy, p, size);
+  copy->shares = 0;
+  p->shares--;
+  return copy;
 }
 
 bool compute_numeric_element(struct numeric_array * p, unsigned dimensions, const unsigned indexes[], double* *addr) {
@@ -95,19 +117,40 @@ struct string_array * new_string_array(unsigned base, unsigned dimensions, const
   if (!init_array_size(&size, base, dimensions, max))
     return NULL;
 
-  struct string_array * p = ecalloc(1, sizeof *p + size.elements * sizeof p->val[0]);
+  struct string_array * p = ecalloc_in(MEM_ARRAYS, 1, sizeof *p + size.elements * sizeof p->val[0]);
   p->size = size;
   return p;
 }
 
-void delete_string_array(struct string_array * p) {
-  if (p) {
+void delete_string_array(struct string_array * p, STRING_HEAP* strings) {
+  if (p && p->shares)
+    p->shares--;
+  else if (p) {
     for (unsigned i = 0; i < p->size.elements; i++)
-      efree(p->val[i]);
+      heap_free(strings, p->val[i]);
     efree(p);
   }
 }
 
+struct string_array * share_string_array(struct string_array * p) {
+  if (p)
+    p->shares++;
+  return p;
+}
+
+// Return an array which only the caller owns, with copies of the same strings.
+struct string_array * unshare_string_array(struct string_array * p, STRING_HEAP* strings) {
+  if (p == NULL || p->shares == 0)
+    return p;
+  struct string_array * copy = emalloc_in(MEM_ARRAYS, sizeof *p + p->size.elements * sizeof p->val[0]);
+  copy->size = p->size;
+  copy->shares = 0;
+  for (unsigned i = 0; i < p->size.elements; i++)
+    copy->val[i] = heap_strdup(strings, p->val[i]);
+  p->shares--;
+  return copy;
+}
+
 bool compute_string_element(struct string_array * p, unsigned dimensions, const unsigned indexes[], char* * *addr) {
   unsigned offset;
   if (compute_element_offset(&p->size, dimensions, indexes, &offset)) {
@@ -377,7 +420,7 @@ static void test_string_array(CuTest* tc) {
   indexes[0] = 5;
   CuAssertIntEquals(tc, false, compute_string_element(p, 1, indexes, &addr));
 
-  delete_string_array(p);
+  delete_string_array(p, NULL);
 
   // array(1..2,1..3)
   max[0] = 2;
@@ -415,7 +458,44 @@ static void test_string_array(CuTest* tc) {
   indexes[1] = 1;
   CuAssertIntEquals(tc, false, compute_string_element(p, 1, indexes, &addr));
 
-  delete_string_array(p);
+  delete_string_array(p, NULL);
+}
+
+static void test_share_arrays(CuTest* tc) {
+  const unsigned max[1] = { 3 };
+  const unsigned index[1] = { 2 };
+
+  struct numeric_array * p = new_numeric_array(0, 1, max);
+  double* addr;
+  CuAssertIntEquals(tc, true, compute_numeric_element(p, 1, index, &addr));
+  *addr = 7;
+  struct numeric_array * q = share_numeric_array(p);
+  CuAssertPtrEquals(tc, p, q);
+  CuAssertIntEquals(tc, 1, p->shares);
+  q = unshare_numeric_array(q);
+  CuAssertTrue(tc, p != q);
+  CuAssertIntEquals(tc, 0, p->shares);
+  CuAssertIntEquals(tc, 0, q->shares);
+  CuAssertDblEquals(tc, 7, q->val[2], 0);
+  CuAssertPtrEquals(tc, q, unshare_numeric_array(q));
+  delete_numeric_array(p);
+  delete_numeric_array(q);
+
+  STRING_HEAP* strings = new_string_heap();
+  struct string_array * s = new_string_array(0, 1, max);
+  s->val[2] = heap_strdup(strings, "two");
+  struct string_array * t = share_string_array(s);
+  delete_string_array(t, strings);
+  CuAssertIntEquals(tc, 0, s->shares);
+  t = unshare_string_array(share_string_array(s), strings);
+  CuAssertTrue(tc, s != t);
+  CuAssertStrEquals(tc, "two", t->val[2]);
+  CuAssertTrue(tc, s->val[2] != t->val[2]);
+  CuAssertPtrEquals(tc, NULL, t->val[1]);
+  delete_string_array(s, strings);
+  delete_string_array(t, strings);
+  CuAssertIntEquals(tc, 0, heap_strings(strings));
+  delete_string_heap(strings);
 }
 
 CuSuite* arrays_test_suite(void) {
@@ -425,6 +505,7 @@ CuSuite* arrays_test_suite(void) {
   SUITE_ADD_TEST(suite, test_compute_element_offset);
   SUITE_ADD_TEST(suite, test_numeric_array);
   SUITE_ADD_TEST(suite, test_string_array);
+  SUITE_ADD_TEST(suite, test_share_arrays);
   return suite;
 }
 
@@ -5,6 +5,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include "strheap.h"
 
 #define MAX_DIMENSIONS (2)
 
@@ -17,20 +18,30 @@ struct array_size {
   unsigned elements;
 };
 
+// An array may be shared between cloned VMs: shares counts the other owners.
+// Delete releases one owner. Unshare before changing elements.
+// The elements of a string array are allocated from the given string heap.
+
 struct numeric_array {
   struct array_size size;
+  unsigned shares;
   double val[0];
 };
 
 struct numeric_array * new_numeric_array(unsigned base, unsigned dimensions, const unsigned max[]);
 void delete_numeric_array(struct numeric_array *);
+struct numeric_array * share_numeric_array(struct numeric_array *);
+struct numeric_array * unshare_numeric_array(struct numeric_array *);
 bool compute_numeric_element(struct numeric_array *, unsigned dimensions, const unsigned indexes[], double* *addr);
 
 struct string_array {
   struct array_size size;
+  unsigned shares;
   char* val[0];
 };
 
 struct string_array * new_string_array(unsigned base, unsigned dimensions, const unsigned max[]);
-void delete_string_array(struct string_array *);
+void delete_string_array(struct string_array *, STRING_HEAP*);
+struct string_array * share_string_array(struct string_array *);
+struct string_array * unshare_string_array(struct string_array *, STRING_HEAP*);
 bool compute_string_element(struct string_array *, unsigned dimensions, const unsigned indexes[], char* * *addr);
@@ -127,6 +127,10 @@ static void check(unsigned opcode) {
     fatal("internal error: opcode out of range\n");
 }
 
+bool bcode_valid(int opcode) {
+  return opcode >= 0 && (unsigned) opcode < sizeof ops / sizeof ops[0];
+}
+
 const char* bcode_name(int opcode) {
   check(opcode);
   return ops[opcode].name;
@@ -138,25 +142,43 @@ int bcode_format(int opcode) {
 }
 
 BCODE* new_bcode(void) {
-  BCODE* p = emalloc(sizeof *p);
+  BCODE* p = emalloc_in(MEM_BCODE, sizeof *p);
   p->inst = NULL;
   p->allocated = 0;
   p->used = 0;
   p->has_data = false;
+  p->strings = NULL;
+  p->segments = NULL;
+  p->segment_count = 0;
   return p;
 }
 
 void delete_bcode(BCODE* p) {
   if (p) {
-    for (unsigned i = 0; i < p->used; i++) {
-      if (p->inst[i].op < sizeof ops / sizeof ops[0] && ops[p->inst[i].op].format == BF_STR)
-        efree(p->inst[i].u.str);
-    }
+    delete_arena(p->strings);
+    efree(p->segments);
     efree(p->inst);
     efree(p);
   }
 }
 
+void bcode_reserve(BCODE* p, unsigned instructions) {
+  assert(p != NULL);
+  if (instructions > p->allocated) {
+    p->allocated = instructions;
+    p->inst = erealloc_in(MEM_BCODE, p->inst, p->allocated * sizeof p->inst[0]);
+  }
+}
+
+char* bcode_strdup(BCODE* p, const char* s) {
+  assert(p != NULL);
+  if (s == NULL)
+    return NULL;
+  if (p->strings == NULL)
+    p->strings = new_arena(MEM_BCODE, 256);
+  return arena_strdup(p->strings, s);
+}
+
 const BINST* bcode_latest(const BCODE* p) {
   assert(p != NULL);
   return p->used ? &p->inst[p->used - 1] : NULL;
@@ -167,7 +189,7 @@ BINST* bcode_next(BCODE* p, unsigned op) {
   assert(p->used <= p->allocated);
   if (p->used == p->allocated) {
     p->allocated = p->allocated ? 2 * p->allocated : 128;
-    p->inst = erealloc(p->inst, p->allocated * sizeof p->inst[0]);
+    p->inst = erealloc_in(MEM_BCODE, p->inst, p->allocated * sizeof p->inst[0]);
   }
   assert(p->used < p->allocated);
   BINST* i = &p->inst[p->used++];
@@ -177,6 +199,22 @@ BINST* bcode_next(BCODE* p, unsigned op) {
   return i;
 }
 
+void bcode_append(BCODE* p, const BINST* inst, unsigned count) {
+  assert(p != NULL);
+  if (p->used + count > p->allocated) {
+    unsigned allocated = p->allocated ? p->allocated : 128;
+    while (p->used + count > allocated)
+      allocated *= 2;
+    bcode_reserve(p, allocated);
+  }
+  memcpy(p->inst + p->used, inst, count * sizeof inst[0]);
+  p->used += count;
+  for (unsigned i = 0; i < count && !p->has_data; i++) {
+    if (inst[i].op == B_DATA)
+      p->has_data = true;
+  }
+}
+
 static unsigned def_end(const BCODE* code, unsigned pc) {
   assert(code != NULL);
   assert(pc < code->used);
@@ -186,11 +224,11 @@ static unsigned def_end(const BCODE* code, unsigned pc) {
   return pc;
 }
 
-static BINST copy_inst(const BINST* i) {
+static BINST copy_inst(BCODE* dst, const BINST* i) {
   BINST j = *i;
   assert(j.op < sizeof ops / sizeof ops[0]);
   if (ops[j.op].format == BF_STR)
-    j.u.str = estrdup(j.u.str);
+    j.u.str = bcode_strdup(dst, j.u.str);
   return j;
 }
 
@@ -199,10 +237,10 @@ BCODE* bcode_copy_def(const BCODE* src, unsigned start) {
   unsigned len = end - start;
   unsigned size = len + 1;
   BCODE* dst = new_bcode();
-  dst->inst = emalloc(size * sizeof dst->inst[0]);
+  dst->inst = emalloc_in(MEM_BCODE, size * sizeof dst->inst[0]);
   dst->allocated = size;
   for (unsigned i = 0; i < len; i++)
-    dst->inst[i] = copy_inst(&src->inst[start + i]);
+    dst->inst[i] = copy_inst(dst, &src->inst[start + i]);
   dst->inst[len].op = B_END_DEF;
   dst->used = size;
   return dst;
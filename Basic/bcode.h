@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include "source.h"
 #include "linemap.h"
+#include "arena.h"
 
 enum {
   // placeholder
@@ -133,6 +134,7 @@ enum bcode_format {
   BF_COUNT,
 };
 
+bool bcode_valid(int opcode);
 const char* bcode_name(int opcode);
 int bcode_format(int opcode);
 
@@ -155,17 +157,35 @@ typedef struct {
   } u;
 } BINST;
 
+// The B-code of one source line, from its B_SOURCE_LINE instruction
+// to the next line's.
+struct bcode_segment {
+  unsigned line_id;  // source_line_id of the line parsed
+  unsigned start;
+};
+
 typedef struct {
   BINST* inst;
   unsigned allocated;
   unsigned used;
   bool has_data;
+  ARENA* strings;  // string operands, freed with the B-code
+  struct bcode_segment * segments;  // of each source line parsed, or NULL
+  unsigned segment_count;
 } BCODE;
 
 BCODE* new_bcode(void);
 void delete_bcode(BCODE*);
+
+// Make room for at least the given number of instructions.
+void bcode_reserve(BCODE*, unsigned instructions);
+
+// Copy a string operand into storage owned by the B-code.
+char* bcode_strdup(BCODE*, const char*);
 const BINST* bcode_latest(const BCODE*);
 BINST* bcode_next(BCODE*, unsigned op);
+// Append copies of instructions, whose string operands the B-code must own.
+void bcode_append(BCODE*, const BINST*, unsigned count);
 
 BCODE* bcode_copy_def(const BCODE*, unsigned start);
 
@@ -6,16 +6,25 @@
 #include "utils.h"
 
 struct def * new_def(BCODE* bc, SOURCE* source, unsigned source_line) {
-  struct def * def = emalloc(sizeof *def);
+  struct def * def = emalloc_in(MEM_DEF, sizeof *def);
   def->bcode = bc;
   def->source = source;
   def->source_line = source_line;
+  def->shares = 0;
   return def;
 }
 
 void delete_def(struct def * def) {
-  if (def) {
+  if (def && def->shares)
+    def->shares--;
+  else if (def) {
     delete_bcode(def->bcode);
     efree(def);
   }
 }
+
+struct def * share_def(struct def * def) {
+  if (def)
+    def->shares++;
+  return def;
+}
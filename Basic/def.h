@@ -11,9 +11,13 @@ struct def {
   BCODE* bcode;
   SOURCE* source; // reference to stored program source if applicable
   unsigned source_line;
+  unsigned shares; // count of other owners: definitions are shared by cloned VMs
 };
 
 // takes ownership of the BCODE
 struct def * new_def(BCODE*, SOURCE*, unsigned source_line);
 
+// release one owner
 void delete_def(struct def *);
+
+struct def * share_def(struct def *);
@@ -28,7 +28,7 @@ void emit_num(BCODE* bcode, unsigned op, double num) {
 
 void emit_str(BCODE* bcode, unsigned op, const char* str) {
   BINST* i = bcode_next(bcode, op);
-  i->u.str = estrdup(str);
+  i->u.str = bcode_strdup(bcode, str);
 }
 
 void emit_str_ptr(BCODE* bcode, unsigned op, char* str) {
@@ -103,7 +103,7 @@ static void test_emit(CuTest* tc) {
   CuAssertStrEquals(tc, STR, bcode->inst[3].u.str);
   CuAssertTrue(tc, bcode->inst[3].u.str != STR);
 
-  char* ptr = estrdup("sardines");
+  char* ptr = bcode_strdup(bcode, "sardines");
   emit_str_ptr(bcode, B_DATA, ptr);
   CuAssertIntEquals(tc, 5, bcode->used);
   CuAssertIntEquals(tc, B_DATA, bcode->inst[4].op);
@@ -0,0 +1,722 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// The B-code instruction dispatcher, included twice by run.c: once without
+// tracing, for running at full speed, and once checking the tracing options
+// and collecting profile samples.
+// Define EXECUTE as the name of the function, and TRACING as 0 or 1.
+
+static void EXECUTE(VM* vm) {
+  assert(vm->code_state.pc < vm->code_state.code->bcode->used);
+
+  const BINST* const i = vm->code_state.code->bcode->inst + vm->code_state.pc;
+
+  switch (i->op) {
+    case B_NOP:
+      break;
+    // source
+    case B_SOURCE_LINE:
+      vm->code_state.source_line = i->u.source_line;
+      if (TRACING && samples_waiting)
+        collect_samples(vm);
+      if (TRACING && vm->trace_basic) {
+        out_printf(vm, "[%u]", source_linenum(vm->code_state.code->source, i->u.source_line));
+        out_flush(vm);
+      }
+      if (TRACING && vm->trace_log) {
+        print_source_line(vm->code_state.code->source, vm->code_state.source_line, stderr);
+        putc('\n', stderr);
+      }
+      break;
+    // whole environment
+    case B_CLEAR:
+      vm_clear_values(vm);
+      break;
+    // number
+    case B_PUSH_NUM:
+      push(vm, i->u.num);
+      break;
+    case B_POP_NUM:
+      pop(vm);
+      break;
+    case B_GET_SIMPLE_NUM: {
+      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
+      get_numeric_simple(vm, sym);
+      break;
+    }
+    case B_SET_SIMPLE_NUM: {
+      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
+      set_numeric_simple(vm, sym, pop(vm));
+      break;
+    }
+    case B_DIM_NUM: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      assert(sym != NULL && sym->kind == SYM_ARRAY && sym->type == TYPE_NUM);
+      if (sym->val.numarr) {
+        assert(sym->defined);
+        delete_numeric_array(sym->val.numarr);
+        sym->val.numarr = NULL;
+        sym->defined = false;
+      }
+      unsigned max[MAX_DIMENSIONS];
+      pop_indexes(vm, max, i->u.param.params, sym->name);
+      dimension_numeric(vm, sym, i->u.param.params, max);
+      break;
+    }
+    case B_GET_PAREN_NUM: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      assert(sym != NULL && sym->type == TYPE_NUM);
+      // must be a parenthesised kind of symbol; not a builtin,
+      // which has its own opcodes; therefore array or user-defined function
+      if (sym->kind == SYM_ARRAY)
+        get_numeric_element(vm, sym, i->u.param.params);
+      else {
+        assert(sym->kind == SYM_DEF);
+        call_def(vm, sym, i->u.param.params);
+      }
+      break;
+    }
+    case B_SET_ARRAY_NUM: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_numeric_element(vm, sym, i->u.param.params, pop(vm));
+      break;
+    }
+    case B_NEG:
+      push(vm, - pop(vm));
+      break;
+    case B_ADD: {
+      double x = pop(vm);
+      push(vm, pop(vm) + x);
+      break;
+    }
+    case B_SUB: {
+      double x = pop(vm);
+      push(vm, pop(vm) - x);
+      break;
+    }
+    case B_MUL: {
+      double x = pop(vm);
+      push(vm, pop(vm) * x);
+      break;
+    }
+    case B_DIV: {
+      double x = pop(vm);
+      push(vm, pop(vm) / x);
+      break;
+    }
+    case B_POW: {
+      double x = pop(vm);
+      push(vm, pow(pop(vm), x));
+      break;
+    }
+    case B_EQ_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) == x);
+      break;
+    }
+    case B_LT_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) < x);
+      break;
+    }
+    case B_GT_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) > x);
+      break;
+    }
+    case B_NE_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) != x);
+      break;
+    }
+    case B_LE_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) <= x);
+      break;
+    }
+    case B_GE_NUM: {
+      double x = pop(vm);
+      push_logic(vm, pop(vm) >= x);
+      break;
+    }
+    case B_OR: {
+      int logic2 = pop_logic(vm);
+      int logic1 = pop_logic(vm);
+      push(vm, logic1 | logic2);
+      break;
+    }
+    case B_AND: {
+      int logic2 = pop_logic(vm);
+      int logic1 = pop_logic(vm);
+      push(vm, logic1 & logic2);
+      break;
+    }
+    case B_NOT: {
+      int logic = pop_logic(vm);
+      push(vm, ~logic);
+      break;
+    }
+    // string
+    case B_PUSH_STR:
+      push_str(vm, i->u.str);
+      break;
+    case B_POP_STR:
+      heap_free(vm->st->strings, pop_str(vm));
+      break;
+    case B_SET_SIMPLE_STR: {
+      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
+      set_string_simple(vm, sym, pop_str(vm));
+      break;
+    }
+    case B_GET_SIMPLE_STR: {
+      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
+      get_string_simple(vm, sym);
+      break;
+    }
+    case B_DIM_STR: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      assert(sym != NULL && sym->kind == SYM_ARRAY && sym->type == TYPE_STR);
+      if (sym->val.strarr) {
+        assert(sym->defined);
+        delete_string_array(sym->val.strarr, vm->st->strings);
+        sym->val.strarr = NULL;
+        sym->defined = false;
+      }
+      unsigned max[MAX_DIMENSIONS];
+      pop_indexes(vm, max, i->u.param.params, sym->name);
+      dimension_string(vm, sym, i->u.param.params, max);
+      break;
+    }
+    case B_GET_PAREN_STR: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      assert(sym != NULL && sym->type == TYPE_STR);
+      // must be a parenthesised kind of symbol; not a builtin,
+      // which has its own opcodes; therefore array or user-defined function
+      if (sym->kind == SYM_ARRAY)
+        get_string_element(vm, sym, i->u.param.params);
+      else {
+        assert(sym->kind == SYM_DEF);
+        call_def(vm, sym, i->u.param.params);
+      }
+      break;
+    }
+    case B_SET_ARRAY_STR: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_string_element(vm, sym, i->u.param.params, pop_str(vm));
+      break;
+    }
+    case B_EQ_STR:
+      push_logic(vm, compare_strings(vm) == 0);
+      break;
+    case B_NE_STR:
+      push_logic(vm, compare_strings(vm) != 0);
+      break;
+    case B_LT_STR:
+      push_logic(vm, compare_strings(vm) < 0);
+      break;
+    case B_GT_STR:
+      push_logic(vm, compare_strings(vm) > 0);
+      break;
+    case B_LE_STR:
+      push_logic(vm, compare_strings(vm) <= 0);
+      break;
+    case B_GE_STR:
+      push_logic(vm, compare_strings(vm) >= 0);
+      break;
+    case B_CONCAT: {
+      char* t = pop_str(vm);
+      char* s = pop_str(vm);
+      size_t sz = strlen(s) + strlen(t);
+      char buf[256];
+      if (sz + 1 > sizeof buf)
+        run_error(vm, "concatenated string would be too long: %lu characters\n", (unsigned long)sz);
+      strcpy(buf, s);
+      strcat(buf, t);
+      push_str(vm, buf);
+      heap_free(vm->st->strings, s);
+      heap_free(vm->st->strings, t);
+      break;
+    }
+    // control flow
+    case B_END:
+      vm->code_state.pc = vm->code_state.code->bcode->used;
+      return;
+    case B_STOP:
+      vm->stopped = true;
+      return;
+    case B_GOTO:
+      go_to_basic_line(vm, i->u.basic_line.lineno);
+      return;
+    case B_GOTRUE:
+      if (pop(vm)) {
+        go_to_basic_line(vm, i->u.basic_line.lineno);
+        return;
+      }
+      break;
+    case B_GOSUB:
+      push_return(vm, vm->code_state.pc + 1);
+      go_to_basic_line(vm, i->u.basic_line.lineno);
+      return;
+    case B_RETURN:
+      pop_return(vm); // pops PC to continue from
+      return;
+    case B_FOR: {
+      if (TRACING && vm->trace_for)
+        dump_for(vm, "FOR");
+      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
+      assert(sym != NULL && sym->kind == SYM_VARIABLE && sym->type == TYPE_NUM);
+      int si = find_for(vm, i->u.symbol_id);
+      if (si >= 0) {
+        if (vm->strict_for)
+          run_error(vm, "already inside FOR loop controlled by this variable: %s\n", sym->name);
+        assert(vm->for_sp > 0);
+        if (si != vm->for_sp - 1) {
+          // bring inner loop to top of stack, for NEXT with no variable
+          struct for_loop inner = vm->for_stack[si];
+          for (unsigned k = si; k < vm->for_sp - 1; k++)
+            vm->for_stack[k] = vm->for_stack[k + 1];
+          vm->for_stack[vm->for_sp - 1] = inner;
+          si = vm->for_sp - 1;
+        }
+      }
+      else {
+        if (vm->for_sp >= MAX_FOR) {
+          dump_for_stack(vm, "overflow");
+          run_error(vm, "FOR is nested too deeply\n");
+        }
+        si = vm->for_sp++;
+      }
+      struct for_loop * f = &vm->for_stack[si];
+      f->code_state = vm->code_state;
+      f->symbol_id = i->u.symbol_id;
+      f->step = pop(vm);
+      f->limit = pop(vm);
+      sym->val.num = pop(vm);
+      sym->defined = true;
+      if (TRACING && vm->trace_for)
+        dump_for_stack(vm, "final stack");
+      break;
+    }
+    case B_NEXT_VAR: {
+      if (TRACING && vm->trace_for)
+        dump_for(vm, "NEXT-VARIABLE");
+      if (vm->for_sp == 0)
+        run_error(vm, "NEXT without FOR\n");
+      int si = vm->for_sp - 1;
+      struct for_loop * f = &vm->for_stack[si];
+      if (f->symbol_id != i->u.symbol_id) {
+        if (vm->strict_for) {
+          const char* for_name = sym_name(vm->st, f->symbol_id);
+          const char* next_name = sym_name(vm->st, i->u.symbol_id);
+          run_error(vm, "mismatched FOR variable: expecting %s, found %s\n", for_name, next_name);
+        }
+        si = find_for(vm, i->u.symbol_id);
+        if (si < 0)
+          run_error(vm, "NEXT without FOR: %s\n", sym_name(vm->st, i->u.symbol_id));
+        f = &vm->for_stack[si];
+      }
+      next(vm, si);
+      if (TRACING && vm->trace_for)
+        dump_for_stack(vm, "final stack");
+      break;
+    }
+    case B_NEXT_IMP: {
+      if (TRACING && vm->trace_for)
+        dump_for(vm, "NEXT-IMPLICIT");
+      if (vm->for_sp == 0)
+        run_error(vm, "NEXT without FOR\n");
+      next(vm, vm->for_sp - 1);
+      if (TRACING && vm->trace_for)
+        dump_for_stack(vm, "final stack");
+      break;
+    }
+    case B_DEF: {
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      assert(sym != NULL && sym->kind == SYM_DEF);
+      if (sym->val.def) {
+        assert(sym->defined);
+        delete_def(sym->val.def);
+        sym->val.def = NULL;
+        sym->defined = false;
+      }
+      if (i->u.param.params != 1)
+        run_error(vm, "unexpected number of parameters: %s\n", sym->name);
+      const BCODE* bcode = vm->code_state.code->bcode;
+      SOURCE* source = NULL;
+      unsigned source_line = 0;
+      if (vm->code_state.code == &vm->stored_program) {
+        source = vm->stored_program.source;
+        source_line = vm->code_state.source_line;
+      }
+      sym->val.def = new_def(bcode_copy_def(bcode, vm->code_state.pc), source, source_line);
+      sym->defined = true;
+      do {
+        vm->code_state.pc++;
+      } while (vm->code_state.pc < bcode->used && bcode->inst[vm->code_state.pc].op != B_END_DEF);
+      break;
+    }
+    case B_PARAM:
+      run_error(vm, "internal error: run into parameter\n");
+      break;
+    case B_END_DEF:
+      end_def(vm);
+      break;
+    case B_ON_GOTO:
+    case B_ON_GOSUB: {
+      double x = pop(vm);
+      if (x != floor(x))
+        run_error(vm, "ON value is invalid: %g\n", x);
+      if (x < 1 || x > i->u.count) {
+        if (vm->strict_on)
+          run_error(vm, "ON value is out of range: %g\n", x);
+        vm->code_state.pc += i->u.count + 1;
+        return;
+      }
+      unsigned k = vm->code_state.pc + (unsigned) x;
+      if (k >= vm->code_state.code->bcode->used || vm->code_state.code->bcode->inst[k].op != B_ON_LINE)
+        run_error(vm, "internal error: ON-LINE expected\n");
+      if (i->op == B_ON_GOSUB)
+        push_return(vm, vm->code_state.pc + i->u.count + 1);
+      go_to_basic_line(vm, vm->code_state.code->bcode->inst[k].u.basic_line.lineno);
+      return;
+    }
+    case B_IF_THEN: // IF ... THEN statements  -- skip to next line if condition false
+      if (!pop(vm)) {
+        do {
+          vm->code_state.pc++;
+        } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_SOURCE_LINE);
+        return;
+      }
+      break;
+    case B_IF_ELSE: // IF ... THEN statements ELSE statements -- skip to ELSE statements if condition false
+      if (!pop(vm)) {
+        do {
+          vm->code_state.pc++;
+        } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_ELSE);
+      }
+      break;
+    case B_ELSE: // THEN statements ELSE statements -- skip to next line after executing THEN section
+      do {
+        vm->code_state.pc++;
+      } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_SOURCE_LINE);
+      return;
+    // output
+    case B_PRINT_LN:
+      out_char(vm, '\n');
+      vm->col = 1;
+      break;
+    case B_PRINT_SPC: {
+      unsigned k = pop_unsigned(vm);
+      while (k--)
+        out_char(vm, ' '), vm->col++;
+      out_flush(vm);
+      break;
+    }
+    case B_PRINT_TAB: {
+      unsigned k = pop_unsigned(vm);
+      if (k < vm->col) {
+        out_char(vm, '\n');
+        vm->col = 1;
+      }
+      while (vm->col < k)
+        out_char(vm, ' '), vm->col++;
+      out_flush(vm);
+      break;
+    }
+    case B_PRINT_COMMA:
+      do {
+        out_char(vm, ' '), vm->col++;
+      } while (vm->col % TAB_SIZE != 1);
+      out_flush(vm);
+      break;
+    case B_PRINT_NUM:
+      vm->col += out_printf(vm, " %g ", pop(vm));
+      out_flush(vm);
+      break;
+    case B_PRINT_STR: {
+      char* s = pop_str(vm);
+      for (const char* S = s; *S; S++) {
+        out_char(vm, *S);
+        if (*S == '\n')
+          vm->col = 1;
+        else
+          vm->col++;
+      }
+      heap_free(vm->st->strings, s);
+      out_flush(vm);
+      break;
+    }
+    case B_CLS:
+      if (vm->hosted)
+        out_str(vm, "\033[2J\033[H"); // the host's terminal is not ours to clear
+      else
+        clear_screen();
+      vm->col = 1;
+      break;
+    // input
+    case B_INPUT_BUF:
+      if (vm->hosted) {
+        // yield until the caller provides a line of input
+        if (!take_input_line(vm)) {
+          if (!vm->prompted)
+            prompt_input(vm, i->u.str);
+          vm->prompted = true;
+          vm->yield = VM_NEEDS_INPUT;
+          return;
+        }
+        vm->prompted = false;
+      }
+      else {
+        prompt_input(vm, i->u.str);
+        restore_keyboard();
+        if (fgets(vm->input, sizeof vm->input, stdin) == NULL) {
+          if (ferror(stdin))
+            run_error(vm, "error reading input\n");
+        }
+      }
+      vm->inp = 0;
+      vm->input_pc = vm->code_state.pc;
+      break;
+    case B_INPUT_END: {
+      int c;
+      while ((c = vm->input[vm->inp]) == ' ' || c == '\t' || c == '\n' || c == '\r')
+        vm->inp++;
+      if (c != '\0')
+        out_str(vm, "* Extra input was discarded *\n");
+      break;
+    }
+    case B_INPUT_SEP: {
+      int c;
+      while ((c = vm->input[vm->inp]) == ' ' || c == '\t')
+        vm->inp++;
+      if (c == ',') {
+        vm->inp++;
+        break;
+      }
+      out_str(vm, "* More input items are expected *\n");
+      vm->code_state.pc = vm->input_pc;
+      return;
+    }
+    case B_INPUT_NUM: {
+      double x;
+      const char* t = convert(vm->input + vm->inp, &x);
+      if (t != NULL && (*t == '\0' || *t == '\n' || *t == ',')) {
+        SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+        set_numeric(vm, sym, i->u.param.params, x);
+        vm->inp = (int) (t - vm->input);
+        break;
+      }
+      out_str(vm, "* Invalid input *\n");
+      vm->code_state.pc = vm->input_pc;
+      return;
+    }
+    case B_INPUT_STR: {
+      const char* s = vm->input + vm->inp;
+      int c;
+      while ((c = vm->input[vm->inp]) != '\0' && c != '\n' && c != ',')
+        vm->inp++;
+      vm->input[vm->inp] = '\0';
+      char* t = heap_strdup(vm->st->strings, s);
+      vm->input[vm->inp] = c;
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_string(vm, sym, i->u.param.params, t);
+      break;
+    }
+    case B_INPUT_LINE: {
+      char* s = strchr(vm->input, '\n');
+      if (s)
+        *s = '\0';
+      s = heap_strdup(vm->st->strings, vm->input);
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_string(vm, sym, i->u.param.params, s);
+      break;
+    }
+    // inline data
+    case B_DATA:
+      break;
+    case B_READ_NUM: {
+      const char* S = find_data(vm);
+      double x;
+      const char* t = convert(S, &x);
+      if (t == NULL || *t != '\0')
+        run_error(vm, "numeric data expected: %s\n", S);
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_numeric(vm, sym, i->u.param.params, x);
+      break;
+    }
+    case B_READ_STR: {
+      const char* S = find_data(vm);
+      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
+      set_string(vm, sym, i->u.param.params, heap_strdup(vm->st->strings, S));
+      break;
+    }
+    case B_RESTORE:
+      vm->program_data = 0;
+      vm->immediate_data = 0;
+      break;
+    case B_RESTORE_LINE:
+      vm->program_data = find_basic_line(vm, i->u.basic_line.lineno);
+      break;
+    // random
+    case B_RAND:
+      seed_rng(vm, (unsigned)time(NULL));
+      break;
+    case B_SEED:
+      seed_rng(vm, pop_unsigned(vm));
+      break;
+    // builtins
+    case B_ASC: {
+      char* s = pop_str(vm);
+      push(vm, s[0]);
+      heap_free(vm->st->strings, s);
+      break;
+    }
+    case B_ABS:
+      push(vm, fabs(pop(vm)));
+      break;
+    case B_ATN:
+      push(vm, atan(pop(vm)));
+      break;
+    case B_CHR: {
+      double x = pop(vm);
+      if (x < 0 || x > 255 || x != floor(x))
+        run_error(vm, "invalid character code: %g\n", x);
+      char buf[2];
+      buf[0] = (char) x;
+      buf[1] = '\0';
+      push_str(vm, buf);
+      break;
+    }
+    case B_COS:
+      push(vm, cos(pop(vm)));
+      break;
+    case B_EXP:
+      push(vm, exp(pop(vm)));
+      break;
+    case B_INKEY: {
+      char buf[2] = "";
+      int c = vm->hosted ? take_key(vm) : poll_key();
+      if (c > 0)
+        buf[0] = (char) c;
+      else if (vm->hosted)
+        vm->yield = VM_BUDGET_EXHAUSTED; // a program polling for keys gives way to the host
+      push_str(vm, buf);
+      break;
+    }
+    case B_INT:
+      push(vm, floor(pop(vm)));
+      break;
+    case B_LEFT: {
+      char* s = pop_str(vm);
+      unsigned u = pop_unsigned(vm);
+      size_t sz = strlen(s);
+      if (u > sz)
+        u = (unsigned long)sz;
+      char buf[256];
+      if (u + 1 > sizeof buf)
+        run_error(vm, STRING_TOO_LONG);
+      strncpy(buf, s, u);
+      buf[u] = '\0';
+      push_str(vm, buf);
+      heap_free(vm->st->strings, s);
+      break;
+    }
+    case B_LEN: {
+      char* s = pop_str(vm);
+      push(vm, (double) strlen(s));
+      heap_free(vm->st->strings, s);
+      break;
+    }
+    case B_LOG: {
+      double x = pop(vm);
+      if (x <= 0)
+        run_error(vm, "invalid logarithm\n");
+      push(vm, log(x));
+      break;
+    }
+    case B_MID3: {
+      char* s = pop_str(vm);
+      unsigned v = pop_unsigned(vm);
+      unsigned u = pop_unsigned(vm);
+      size_t sz = strlen(s);
+      if (u < 1 || u > sz)
+        run_error(vm, "string index out of range\n");
+      if (v > sz - u + 1)
+        v = (unsigned long)(sz - u + 1);
+      char buf[256];
+      if (v + 1 > sizeof buf)
+        run_error(vm, STRING_TOO_LONG);
+      strncpy(buf, s + u - 1, v);
+      buf[v] = '\0';
+      push_str(vm, buf);
+      heap_free(vm->st->strings, s);
+      break;
+    }
+    case B_STR: {
+      double x = pop(vm);
+      char buf[64];
+      sprintf(buf, "%g", x);
+      push_str(vm, buf);
+      break;
+    }
+    case B_RIGHT: {
+      char* s = pop_str(vm);
+      unsigned u = pop_unsigned(vm);
+      size_t sz = strlen(s);
+      if (u > sz)
+        u = (unsigned long)sz;
+      char buf[256];
+      if (u + 1 > sizeof buf)
+        run_error(vm, STRING_TOO_LONG);
+      strncpy(buf, s + sz - u, u);
+      buf[u] = '\0';
+      push_str(vm, buf);
+      heap_free(vm->st->strings, s);
+      break;
+    }
+    case B_RND:
+      push(vm, next_rng(vm));
+      break;
+    case B_SGN: {
+      double x = pop(vm);
+      if (x < 0)
+        x = -1;
+      else if (x > 0)
+        x = 1;
+      push(vm, x);
+      break;
+    }
+    case B_SIN:
+      push(vm, sin(pop(vm)));
+      break;
+     case B_SQR:
+      push(vm, sqrt(pop(vm)));
+      break;
+    case B_TAN:
+      push(vm, tan(pop(vm)));
+      break;
+    case B_TIME_STR: {
+      time_t t = time(NULL);
+      struct tm * tm = localtime(&t);
+      char buf[12];
+      sprintf(buf, "%02u:%02u:%02u", tm->tm_hour, tm->tm_min, tm->tm_sec);
+      push_str(vm, buf);
+      break;
+    }
+    case B_VAL: {
+      char* s = pop_str(vm);
+      double x;
+      const char* t = convert(s, &x);
+      if (t == NULL || *t != '\0')
+        run_error(vm, "invalid number: %s\n", s);
+      heap_free(vm->st->strings, s);
+      push(vm, x);
+      break;
+    }
+    // unknown opcode
+    default:
+      fputs("UNKNOWN OPCODE:\n", stderr);
+      print_binst(i, vm->code_state.pc, vm->code_state.code->source, vm->st, stderr);
+      run_error(vm, "unknown opcode: %u\n", i->op);
+  }
+  vm->code_state.pc++;
+}
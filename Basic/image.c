@@ -0,0 +1,689 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Precompiled B-code image files.
+
+// An image holds a compiled program so that it can be run without
+// lexing, parsing or indexing: the source line table (for LIST and
+// error messages), the symbol names and kinds that the B-code refers to
+// by ID, a table of the B-code's constant strings, the B-code itself,
+// and the line map. Integers are stored little-endian.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include "image.h"
+#include "builtin.h"
+#include "hash.h"
+#include "os.h"
+#include "utils.h"
+
+#define IMAGE_MAGIC "LBBC"
+
+// Increase when the image format or the B-code instruction set changes,
+// so that out of date images and cache entries are not used.
+#define IMAGE_VERSION (1)
+
+#define IMAGE_KEYWORDS_ANYWHERE (1)
+
+#define NO_STRING (0xffffffffU)
+
+void put_u8(FILE* fp, unsigned x) {
+  putc(x & 0xff, fp);
+}
+
+void put_u16(FILE* fp, unsigned x) {
+  put_u8(fp, x);
+  put_u8(fp, x >> 8);
+}
+
+void put_u32(FILE* fp, unsigned x) {
+  put_u16(fp, x);
+  put_u16(fp, x >> 16);
+}
+
+void put_num(FILE* fp, double x) {
+  unsigned long long u;
+  memcpy(&u, &x, sizeof u);
+  for (unsigned i = 0; i < 8; i++, u >>= 8)
+    put_u8(fp, (unsigned) u);
+}
+
+// Strings are stored with their length and a terminating NUL,
+// so that loaded strings can be used in place.
+void put_str(FILE* fp, const char* s) {
+  if (s == NULL)
+    put_u32(fp, NO_STRING);
+  else {
+    size_t len = strlen(s);
+    put_u32(fp, (unsigned) len);
+    fwrite(s, 1, len + 1, fp);
+  }
+}
+
+void write_image(FILE* fp, const IMAGE* image, const SYMTAB* st) {
+  assert(fp != NULL);
+  assert(image != NULL && image->source != NULL && image->bcode != NULL && image->index != NULL);
+  assert(st != NULL);
+
+  const SOURCE* src = image->source;
+  const BCODE* bc = image->bcode;
+
+  fwrite(IMAGE_MAGIC, 1, 4, fp);
+  put_u32(fp, IMAGE_VERSION);
+  put_u32(fp, image->keywords_anywhere ? IMAGE_KEYWORDS_ANYWHERE : 0);
+
+  put_str(fp, source_name(src));
+  put_u32(fp, source_lines(src));
+  for (unsigned i = 0; i < source_lines(src); i++) {
+    put_u32(fp, source_linenum(src, i));
+    put_str(fp, source_text(src, i));
+  }
+
+  put_u32(fp, st->used);
+  for (unsigned i = 0; i < st->used; i++) {
+    const SYMBOL* sym = st->psym[i];
+    put_u8(fp, sym->kind);
+    put_u8(fp, sym->type);
+    put_str(fp, sym->name);
+  }
+
+  unsigned strings = 0;
+  for (unsigned i = 0; i < bc->used; i++) {
+    if (bcode_format(bc->inst[i].op) == BF_STR && bc->inst[i].u.str)
+      strings++;
+  }
+  put_u32(fp, strings);
+  for (unsigned i = 0; i < bc->used; i++) {
+    if (bcode_format(bc->inst[i].op) == BF_STR && bc->inst[i].u.str)
+      put_str(fp, bc->inst[i].u.str);
+  }
+
+  put_u32(fp, bc->used);
+  unsigned string_id = 0;
+  for (unsigned i = 0; i < bc->used; i++) {
+    const BINST* in = bc->inst + i;
+    put_u16(fp, in->op);
+    switch (bcode_format(in->op)) {
+      case BF_IMPLICIT:
+        break;
+      case BF_SOURCE_LINE:
+        put_u32(fp, in->u.source_line);
+        break;
+      case BF_BASIC_LINE:
+        put_u32(fp, in->u.basic_line.lineno);
+        put_u32(fp, in->u.basic_line.bcode);
+        break;
+      case BF_NUM:
+        put_num(fp, in->u.num);
+        break;
+      case BF_STR:
+        put_u32(fp, in->u.str ? string_id++ : NO_STRING);
+        break;
+      case BF_VAR:
+        put_u32(fp, in->u.symbol_id);
+        break;
+      case BF_PARAM:
+        put_u32(fp, in->u.param.symbol_id);
+        put_u8(fp, in->u.param.params);
+        break;
+      case BF_COUNT:
+        put_u32(fp, in->u.count);
+        break;
+    }
+  }
+
+  put_u32(fp, line_map_count(image->index));
+  for (unsigned i = 0; i < line_map_count(image->index); i++) {
+    unsigned basic_line, val;
+    line_mapping(image->index, i, &basic_line, &val);
+    put_u32(fp, basic_line);
+    put_u32(fp, val);
+  }
+}
+
+bool save_image(const char* name, const IMAGE* image, const SYMTAB* st) {
+  assert(name != NULL);
+
+  FILE* fp = fopen(name, "wb");
+  if (fp == NULL) {
+    fprintf(diagnostics(), "Cannot create image file: %s\n", name);
+    return false;
+  }
+
+  write_image(fp, image, st);
+
+  bool ok = !ferror(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok) {
+    fprintf(diagnostics(), "Error writing image file: %s\n", name);
+    remove(name);
+  }
+  return ok;
+}
+
+static bool available(IMAGE_READER* r, size_t size) {
+  if (r->ok && (size_t)(r->end - r->p) < size)
+    r->ok = false;
+  return r->ok;
+}
+
+unsigned get_u8(IMAGE_READER* r) {
+  return available(r, 1) ? *r->p++ : 0;
+}
+
+unsigned get_u16(IMAGE_READER* r) {
+  unsigned lo = get_u8(r);
+  return lo | get_u8(r) << 8;
+}
+
+unsigned get_u32(IMAGE_READER* r) {
+  unsigned lo = get_u16(r);
+  return lo | get_u16(r) << 16;
+}
+
+double get_num(IMAGE_READER* r) {
+  unsigned long long u = 0;
+  for (unsigned i = 0; i < 8; i++)
+    u |= (unsigned long long) get_u8(r) << (8 * i);
+  double x;
+  memcpy(&x, &u, sizeof x);
+  return x;
+}
+
+// Return string in place, or NULL if the stored string is null or invalid.
+const char* get_str(IMAGE_READER* r) {
+  unsigned len = get_u32(r);
+  if (len == NO_STRING || !available(r, (size_t) len + 1))
+    return NULL;
+  if (r->p[len] != '\0') {
+    r->ok = false;
+    return NULL;
+  }
+  const char* s = (const char*) r->p;
+  r->p += len + 1;
+  return s;
+}
+
+// Read a count of items, each occupying at least the given number of bytes,
+// failing if the rest of the image is too short to hold them.
+unsigned get_count(IMAGE_READER* r, unsigned min_item_size) {
+  unsigned n = get_u32(r);
+  if (r->ok && n > (size_t)(r->end - r->p) / min_item_size)
+    r->ok = false;
+  return r->ok ? n : 0;
+}
+
+// Whether the symbol an instruction refers to is of the kind and type
+// the instruction is executed on, so that loaded B-code cannot misuse a symbol.
+static bool symbol_fits(SYMTAB* st, const BINST* in) {
+  if (bcode_format(in->op) == BF_VAR) {
+    const SYMBOL* sym = symbol(st, (SYMID) in->u.symbol_id);
+    switch (in->op) {
+      case B_GET_SIMPLE_NUM:
+      case B_SET_SIMPLE_NUM:
+      case B_FOR:
+      case B_NEXT_VAR:
+      case B_PARAM:
+        return sym->kind == SYM_VARIABLE && sym->type == TYPE_NUM;
+      case B_GET_SIMPLE_STR:
+      case B_SET_SIMPLE_STR:
+        return sym->kind == SYM_VARIABLE && sym->type == TYPE_STR;
+    }
+    return false;
+  }
+
+  assert(bcode_format(in->op) == BF_PARAM);
+  const SYMBOL* sym = symbol(st, (SYMID) in->u.param.symbol_id);
+  const unsigned params = in->u.param.params;
+  if (in->op == B_DEF)
+    return sym->kind == SYM_DEF && params == 1;
+  if (params > MAX_DIMENSIONS)
+    return false;
+  switch (in->op) {
+    case B_DIM_NUM:
+    case B_SET_ARRAY_NUM:
+      return sym->kind == SYM_ARRAY && sym->type == TYPE_NUM && params > 0;
+    case B_DIM_STR:
+    case B_SET_ARRAY_STR:
+      return sym->kind == SYM_ARRAY && sym->type == TYPE_STR && params > 0;
+    case B_GET_PAREN_NUM:
+      return (sym->kind == SYM_ARRAY || sym->kind == SYM_DEF) && sym->type == TYPE_NUM && params > 0;
+    case B_GET_PAREN_STR:
+      return (sym->kind == SYM_ARRAY || sym->kind == SYM_DEF) && sym->type == TYPE_STR && params > 0;
+    case B_INPUT_NUM:
+    case B_READ_NUM:
+      return sym->kind == (params ? SYM_ARRAY : SYM_VARIABLE) && sym->type == TYPE_NUM;
+    case B_INPUT_STR:
+    case B_INPUT_LINE:
+    case B_READ_STR:
+      return sym->kind == (params ? SYM_ARRAY : SYM_VARIABLE) && sym->type == TYPE_STR;
+  }
+  return false;
+}
+
+bool read_image(IMAGE_READER* r, IMAGE* image, SYMTAB* st) {
+  if (!available(r, 4) || memcmp(r->p, IMAGE_MAGIC, 4) != 0)
+    return false;
+  r->p += 4;
+  if (get_u32(r) != IMAGE_VERSION)
+    return false;
+  image->keywords_anywhere = (get_u32(r) & IMAGE_KEYWORDS_ANYWHERE) != 0;
+
+  // source
+  const char* name = get_str(r);
+  if (!r->ok)
+    return false;
+  image->source = new_source(name);
+  const unsigned lines = get_count(r, 8);
+  unsigned prev = 0;
+  for (unsigned i = 0; i < lines; i++) {
+    unsigned num = get_u32(r);
+    const char* text = get_str(r);
+    if (!r->ok || text == NULL || num <= prev)
+      return false;
+    enter_source_line(image->source, num, text);
+    prev = num;
+  }
+
+  // symbols, inserted in order so that they have their original IDs
+  const unsigned symbols = get_count(r, 6);
+  for (unsigned i = 0; i < symbols; i++) {
+    int kind = get_u8(r);
+    int type = get_u8(r);
+    const char* name = get_str(r);
+    if (!r->ok || name == NULL || type > TYPE_STR)
+      return false;
+    if (kind == SYM_BUILTIN) {
+      const BUILTIN* b = builtin(name);
+      if (b == NULL || b->type != type)
+        return false;
+      sym_insert_builtin(st, name, b->type, b->args, b->opcode);
+    }
+    else if (kind <= SYM_DEF)
+      sym_insert(st, name, kind, type);
+    else
+      return false;
+  }
+
+  // constant strings, referenced by B-code in order of occurrence
+  const unsigned strings = get_count(r, 5);
+  const char* * string = strings ? emalloc(strings * sizeof string[0]) : NULL;
+  for (unsigned i = 0; i < strings; i++)
+    string[i] = get_str(r);
+
+  // B-code
+  const unsigned count = get_count(r, 2);
+  BCODE* bc = image->bcode = new_bcode();
+  if (count) {
+    bc->inst = emalloc_in(MEM_BCODE, count * sizeof bc->inst[0]);
+    bc->allocated = count;
+  }
+  for (unsigned i = 0; i < count && r->ok; i++) {
+    unsigned op = get_u16(r);
+    if (!bcode_valid(op)) {
+      r->ok = false;
+      break;
+    }
+    BINST* in = bcode_next(bc, op);
+    memset(&in->u, 0, sizeof in->u);
+    switch (bcode_format(op)) {
+      case BF_IMPLICIT:
+        break;
+      case BF_SOURCE_LINE:
+        in->u.source_line = get_u32(r);
+        if (in->u.source_line >= lines)
+          r->ok = false;
+        break;
+      case BF_BASIC_LINE:
+        in->u.basic_line.lineno = get_u32(r);
+        in->u.basic_line.bcode = get_u32(r);
+        break;
+      case BF_NUM:
+        in->u.num = get_num(r);
+        break;
+      case BF_STR: {
+        unsigned k = get_u32(r);
+        if (k != NO_STRING) {
+          if (k < strings && string[k])
+            in->u.str = bcode_strdup(bc, string[k]);
+          else
+            r->ok = false;
+        }
+        break;
+      }
+      case BF_VAR:
+        in->u.symbol_id = get_u32(r);
+        if (in->u.symbol_id >= symbols || !symbol_fits(st, in))
+          r->ok = false;
+        break;
+      case BF_PARAM:
+        in->u.param.symbol_id = get_u32(r);
+        in->u.param.params = get_u8(r);
+        if (in->u.param.symbol_id >= symbols || !symbol_fits(st, in))
+          r->ok = false;
+        break;
+      case BF_COUNT:
+        in->u.count = get_u32(r);
+        if (in->u.count > count - 1 - i)
+          r->ok = false;
+        break;
+    }
+  }
+  efree(string);
+
+  // each ON is followed by as many line operands as it counts
+  for (unsigned i = 0; i < bc->used && r->ok; i++) {
+    if (bcode_format(bc->inst[i].op) == BF_COUNT) {
+      for (unsigned j = 1; j <= bc->inst[i].u.count; j++) {
+        if (i + j >= bc->used || bc->inst[i + j].op != B_ON_LINE)
+          r->ok = false;
+      }
+    }
+  }
+
+  // line map
+  const unsigned mappings = get_count(r, 8);
+  image->index = new_line_map(mappings);
+  for (unsigned i = 0; i < mappings; i++) {
+    unsigned basic_line = get_u32(r);
+    unsigned val = get_u32(r);
+    if (!r->ok || val >= count)
+      return false;
+    insert_line_mapping(image->index, basic_line, val);
+  }
+
+  return r->ok;
+}
+
+void release_image(IMAGE* image) {
+  delete_line_map(image->index);
+  delete_bcode(image->bcode);
+  delete_source(image->source);
+  memset(image, 0, sizeof *image);
+}
+
+bool load_image(const char* name, IMAGE* image, SYMTAB* st) {
+  assert(name != NULL);
+  assert(image != NULL);
+  assert(st != NULL && st->used == 0);
+
+  memset(image, 0, sizeof *image);
+
+  MAPPED_FILE mf;
+  if (!map_file(name, &mf)) {
+    fprintf(diagnostics(), "Cannot open image file: %s\n", name);
+    return false;
+  }
+
+  IMAGE_READER r;
+  r.p = (const unsigned char*) mf.data;
+  r.end = r.p + mf.size;
+  r.ok = true;
+  bool ok = read_image(&r, image, st) && r.p == r.end;
+  unmap_file(&mf);
+
+  if (!ok) {
+    fprintf(diagnostics(), "Invalid or out of date image file: %s\n", name);
+    release_image(image);
+    clear_symbol_table_names(st);
+  }
+  return ok;
+}
+
+static const char* extension(const char* name) {
+  const char* dot = strrchr(name, '.');
+  if (dot && strpbrk(dot, "/\\") == NULL)
+    return dot;
+  return NULL;
+}
+
+bool has_image_extension(const char* name) {
+  const char* ext = extension(name);
+  return ext && STRICMP(ext, IMAGE_EXTENSION) == 0;
+}
+
+// Replace the extension of a source file name, or add one.
+char* image_file_name(const char* source_name) {
+  const char* ext = extension(source_name);
+  size_t len = ext ? (size_t)(ext - source_name) : strlen(source_name);
+  char* name = emalloc(len + sizeof IMAGE_EXTENSION);
+  memcpy(name, source_name, len);
+  strcpy(name + len, IMAGE_EXTENSION);
+  return name;
+}
+
+char* image_cache_name(const char* cache_dir, const char* source_name, bool keywords_anywhere) {
+  assert(cache_dir != NULL && source_name != NULL);
+
+  MAPPED_FILE mf;
+  if (!map_file(source_name, &mf))
+    return NULL;
+
+  // The image depends on the source, the compilation options and the image format.
+  char config[32];
+  sprintf(config, "%s %d %d", IMAGE_MAGIC, IMAGE_VERSION, keywords_anywhere);
+  unsigned long long h = hash_fnv1a(mf.data, mf.size, FNV1A_BASIS);
+  h = hash_fnv1a(config, strlen(config), h);
+  unmap_file(&mf);
+
+  size_t len = strlen(cache_dir);
+  bool sep = len > 0 && cache_dir[len-1] != '/' && cache_dir[len-1] != '\\';
+  char* name = emalloc(len + 1 + 16 + sizeof IMAGE_EXTENSION);
+  sprintf(name, "%s%s%016llx%s", cache_dir, sep ? "/" : "", h, IMAGE_EXTENSION);
+  return name;
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+#include "init.h"
+#include "parse.h"
+
+static void test_image_file_name(CuTest* tc) {
+  char* name;
+
+  name = image_file_name("game.bas");
+  CuAssertStrEquals(tc, "game.bbc", name);
+  efree(name);
+
+  name = image_file_name("dir.x/game");
+  CuAssertStrEquals(tc, "dir.x/game.bbc", name);
+  efree(name);
+
+  CuAssertIntEquals(tc, true, has_image_extension("game.BBC"));
+  CuAssertIntEquals(tc, false, has_image_extension("game.bas"));
+  CuAssertIntEquals(tc, false, has_image_extension("bbc"));
+}
+
+static void test_save_load(CuTest* tc) {
+  static const char CODE[] =
+    "10 DIM A(5)\n"
+    "20 DEF FNA(X)=X*2\n"
+    "30 READ N$,B\n"
+    "40 PRINT \"HELLO\";N$;FNA(B);SIN(B)\n"
+    "50 GOSUB 70\n"
+    "60 END\n"
+    "70 RETURN\n"
+    "80 DATA TEST,3.25\n";
+  static const char NAME[] = "test-image" IMAGE_EXTENSION;
+
+  IMAGE saved;
+  SYMTAB* st = new_symbol_table();
+  init_builtins(st);
+  saved.source = load_source_string(CODE, "image");
+  saved.bcode = parse_source(saved.source, st, false);
+  CuAssertPtrNotNull(tc, saved.bcode);
+  saved.index = bcode_index(saved.bcode, saved.source);
+  saved.keywords_anywhere = true;
+  CuAssertIntEquals(tc, true, save_image(NAME, &saved, st));
+
+  IMAGE loaded;
+  SYMTAB* st2 = new_symbol_table();
+  CuAssertIntEquals(tc, true, load_image(NAME, &loaded, st2));
+  remove(NAME);
+
+  CuAssertIntEquals(tc, true, loaded.keywords_anywhere);
+
+  CuAssertStrEquals(tc, "image", source_name(loaded.source));
+  CuAssertIntEquals(tc, source_lines(saved.source), source_lines(loaded.source));
+  for (unsigned i = 0; i < source_lines(saved.source); i++) {
+    CuAssertIntEquals(tc, source_linenum(saved.source, i), source_linenum(loaded.source, i));
+    CuAssertStrEquals(tc, source_text(saved.source, i), source_text(loaded.source, i));
+  }
+
+  CuAssertIntEquals(tc, st->used, st2->used);
+  for (unsigned i = 0; i < st->used; i++) {
+    CuAssertStrEquals(tc, st->psym[i]->name, st2->psym[i]->name);
+    CuAssertIntEquals(tc, st->psym[i]->id, st2->psym[i]->id);
+    CuAssertIntEquals(tc, st->psym[i]->kind, st2->psym[i]->kind);
+    CuAssertIntEquals(tc, st->psym[i]->type, st2->psym[i]->type);
+  }
+  SYMBOL* sin = sym_lookup(st2, "SIN", true);
+  CuAssertPtrNotNull(tc, sin);
+  CuAssertIntEquals(tc, B_SIN, sin->val.builtin.opcode);
+
+  CuAssertIntEquals(tc, saved.bcode->used, loaded.bcode->used);
+  CuAssertIntEquals(tc, true, loaded.bcode->has_data);
+  for (unsigned i = 0; i < saved.bcode->used; i++) {
+    const BINST* a = saved.bcode->inst + i;
+    const BINST* b = loaded.bcode->inst + i;
+    CuAssertIntEquals(tc, a->op, b->op);
+    switch (bcode_format(a->op)) {
+      case BF_IMPLICIT:
+        break;
+      case BF_NUM:
+        CuAssertDblEquals(tc, a->u.num, b->u.num, 0);
+        break;
+      case BF_STR:
+        CuAssertStrEquals(tc, a->u.str, b->u.str);
+        break;
+      case BF_PARAM:
+        CuAssertIntEquals(tc, a->u.param.symbol_id, b->u.param.symbol_id);
+        CuAssertIntEquals(tc, a->u.param.params, b->u.param.params);
+        break;
+      default:
+        CuAssertIntEquals(tc, a->u.count, b->u.count);
+        break;
+    }
+  }
+
+  for (unsigned line = 10; line <= 80; line += 10) {
+    unsigned a, b;
+    CuAssertIntEquals(tc, true, lookup_line_mapping(saved.index, line, &a));
+    CuAssertIntEquals(tc, true, lookup_line_mapping(loaded.index, line, &b));
+    CuAssertIntEquals(tc, a, b);
+  }
+
+  delete_line_map(loaded.index);
+  delete_bcode(loaded.bcode);
+  delete_source(loaded.source);
+  delete_symbol_table(st2);
+  delete_line_map(saved.index);
+  delete_bcode(saved.bcode);
+  delete_source(saved.source);
+  delete_symbol_table(st);
+}
+
+static void test_load_invalid(CuTest* tc) {
+  static const char NAME[] = "test-invalid" IMAGE_EXTENSION;
+  IMAGE image;
+  SYMTAB* st = new_symbol_table();
+
+  FILE* fp = fopen(NAME, "wb");
+  CuAssertPtrNotNull(tc, fp);
+  fputs(IMAGE_MAGIC "\x01\x00\x00\x00\x00\x00\x00\x00\xff\xff", fp);
+  fclose(fp);
+
+  CuAssertIntEquals(tc, false, load_image(NAME, &image, st));
+  CuAssertPtrEquals(tc, NULL, image.source);
+  CuAssertPtrEquals(tc, NULL, image.bcode);
+  CuAssertIntEquals(tc, 0, st->used);
+  remove(NAME);
+
+  delete_symbol_table(st);
+}
+
+// An ON count that runs past the line operands following it.
+static void test_load_invalid_on(CuTest* tc) {
+  static const char NAME[] = "test-invalid-on" IMAGE_EXTENSION;
+  IMAGE saved;
+  SYMTAB* st = new_symbol_table();
+  init_builtins(st);
+  saved.source = load_source_string("10 ON X GOTO 20, 30\n20 END\n30 END\n", "image");
+  saved.bcode = parse_source(saved.source, st, false);
+  CuAssertPtrNotNull(tc, saved.bcode);
+  saved.index = bcode_index(saved.bcode, saved.source);
+  saved.keywords_anywhere = false;
+  unsigned i = 0;
+  while (saved.bcode->inst[i].op != B_ON_GOTO)
+    i++;
+  saved.bcode->inst[i].u.count = 3;
+  CuAssertIntEquals(tc, true, save_image(NAME, &saved, st));
+
+  IMAGE loaded;
+  SYMTAB* st2 = new_symbol_table();
+  CuAssertIntEquals(tc, false, load_image(NAME, &loaded, st2));
+  CuAssertPtrEquals(tc, NULL, loaded.bcode);
+  remove(NAME);
+
+  delete_symbol_table(st2);
+  delete_line_map(saved.index);
+  delete_bcode(saved.bcode);
+  delete_source(saved.source);
+  delete_symbol_table(st);
+}
+
+// Instructions referring to symbols of the wrong kind or type.
+static void test_load_wrong_symbol(CuTest* tc) {
+  static const char NAME[] = "test-wrong-symbol" IMAGE_EXTENSION;
+  static const unsigned short ops[] = { B_SET_SIMPLE_NUM, B_GET_PAREN_NUM, B_DIM_NUM };
+  for (unsigned k = 0; k < sizeof ops / sizeof ops[0]; k++) {
+    IMAGE saved;
+    SYMTAB* st = new_symbol_table();
+    init_builtins(st);
+    saved.source = load_source_string("10 DIM A(3)\n20 X = A(1)\n30 S$ = \"S\"\n", "image");
+    saved.bcode = parse_source(saved.source, st, false);
+    CuAssertPtrNotNull(tc, saved.bcode);
+    saved.index = bcode_index(saved.bcode, saved.source);
+    saved.keywords_anywhere = false;
+    const SYMBOL* s = sym_lookup(st, "S$", false);
+    CuAssertPtrNotNull(tc, s);
+    unsigned i = 0;
+    while (saved.bcode->inst[i].op != ops[k])
+      i++;
+    if (ops[k] == B_SET_SIMPLE_NUM)
+      saved.bcode->inst[i].u.symbol_id = s->id;  // a string variable
+    else if (ops[k] == B_GET_PAREN_NUM)
+      saved.bcode->inst[i].u.param.symbol_id = s->id;  // not an array
+    else
+      saved.bcode->inst[i].u.param.params = MAX_DIMENSIONS + 1;  // too many dimensions
+    CuAssertIntEquals(tc, true, save_image(NAME, &saved, st));
+
+    IMAGE loaded;
+    SYMTAB* st2 = new_symbol_table();
+    CuAssertIntEquals(tc, false, load_image(NAME, &loaded, st2));
+    CuAssertPtrEquals(tc, NULL, loaded.bcode);
+    remove(NAME);
+
+    delete_symbol_table(st2);
+    delete_line_map(saved.index);
+    delete_bcode(saved.bcode);
+    delete_source(saved.source);
+    delete_symbol_table(st);
+  }
+}
+
+CuSuite* image_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_image_file_name);
+  SUITE_ADD_TEST(suite, test_save_load);
+  SUITE_ADD_TEST(suite, test_load_invalid);
+  SUITE_ADD_TEST(suite, test_load_invalid_on);
+  SUITE_ADD_TEST(suite, test_load_wrong_symbol);
+  return suite;
+}
+
+#endif
@@ -0,0 +1,66 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Precompiled B-code image files.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "source.h"
+#include "bcode.h"
+#include "linemap.h"
+#include "symbol.h"
+
+#define IMAGE_EXTENSION ".bbc"
+
+// Environment variable naming the directory of cached images.
+#define IMAGE_CACHE_ENV "LEGACY_BASIC_CACHE"
+
+// A compiled program: everything needed to run it without parsing.
+typedef struct {
+  SOURCE* source;
+  BCODE* bcode;
+  LINE_MAP* index;
+  bool keywords_anywhere;
+} IMAGE;
+
+bool save_image(const char* file_name, const IMAGE*, const SYMTAB*);
+
+// Load a saved image, creating new source, B-code and index objects,
+// and inserting its names into the given empty symbol table.
+bool load_image(const char* file_name, IMAGE*, SYMTAB*);
+
+// Delete the parts of a loaded image.
+void release_image(IMAGE*);
+
+bool has_image_extension(const char* file_name);
+char* image_file_name(const char* source_file_name);
+
+// Name of the cached image for a source file, derived from the content of the file,
+// or NULL if the source file cannot be read.
+char* image_cache_name(const char* cache_dir, const char* source_file_name, bool keywords_anywhere);
+
+// The binary encoding of images, also used by VM snapshots, which embed an image.
+// Integers are little-endian. Reading fails, clearing ok, at the end of the data.
+
+void put_u8(FILE*, unsigned);
+void put_u16(FILE*, unsigned);
+void put_u32(FILE*, unsigned);
+void put_num(FILE*, double);
+void put_str(FILE*, const char*);  // may be NULL
+
+typedef struct {
+  const unsigned char* p;
+  const unsigned char* end;
+  bool ok;
+} IMAGE_READER;
+
+unsigned get_u8(IMAGE_READER*);
+unsigned get_u16(IMAGE_READER*);
+unsigned get_u32(IMAGE_READER*);
+double get_num(IMAGE_READER*);
+const char* get_str(IMAGE_READER*);  // in place
+unsigned get_count(IMAGE_READER*, unsigned min_item_size);
+
+void write_image(FILE*, const IMAGE*, const SYMTAB*);
+bool read_image(IMAGE_READER*, IMAGE*, SYMTAB*);
@@ -12,6 +12,46 @@
 #include "token.h"
 #include "utils.h"
 
+static void append_tokens(LEX* lex, const char* p, unsigned n) {
+  if (lex->tokens_used + n > lex->tokens_allocated) {
+    while (lex->tokens_used + n > lex->tokens_allocated)
+      lex->tokens_allocated *= 2;
+    lex->tokens = erealloc(lex->tokens, lex->tokens_allocated);
+  }
+  memcpy(lex->tokens + lex->tokens_used, p, n);
+  lex->tokens_used += n;
+}
+
+// Replace a keyword spelled in upper case with its byte in the tokenized line.
+static void tokenize_keyword(LEX* lex) {
+  const char* name = keyword_name(lex->token);
+  const unsigned len = lex->pos - lex->token_pos;
+  if (strlen(name) != len || strncmp(lex->text + lex->token_pos, name, len) != 0)
+    return;
+  append_tokens(lex, lex->text + lex->tokens_from, lex->token_pos - lex->tokens_from);
+  const char b = keyword_byte(lex->token);
+  append_tokens(lex, &b, 1);
+  lex->tokens_from = lex->pos;
+}
+
+void lex_tokenize(LEX* lex) {
+  assert(lex != NULL);
+  if (lex->tokens == NULL) {
+    lex->tokens_allocated = 256;
+    lex->tokens = emalloc(lex->tokens_allocated);
+  }
+}
+
+const char* lex_tokenized(LEX* lex) {
+  assert(lex != NULL);
+  if (!lex->tokenizing)
+    return NULL;
+  const char* rest = lex->text + lex->tokens_from;
+  append_tokens(lex, rest, (unsigned) strlen(rest) + 1);
+  lex->tokenizing = false;
+  return lex->tokens;
+}
+
 LEX* new_lex(const char* name, bool recognise_keyword_prefixes) {
   LEX* lex = emalloc(sizeof *lex);
   lex->name = name;
@@ -22,12 +62,24 @@ LEX* new_lex(const char* name, bool recognise_keyword_prefixes) {
   lex->token = TOK_NONE;
   lex->num = 0;
   lex->word[0] = '\0';
+  lex->key[0] = '\0';
   lex->recognise_keyword_prefixes = recognise_keyword_prefixes;
+  lex->tokenized = false;
+  lex->tokens = NULL;
+  lex->tokens_used = 0;
+  lex->tokens_allocated = 0;
+  lex->tokens_from = 0;
+  lex->tokenizing = false;
+  lex->quiet = false;
+  lex->errjmp = NULL;
   return lex;
 }
 
 void delete_lex(LEX* lex) {
-  efree(lex);
+  if (lex) {
+    efree(lex->tokens);
+    efree(lex);
+  }
 }
 
 int lex_line(LEX* lex, unsigned lineno, const char* text) {
@@ -35,6 +87,21 @@ int lex_line(LEX* lex, unsigned lineno, const char* text) {
   lex->lineno = lineno;
   lex->text = text;
   lex->pos = 0;
+  lex->tokenized = false;
+  lex->tokens_used = 0;
+  lex->tokens_from = 0;
+  lex->tokenizing = lex->tokens != NULL;
+  return lex_next(lex);
+}
+
+int lex_tokenized_line(LEX* lex, unsigned lineno, const char* tokens) {
+  assert(lex != NULL);
+  assert(tokens != NULL);
+  lex->lineno = lineno;
+  lex->text = tokens;
+  lex->pos = 0;
+  lex->tokenized = true;
+  lex->tokenizing = false;
   return lex_next(lex);
 }
 
@@ -42,19 +109,37 @@ int lex_line(LEX* lex, unsigned lineno, const char* text) {
 int lex_refresh(LEX* lex, const char* text) {
   lex->text = text;
   lex->pos = lex->token_pos;
+  lex->tokenizing = false;
   return lex_next(lex);
 }
 
+unsigned print_lex_line(LEX* lex, FILE* fp) {
+  assert(lex != NULL);
+  unsigned col = lex->token_pos;
+  for (unsigned i = 0; lex->text[i]; i++) {
+    const int keyword = lex->tokenized ? byte_keyword(lex->text[i]) : TOK_NONE;
+    if (keyword == TOK_NONE)
+      putc(lex->text[i], fp);
+    else {
+      const char* name = keyword_name(keyword);
+      fputs(name, fp);
+      if (i < lex->token_pos)
+        col += (unsigned) strlen(name) - 1;
+    }
+  }
+  return col;
+}
+
 static void lex_error_va(LEX* lex, const char* fmt, va_list ap) {
   assert(lex != NULL);
   if (lex->name)
-    fprintf(stderr, "%s(%u): ", lex->name, lex->lineno);
+    fprintf(diagnostics(), "%s(%u): ", lex->name, lex->lineno);
   if (lex->lineno)
-    fprintf(stderr, "%u ", lex->lineno);
-  fputs(lex->text, stderr);
-  putc('\n', stderr);
-  vfprintf(stderr, fmt, ap);
-  putc('\n', stderr);
+    fprintf(diagnostics(), "%u ", lex->lineno);
+  print_lex_line(lex, diagnostics());
+  putc('\n', diagnostics());
+  vfprintf(diagnostics(), fmt, ap);
+  putc('\n', diagnostics());
 }
 
 static void lex_fatal(LEX* lex, const char* fmt, ...) {
@@ -66,20 +151,45 @@ static void lex_fatal(LEX* lex, const char* fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
+// Report an error the parser will handle, unless quiet.
 static void lex_error(LEX* lex, const char* fmt, ...) {
+  if (lex->quiet)
+    return;
   va_list ap;
   va_start(ap, fmt);
   lex_error_va(lex, fmt, ap);
   va_end(ap);
 }
 
+// Report an error in the source, unless quiet, and abandon the line:
+// the caller's error handler decides what to do, or without one, exit.
+static void lex_abort(LEX* lex, const char* fmt, ...) {
+  if (!lex->quiet) {
+    va_list ap;
+    va_start(ap, fmt);
+    lex_error_va(lex, fmt, ap);
+    va_end(ap);
+  }
+  if (lex->errjmp)
+    longjmp(*lex->errjmp, 1);
+  exit(EXIT_FAILURE);
+}
+
 static void validate(LEX* lex, int c) {
   if (c != EOF && (c < 0 || c >= 127)) {
-    lex_error(lex, "invalid character on line: value %d\n", c);
-    exit(EXIT_FAILURE);
+    lex_abort(lex, "invalid character on line: value %d\n", c);
   }
 }
 
+// The character at a position in the text, or in tokenized text, a keyword byte.
+static int text_char(LEX* lex, unsigned pos) {
+  const char c = lex->text[pos];
+  if (lex->tokenized && byte_keyword(c) != TOK_NONE)
+    return (unsigned char) c;
+  validate(lex, c);
+  return c;
+}
+
 static int lex_char_pos(LEX* lex, unsigned *pos) {
   assert(lex != NULL);
   assert(pos != NULL);
@@ -94,9 +204,7 @@ static int lex_char_pos(LEX* lex, unsigned *pos) {
   if (lex->text[lex->pos] == '\0')
     return '\n';
 
-  int c = lex->text[lex->pos++];
-  validate(lex, c);
-  return c;
+  return text_char(lex, lex->pos++);
 }
 
 static int lex_char(LEX* lex) {
@@ -108,9 +216,7 @@ static int lex_char(LEX* lex) {
   if (lex->text[lex->pos] == '\0')
     return '\n';
 
-  int c = lex->text[lex->pos++];
-  validate(lex, c);
-  return c;
+  return text_char(lex, lex->pos++);
 }
 
 int lex_peek(LEX* lex) {
@@ -122,9 +228,7 @@ int lex_peek(LEX* lex) {
   if (lex->text[lex->pos] == '\0')
     return '\n';
 
-  int c = lex->text[lex->pos];
-  validate(lex, c);
-  return c;
+  return text_char(lex, lex->pos);
 }
 
 void lex_discard(LEX* lex) {
@@ -150,7 +254,7 @@ static void pushback(LEX* lex, int c) {
   if (lex->pos == 0)
     lex_fatal(lex, "internal error: invalid pushback\n");
   lex->pos--;
-  if (lex->text[lex->pos] != c)
+  if ((unsigned char) lex->text[lex->pos] != (unsigned char) c)
     lex_fatal(lex, "internal error: pushback: attempted '%c' 0x%02x, found '%c' 0x%02x\n",
         chr(c), c, chr(lex->text[lex->pos]), lex->text[lex->pos]);
 }
@@ -176,7 +280,25 @@ static bool append(LEX* lex, unsigned *i, int c, const char* descrip) {
   return true;
 }
 
+// A name: canonicalise it once for symbol lookup.
+static int name_token(LEX* lex) {
+  unsigned i = 0;
+  do
+    lex->key[i] = (char) toupper((unsigned char) lex->word[i]);
+  while (lex->word[i++]);
+  return lex->token = TOK_ID;
+}
+
+static int scan(LEX*);
+
 int lex_next(LEX* lex) {
+  const int token = scan(lex);
+  if (lex->tokenizing && token >= TOK_AND && token <= TOK_TO)
+    tokenize_keyword(lex);
+  return token;
+}
+
+static int scan(LEX* lex) {
   unsigned pos;
   int c = lex_char_pos(lex, &pos);
 
@@ -185,6 +307,12 @@ int lex_next(LEX* lex) {
 
   lex->token_pos = pos;
 
+  if (c >= KEYWORD_BYTE) {
+    const int token = byte_keyword((char) c);
+    strcpy(lex->word, keyword_name(token));
+    return lex->token = token;
+  }
+
   if (isalpha(c)) {
     if (lex->recognise_keyword_prefixes) {
       pushback(lex, c);
@@ -199,7 +327,7 @@ int lex_next(LEX* lex) {
       while (isalnum(c = lex_peek(lex))) {
         if (isalpha(c) && (keyword_prefix(lex->text + lex->pos))) {
           lex->word[i] = '\0';
-          return lex->token = TOK_ID;
+          return name_token(lex);
         }
         if (i + 2 >= sizeof lex->word) {
           lex->word[i] = '\0';
@@ -211,7 +339,7 @@ int lex_next(LEX* lex) {
       if (c == '$')
         lex->word[i++] = lex_char(lex);
       lex->word[i] = '\0';
-      return lex->token = TOK_ID;
+      return name_token(lex);
     }
 
     unsigned i = 0;
@@ -229,7 +357,8 @@ int lex_next(LEX* lex) {
     else
       pushback(lex, c);
     lex->word[i] = '\0';
-    return lex->token = identifier_token(lex->word);
+    const int token = identifier_token(lex->word);
+    return token == TOK_ID ? name_token(lex) : (lex->token = token);
   }
 
   if (isdigit(c) || c == '.') {
@@ -326,22 +455,19 @@ const char* lex_next_data(LEX* lex) {
     while ((c = lex_char(lex)) != '\"' && c != '\n' && c != EOF) {
       if (i + 1 >= sizeof lex->word) {
         lex->word[i] = '\0';
-        lex_error(lex, "a string is too long: \"%s...", lex->word);
-        exit(EXIT_FAILURE);
+        lex_abort(lex, "a string is too long: \"%s...", lex->word);
       }
       lex->word[i++] = c;
     }
     if (c != '\"') {
-      lex_error(lex, "unterminated string: \"%s...", lex->word);
-      exit(EXIT_FAILURE);
+      lex_abort(lex, "unterminated string: \"%s...", lex->word);
     }
   }
   else {
     while (c != '\"' && c != ',' && c != ':' && c != '\n' && c != EOF) {
       if (i + 1 >= sizeof lex->word) {
         lex->word[i] = '\0';
-        lex_error(lex, "data is too long: %s...", lex->word);
-        exit(EXIT_FAILURE);
+        lex_abort(lex, "data is too long: %s...", lex->word);
       }
       lex->word[i++] = c;
       c = lex_char(lex);
@@ -366,6 +492,11 @@ const char* lex_word(LEX* lex) {
   return lex->word;
 }
 
+const char* lex_key(LEX* lex) {
+  assert(lex != NULL && lex->token == TOK_ID);
+  return lex->key;
+}
+
 double lex_num(LEX* lex) {
   assert(lex != NULL);
   return lex->num;
@@ -533,6 +664,7 @@ static void test_lexer(CuTest* tc) {
 
   CuAssertIntEquals(tc, TOK_ID, lex_next(lex));
   CuAssertStrEquals(tc, "ab12$", lex_word(lex));
+  CuAssertStrEquals(tc, "AB12$", lex_key(lex));
 
   CuAssertIntEquals(tc, TOK_AND, lex_next(lex));
   CuAssertIntEquals(tc, TOK_NE, lex_next(lex));
@@ -687,6 +819,121 @@ static void test_data(CuTest* tc) {
   delete_lex(lex);
 }
 
+struct lexed {
+  int token;
+  char word[MAX_WORD];
+  char key[MAX_WORD];
+  double num;
+};
+
+// Lex a line as the parser does, reading DATA items and discarding remarks.
+static unsigned transcript(LEX* lex, const char* text, bool tokenized, struct lexed* out, unsigned max) {
+  int tok = tokenized ? lex_tokenized_line(lex, 0, text) : lex_line(lex, 0, text);
+  bool data = false;
+  unsigned n = 0;
+  while (n < max) {
+    struct lexed * t = out + n++;
+    memset(t, 0, sizeof *t);
+    t->token = tok;
+    if (tok == TOK_ID || tok == TOK_NUM || tok == TOK_STR || tok >= TOK_AND)
+      strcpy(t->word, lex_word(lex));
+    if (tok == TOK_ID)
+      strcpy(t->key, lex_key(lex));
+    if (tok == TOK_NUM)
+      t->num = lex_num(lex);
+    if (tok == '\n' || tok == TOK_ERROR)
+      break;
+    if (tok == TOK_REM) {
+      lex_discard(lex);
+      tok = lex_token(lex);
+    }
+    else if (tok == TOK_DATA || (data && tok == ',')) {
+      lex_next_data(lex);
+      data = true;
+      tok = lex_next(lex);
+    }
+    else {
+      data = false;
+      tok = lex_next(lex);
+    }
+  }
+  return n;
+}
+
+static void test_tokenize(CuTest* tc) {
+  static const char* const LINES[] = {
+    "PRINT 3.14+ab12$and<>data<=>=\"scrambled\":",
+    "FOR I=1 TO 10 STEP 2: A(I) = 1E-3 * .5: NEXT i",
+    "FORI=1TO10:PRINTA$(I);BEFORE:GOTO100",
+    "DATA \"x\", 3, PRINT: PRINT \"done\"",
+    "IF A$ <> \"\" THEN 100 ELSE GOSUB 200: REM : PRINT",
+    "printable before abc$abc for$",
+    "PRINT \"unterminated",
+  };
+  struct lexed lexed[32], tokenized[32];
+  for (int prefixes = 0; prefixes <= 1; prefixes++) {
+    LEX* lex = new_lex(NULL, prefixes);
+    lex_tokenize(lex);
+    for (unsigned i = 0; i < sizeof LINES / sizeof LINES[0]; i++) {
+      const unsigned n = transcript(lex, LINES[i], false, lexed, 32);
+      const char* tokens = lex_tokenized(lex);
+      CuAssertPtrNotNull(tc, tokens);
+      CuAssertPtrEquals(tc, NULL, (void*) lex_tokenized(lex));
+      char* copy = estrdup(tokens);
+      CuAssertTrue(tc, strlen(copy) <= strlen(LINES[i]));
+      char spelled[64];
+      CuAssertIntEquals(tc, strlen(LINES[i]), spelled_length(copy));
+      spell_keywords(copy, spelled);
+      CuAssertStrEquals(tc, LINES[i], spelled);
+      CuAssertIntEquals(tc, n, transcript(lex, copy, true, tokenized, 32));
+      for (unsigned k = 0; k < n; k++) {
+        CuAssertIntEquals(tc, lexed[k].token, tokenized[k].token);
+        CuAssertStrEquals(tc, lexed[k].word, tokenized[k].word);
+        CuAssertStrEquals(tc, lexed[k].key, tokenized[k].key);
+        CuAssertDblEquals(tc, lexed[k].num, tokenized[k].num, 0);
+      }
+      efree(copy);
+    }
+    delete_lex(lex);
+  }
+
+  // a byte above ASCII in text not tokenized is not a keyword
+  LEX* lex = new_lex(NULL, false);
+  jmp_buf errjmp;
+  lex->errjmp = &errjmp;
+  lex->quiet = true;
+  const char text[] = { 'X', '=', keyword_byte(TOK_NOT), '1', '\0' };
+  volatile bool aborted = false;
+  if (setjmp(errjmp) == 0) {
+    lex_line(lex, 0, text);
+    lex_next(lex);
+    lex_next(lex);
+  }
+  else
+    aborted = true;
+  CuAssertTrue(tc, aborted);
+  CuAssertIntEquals(tc, TOK_ID, lex_tokenized_line(lex, 0, text));
+  CuAssertIntEquals(tc, '=', lex_next(lex));
+  CuAssertIntEquals(tc, TOK_NOT, lex_next(lex));
+  CuAssertIntEquals(tc, TOK_NUM, lex_next(lex));
+
+  // diagnostics show the keywords spelled out, pointing at the token
+  const char line[] = { keyword_byte(TOK_IF), ' ', 'X', ' ', keyword_byte(TOK_THEN), ' ', '1', '\0' };
+  lex_tokenized_line(lex, 0, line);
+  lex_next(lex);
+  lex_next(lex);
+  CuAssertIntEquals(tc, TOK_NUM, lex_next(lex));
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  CuAssertIntEquals(tc, 10, print_lex_line(lex, fp));
+  rewind(fp);
+  char shown[32];
+  CuAssertPtrNotNull(tc, fgets(shown, sizeof shown, fp));
+  CuAssertStrEquals(tc, "IF X THEN 1", shown);
+  fclose(fp);
+  delete_lex(lex);
+}
+
 CuSuite* lexer_test_suite(void) {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_new);
@@ -695,6 +942,7 @@ CuSuite* lexer_test_suite(void) {
   SUITE_ADD_TEST(suite, test_number);
   SUITE_ADD_TEST(suite, test_keyword_recognition);
   SUITE_ADD_TEST(suite, test_data);
+  SUITE_ADD_TEST(suite, test_tokenize);
   return suite;
 }
 
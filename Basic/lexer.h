@@ -4,6 +4,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <setjmp.h>
 #include "source.h"
 
 #define MAX_WORD (128)
@@ -18,6 +19,15 @@ typedef struct {
   double num;
   bool recognise_keyword_prefixes;
   char word[MAX_WORD];
+  char key[MAX_WORD];  // a name in upper case, for symbol lookup
+  bool tokenized;   // the text holds keyword bytes: see token.h
+  char* tokens;     // the current line tokenized as it is lexed
+  unsigned tokens_used;
+  unsigned tokens_allocated;
+  unsigned tokens_from;  // where the text not yet copied to tokens begins
+  bool tokenizing;
+  bool quiet;  // do not report errors in the source
+  jmp_buf* errjmp;  // where to abandon a line the lexer cannot continue, or NULL to exit
 } LEX;
 
 LEX* new_lex(const char* name, bool recognise_keyword_prefixes);
@@ -26,6 +36,18 @@ void delete_lex(LEX*);
 int lex_line(LEX*, unsigned lineno, const char* text);
 int lex_refresh(LEX*, const char* text);
 
+// Tokenize each line lexed from its text from now on, replacing the keywords
+// the lexer finds with keyword bytes, so it can be lexed again without
+// recognising them.
+void lex_tokenize(LEX*);
+// The current line tokenized, once, after it has been lexed; otherwise NULL.
+const char* lex_tokenized(LEX*);
+// Lex a line tokenized in the same keyword-recognition mode.
+int lex_tokenized_line(LEX*, unsigned lineno, const char* tokens);
+// Print the line with its keywords spelled out,
+// and return the column at which the current token appears.
+unsigned print_lex_line(LEX*, FILE*);
+
 int lex_peek(LEX*);
 
 unsigned lex_line_num(LEX*);
@@ -36,6 +58,7 @@ bool lex_unsigned(LEX*, unsigned *val);
 int lex_next(LEX*);
 int lex_token(LEX*);
 const char* lex_word(LEX*);
+const char* lex_key(LEX*);
 double lex_num(LEX*);
 
 const char* lex_next_data(LEX*);
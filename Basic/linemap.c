@@ -2,6 +2,7 @@
 // Copyright (c) 2024 Nigel Perks
 // Map Basic line number to value.
 
+#include <stdlib.h>
 #include <assert.h>
 #include "linemap.h"
 #include "utils.h"
@@ -10,62 +11,179 @@
 struct line_node {
   unsigned basic_line;
   unsigned val;
-  struct line_node * next;
 };
 
-#define LINE_HASH_SIZE (397)
+// How a full map is indexed for lookup: until all lines are inserted,
+// lookup searches the mappings in order.
+enum { LINE_MAP_LINEAR, LINE_MAP_DIRECT, LINE_MAP_SORTED };
 
 struct line_map {
-  struct line_node * hash[LINE_HASH_SIZE];
-  struct line_node * nodes;
+  struct line_node * nodes;  // in order of insertion
   unsigned allocated;
   unsigned count;
+  bool increasing;           // each line inserted is greater than the one before
+  int kind;
+  // direct: for each line from first, 1 + the index of its node, or 0
+  unsigned first;
+  unsigned range;
+  unsigned* direct;
+  // sorted: line numbers in order, and their values
+  unsigned* lines;
+  unsigned* vals;
 };
 
 LINE_MAP* new_line_map(unsigned lines) {
-  LINE_MAP* map = ecalloc(1, sizeof *map); // initialise hash table node pointers to null
+  LINE_MAP* map = ecalloc_in(MEM_LINEMAP, 1, sizeof *map);
   if (lines > 0)
-    map->nodes = ecalloc(lines, sizeof map->nodes[0]);
+    map->nodes = ecalloc_in(MEM_LINEMAP, lines, sizeof map->nodes[0]);
   map->allocated = lines;
   map->count = 0;
+  map->increasing = true;
+  map->kind = LINE_MAP_LINEAR;
   return map;
 }
 
 void delete_line_map(LINE_MAP* map) {
   if (map) {
     efree(map->nodes);
+    efree(map->direct);
+    efree(map->lines);
+    efree(map->vals);
     efree(map);
   }
 }
 
+// Index lines numbered densely enough, such as by 10s, directly by line number.
+static bool dense(unsigned range, unsigned count) {
+  return range <= 1024 || range / 16 <= count;
+}
+
+static void index_direct(LINE_MAP* map, unsigned first, unsigned last) {
+  map->kind = LINE_MAP_DIRECT;
+  map->first = first;
+  map->range = last - first + 1;
+  map->direct = ecalloc_in(MEM_LINEMAP, map->range, sizeof map->direct[0]);
+  // a line inserted again maps to its latest value
+  for (unsigned i = 0; i < map->count; i++)
+    map->direct[map->nodes[i].basic_line - first] = i + 1;
+}
+
+static const struct line_node * sorting_nodes;
+
+static int compare_nodes(const void* a, const void* b) {
+  const unsigned i = *(const unsigned*) a;
+  const unsigned j = *(const unsigned*) b;
+  const unsigned x = sorting_nodes[i].basic_line;
+  const unsigned y = sorting_nodes[j].basic_line;
+  if (x != y)
+    return x < y ? -1 : 1;
+  return i < j ? -1 : i > j;
+}
+
+static void index_sorted(LINE_MAP* map) {
+  map->kind = LINE_MAP_SORTED;
+  map->lines = emalloc_in(MEM_LINEMAP, map->count * sizeof map->lines[0]);
+  map->vals = emalloc_in(MEM_LINEMAP, map->count * sizeof map->vals[0]);
+  unsigned* order = emalloc(map->count * sizeof order[0]);
+  for (unsigned i = 0; i < map->count; i++)
+    order[i] = i;
+  if (!map->increasing) {
+    sorting_nodes = map->nodes;
+    qsort(order, map->count, sizeof order[0], compare_nodes);
+  }
+  // a line inserted again maps to its latest value
+  unsigned n = 0;
+  for (unsigned i = 0; i < map->count; i++) {
+    const struct line_node * node = map->nodes + order[i];
+    if (n && map->lines[n - 1] == node->basic_line)
+      n--;
+    map->lines[n] = node->basic_line;
+    map->vals[n] = node->val;
+    n++;
+  }
+  map->range = n;
+  efree(order);
+}
+
+static void index_map(LINE_MAP* map) {
+  assert(map->count > 0);
+  unsigned first = map->nodes[0].basic_line;
+  unsigned last = first;
+  for (unsigned i = 1; i < map->count; i++) {
+    if (map->nodes[i].basic_line < first)
+      first = map->nodes[i].basic_line;
+    if (map->nodes[i].basic_line > last)
+      last = map->nodes[i].basic_line;
+  }
+  if (dense(last - first + 1, map->count))
+    index_direct(map, first, last);
+  else
+    index_sorted(map);
+}
+
 bool insert_line_mapping(LINE_MAP* map, unsigned basic_line, unsigned val) {
   assert(map->count <= map->allocated);
   if (map->count == map->allocated)
     return false;
 
+  if (map->count && basic_line <= map->nodes[map->count - 1].basic_line)
+    map->increasing = false;
   struct line_node * node = map->nodes + map->count;
   node->basic_line = basic_line;
   node->val = val;
-  unsigned h = node->basic_line % LINE_HASH_SIZE;
-  node->next = map->hash[h];
-  map->hash[h] = node;
   map->count++;
+  if (map->count == map->allocated)
+    index_map(map);
   return true;
 }
 
 bool lookup_line_mapping(const LINE_MAP* map, unsigned basic_line, unsigned *val) {
   assert(map != NULL);
   assert(val != NULL);
-  unsigned h = basic_line % LINE_HASH_SIZE;
-  for (const struct line_node * node = map->hash[h]; node; node = node->next) {
-    if (node->basic_line == basic_line) {
-      *val = node->val;
+  switch (map->kind) {
+    case LINE_MAP_DIRECT: {
+      const unsigned offset = basic_line - map->first;  // wraps if below first
+      if (offset >= map->range || map->direct[offset] == 0)
+        return false;
+      *val = map->nodes[map->direct[offset] - 1].val;
+      return true;
+    }
+    case LINE_MAP_SORTED: {
+      // binary search without branching on the comparison
+      const unsigned* base = map->lines;
+      unsigned n = map->range;
+      while (n > 1) {
+        const unsigned half = n / 2;
+        base += base[half] <= basic_line ? half : 0;
+        n -= half;
+      }
+      if (*base != basic_line)
+        return false;
+      *val = map->vals[base - map->lines];
+      return true;
+    }
+  }
+  // not yet full: the latest mapping of the line
+  for (unsigned i = map->count; i > 0; i--) {
+    if (map->nodes[i - 1].basic_line == basic_line) {
+      *val = map->nodes[i - 1].val;
       return true;
     }
   }
   return false;
 }
 
+unsigned line_map_count(const LINE_MAP* map) {
+  assert(map != NULL);
+  return map->count;
+}
+
+void line_mapping(const LINE_MAP* map, unsigned i, unsigned *basic_line, unsigned *val) {
+  assert(map != NULL);
+  assert(i < map->count);
+  *basic_line = map->nodes[i].basic_line;
+  *val = map->nodes[i].val;
+}
 
 #ifdef UNIT_TEST
 
@@ -80,8 +198,7 @@ static void test_new_map(CuTest* tc) {
   CuAssertIntEquals(tc, 0, map->allocated);
   CuAssertIntEquals(tc, 0, map->count);
   CuAssertPtrEquals(tc, NULL, map->nodes);
-  for (unsigned i = 0; i < LINE_HASH_SIZE; i++)
-    CuAssertPtrEquals(tc, NULL, map->hash[i]);
+  CuAssertIntEquals(tc, LINE_MAP_LINEAR, map->kind);
   delete_line_map(map);
 
   // Lines
@@ -93,10 +210,8 @@ static void test_new_map(CuTest* tc) {
   for (unsigned i = 0; i < 4; i++) {
     CuAssertIntEquals(tc, 0, map->nodes[i].basic_line);
     CuAssertIntEquals(tc, 0, map->nodes[i].val);
-    CuAssertPtrEquals(tc, NULL, map->nodes[i].next);
   }
-  for (unsigned i = 0; i < LINE_HASH_SIZE; i++)
-    CuAssertPtrEquals(tc, NULL, map->hash[i]);
+  CuAssertIntEquals(tc, LINE_MAP_LINEAR, map->kind);
   delete_line_map(map);
 }
 
@@ -130,13 +245,76 @@ static void test_lookup(CuTest* tc) {
   succ = lookup_line_mapping(map, 230, &val);
   CuAssertIntEquals(tc, false, succ);
 
+  unsigned basic_line;
+  CuAssertIntEquals(tc, 2, line_map_count(map));
+  line_mapping(map, 1, &basic_line, &val);
+  CuAssertIntEquals(tc, 1000, basic_line);
+  CuAssertIntEquals(tc, 77, val);
+
   delete_line_map(map);
 }
 
+// Map count lines numbered from first by step, in the given order, to 1000 + their index.
+static LINE_MAP* numbered_map(unsigned count, unsigned first, unsigned step, bool reverse) {
+  LINE_MAP* map = new_line_map(count);
+  for (unsigned i = 0; i < count; i++) {
+    unsigned k = reverse ? count - 1 - i : i;
+    insert_line_mapping(map, first + k * step, 1000 + k);
+  }
+  return map;
+}
+
+static void check_numbered_map(CuTest* tc, const LINE_MAP* map, unsigned count, unsigned first, unsigned step) {
+  unsigned val;
+  for (unsigned k = 0; k < count; k++) {
+    CuAssertIntEquals(tc, true, lookup_line_mapping(map, first + k * step, &val));
+    CuAssertIntEquals(tc, 1000 + k, val);
+    if (step > 1)
+      CuAssertIntEquals(tc, false, lookup_line_mapping(map, first + k * step + 1, &val));
+  }
+  CuAssertIntEquals(tc, false, lookup_line_mapping(map, first + count * step, &val));
+  if (first)
+    CuAssertIntEquals(tc, false, lookup_line_mapping(map, first - 1, &val));
+}
+
+static void test_index_kinds(CuTest* tc) {
+  LINE_MAP* map = numbered_map(500, 100, 10, false);
+  CuAssertIntEquals(tc, LINE_MAP_DIRECT, map->kind);
+  check_numbered_map(tc, map, 500, 100, 10);
+  delete_line_map(map);
+
+  map = numbered_map(500, 7, 100, true);
+  CuAssertIntEquals(tc, LINE_MAP_SORTED, map->kind);
+  check_numbered_map(tc, map, 500, 7, 100);
+  delete_line_map(map);
+
+  map = numbered_map(1, 65535, 1, false);
+  check_numbered_map(tc, map, 1, 65535, 1);
+  delete_line_map(map);
+
+  // the latest mapping of a line inserted twice
+  unsigned val;
+  static const unsigned steps[] = { 1, 10000 };
+  for (unsigned k = 0; k < 2; k++) {
+    const unsigned step = steps[k];
+    map = new_line_map(3);
+    insert_line_mapping(map, 2 * step, 1);
+    insert_line_mapping(map, step, 2);
+    insert_line_mapping(map, 2 * step, 3);
+    CuAssertIntEquals(tc, step == 1 ? LINE_MAP_DIRECT : LINE_MAP_SORTED, map->kind);
+    CuAssertIntEquals(tc, true, lookup_line_mapping(map, 2 * step, &val));
+    CuAssertIntEquals(tc, 3, val);
+    CuAssertIntEquals(tc, true, lookup_line_mapping(map, step, &val));
+    CuAssertIntEquals(tc, 2, val);
+    delete_line_map(map);
+  }
+}
+
 CuSuite* linemap_test_suite(void) {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_new_map);
   SUITE_ADD_TEST(suite, test_lookup);
+  SUITE_ADD_TEST(suite, test_index_kinds);
   return suite;
 }
 
@@ -12,3 +12,7 @@ LINE_MAP* new_line_map(unsigned lines);
 void delete_line_map(LINE_MAP*);
 bool insert_line_mapping(LINE_MAP*, unsigned basic_line, unsigned value);
 bool lookup_line_mapping(const LINE_MAP*, unsigned basic_line, unsigned *value);
+
+// Mappings in order of insertion, for saving the map.
+unsigned line_map_count(const LINE_MAP*);
+void line_mapping(const LINE_MAP*, unsigned i, unsigned *basic_line, unsigned *value);
@@ -15,6 +15,7 @@
 #include "emit.h"
 #include "bcode.h"
 #include "builtin.h"
+#include "linemap.h"
 #include "os.h"
 
 typedef struct {
@@ -22,76 +23,203 @@ typedef struct {
   BCODE* bcode;
   SYMTAB* st;
   unsigned if_then;
+  bool quiet;  // on error, stop without reporting it
   jmp_buf errjmp;
 } PARSER;
 
-static void parse_line(PARSER*, unsigned line_index, unsigned lineno, const char* text);
+static void parse_line(PARSER*, unsigned line_index, unsigned lineno, const char* text, bool tokenized);
+
+// Parse a line from its tokenized text, or parse and tokenize its text,
+// and note where its B-code starts.
+static void parse_source_line(PARSER* parser, SOURCE* source, unsigned i) {
+  struct bcode_segment * seg = &parser->bcode->segments[parser->bcode->segment_count++];
+  seg->line_id = source_line_id(source, i);
+  seg->start = parser->bcode->used;
+  const char* tokens = source_tokens(source, i);
+  if (tokens)
+    parse_line(parser, i, source_linenum(source, i), tokens, true);
+  else {
+    parse_line(parser, i, source_linenum(source, i), source_text(source, i), false);
+    if ((tokens = lex_tokenized(parser->lex)) != NULL)
+      set_source_tokens(source, i, tokens);
+  }
+}
 
-BCODE* parse_source(const SOURCE* source, SYMTAB* st, bool recognise_keyword_prefixes) {
+// Parse each line, tokenizing the lines not parsed before, and store the
+// program compactly once their text has shrunk.
+BCODE* parse_source(SOURCE* source, SYMTAB* st, bool recognise_keyword_prefixes) {
   assert(source != NULL);
   assert(st != NULL);
   PARSER parser;
   parser.lex = new_lex(source_name(source), recognise_keyword_prefixes);
+  parser.lex->errjmp = &parser.errjmp;
+  lex_tokenize(parser.lex);
+  set_source_token_mode(source, recognise_keyword_prefixes);
   parser.bcode = new_bcode();
+  bcode_reserve(parser.bcode, 4 * source_lines(source));
+  parser.bcode->segments = emalloc_in(MEM_BCODE, (source_lines(source) + 1) * sizeof parser.bcode->segments[0]);
   parser.st = st;
   parser.if_then = 0;
+  parser.quiet = false;
   if (setjmp(parser.errjmp) == 0) {
     for (unsigned i = 0; i < source_lines(source); i++)
-      parse_line(&parser, i, source_linenum(source, i), source_text(source, i));
+      parse_source_line(&parser, source, i);
   }
   else {
     delete_bcode(parser.bcode);
     parser.bcode = NULL;
   }
   delete_lex(parser.lex);
+  compact_source(source);
   sym_make_unknown_array(st);
   return parser.bcode;
 }
 
+static bool segment_has_def(const BCODE* bcode, unsigned seg) {
+  unsigned end = seg + 1 < bcode->segment_count ? bcode->segments[seg + 1].start : bcode->used;
+  for (unsigned pc = bcode->segments[seg].start; pc < end; pc++) {
+    if (bcode->inst[pc].op == B_DEF)
+      return true;
+  }
+  return false;
+}
+
+// Recompile a changed program, copying the B-code of each line unchanged since
+// the previous compilation and parsing only new and changed lines, in the same
+// symbol table. The previous B-code is consumed. Jumps are resolved through
+// the line index at run time, so copied code needs only its source line
+// renumbered. Return NULL, without reporting errors, if the program must be
+// parsed in full: because a removed line defined a function, whose symbol a
+// full parse might now give another kind, or because a line has an error.
+BCODE* reparse_source(SOURCE* source, SYMTAB* st, bool recognise_keyword_prefixes, BCODE* previous) {
+  assert(source != NULL);
+  assert(st != NULL);
+  assert(previous != NULL);
+
+  if (previous->segments == NULL) {
+    delete_bcode(previous);
+    return NULL;
+  }
+
+  // which previous line segments are still in the program
+  LINE_MAP* old = new_line_map(previous->segment_count);
+  for (unsigned j = 0; j < previous->segment_count; j++)
+    insert_line_mapping(old, previous->segments[j].line_id, j);
+  bool* kept = ecalloc(previous->segment_count + 1, sizeof kept[0]);
+  for (unsigned i = 0; i < source_lines(source); i++) {
+    unsigned j;
+    if (lookup_line_mapping(old, source_line_id(source, i), &j))
+      kept[j] = true;
+  }
+  for (unsigned j = 0; j < previous->segment_count; j++) {
+    if (!kept[j] && segment_has_def(previous, j)) {
+      delete_line_map(old);
+      efree(kept);
+      delete_bcode(previous);
+      return NULL;
+    }
+  }
+  efree(kept);
+
+  PARSER parser;
+  parser.lex = new_lex(source_name(source), recognise_keyword_prefixes);
+  parser.lex->errjmp = &parser.errjmp;
+  parser.lex->quiet = true;
+  lex_tokenize(parser.lex);
+  set_source_token_mode(source, recognise_keyword_prefixes);
+  parser.bcode = new_bcode();
+  bcode_reserve(parser.bcode, previous->used + 4 * source_lines(source));
+  parser.bcode->segments = emalloc_in(MEM_BCODE, (source_lines(source) + 1) * sizeof parser.bcode->segments[0]);
+  parser.st = st;
+  parser.if_then = 0;
+  parser.quiet = true;
+
+  if (setjmp(parser.errjmp) == 0) {
+    for (unsigned i = 0; i < source_lines(source); i++) {
+      unsigned j;
+      if (lookup_line_mapping(old, source_line_id(source, i), &j)) {
+        unsigned start = previous->segments[j].start;
+        unsigned end = j + 1 < previous->segment_count ? previous->segments[j + 1].start : previous->used;
+        struct bcode_segment * seg = &parser.bcode->segments[parser.bcode->segment_count++];
+        seg->line_id = previous->segments[j].line_id;
+        seg->start = parser.bcode->used;
+        bcode_append(parser.bcode, previous->inst + start, end - start);
+        // only strings still in use move to the new arena, so edits do not accumulate
+        for (unsigned pc = seg->start; pc < parser.bcode->used; pc++) {
+          BINST* in = &parser.bcode->inst[pc];
+          if (bcode_format(in->op) == BF_STR)
+            in->u.str = bcode_strdup(parser.bcode, in->u.str);
+        }
+        assert(parser.bcode->inst[seg->start].op == B_SOURCE_LINE);
+        parser.bcode->inst[seg->start].u.source_line = i;
+      }
+      else
+        parse_source_line(&parser, source, i);
+    }
+  }
+  else {
+    delete_bcode(parser.bcode);
+    parser.bcode = NULL;
+  }
+  delete_line_map(old);
+  delete_lex(parser.lex);
+  delete_bcode(previous);
+  if (parser.bcode)
+    sym_make_unknown_array(st);
+  return parser.bcode;
+}
+
 static void print_line(LEX* lex) {
   unsigned lineno = lex_line_num(lex);
-  int len = lineno ? fprintf(stderr, "%u ", lineno) : 0;
-  fprintf(stderr, "%s\n", lex_line_text(lex));
-  space(len + lex_token_pos(lex), stderr);
-  fputs("^\n", stderr);
+  int len = lineno ? fprintf(diagnostics(), "%u ", lineno) : 0;
+  unsigned col = print_lex_line(lex, diagnostics());
+  putc('\n', diagnostics());
+  space(len + col, diagnostics());
+  fputs("^\n", diagnostics());
 }
 
 // Print error line, formatted error message, and current token, and stop parsing.
 static void parse_error(PARSER* parser, const char* fmt, ...) {
+  if (parser->quiet)
+    longjmp(parser->errjmp, 1);
   print_line(parser->lex);
 
-  fputs("Error: ", stderr);
+  fputs("Error: ", diagnostics());
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vfprintf(diagnostics(), fmt, ap);
   va_end(ap);
 
-  fputs(": ", stderr);
-  print_lex_token(parser->lex, stderr);
-  putc('\n', stderr);
+  fputs(": ", diagnostics());
+  print_lex_token(parser->lex, diagnostics());
+  putc('\n', diagnostics());
 
   longjmp(parser->errjmp, 1);
 }
 
 // Print error line and formatted error message, and stop parsing.
 static void parse_error_no_token(PARSER* parser, const char* fmt, ...) {
+  if (parser->quiet)
+    longjmp(parser->errjmp, 1);
   print_line(parser->lex);
 
-  fputs("Error: ", stderr);
+  fputs("Error: ", diagnostics());
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vfprintf(diagnostics(), fmt, ap);
   va_end(ap);
-  putc('\n', stderr);
+  putc('\n', diagnostics());
 
   longjmp(parser->errjmp, 1);
 }
 
 static void match(PARSER* parser, int token) {
   if (lex_token(parser->lex) != token) {
-    fputs("Error: expected: ", stderr);
-    print_token(token, stderr);
-    putc('\n', stderr);
+    if (parser->quiet)
+      longjmp(parser->errjmp, 1);
+    fputs("Error: expected: ", diagnostics());
+    print_token(token, diagnostics());
+    putc('\n', diagnostics());
     parse_error(parser, "unexpected token");
   }
   lex_next(parser->lex);
@@ -99,8 +227,11 @@ static void match(PARSER* parser, int token) {
 
 static void complete_statement(PARSER*);
 
-static void parse_line(PARSER* parser, unsigned line_index, unsigned lineno, const char* text) {
-  lex_line(parser->lex, lineno, text);
+static void parse_line(PARSER* parser, unsigned line_index, unsigned lineno, const char* text, bool tokenized) {
+  if (tokenized)
+    lex_tokenized_line(parser->lex, lineno, text);
+  else
+    lex_line(parser->lex, lineno, text);
   emit_source_line(parser->bcode, B_SOURCE_LINE, line_index);
   parser->if_then = 0;
   complete_statement(parser);
@@ -262,7 +393,7 @@ static void def_statement(PARSER* parser) {
 
   const char* name = lex_word(parser->lex);
   int type = string_name(lex_word(parser->lex)) ? TYPE_STR : TYPE_NUM;
-  SYMBOL* sym = sym_lookup(parser->st, name, /*paren*/ true);
+  SYMBOL* sym = sym_lookup_key(parser->st, lex_key(parser->lex), /*paren*/ true);
   if (sym) {
     if (sym->kind == SYM_UNKNOWN)
       sym->kind = SYM_DEF;
@@ -429,7 +560,7 @@ static void input_statement(PARSER* parser) {
 static void input_buffer(PARSER* parser) {
   char* prompt = NULL;
   if (lex_token(parser->lex) == TOK_STR) {
-    prompt = estrdup(lex_word(parser->lex));
+    prompt = bcode_strdup(parser->bcode, lex_word(parser->lex));
     int sep = lex_next(parser->lex);
     if (sep == ';' || sep == ',')
       lex_next(parser->lex);
@@ -892,9 +1023,11 @@ static void builtin_arg(PARSER* parser, int type) {
 // If paren_kind is not UNKNOWN, an existing paren symbol must be of that kind.
 // A new paren symbol is inserted with that kind.
 static SYMBOL* identifier(PARSER* parser, unsigned *parameters, int paren_kind) {
-  char name[MAX_WORD];
-  if (lex_token(parser->lex) == TOK_ID)
+  char name[MAX_WORD], key[MAX_WORD];
+  if (lex_token(parser->lex) == TOK_ID) {
     strcpy(name, lex_word(parser->lex));
+    strcpy(key, lex_key(parser->lex));
+  }
   match(parser, TOK_ID);
 
   int type = string_name(name) ? TYPE_STR : TYPE_NUM;
@@ -909,7 +1042,7 @@ static SYMBOL* identifier(PARSER* parser, unsigned *parameters, int paren_kind)
     match(parser, ')');
   }
 
-  SYMBOL* sym = sym_lookup(parser->st, name, /*paren*/ *parameters);
+  SYMBOL* sym = sym_lookup_key(parser->st, key, /*paren*/ *parameters);
   if (sym) {
     if (*parameters) {
       if (sym->kind == SYM_UNKNOWN)
@@ -7,6 +7,10 @@
 #include "symbol.h"
 #include "bcode.h"
 
-BCODE* parse_source(const SOURCE*, SYMTAB*, bool recognise_keyword_prefixes);
+BCODE* parse_source(SOURCE*, SYMTAB*, bool recognise_keyword_prefixes);
+
+// Recompile, reusing the previous B-code of unchanged lines, and consuming it.
+// Return NULL if the program must be parsed in full.
+BCODE* reparse_source(SOURCE*, SYMTAB*, bool recognise_keyword_prefixes, BCODE* previous);
 
 bool name_is_print_builtin(const char* name);
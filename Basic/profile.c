@@ -0,0 +1,509 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Execution profiles of a program: counts and times per source line,
+// and a call graph of GOSUB subroutines.
+
+// A line is timed while control is in it: its time includes that of any
+// DEF function it calls, but not of the lines of a subroutine it calls
+// with GOSUB, which are charged to themselves.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "profile.h"
+#include "os.h"
+#include "utils.h"
+
+#define NO_LINE (~0U)
+
+struct line_profile {
+  unsigned long count;
+  unsigned long long nsec;
+};
+
+struct profile {
+  unsigned lines;
+  unsigned current;  // line being timed, or NO_LINE
+  unsigned long long since;
+  struct line_profile line[0];
+};
+
+PROFILE* new_profile(unsigned lines) {
+  PROFILE* p = ecalloc(1, sizeof *p + lines * sizeof p->line[0]);
+  p->lines = lines;
+  p->current = NO_LINE;
+  return p;
+}
+
+void delete_profile(PROFILE* p) {
+  efree(p);
+}
+
+unsigned profile_lines(const PROFILE* p) {
+  return p->lines;
+}
+
+void profile_count_line(PROFILE* p, unsigned source_line) {
+  assert(p != NULL);
+  if (source_line < p->lines)
+    p->line[source_line].count++;
+}
+
+void profile_enter(PROFILE* p, unsigned source_line, unsigned long long now) {
+  assert(p != NULL);
+  if (p->current != NO_LINE)
+    p->line[p->current].nsec += now - p->since;
+  p->current = source_line < p->lines ? source_line : NO_LINE;
+  p->since = now;
+}
+
+void profile_stop(PROFILE* p, unsigned long long now) {
+  assert(p != NULL);
+  if (p->current != NO_LINE) {
+    p->line[p->current].nsec += now - p->since;
+    p->current = NO_LINE;
+  }
+}
+
+unsigned long profile_line_count(const PROFILE* p, unsigned source_line) {
+  assert(source_line < p->lines);
+  return p->line[source_line].count;
+}
+
+unsigned long long profile_line_nsec(const PROFILE* p, unsigned source_line) {
+  assert(source_line < p->lines);
+  return p->line[source_line].nsec;
+}
+
+int profile_format(const char* name) {
+  const char* dot = strrchr(name, '.');
+  if (dot && STRICMP(dot, ".csv") == 0)
+    return PROFILE_CSV;
+  if (dot && STRICMP(dot, ".json") == 0)
+    return PROFILE_JSON;
+  return PROFILE_TEXT;
+}
+
+struct hot_line {
+  unsigned line;
+  unsigned long count;
+  unsigned long long nsec;
+};
+
+static int hotter(const void* a, const void* b) {
+  const struct hot_line * x = a;
+  const struct hot_line * y = b;
+  if (x->nsec != y->nsec)
+    return x->nsec > y->nsec ? -1 : 1;
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static void print_csv_string(const char* s, FILE* fp) {
+  putc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"')
+      putc('"', fp);
+    putc(*s, fp);
+  }
+  putc('"', fp);
+}
+
+static void print_json_string(const char* s, FILE* fp) {
+  putc('"', fp);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < ' ')
+      fprintf(fp, "\\u%04x", c);
+    else
+      putc(c, fp);
+  }
+  putc('"', fp);
+}
+
+static double percent(unsigned long long nsec, unsigned long long total) {
+  return total ? 100.0 * (double) nsec / (double) total : 0;
+}
+
+void print_profile(const PROFILE* p, const SOURCE* source, int format, FILE* fp) {
+  assert(p != NULL && source != NULL && fp != NULL);
+
+  const unsigned lines = p->lines < source_lines(source) ? p->lines : source_lines(source);
+  unsigned long long total = 0;
+  for (unsigned i = 0; i < lines; i++)
+    total += p->line[i].nsec;
+
+  switch (format) {
+    case PROFILE_CSV:
+      fputs("line,count,nsec,percent,source\n", fp);
+      for (unsigned i = 0; i < lines; i++) {
+        if (p->line[i].count) {
+          fprintf(fp, "%u,%lu,%llu,%.2f,", source_linenum(source, i), p->line[i].count,
+                  p->line[i].nsec, percent(p->line[i].nsec, total));
+          print_csv_string(source_text(source, i), fp);
+          putc('\n', fp);
+        }
+      }
+      break;
+    case PROFILE_JSON: {
+      fprintf(fp, "{\n  \"total_nsec\": %llu,\n  \"lines\": [", total);
+      const char* sep = "\n";
+      for (unsigned i = 0; i < lines; i++) {
+        if (p->line[i].count) {
+          fprintf(fp, "%s    {\"line\": %u, \"count\": %lu, \"nsec\": %llu, \"percent\": %.2f, \"source\": ",
+                  sep, source_linenum(source, i), p->line[i].count, p->line[i].nsec, percent(p->line[i].nsec, total));
+          print_json_string(source_text(source, i), fp);
+          putc('}', fp);
+          sep = ",\n";
+        }
+      }
+      fputs("\n  ]\n}\n", fp);
+      break;
+    }
+    default: {
+      struct hot_line * hot = emalloc((lines ? lines : 1) * sizeof hot[0]);
+      unsigned n = 0;
+      for (unsigned i = 0; i < lines; i++) {
+        if (p->line[i].count) {
+          hot[n].line = i;
+          hot[n].count = p->line[i].count;
+          hot[n].nsec = p->line[i].nsec;
+          n++;
+        }
+      }
+      qsort(hot, n, sizeof hot[0], hotter);
+      fprintf(fp, "Profile: %u lines executed, %.3f ms\n", n, total / 1e6);
+      fputs("   LINE        COUNT   %TIME  SOURCE\n", fp);
+      for (unsigned i = 0; i < n; i++)
+        fprintf(fp, "%7u %12lu %6.2f%%  %s\n", source_linenum(source, hot[i].line), hot[i].count,
+                percent(hot[i].nsec, total), source_text(source, hot[i].line));
+      efree(hot);
+      break;
+    }
+  }
+}
+
+// The call graph is a calling context tree: a node for each subroutine
+// in each chain of calls leading to it, so that a subroutine called from
+// several places has several nodes, whose times are summed to report it.
+// Nodes are created after their parents, so a parent's index is lower.
+
+#define ROOT (0)
+
+struct call_node {
+  unsigned line;
+  unsigned parent;
+  unsigned child;    // first child, or ROOT if none
+  unsigned sibling;  // next child of parent, or ROOT if none
+  unsigned long calls;
+  unsigned long long self;
+};
+
+struct call_profile {
+  struct call_node * node;
+  unsigned used;
+  unsigned allocated;
+  unsigned current;
+  unsigned depth;
+  bool timing;
+  unsigned long long since;
+};
+
+CALL_PROFILE* new_call_profile(void) {
+  CALL_PROFILE* p = ecalloc(1, sizeof *p);
+  p->allocated = 64;
+  p->node = ecalloc(p->allocated, sizeof p->node[0]);
+  p->used = 1;  // the main program
+  p->node[ROOT].calls = 1;
+  return p;
+}
+
+void delete_call_profile(CALL_PROFILE* p) {
+  if (p) {
+    efree(p->node);
+    efree(p);
+  }
+}
+
+static void charge(CALL_PROFILE* p, unsigned long long now) {
+  if (p->timing)
+    p->node[p->current].self += now - p->since;
+  p->since = now;
+  p->timing = true;
+}
+
+void profile_call(CALL_PROFILE* p, unsigned line, unsigned long long now) {
+  assert(p != NULL);
+  charge(p, now);
+  unsigned k = p->node[p->current].child;
+  while (k != ROOT && p->node[k].line != line)
+    k = p->node[k].sibling;
+  if (k == ROOT) {
+    if (p->used == p->allocated) {
+      p->allocated *= 2;
+      p->node = erealloc(p->node, p->allocated * sizeof p->node[0]);
+    }
+    k = p->used++;
+    struct call_node * n = &p->node[k];
+    n->line = line;
+    n->parent = p->current;
+    n->child = ROOT;
+    n->sibling = p->node[p->current].child;
+    n->calls = 0;
+    n->self = 0;
+    p->node[p->current].child = k;
+  }
+  p->node[k].calls++;
+  p->current = k;
+  p->depth++;
+}
+
+void profile_return(CALL_PROFILE* p, unsigned long long now) {
+  assert(p != NULL);
+  charge(p, now);
+  if (p->current != ROOT) {
+    p->current = p->node[p->current].parent;
+    p->depth--;
+  }
+}
+
+unsigned call_profile_depth(const CALL_PROFILE* p) {
+  return p->depth;
+}
+
+void call_profile_start(CALL_PROFILE* p, unsigned long long now) {
+  assert(p != NULL);
+  p->since = now;
+  p->timing = true;
+}
+
+void call_profile_stop(CALL_PROFILE* p, unsigned long long now) {
+  assert(p != NULL);
+  charge(p, now);
+  p->timing = false;
+}
+
+// Inclusive time of each node: its own and that of its descendants.
+static unsigned long long * inclusive_times(const CALL_PROFILE* p) {
+  unsigned long long * incl = emalloc(p->used * sizeof incl[0]);
+  for (unsigned i = 0; i < p->used; i++)
+    incl[i] = p->node[i].self;
+  for (unsigned i = p->used - 1; i > ROOT; i--)
+    incl[p->node[i].parent] += incl[i];
+  return incl;
+}
+
+// Whether a node is called, directly or indirectly, by another call of the same subroutine.
+static bool recursive(const CALL_PROFILE* p, unsigned k) {
+  for (unsigned a = p->node[k].parent; a != ROOT; a = p->node[a].parent) {
+    if (p->node[a].line == p->node[k].line)
+      return true;
+  }
+  return false;
+}
+
+struct subroutine {
+  unsigned line;
+  unsigned long calls;
+  unsigned long long incl;
+  unsigned long long excl;
+};
+
+static int more_inclusive(const void* a, const void* b) {
+  const struct subroutine * x = a;
+  const struct subroutine * y = b;
+  if (x->incl != y->incl)
+    return x->incl > y->incl ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+void print_call_profile(const CALL_PROFILE* p, FILE* fp) {
+  assert(p != NULL && fp != NULL);
+  unsigned long long * incl = inclusive_times(p);
+  struct subroutine * sub = emalloc(p->used * sizeof sub[0]);
+  unsigned n = 0;
+  for (unsigned i = 0; i < p->used; i++) {
+    unsigned j = 0;
+    while (j < n && sub[j].line != p->node[i].line)
+      j++;
+    if (j == n) {
+      sub[n].line = p->node[i].line;
+      sub[n].calls = sub[n].incl = sub[n].excl = 0;
+      n++;
+    }
+    sub[j].calls += p->node[i].calls;
+    sub[j].excl += p->node[i].self;
+    if (!recursive(p, i))
+      sub[j].incl += incl[i];
+  }
+  qsort(sub, n, sizeof sub[0], more_inclusive);
+
+  const unsigned long long total = incl[ROOT];
+  fprintf(fp, "Call profile: %u subroutines, %.3f ms\n", n - 1, total / 1e6);
+  fputs("   LINE        CALLS    INCL ms    EXCL ms   %INCL   %EXCL\n", fp);
+  for (unsigned i = 0; i < n; i++) {
+    if (sub[i].line == 0)
+      fprintf(fp, "%7s", "main");
+    else
+      fprintf(fp, "%7u", sub[i].line);
+    fprintf(fp, " %12lu %10.3f %10.3f %6.2f%% %6.2f%%\n", sub[i].calls, sub[i].incl / 1e6, sub[i].excl / 1e6,
+            percent(sub[i].incl, total), percent(sub[i].excl, total));
+  }
+  efree(sub);
+  efree(incl);
+}
+
+void print_folded_stacks(const CALL_PROFILE* p, FILE* fp) {
+  assert(p != NULL && fp != NULL);
+  for (unsigned i = 0; i < p->used; i++) {
+    unsigned long long usec = p->node[i].self / 1000;
+    if (usec == 0)
+      continue;
+    unsigned path[64];
+    unsigned depth = 0;
+    for (unsigned k = i; k != ROOT && depth < sizeof path / sizeof path[0]; k = p->node[k].parent)
+      path[depth++] = p->node[k].line;
+    fputs("main", fp);
+    while (depth > 0)
+      fprintf(fp, ";%u", path[--depth]);
+    fprintf(fp, " %llu\n", usec);
+  }
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_profile(CuTest* tc) {
+  PROFILE* p = new_profile(3);
+  CuAssertIntEquals(tc, 3, profile_lines(p));
+
+  const unsigned lines[] = { 0, 1, 2, 1, 2 };
+  const unsigned long long times[] = { 1000, 1100, 1400, 1500, 1600 };
+  for (unsigned i = 0; i < 5; i++) {
+    profile_count_line(p, lines[i]);
+    profile_enter(p, lines[i], times[i]);
+  }
+  profile_stop(p, 1800);
+  profile_stop(p, 5000);
+
+  CuAssertIntEquals(tc, 1, profile_line_count(p, 0));
+  CuAssertIntEquals(tc, 2, profile_line_count(p, 1));
+  CuAssertIntEquals(tc, 2, profile_line_count(p, 2));
+  CuAssertTrue(tc, profile_line_nsec(p, 0) == 100);
+  CuAssertTrue(tc, profile_line_nsec(p, 1) == 400);
+  CuAssertTrue(tc, profile_line_nsec(p, 2) == 300);
+
+  // a line outside the profile stops timing
+  profile_enter(p, 0, 6000);
+  profile_enter(p, 7, 6050);
+  profile_enter(p, 1, 9000);
+  profile_stop(p, 9001);
+  CuAssertTrue(tc, profile_line_nsec(p, 0) == 150);
+  CuAssertTrue(tc, profile_line_nsec(p, 1) == 401);
+  CuAssertIntEquals(tc, 2, profile_line_count(p, 1));
+
+  delete_profile(p);
+}
+
+static void test_profile_report(CuTest* tc) {
+  SOURCE* source = load_source_string("10 PRINT \"A\"\n20 GOTO 10\n30 END\n", "profile");
+  PROFILE* p = new_profile(source_lines(source));
+  profile_count_line(p, 0);
+  profile_enter(p, 0, 0);
+  profile_count_line(p, 1);
+  profile_enter(p, 1, 100);
+  profile_stop(p, 400);
+
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  char buf[512];
+  size_t n;
+
+  print_profile(p, source, PROFILE_CSV, fp);
+  rewind(fp);
+  n = fread(buf, 1, sizeof buf - 1, fp);
+  buf[n] = '\0';
+  CuAssertStrEquals(tc,
+    "line,count,nsec,percent,source\n"
+    "10,1,100,25.00,\"PRINT \"\"A\"\"\"\n"
+    "20,1,300,75.00,\"GOTO 10\"\n", buf);
+
+  rewind(fp);
+  print_profile(p, source, PROFILE_TEXT, fp);
+  n = (size_t) ftell(fp);
+  rewind(fp);
+  n = fread(buf, 1, n < sizeof buf ? n : sizeof buf - 1, fp);
+  buf[n] = '\0';
+  char* line20 = strstr(buf, "     20 ");
+  char* line10 = strstr(buf, "     10 ");
+  CuAssertPtrNotNull(tc, line20);
+  CuAssertPtrNotNull(tc, line10);
+  CuAssertTrue(tc, line20 < line10);
+  CuAssertPtrEquals(tc, NULL, strstr(buf, "END"));
+
+  fclose(fp);
+  delete_profile(p);
+  delete_source(source);
+
+  CuAssertIntEquals(tc, PROFILE_CSV, profile_format("hot.CSV"));
+  CuAssertIntEquals(tc, PROFILE_JSON, profile_format("out/hot.json"));
+  CuAssertIntEquals(tc, PROFILE_TEXT, profile_format("hot.txt"));
+}
+
+static void test_call_profile(CuTest* tc) {
+  CALL_PROFILE* p = new_call_profile();
+  // main calls 1000 twice, which calls 2000 the first time; main also calls 2000
+  const unsigned long long MS = 1000000;
+  call_profile_start(p, 0);
+  profile_call(p, 1000, 1 * MS);       // main: 1 ms
+  profile_call(p, 2000, 3 * MS);       // 1000: 2 ms
+  CuAssertIntEquals(tc, 2, call_profile_depth(p));
+  profile_return(p, 7 * MS);           // 2000: 4 ms
+  profile_return(p, 8 * MS);           // 1000: 1 ms
+  profile_call(p, 1000, 9 * MS);       // main: 1 ms
+  profile_return(p, 10 * MS);          // 1000: 1 ms
+  profile_call(p, 2000, 10 * MS);
+  profile_return(p, 12 * MS);          // 2000: 2 ms
+  call_profile_stop(p, 15 * MS);       // main: 3 ms
+  call_profile_stop(p, 99 * MS);
+  CuAssertIntEquals(tc, 0, call_profile_depth(p));
+
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  char buf[512];
+  print_folded_stacks(p, fp);
+  long len = ftell(fp);
+  rewind(fp);
+  size_t n = fread(buf, 1, (size_t) len, fp);
+  buf[n] = '\0';
+  CuAssertStrEquals(tc, "main 5000\nmain;1000 4000\nmain;1000;2000 4000\nmain;2000 2000\n", buf);
+
+  rewind(fp);
+  print_call_profile(p, fp);
+  len = ftell(fp);
+  rewind(fp);
+  n = fread(buf, 1, (size_t) len, fp);
+  buf[n] = '\0';
+  CuAssertPtrNotNull(tc, strstr(buf, "Call profile: 2 subroutines, 15.000 ms"));
+  CuAssertPtrNotNull(tc, strstr(buf, "   main            1     15.000      5.000"));
+  CuAssertPtrNotNull(tc, strstr(buf, "   1000            2      8.000      4.000"));
+  CuAssertPtrNotNull(tc, strstr(buf, "   2000            2      6.000      6.000"));
+  CuAssertTrue(tc, strstr(buf, "   1000 ") < strstr(buf, "   2000 "));
+  fclose(fp);
+
+  delete_call_profile(p);
+}
+
+CuSuite* profile_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_profile);
+  SUITE_ADD_TEST(suite, test_profile_report);
+  SUITE_ADD_TEST(suite, test_call_profile);
+  return suite;
+}
+
+#endif // UNIT_TEST
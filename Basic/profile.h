@@ -0,0 +1,64 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Execution profiles of a program: counts and times per source line,
+// and a call graph of GOSUB subroutines.
+
+#pragma once
+
+#include <stdio.h>
+#include "source.h"
+
+enum profile_format { PROFILE_TEXT, PROFILE_CSV, PROFILE_JSON };
+
+typedef struct profile PROFILE;
+
+PROFILE* new_profile(unsigned lines);
+void delete_profile(PROFILE*);
+
+unsigned profile_lines(const PROFILE*);
+
+// Count an execution of a source line.
+void profile_count_line(PROFILE*, unsigned source_line);
+
+// Start timing a source line, charging the time since the previous call
+// to the line timed before.
+void profile_enter(PROFILE*, unsigned source_line, unsigned long long now_nsec);
+
+// Charge the time since the last line started to that line, and stop timing.
+void profile_stop(PROFILE*, unsigned long long now_nsec);
+
+unsigned long profile_line_count(const PROFILE*, unsigned source_line);
+unsigned long long profile_line_nsec(const PROFILE*, unsigned source_line);
+
+// Report executed lines: as text, the most time-consuming first,
+// or as CSV or JSON in source order.
+void print_profile(const PROFILE*, const SOURCE*, int format, FILE*);
+
+// Choose a report format from the extension of a file name.
+int profile_format(const char* file_name);
+
+// Call graph profile: calls to, and inclusive and exclusive time of,
+// each subroutine in each calling context. Subroutines are identified
+// by the BASIC line number called by GOSUB; the main program is line 0.
+
+typedef struct call_profile CALL_PROFILE;
+
+CALL_PROFILE* new_call_profile(void);
+void delete_call_profile(CALL_PROFILE*);
+
+void profile_call(CALL_PROFILE*, unsigned basic_line, unsigned long long now_nsec);
+void profile_return(CALL_PROFILE*, unsigned long long now_nsec);
+unsigned call_profile_depth(const CALL_PROFILE*);
+
+// Start timing in the current subroutine.
+void call_profile_start(CALL_PROFILE*, unsigned long long now_nsec);
+
+// Charge the time since the last call or return, and stop timing.
+void call_profile_stop(CALL_PROFILE*, unsigned long long now_nsec);
+
+// Report each subroutine's calls and inclusive and exclusive time, most inclusive first.
+void print_call_profile(const CALL_PROFILE*, FILE*);
+
+// Write exclusive time in microseconds for each calling context in the collapsed
+// stack format of flame graph tools, one line per stack: "main;1000;2000 123".
+void print_folded_stacks(const CALL_PROFILE*, FILE*);
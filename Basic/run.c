@@ -21,6 +21,11 @@
 #include "utils.h"
 #include "interrupt.h"
 #include "parse.h"
+#include "image.h"
+#include "profile.h"
+#include "stats.h"
+#include "sample.h"
+#include "trace.h"
 #include "os.h"
 
 #define MAX_NUM_STACK (16)
@@ -28,6 +33,10 @@
 #define MAX_RETURN_STACK (8)
 #define MAX_FOR (8)
 #define TAB_SIZE (8)
+#define OUTPUT_READY_SIZE (4096)
+
+// Instructions set vm->yield to a vm_status to end the current step early.
+#define RUNNING (-1)
 
 // Everything required to specify a piece of code to run:
 // may be stored program or immediate code.
@@ -35,16 +44,37 @@ typedef struct {
   SOURCE* source;
   BCODE* bcode;
   LINE_MAP* index; // map Basic line number to bcode index
+  unsigned* shares; // if shared by cloned VMs, the count of other owners
+  BCODE* previous; // out of date bcode, owned, to reuse in recompiling
 } CODE;
 
+// Release the code, deleting it unless other VMs share it.
 static void deinit_code(CODE* code) {
   assert(code != NULL);
-  delete_line_map(code->index);
-  delete_bcode(code->bcode);
-  delete_source(code->source);
+  if (code->shares && *code->shares > 0)
+    (*code->shares)--;
+  else {
+    delete_line_map(code->index);
+    delete_bcode(code->bcode);
+    delete_source(code->source);
+    efree(code->shares);
+  }
+  delete_bcode(code->previous);
   code->source = NULL;
   code->bcode = NULL;
   code->index = NULL;
+  code->shares = NULL;
+  code->previous = NULL;
+}
+
+static void share_code(CODE* code, CODE* copy) {
+  if (code->source == NULL && code->bcode == NULL)
+    return;
+  if (code->shares == NULL)
+    code->shares = ecalloc(1, sizeof *code->shares);
+  (*code->shares)++;
+  *copy = *code;
+  copy->previous = NULL;
 }
 
 // state of code being run: the code and a position in it
@@ -54,6 +84,17 @@ typedef struct {
   unsigned pc;
 } CODE_STATE;
 
+// Immediate lines compiled recently, to run again without parsing.
+// Code is valid only with the symbol table names it was compiled against.
+#define IMMEDIATE_CACHE_LINES 32
+
+struct cached_line {
+  char* text;
+  unsigned generation;
+  unsigned long used;  // when last run, to replace the least recently used
+  CODE code;
+};
+
 static void clear_code_state(CODE_STATE* cs) {
   cs->code = NULL;
   cs->source_line = 0;
@@ -63,9 +104,12 @@ static void clear_code_state(CODE_STATE* cs) {
 struct vm {
   CODE stored_program;
   CODE immediate_code;
+  struct cached_line * immediate_cache; // IMMEDIATE_CACHE_LINES, or NULL
+  unsigned long immediate_runs;
   CODE def_code; // does not own its bcode or source: points to DEF code temporarily
   CODE_STATE code_state;
   SYMTAB* st;
+  unsigned program_symbols; // names in st after the stored program was last compiled
   double stack[MAX_NUM_STACK];
   char* strstack[MAX_STR_STACK];
   CODE_STATE retstack[MAX_RETURN_STACK];
@@ -86,6 +130,8 @@ struct vm {
   // DATA
   unsigned program_data;
   unsigned immediate_data;
+  // RND
+  unsigned long long rng;
   // FN
   struct {
     CODE_STATE code_state;
@@ -109,10 +155,58 @@ struct vm {
   bool strict_variables;
   bool input_prompt;
   bool verbose;
+  // profiling of the stored program
+  bool profiling;
+  bool call_profiling;
+  PROFILE* profile;
+  CALL_PROFILE* calls;
+  bool sampling;
+  SAMPLER* sampler;
+  TRACE* trace;
+#if HAS_TIMER
+  // the last compilation of the stored program
+  TIMER parse_timer;
+  TIMER index_timer;
+#endif
+  // execution statistics
+  bool collecting_stats;
+  EXEC_STATS* stats;
+  // hosted execution: output collected for, and input provided by, the caller of vm_step
+  bool hosted;
+  bool running;
+  bool prompted;
+  int yield;
+  unsigned long executed;
+  struct buffer {
+    char* text;
+    size_t len;
+    size_t allocated;
+  } output, pending_input;
+  char error_message[512];
   // run-time error-catching
   jmp_buf errjmp;
 };
 
+// Each VM has its own random number generator, the 48-bit linear congruential
+// generator of drand48, so that cloned VMs continue the same sequence.
+#define RNG_MULTIPLIER (0x5DEECE66DULL)
+#define RNG_INCREMENT (0xBULL)
+#define RNG_MASK ((1ULL << 48) - 1)
+
+static void seed_rng(VM* vm, unsigned seed) {
+  vm->rng = ((unsigned long long) seed << 16 | 0x330E) & RNG_MASK;
+}
+
+void vm_seed_random(VM* vm, unsigned seed) {
+  assert(vm != NULL);
+  seed_rng(vm, seed);
+}
+
+static double next_rng(VM* vm) {
+  vm->rng = (vm->rng * RNG_MULTIPLIER + RNG_INCREMENT) & RNG_MASK;
+  return (double) vm->rng / (double) (1ULL << 48);
+}
+
 VM* new_vm(bool keywords_anywhere, bool trace_basic, bool trace_for, bool trace_log) {
   VM* vm = ecalloc(1, sizeof *vm);
   vm->st = new_symbol_table();
@@ -123,25 +217,162 @@ VM* new_vm(bool keywords_anywhere, bool trace_basic, bool trace_for, bool trace_
   vm->trace_for = trace_for;
   vm->trace_log = trace_log;
   vm->input_prompt = true;
+  vm->yield = RUNNING;
+  seed_rng(vm, (unsigned) rand()); // so --randomize affects every VM
   return vm;
 }
 
 static void clear_string_stack(VM*);
+static void append(struct buffer *, const char*, size_t len);
+static void stored_program_changed(VM*);
+static bool ensure_program_compiled(VM*);
+static void delete_immediate_cache(struct cached_line *);
 
 void delete_vm(VM* vm) {
   if (vm) {
     clear_string_stack(vm);
     deinit_code(&vm->stored_program);
     deinit_code(&vm->immediate_code);
+    delete_immediate_cache(vm->immediate_cache);
     delete_symbol_table(vm->st);
+    efree(vm->output.text);
+    efree(vm->pending_input.text);
+    delete_profile(vm->profile);
+    delete_call_profile(vm->calls);
+    delete_exec_stats(vm->stats);
+    delete_sampler(vm->sampler);
+    delete_trace(vm->trace);
     efree(vm);
   }
 }
 
+static void rebase_code_state(const VM* from, VM* to, CODE_STATE* cs) {
+  if (cs->code == &from->stored_program)
+    cs->code = &to->stored_program;
+  else if (cs->code == &from->immediate_code)
+    cs->code = &to->immediate_code;
+  else if (cs->code == &from->def_code)
+    cs->code = &to->def_code;
+}
+
+// Copy the VM and the state of the program it is running.
+// The copy shares the compiled code, arrays and DEF definitions,
+// and copies an array before changing it.
+// Output not yet taken is not copied; pending input is.
+VM* vm_clone(VM* vm) {
+  assert(vm != NULL);
+  VM* copy = emalloc(sizeof *copy);
+  *copy = *vm;
+
+  share_code(&vm->stored_program, &copy->stored_program);
+  share_code(&vm->immediate_code, &copy->immediate_code);
+  copy->immediate_cache = NULL;
+  copy->st = copy_symbol_table(vm->st);
+
+  for (unsigned i = 0; i < vm->ssp; i++)
+    copy->strstack[i] = heap_strdup(copy->st->strings, vm->strstack[i]);
+
+  rebase_code_state(vm, copy, &copy->code_state);
+  rebase_code_state(vm, copy, &copy->stopped_program);
+  rebase_code_state(vm, copy, &copy->fn.code_state);
+  for (unsigned i = 0; i < vm->rsp; i++)
+    rebase_code_state(vm, copy, &copy->retstack[i]);
+  for (unsigned i = 0; i < vm->for_sp; i++)
+    rebase_code_state(vm, copy, &copy->for_stack[i].code_state);
+
+  copy->profile = NULL;
+  copy->calls = NULL;
+  copy->stats = NULL;
+  copy->sampler = NULL;
+  copy->trace = NULL;
+  memset(&copy->output, 0, sizeof copy->output);
+  memset(&copy->pending_input, 0, sizeof copy->pending_input);
+  if (vm->pending_input.len)
+    append(&copy->pending_input, vm->pending_input.text, vm->pending_input.len);
+
+  return copy;
+}
+
 bool vm_keywords_anywhere(const VM* vm) {
   return vm->keywords_anywhere;
 }
 
+// The program must be recompiled to recognise keywords differently.
+void vm_set_keywords_anywhere(VM* vm, bool on) {
+  if (vm->keywords_anywhere != on) {
+    vm->keywords_anywhere = on;
+    stored_program_changed(vm);
+    delete_bcode(vm->stored_program.previous);
+    vm->stored_program.previous = NULL;
+  }
+}
+
+void vm_set_array_base(VM* vm, unsigned base) {
+  assert(base <= 1);
+  vm->array_base = base;
+}
+
+void vm_set_strict_dim(VM* vm, bool on) {
+  vm->strict_dim = on;
+}
+
+void vm_set_strict_for(VM* vm, bool on) {
+  vm->strict_for = on;
+}
+
+void vm_set_strict_on(VM* vm, bool on) {
+  vm->strict_on = on;
+}
+
+void vm_set_strict_variables(VM* vm, bool on) {
+  vm->strict_variables = on;
+}
+
+// Find a simple variable of the given type, compiling the program first
+// so that the variable is the one the program uses.
+static SYMBOL* find_variable(VM* vm, const char* name, int type) {
+  if (!ensure_program_compiled(vm))
+    return NULL;
+  SYMBOL* sym = sym_lookup(vm->st, name, false);
+  if (sym == NULL || sym->kind != SYM_VARIABLE || sym->type != type)
+    return NULL;
+  return sym;
+}
+
+bool vm_get_number(VM* vm, const char* name, double* val) {
+  SYMBOL* sym = find_variable(vm, name, TYPE_NUM);
+  if (sym == NULL)
+    return false;
+  *val = sym->defined ? sym->val.num : 0;
+  return true;
+}
+
+bool vm_set_number(VM* vm, const char* name, double val) {
+  SYMBOL* sym = find_variable(vm, name, TYPE_NUM);
+  if (sym == NULL)
+    return false;
+  sym->val.num = val;
+  sym->defined = true;
+  return true;
+}
+
+const char* vm_get_string(VM* vm, const char* name) {
+  SYMBOL* sym = find_variable(vm, name, TYPE_STR);
+  if (sym == NULL)
+    return NULL;
+  return sym->defined && sym->val.str ? sym->val.str : "";
+}
+
+bool vm_set_string(VM* vm, const char* name, const char* val) {
+  SYMBOL* sym = find_variable(vm, name, TYPE_STR);
+  if (sym == NULL)
+    return false;
+  heap_free(vm->st->strings, sym->val.str);
+  sym->val.str = heap_strdup(vm->st->strings, val);
+  sym->defined = true;
+  return true;
+}
+
 void vm_clear_names(VM* vm) {
   clear_symbol_table_names(vm->st);
   init_builtins(vm->st);
@@ -149,12 +380,14 @@ void vm_clear_names(VM* vm) {
 
 void vm_clear_values(VM* vm) {
   clear_symbol_table_values(vm->st);
+  if (vm->ssp == 0)
+    release_string_heap(vm->st->strings);
 }
 
 static void clear_string_stack(VM* vm) {
   while (vm->ssp > 0) {
     vm->ssp--;
-    efree(vm->strstack[vm->ssp]);
+    heap_free(vm->st->strings, vm->strstack[vm->ssp]);
   }
 }
 
@@ -175,15 +408,41 @@ static void reset_control_state(VM* vm) {
   vm->input_pc = 0;
 }
 
+// Give this VM its own copy of a stored program shared with clones,
+// so that it can be changed. The copy must be recompiled.
+static void unshare_program(VM* vm) {
+  CODE* code = &vm->stored_program;
+  if (code->shares && *code->shares > 0) {
+    (*code->shares)--;
+    code->source = code->source ? copy_source(code->source) : NULL;
+    code->bcode = NULL;
+    code->index = NULL;
+    code->shares = NULL;
+  }
+}
+
 // Flag stored program source as changed and compiled program as out of date.
 // Do not clear environment.
 static void stored_program_changed(VM* vm) {
+  // a program being stepped cannot continue in code that no longer exists
+  if (vm->running) {
+    vm->running = false;
+    strcpy(vm->error_message, "Runtime error: program changed while running\n");
+  }
+  unshare_program(vm);
+  delete_profile(vm->profile);
+  vm->profile = NULL;
+  delete_call_profile(vm->calls);
+  vm->calls = NULL;
+  delete_sampler(vm->sampler);
+  vm->sampler = NULL;
   if (vm->stored_program.index) {
     delete_line_map(vm->stored_program.index);
     vm->stored_program.index = NULL;
   }
   if (vm->stored_program.bcode) {
-    delete_bcode(vm->stored_program.bcode);
+    delete_bcode(vm->stored_program.previous);
+    vm->stored_program.previous = vm->stored_program.bcode;
     vm->stored_program.bcode = NULL;
   }
 }
@@ -195,24 +454,57 @@ static bool ensure_program_compiled(VM* vm) {
     assert(vm->stored_program.index == NULL);
     if (vm->verbose)
       puts("Compiling...");
-    clear_symbol_table_names(vm->st);
-    init_builtins(vm->st);
-    vm->stored_program.bcode = parse_source(vm->stored_program.source, vm->st, vm->keywords_anywhere);
+#if HAS_TIMER
+    start_timer(&vm->parse_timer);
+#endif
+    // Reuse the code of unchanged lines if only the program has added names since.
+    BCODE* previous = vm->stored_program.previous;
+    vm->stored_program.previous = NULL;
+    if (previous && vm->st->used == vm->program_symbols) {
+      clear_symbol_table_values(vm->st);
+      vm->stored_program.bcode = reparse_source(vm->stored_program.source, vm->st, vm->keywords_anywhere, previous);
+    }
+    else
+      delete_bcode(previous);
+    if (vm->stored_program.bcode == NULL) {
+      clear_symbol_table_names(vm->st);
+      init_builtins(vm->st);
+      vm->stored_program.bcode = parse_source(vm->stored_program.source, vm->st, vm->keywords_anywhere);
+    }
+    vm->program_symbols = vm->st->used;
+#if HAS_TIMER
+    stop_timer(&vm->parse_timer);
+#endif
     if (vm->stored_program.bcode == NULL)
       return false;
+#if HAS_TIMER
+    start_timer(&vm->index_timer);
+#endif
     vm->stored_program.index = bcode_index(vm->stored_program.bcode, vm->stored_program.source);
+#if HAS_TIMER
+    stop_timer(&vm->index_timer);
+#endif
     reset_control_state(vm); // resets DATA pointer
   }
 
   return true;
 }
 
-void vm_compile(VM* vm) {
-  ensure_program_compiled(vm);
+bool vm_compile(VM* vm) {
+  return ensure_program_compiled(vm);
 }
 
+#if HAS_TIMER
+// The times taken by the last compilation of the stored program.
+void vm_compile_timers(const VM* vm, TIMER* parse, TIMER* index) {
+  *parse = vm->parse_timer;
+  *index = vm->index_timer;
+}
+#endif
+
 void vm_new_program(VM* vm) {
   assert(vm != NULL);
+  unshare_program(vm);
   if (vm->stored_program.source)
     clear_source(vm->stored_program.source);
   stored_program_changed(vm);
@@ -225,6 +517,7 @@ void vm_delete_source_line(VM* vm, unsigned num) {
   if (vm->stored_program.source) {
     unsigned i;
     if (find_source_linenum(vm->stored_program.source, num, &i)) {
+      unshare_program(vm);
       delete_source_line(vm->stored_program.source, i);
       stored_program_changed(vm);
     }
@@ -234,6 +527,7 @@ void vm_delete_source_line(VM* vm, unsigned num) {
 // Add or replace stored program source line,
 // first creating stored program SOURCE object if required.
 void vm_enter_source_line(VM* vm, unsigned num, const char* text) {
+  unshare_program(vm);
   if (vm->stored_program.source == NULL)
     vm->stored_program.source = new_source(NULL);
   enter_source_line(vm->stored_program.source, num, text);
@@ -246,19 +540,470 @@ bool vm_save_source(VM* vm, const char* name) {
   return save_source_file(vm->stored_program.source, name);
 }
 
-bool vm_load_source(VM* vm, const char* name) {
-  SOURCE* source = load_source_file(name); // TODO: errors should not terminate the interpreter
+static bool replace_source(VM* vm, SOURCE* source) {
   if (source == NULL)
     return false;
 
-  if (vm->stored_program.source)
-    delete_source(vm->stored_program.source);
+  deinit_code(&vm->stored_program);
   vm->stored_program.source = source;
-  stored_program_changed(vm);
   return true;
 }
 
-SOURCE* vm_stored_source(VM* vm) {
+bool vm_load_source(VM* vm, const char* name) {
+  return replace_source(vm, load_source_file(name));
+}
+
+bool vm_load_source_string(VM* vm, const char* text, const char* name) {
+  return replace_source(vm, load_source_string(text, name));
+}
+
+// Save the compiled stored program as an image that can be run without parsing.
+bool vm_save_image(VM* vm, const char* name) {
+  assert(vm != NULL && name != NULL);
+  if (vm->stored_program.source == NULL || !ensure_program_compiled(vm))
+    return false;
+  IMAGE image;
+  image.source = vm->stored_program.source;
+  image.bcode = vm->stored_program.bcode;
+  image.index = vm->stored_program.index;
+  image.keywords_anywhere = vm->keywords_anywhere;
+  return save_image(name, &image, vm->st);
+}
+
+// Load a compiled program image as the stored program, replacing the names in scope.
+bool vm_load_image(VM* vm, const char* name) {
+  assert(vm != NULL && name != NULL);
+  SYMTAB* st = new_symbol_table();
+  IMAGE image;
+  if (!load_image(name, &image, st)) {
+    delete_symbol_table(st);
+    return false;
+  }
+  reset_control_state(vm);
+  deinit_code(&vm->stored_program);
+  delete_symbol_table(vm->st);
+  vm->st = st;
+  vm->stored_program.source = image.source;
+  vm->stored_program.bcode = image.bcode;
+  vm->stored_program.index = image.index;
+  vm->keywords_anywhere = image.keywords_anywhere;
+  return true;
+}
+
+// A snapshot holds the stored program, as an image, followed by the state
+// of the VM running it: the values of its variables, arrays and DEF functions,
+// its stacks, and its position in the program, so that a stopped or
+// interrupted program can be continued later, possibly on another machine.
+// Only positions in the stored program are saved, not in immediate code,
+// and DEF functions defined in immediate mode are not saved.
+
+#define SNAPSHOT_MAGIC "LBVS"
+#define SNAPSHOT_VERSION (1)
+
+enum { SNAPSHOT_NO_CODE, SNAPSHOT_STORED_PROGRAM };
+
+static void put_code_state(FILE* fp, const VM* vm, const CODE_STATE* cs) {
+  if (cs->code == &vm->stored_program) {
+    put_u8(fp, SNAPSHOT_STORED_PROGRAM);
+    put_u32(fp, cs->source_line);
+    put_u32(fp, cs->pc);
+  }
+  else
+    put_u8(fp, SNAPSHOT_NO_CODE);
+}
+
+// Find the DEF statement in the stored program from which a definition was copied.
+static bool find_def(const VM* vm, const SYMBOL* sym, unsigned *pc) {
+  const struct def * def = sym->val.def;
+  const BCODE* bc = vm->stored_program.bcode;
+  if (def->source == NULL || def->source != vm->stored_program.source || bc == NULL)
+    return false;
+  unsigned source_line = 0;
+  for (unsigned i = 0; i < bc->used; i++) {
+    if (bc->inst[i].op == B_SOURCE_LINE)
+      source_line = bc->inst[i].u.source_line;
+    else if (bc->inst[i].op == B_DEF && bc->inst[i].u.param.symbol_id == sym->id && source_line == def->source_line) {
+      *pc = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put_symbol_value(FILE* fp, const VM* vm, const SYMBOL* sym) {
+  switch (sym->kind) {
+    case SYM_VARIABLE:
+      put_u8(fp, sym->defined);
+      if (sym->type == TYPE_NUM)
+        put_num(fp, sym->val.num);
+      else
+        put_str(fp, sym->val.str);
+      break;
+    case SYM_ARRAY: {
+      const struct array_size * size = sym->type == TYPE_NUM
+        ? (sym->val.numarr ? &sym->val.numarr->size : NULL)
+        : (sym->val.strarr ? &sym->val.strarr->size : NULL);
+      put_u8(fp, size != NULL);
+      if (size) {
+        put_u8(fp, size->base);
+        put_u8(fp, size->dimensions);
+        for (unsigned i = 0; i < size->dimensions; i++)
+          put_u32(fp, size->max[i]);
+        for (unsigned i = 0; i < size->elements; i++) {
+          if (sym->type == TYPE_NUM)
+            put_num(fp, sym->val.numarr->val[i]);
+          else
+            put_str(fp, sym->val.strarr->val[i]);
+        }
+      }
+      break;
+    }
+    case SYM_DEF: {
+      unsigned pc;
+      bool saved = sym->defined && sym->val.def && find_def(vm, sym, &pc);
+      put_u8(fp, saved);
+      if (saved) {
+        put_u32(fp, pc);
+        put_u32(fp, sym->val.def->source_line);
+      }
+      break;
+    }
+  }
+}
+
+// Save the stored program and the state of running it.
+bool vm_save_snapshot(VM* vm, const char* name) {
+  assert(vm != NULL && name != NULL);
+  if (vm->stored_program.source == NULL) {
+    error("No program");
+    return false;
+  }
+  if (!ensure_program_compiled(vm))
+    return false;
+
+  FILE* fp = fopen(name, "wb");
+  if (fp == NULL) {
+    fprintf(diagnostics(), "Cannot create snapshot file: %s\n", name);
+    return false;
+  }
+
+  fwrite(SNAPSHOT_MAGIC, 1, 4, fp);
+  put_u32(fp, SNAPSHOT_VERSION);
+
+  IMAGE image;
+  image.source = vm->stored_program.source;
+  image.bcode = vm->stored_program.bcode;
+  image.index = vm->stored_program.index;
+  image.keywords_anywhere = vm->keywords_anywhere;
+  write_image(fp, &image, vm->st);
+
+  for (unsigned i = 0; i < vm->st->used; i++)
+    put_symbol_value(fp, vm, vm->st->psym[i]);
+
+  put_code_state(fp, vm, &vm->code_state);
+  put_code_state(fp, vm, &vm->stopped_program);
+
+  put_u32(fp, vm->sp);
+  for (unsigned i = 0; i < vm->sp; i++)
+    put_num(fp, vm->stack[i]);
+  put_u32(fp, vm->ssp);
+  for (unsigned i = 0; i < vm->ssp; i++)
+    put_str(fp, vm->strstack[i]);
+
+  put_u32(fp, vm->rsp);
+  for (unsigned i = 0; i < vm->rsp; i++)
+    put_code_state(fp, vm, &vm->retstack[i]);
+
+  put_u32(fp, vm->for_sp);
+  for (unsigned i = 0; i < vm->for_sp; i++) {
+    const struct for_loop * f = &vm->for_stack[i];
+    put_code_state(fp, vm, &f->code_state);
+    put_u32(fp, f->symbol_id);
+    put_num(fp, f->step);
+    put_num(fp, f->limit);
+  }
+
+  put_code_state(fp, vm, &vm->fn.code_state);
+  put_u32(fp, vm->fn.param_id);
+  put_u8(fp, vm->fn.param_defined);
+  put_num(fp, vm->fn.param_val);
+
+  put_u32(fp, vm->program_data);
+  put_u32(fp, vm->col);
+  put_u32(fp, (unsigned) vm->rng);
+  put_u32(fp, (unsigned) (vm->rng >> 32));
+
+  put_str(fp, vm->input);
+  put_u32(fp, (unsigned) (vm->inp + 1));
+  put_u32(fp, vm->input_pc);
+
+  bool ok = !ferror(fp);
+  if (fclose(fp) != 0)
+    ok = false;
+  if (!ok) {
+    fprintf(diagnostics(), "Error writing snapshot file: %s\n", name);
+    remove(name);
+  }
+  return ok;
+}
+
+static void get_code_state(IMAGE_READER* r, VM* vm, CODE_STATE* cs) {
+  clear_code_state(cs);
+  unsigned kind = get_u8(r);
+  if (kind == SNAPSHOT_STORED_PROGRAM) {
+    cs->code = &vm->stored_program;
+    cs->source_line = get_u32(r);
+    cs->pc = get_u32(r);
+    if (cs->source_line >= source_lines(vm->stored_program.source) || cs->pc > vm->stored_program.bcode->used)
+      r->ok = false;
+  }
+  else if (kind != SNAPSHOT_NO_CODE)
+    r->ok = false;
+}
+
+static void get_symbol_value(IMAGE_READER* r, VM* vm, SYMBOL* sym) {
+  switch (sym->kind) {
+    case SYM_VARIABLE:
+      sym->defined = get_u8(r) != 0;
+      if (sym->type == TYPE_NUM)
+        sym->val.num = get_num(r);
+      else {
+        const char* s = get_str(r);
+        sym->val.str = s ? heap_strdup(vm->st->strings, s) : NULL;
+      }
+      break;
+    case SYM_ARRAY:
+      if (get_u8(r)) {
+        unsigned base = get_u8(r);
+        unsigned dimensions = get_u8(r);
+        unsigned max[MAX_DIMENSIONS];
+        if (base > 1 || dimensions < 1 || dimensions > MAX_DIMENSIONS) {
+          r->ok = false;
+          return;
+        }
+        for (unsigned i = 0; i < dimensions; i++)
+          max[i] = get_u32(r);
+        if (!r->ok)
+          return;
+        // fail before allocating more elements than the rest of the snapshot
+        // could hold, at 8 bytes a number or 4 a string
+        const size_t limit = (size_t)(r->end - r->p) / (sym->type == TYPE_NUM ? 8 : 4);
+        size_t elements = 1;
+        for (unsigned i = 0; i < dimensions; i++) {
+          if (max[i] < base || max[i] - base >= limit || elements > limit / ((size_t) max[i] - base + 1)) {
+            r->ok = false;
+            return;
+          }
+          elements *= max[i] - base + 1;
+        }
+        if (sym->type == TYPE_NUM) {
+          struct numeric_array * a = new_numeric_array(base, dimensions, max);
+          if (a == NULL) {
+            r->ok = false;
+            return;
+          }
+          sym->val.numarr = a;
+          for (unsigned i = 0; i < a->size.elements; i++)
+            a->val[i] = get_num(r);
+        }
+        else {
+          struct string_array * a = new_string_array(base, dimensions, max);
+          if (a == NULL) {
+            r->ok = false;
+            return;
+          }
+          sym->val.strarr = a;
+          for (unsigned i = 0; i < a->size.elements; i++) {
+            const char* s = get_str(r);
+            a->val[i] = s ? heap_strdup(vm->st->strings, s) : NULL;
+          }
+        }
+        sym->defined = true;
+      }
+      break;
+    case SYM_DEF:
+      if (get_u8(r)) {
+        const BCODE* bc = vm->stored_program.bcode;
+        unsigned pc = get_u32(r);
+        unsigned source_line = get_u32(r);
+        if (!r->ok || pc >= bc->used || bc->inst[pc].op != B_DEF || bc->inst[pc].u.param.symbol_id != sym->id) {
+          r->ok = false;
+          return;
+        }
+        sym->val.def = new_def(bcode_copy_def(bc, pc), vm->stored_program.source, source_line);
+        sym->defined = true;
+      }
+      break;
+  }
+}
+
+static bool available_snapshot_magic(IMAGE_READER* r) {
+  if (r->end - r->p < 4 || memcmp(r->p, SNAPSHOT_MAGIC, 4) != 0)
+    return false;
+  r->p += 4;
+  return true;
+}
+
+static void read_snapshot(IMAGE_READER* r, VM* vm) {
+  SYMTAB* st = vm->st;
+  for (unsigned i = 0; i < st->used && r->ok; i++)
+    get_symbol_value(r, vm, st->psym[i]);
+
+  get_code_state(r, vm, &vm->code_state);
+  get_code_state(r, vm, &vm->stopped_program);
+
+  unsigned sp = get_u32(r);
+  if (sp > MAX_NUM_STACK) {
+    r->ok = false;
+    return;
+  }
+  for (vm->sp = 0; vm->sp < sp; vm->sp++)
+    vm->stack[vm->sp] = get_num(r);
+
+  unsigned ssp = get_u32(r);
+  if (ssp > MAX_STR_STACK) {
+    r->ok = false;
+    return;
+  }
+  while (vm->ssp < ssp && r->ok) {
+    const char* s = get_str(r);
+    if (s == NULL)
+      r->ok = false;
+    else
+      vm->strstack[vm->ssp++] = heap_strdup(vm->st->strings, s);
+  }
+
+  unsigned rsp = get_u32(r);
+  if (rsp > MAX_RETURN_STACK) {
+    r->ok = false;
+    return;
+  }
+  for (vm->rsp = 0; vm->rsp < rsp; vm->rsp++)
+    get_code_state(r, vm, &vm->retstack[vm->rsp]);
+
+  unsigned for_sp = get_u32(r);
+  if (for_sp > MAX_FOR) {
+    r->ok = false;
+    return;
+  }
+  for (vm->for_sp = 0; vm->for_sp < for_sp; vm->for_sp++) {
+    struct for_loop * f = &vm->for_stack[vm->for_sp];
+    get_code_state(r, vm, &f->code_state);
+    f->symbol_id = get_u32(r);
+    f->step = get_num(r);
+    f->limit = get_num(r);
+    if (f->symbol_id >= st->used)
+      r->ok = false;
+  }
+
+  get_code_state(r, vm, &vm->fn.code_state);
+  vm->fn.param_id = get_u32(r);
+  vm->fn.param_defined = get_u8(r) != 0;
+  vm->fn.param_val = get_num(r);
+  if (vm->fn.code_state.code && vm->fn.param_id >= st->used)
+    r->ok = false;
+
+  vm->program_data = get_u32(r);
+  vm->col = get_u32(r);
+  vm->rng = get_u32(r);
+  vm->rng |= (unsigned long long) get_u32(r) << 32;
+
+  const char* input = get_str(r);
+  if (input && strlen(input) < sizeof vm->input)
+    strcpy(vm->input, input);
+  else
+    r->ok = false;
+  vm->inp = (int) get_u32(r) - 1;
+  vm->input_pc = get_u32(r);
+}
+
+// Replace the program and its state with those saved in a snapshot.
+// The program can then be continued if it was stopped or interrupted.
+bool vm_load_snapshot(VM* vm, const char* name) {
+  assert(vm != NULL && name != NULL);
+
+  MAPPED_FILE mf;
+  if (!map_file(name, &mf)) {
+    fprintf(diagnostics(), "Cannot open snapshot file: %s\n", name);
+    return false;
+  }
+
+  // read into a new VM, so that this one is unchanged if the snapshot is invalid
+  VM* snap = new_vm(false, false, false, false);
+  delete_symbol_table(snap->st);
+  snap->st = new_symbol_table();
+
+  IMAGE_READER r;
+  r.p = (const unsigned char*) mf.data;
+  r.end = r.p + mf.size;
+  r.ok = true;
+  IMAGE image;
+  memset(&image, 0, sizeof image);
+  if (available_snapshot_magic(&r) && get_u32(&r) == SNAPSHOT_VERSION && read_image(&r, &image, snap->st)) {
+    snap->stored_program.source = image.source;
+    snap->stored_program.bcode = image.bcode;
+    snap->stored_program.index = image.index;
+    snap->keywords_anywhere = image.keywords_anywhere;
+    read_snapshot(&r, snap);
+  }
+  else {
+    release_image(&image);
+    r.ok = false;
+  }
+  bool ok = r.ok && r.p == r.end;
+  unmap_file(&mf);
+
+  if (!ok) {
+    fprintf(diagnostics(), "Invalid or out of date snapshot file: %s\n", name);
+    delete_vm(snap);
+    return false;
+  }
+
+  // move the program and state into this VM, keeping its behaviour options
+  clear_string_stack(vm);
+  deinit_code(&vm->stored_program);
+  deinit_code(&vm->immediate_code);
+  delete_symbol_table(vm->st);
+  vm->stored_program = snap->stored_program;
+  vm->st = snap->st;
+  vm->keywords_anywhere = snap->keywords_anywhere;
+  vm->code_state = snap->code_state;
+  vm->stopped_program = snap->stopped_program;
+  memcpy(vm->stack, snap->stack, sizeof vm->stack);
+  vm->sp = snap->sp;
+  memcpy(vm->strstack, snap->strstack, sizeof vm->strstack);
+  vm->ssp = snap->ssp;
+  memcpy(vm->retstack, snap->retstack, sizeof vm->retstack);
+  vm->rsp = snap->rsp;
+  memcpy(vm->for_stack, snap->for_stack, sizeof vm->for_stack);
+  vm->for_sp = snap->for_sp;
+  vm->fn = snap->fn;
+  vm->program_data = snap->program_data;
+  vm->immediate_data = 0;
+  vm->col = snap->col;
+  vm->rng = snap->rng;
+  memcpy(vm->input, snap->input, sizeof vm->input);
+  vm->inp = snap->inp;
+  vm->input_pc = snap->input_pc;
+
+  rebase_code_state(snap, vm, &vm->code_state);
+  rebase_code_state(snap, vm, &vm->stopped_program);
+  rebase_code_state(snap, vm, &vm->fn.code_state);
+  for (unsigned i = 0; i < vm->rsp; i++)
+    rebase_code_state(snap, vm, &vm->retstack[i]);
+  for (unsigned i = 0; i < vm->for_sp; i++)
+    rebase_code_state(snap, vm, &vm->for_stack[i].code_state);
+
+  efree(snap);
+  return true;
+}
+
+// Whether a stopped or interrupted program can be continued.
+bool vm_can_continue(const VM* vm) {
+  return vm->stopped_program.code != NULL && vm->stopped_program.code->bcode != NULL;
+}
+
+SOURCE* vm_stored_source(const VM* vm) {
   return vm->stored_program.source;
 }
 
@@ -279,6 +1024,51 @@ void run_program(VM* vm) {
   }
 }
 
+static void delete_immediate_cache(struct cached_line * cache) {
+  if (cache) {
+    for (unsigned i = 0; i < IMMEDIATE_CACHE_LINES; i++) {
+      deinit_code(&cache[i].code);
+      efree(cache[i].text);
+    }
+    efree(cache);
+  }
+}
+
+// Share the code of a line compiled against the current names, if cached.
+static bool cached_immediate_code(VM* vm, const char* line) {
+  if (vm->immediate_cache == NULL)
+    return false;
+  for (unsigned i = 0; i < IMMEDIATE_CACHE_LINES; i++) {
+    struct cached_line * p = &vm->immediate_cache[i];
+    if (p->text && p->generation == vm->st->generation && strcmp(p->text, line) == 0) {
+      p->used = ++vm->immediate_runs;
+      share_code(&p->code, &vm->immediate_code);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Cache newly compiled code in place of the least recently used, and share it.
+static void cache_immediate_code(VM* vm, const char* line, SOURCE* source, BCODE* bcode) {
+  if (vm->immediate_cache == NULL)
+    vm->immediate_cache = ecalloc(IMMEDIATE_CACHE_LINES, sizeof vm->immediate_cache[0]);
+  struct cached_line * p = &vm->immediate_cache[0];
+  for (unsigned i = 1; i < IMMEDIATE_CACHE_LINES && p->text; i++) {
+    if (vm->immediate_cache[i].text == NULL || vm->immediate_cache[i].used < p->used)
+      p = &vm->immediate_cache[i];
+  }
+  deinit_code(&p->code);
+  efree(p->text);
+  p->text = estrdup(line);
+  p->generation = vm->st->generation;
+  p->used = ++vm->immediate_runs;
+  p->code.source = source;
+  p->code.bcode = bcode;
+  p->code.index = bcode_index(bcode, source);
+  share_code(&p->code, &vm->immediate_code);
+}
+
 static bool immediate_state(VM*);
 
 void run_immediate(VM* vm, const char* line) {
@@ -290,14 +1080,15 @@ void run_immediate(VM* vm, const char* line) {
   // compile stored program before immediate line
   // because ensure_program_compiled might clear symbol table
   if (ensure_program_compiled(vm)) {
-    SOURCE* source = wrap_source_text(line);
-    vm->immediate_code.bcode = parse_source(source, vm->st, /*keywords_anywhere*/ false);
-    if (vm->immediate_code.bcode == NULL) {
-      delete_source(source);
-      return;
+    if (!cached_immediate_code(vm, line)) {
+      SOURCE* source = wrap_source_text(line);
+      BCODE* bcode = parse_source(source, vm->st, /*keywords_anywhere*/ false);
+      if (bcode == NULL) {
+        delete_source(source);
+        return;
+      }
+      cache_immediate_code(vm, line, source, bcode);
     }
-    vm->immediate_code.index = bcode_index(vm->immediate_code.bcode, source);
-    vm->immediate_code.source = source;
     vm->immediate_data = 0;
     vm->code_state.code = &vm->immediate_code;
     vm->code_state.source_line = 0;
@@ -330,26 +1121,208 @@ static bool immediate_state(VM* vm) {
 }
 
 static void execute(VM*);
+static void execute_traced(VM*);
+static void finish_run(VM*);
 static void report_for_in_progress(VM*);
 
+static void out_char(VM*, int c);
+static void out_str(VM*, const char*);
+static int out_printf(VM*, const char* fmt, ...);
+static void out_flush(VM*);
+
+static void consume(struct buffer *, size_t len);
+
+static void run_profiled(VM*);
+static bool start_samples(VM*);
+
+// Whether instructions must be executed by execute_traced.
+static bool tracing(const VM* vm) {
+  return vm->trace_basic || vm->trace_for || vm->trace_log;
+}
+static void stop_samples(VM*);
+
 // Run the currently selected code from current PC.
 static void run(VM* vm) {
   assert(vm->code_state.code != NULL);
 
+  vm->hosted = false;
   vm->stopped = false;
   trap_interrupt();
+  const bool sampling = vm->sampling && start_samples(vm);
   if (setjmp(vm->errjmp) == 0) {
-    while (vm->code_state.pc < vm->code_state.code->bcode->used && !vm->stopped && !interrupted)
-      execute(vm);
+    if (((vm->profiling || vm->call_profiling) && vm->stored_program.source) || vm->collecting_stats || vm->trace)
+      run_profiled(vm);
+    else if (tracing(vm) || sampling) {
+      while (vm->code_state.pc < vm->code_state.code->bcode->used && !vm->stopped && !interrupted)
+        execute_traced(vm);
+    }
+    else {
+      while (vm->code_state.pc < vm->code_state.code->bcode->used && !vm->stopped && !interrupted)
+        execute(vm);
+    }
   }
+  if (sampling)
+    stop_samples(vm);
   untrap_interrupt();
+  restore_keyboard();
+  if (vm->profile)
+    profile_stop(vm->profile, clock_nsec());
+  if (vm->calls)
+    call_profile_stop(vm->calls, clock_nsec());
 
-  if (interrupted)
-    puts("Break");
+  finish_run(vm);
+}
+
+static PROFILE* line_profile(VM* vm) {
+  const unsigned lines = source_lines(vm->stored_program.source);
+  if (vm->profile && profile_lines(vm->profile) != lines) {
+    delete_profile(vm->profile);
+    vm->profile = NULL;
+  }
+  if (vm->profile == NULL)
+    vm->profile = new_profile(lines);
+  return vm->profile;
+}
+
+static CALL_PROFILE* call_profile(VM* vm) {
+  if (vm->calls == NULL)
+    vm->calls = new_call_profile();
+  // return to the calling context of this run
+  const unsigned long long now = clock_nsec();
+  while (call_profile_depth(vm->calls) > vm->rsp)
+    profile_return(vm->calls, now);
+  call_profile_start(vm->calls, now);
+  return vm->calls;
+}
+
+// The BASIC line number of the subroutine just called by GOSUB.
+static unsigned called_line(const VM* vm) {
+  const BINST* i = vm->code_state.code->bcode->inst + vm->code_state.pc;
+  return i->op == B_SOURCE_LINE ? source_linenum(vm->code_state.code->source, i->u.source_line) : 0;
+}
+
+// Sampling profile: a timer signal records the line the sampled VM is executing
+// and its GOSUB stack. The VM collects the samples when the buffer is filling,
+// at the start of a line, and when it stops running. A sampled program runs
+// through the traced dispatcher, so the full-speed one never checks.
+
+#define SAMPLE_INTERVAL_USEC (1000)
+
+static VM* volatile sampled_vm;
+static volatile sig_atomic_t samples_waiting;
+
+static unsigned sampled_line(const VM* vm, const CODE_STATE* cs) {
+  return cs->code == &vm->stored_program ? cs->source_line : SAMPLE_NO_LINE;
+}
+
+static void take_sample(void) {
+  const VM* vm = sampled_vm;
+  if (vm == NULL)
+    return;
+  unsigned callers[MAX_RETURN_STACK];
+  unsigned depth = vm->rsp <= MAX_RETURN_STACK ? vm->rsp : MAX_RETURN_STACK;
+  for (unsigned i = 0; i < depth; i++)
+    callers[i] = sampled_line(vm, &vm->retstack[i]);
+  sampler_record(vm->sampler, sampled_line(vm, &vm->code_state), callers, depth);
+  if (sampler_filling(vm->sampler))
+    samples_waiting = 1;
+}
+
+static void collect_samples(VM* vm) {
+  samples_waiting = 0;
+  if (vm->sampler)
+    sampler_collect(vm->sampler);
+}
+
+static bool start_samples(VM* vm) {
+#if HAS_SAMPLING
+  if (vm->stored_program.source == NULL || vm->hosted || sampled_vm != NULL)
+    return false;
+  if (vm->sampler == NULL)
+    vm->sampler = new_sampler();
+  sampled_vm = vm;
+  if (start_sampling(SAMPLE_INTERVAL_USEC, take_sample))
+    return true;
+  sampled_vm = NULL;
+#endif
+  return false;
+}
+
+static void stop_samples(VM* vm) {
+#if HAS_SAMPLING
+  stop_sampling();
+  sampled_vm = NULL;
+  collect_samples(vm);
+#endif
+}
+
+static EXEC_STATS* exec_stats(VM* vm) {
+  if (vm->stats == NULL)
+    vm->stats = new_exec_stats();
+  stats_break(vm->stats);
+  return vm->stats;
+}
+
+static void trace_instruction_at(VM* vm) {
+  const CODE* code = vm->code_state.code;
+  const BINST* i = code->bcode->inst + vm->code_state.pc;
+  const unsigned line = i->op == B_SOURCE_LINE ? i->u.source_line : vm->code_state.source_line;
+  const int kind = code == &vm->stored_program ? TRACE_PROGRAM :
+                   code == &vm->immediate_code ? TRACE_IMMEDIATE : TRACE_DEF;
+  trace_instruction(vm->trace, vm->code_state.pc, i->op, kind,
+                    code->source && line < source_lines(code->source) ? source_linenum(code->source, line) : 0,
+                    vm->sp, vm->ssp, vm->rsp, vm->sp ? vm->stack[vm->sp - 1] : 0);
+}
+
+// The loop of run, also counting and timing the lines of the stored program,
+// timing the GOSUB subroutines it calls, counting instructions executed,
+// and recording them in a binary trace.
+// A separate loop, so that running without profiling costs nothing extra.
+static void run_profiled(VM* vm) {
+  const CODE* const program = &vm->stored_program;
+  const bool source = program->source != NULL;
+  PROFILE* const profile = vm->profiling && source ? line_profile(vm) : NULL;
+  CALL_PROFILE* const calls = vm->call_profiling && source ? call_profile(vm) : NULL;
+  EXEC_STATS* const stats = vm->collecting_stats ? exec_stats(vm) : NULL;
+  void (*const execute_one)(VM*) = tracing(vm) || sampled_vm == vm ? execute_traced : execute;
+
+  unsigned timed = UINT_MAX;
+  while (vm->code_state.pc < vm->code_state.code->bcode->used && !vm->stopped && !interrupted) {
+    const unsigned rsp = vm->rsp;
+    if (profile && vm->code_state.code == program) {
+      const BINST* i = program->bcode->inst + vm->code_state.pc;
+      if (i->op == B_SOURCE_LINE)
+        profile_count_line(profile, i->u.source_line);
+    }
+    if (stats)
+      stats_instruction(stats, vm->code_state.code->bcode->inst[vm->code_state.pc].op);
+    if (vm->trace)
+      trace_instruction_at(vm);
+    execute_one(vm);
+    if (stats)
+      stats_stack_depths(stats, vm->sp, vm->ssp, vm->rsp, vm->for_sp);
+    if (profile && vm->code_state.code == program && vm->code_state.source_line != timed) {
+      timed = vm->code_state.source_line;
+      profile_enter(profile, timed, clock_nsec());
+    }
+    if (calls && vm->rsp != rsp) {
+      if (vm->rsp > rsp)
+        profile_call(calls, called_line(vm), clock_nsec());
+      else
+        profile_return(calls, clock_nsec());
+    }
+  }
+}
+
+// Report how the code stopped running, and record the program's state for CONT.
+static void finish_run(VM* vm) {
+  if (interrupted && !vm->hosted)
+    out_str(vm, "Break\n");
   else if (vm->stopped) {
-    print_source_line(vm->code_state.code->source, vm->code_state.source_line, stdout);
-    putchar('\n');
-    puts("Stopped");
+    const SOURCE* source = vm->code_state.code->source;
+    if (source && vm->code_state.source_line < source_lines(source))
+      out_printf(vm, "%u %s", source_linenum(source, vm->code_state.source_line), source_text(source, vm->code_state.source_line));
+    out_str(vm, "\nStopped\n");
   }
   else {
     if (vm->strict_for && vm->for_sp != 0)
@@ -360,13 +1333,78 @@ static void run(VM* vm) {
   // On normal program end, clear program stopped state.
   // After running immediate code, leave program stopped state alone.
   if (vm->code_state.code == &vm->stored_program) {
-    if (vm->stopped || interrupted)
+    if (vm->stopped || (interrupted && !vm->hosted))
       vm->stopped_program = vm->code_state;
     else
       clear_code_state(&vm->stopped_program);
   }
 }
 
+// Count executions of, and time spent in, each line of the stored program when run.
+void vm_set_profiling(VM* vm, bool on) {
+  vm->profiling = on;
+}
+
+// Time GOSUB subroutines of the stored program, in each context they are called from.
+void vm_set_call_profiling(VM* vm, bool on) {
+  vm->call_profiling = on;
+}
+
+// Sample the line being executed by the stored program, at intervals of CPU time.
+void vm_set_sampling(VM* vm, bool on) {
+  vm->sampling = on;
+}
+
+// Report the sampling profile, as a histogram of lines and as folded stacks.
+bool vm_print_samples(const VM* vm, FILE* histogram, FILE* folded) {
+  if (vm->sampler == NULL || vm->stored_program.source == NULL)
+    return false;
+  if (histogram)
+    print_sample_histogram(vm->sampler, vm->stored_program.source, histogram);
+  if (folded)
+    print_sample_stacks(vm->sampler, vm->stored_program.source, folded);
+  return true;
+}
+
+// Record each instruction executed in a ring of the last events in a binary trace file.
+bool vm_set_trace_file(VM* vm, const char* file_name, unsigned long events, const char* program_name) {
+  delete_trace(vm->trace);
+  vm->trace = file_name ? new_trace(file_name, events, program_name) : NULL;
+  return file_name == NULL || vm->trace != NULL;
+}
+
+// Count instructions executed, stack depths, strings allocated and line lookups.
+void vm_set_stats(VM* vm, bool on) {
+  vm->collecting_stats = on;
+}
+
+// Report execution statistics. Return false if none have been collected.
+bool vm_print_stats(const VM* vm, FILE* fp) {
+  if (vm->stats == NULL)
+    return false;
+  print_exec_stats(vm->stats, fp);
+  return true;
+}
+
+// Report the call profile, as a table and as folded stacks for flame graphs.
+bool vm_print_call_profile(const VM* vm, FILE* table, FILE* folded) {
+  if (vm->calls == NULL)
+    return false;
+  if (table)
+    print_call_profile(vm->calls, table);
+  if (folded)
+    print_folded_stacks(vm->calls, folded);
+  return true;
+}
+
+// Report the profile of the stored program. Return false if there is none.
+bool vm_print_profile(const VM* vm, int format, FILE* fp) {
+  if (vm->profile == NULL || vm->stored_program.source == NULL)
+    return false;
+  print_profile(vm->profile, vm->stored_program.source, format, fp);
+  return true;
+}
+
 bool vm_continue(VM* vm) {
   if (vm->stopped_program.code == NULL)
     return false;
@@ -381,26 +1419,141 @@ bool vm_continue(VM* vm) {
   return true;
 }
 
+// Start running the stored program in hosted mode, for vm_step.
+bool vm_start_program(VM* vm) {
+  assert(vm != NULL);
+  vm->hosted = true;
+  vm->running = false;
+  vm->prompted = false;
+  vm->error_message[0] = '\0';
+  if (vm->stored_program.source == NULL || !ensure_program_compiled(vm))
+    return false;
+  reset_control_state(vm);
+  vm->code_state.code = &vm->stored_program;
+  vm->code_state.source_line = 0;
+  vm->code_state.pc = 0;
+  vm->stopped = false;
+  vm->running = true;
+  vm->executed = 0;
+  return true;
+}
+
+static void step(VM* vm, unsigned long budget) {
+  void (*const execute_one)(VM*) = tracing(vm) ? execute_traced : execute;
+  while (budget && vm->code_state.pc < vm->code_state.code->bcode->used && !vm->stopped && vm->yield == RUNNING) {
+    execute_one(vm);
+    vm->executed++;
+    budget--;
+  }
+}
+
+// Run at most budget instructions of the started program, returning early
+// to wait for input, to let the caller take output, or at the end of the program.
+int vm_step(VM* vm, unsigned long budget) {
+  assert(vm != NULL && vm->hosted);
+  if (!vm->running)
+    return vm->error_message[0] ? VM_ERROR : VM_DONE;
+  if (vm->code_state.code == NULL || vm->code_state.code->bcode == NULL) {
+    vm->running = false;
+    strcpy(vm->error_message, "Runtime error: no compiled program to run\n");
+    return VM_ERROR;
+  }
+
+  vm->yield = RUNNING;
+  if (setjmp(vm->errjmp)) {
+    vm->yield = RUNNING;
+    vm->running = false;
+    return VM_ERROR;
+  }
+
+  step(vm, budget);
+
+  int status = vm->yield;
+  vm->yield = RUNNING;
+  if (status != RUNNING)
+    return status;
+  if (vm->code_state.pc >= vm->code_state.code->bcode->used || vm->stopped) {
+    finish_run(vm);
+    vm->running = false;
+    return VM_DONE;
+  }
+  return VM_BUDGET_EXHAUSTED;
+}
+
+// Provide a line of input, for INPUT. A newline is added if not given.
+void vm_provide_input(VM* vm, const char* line) {
+  assert(vm != NULL && line != NULL);
+  size_t len = strlen(line);
+  append(&vm->pending_input, line, len);
+  if (len == 0 || line[len-1] != '\n')
+    append(&vm->pending_input, "\n", 1);
+}
+
+// Provide characters as typed: taken one at a time by INKEY$, or by line by INPUT.
+void vm_provide_keys(VM* vm, const char* keys, size_t len) {
+  assert(vm != NULL && keys != NULL);
+  append(&vm->pending_input, keys, len);
+}
+
+const char* vm_output(const VM* vm, size_t* len) {
+  assert(vm != NULL);
+  if (len)
+    *len = vm->output.len;
+  return vm->output.text ? vm->output.text : "";
+}
+
+void vm_clear_output(VM* vm) {
+  assert(vm != NULL);
+  vm->output.len = 0;
+  if (vm->output.text)
+    vm->output.text[0] = '\0';
+}
+
+const char* vm_error(const VM* vm) {
+  assert(vm != NULL);
+  return vm->error_message;
+}
+
+// Number of instructions executed by vm_step since the program was started.
+unsigned long vm_executed(const VM* vm) {
+  assert(vm != NULL);
+  return vm->executed;
+}
+
 static void report_for_in_progress(VM* vm) {
   assert(vm->for_sp != 0);
   struct for_loop * f = &vm->for_stack[vm->for_sp-1];
   SYMBOL* sym = symbol(vm->st, f->symbol_id);
   assert(sym != NULL);
-  fprintf(stderr, "FOR without NEXT: %s\n", sym->name);
-  print_source_line(f->code_state.code->source, f->code_state.source_line, stderr);
-  putc('\n', stderr);
+  fprintf(diagnostics(), "FOR without NEXT: %s\n", sym->name);
+  print_source_line(f->code_state.code->source, f->code_state.source_line, diagnostics());
+  putc('\n', diagnostics());
 }
 
+// Report a runtime error as a diagnostic, or for vm_error when hosted, and abandon the instruction.
 static void run_error(VM* vm, const char* fmt, ...) {
-  fputs("Runtime error: ", stderr);
+  char message[sizeof vm->error_message];
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vsnprintf(message, sizeof message, fmt, ap);
   va_end(ap);
 
-  if (vm->code_state.code && vm->code_state.code->source) {
-    print_source_line(vm->code_state.code->source, vm->code_state.source_line, stderr);
-    putc('\n', stderr);
+  const SOURCE* source = vm->code_state.code ? vm->code_state.code->source : NULL;
+  if (vm->hosted) {
+    static const char PREFIX[] = "Runtime error: ";
+    int n = snprintf(vm->error_message, sizeof vm->error_message, "%s%.*s", PREFIX,
+                     (int) (sizeof vm->error_message - sizeof PREFIX), message);
+    if (source && vm->code_state.source_line < source_lines(source) && n >= 0 && n < (int) sizeof vm->error_message)
+      snprintf(vm->error_message + n, sizeof vm->error_message - n, "%u %s\n",
+               source_linenum(source, vm->code_state.source_line), source_text(source, vm->code_state.source_line));
+  }
+  else {
+    fputs("Runtime error: ", diagnostics());
+    fputs(message, diagnostics());
+    if (source) {
+      print_source_line(source, vm->code_state.source_line, diagnostics());
+      putc('\n', diagnostics());
+    }
   }
 
   longjmp(vm->errjmp, 1);
@@ -461,734 +1614,48 @@ static void next(VM*, int stack_index);
 static void call_def(VM*, SYMBOL*, unsigned params);
 static void end_def(VM*);
 
+// Input
+static void prompt_input(VM*, const char* prompt);
+static bool take_input_line(VM*);
+static int take_key(VM*);
+
 // Debugging
 static void print_stack(const VM*);
 static void dump_for(VM*, const char* tag);
 static void dump_for_stack(VM*, const char* tag);
 
-static void execute(VM* vm) {
-  assert(vm->code_state.pc < vm->code_state.code->bcode->used);
-
-  const BINST* const i = vm->code_state.code->bcode->inst + vm->code_state.pc;
-
-  switch (i->op) {
-    case B_NOP:
-      break;
-    // source
-    case B_SOURCE_LINE:
-      vm->code_state.source_line = i->u.source_line;
-      if (vm->trace_basic) {
-        printf("[%u]", source_linenum(vm->code_state.code->source, i->u.source_line));
-        fflush(stdout);
-      }
-      if (vm->trace_log) {
-        print_source_line(vm->code_state.code->source, vm->code_state.source_line, stderr);
-        putc('\n', stderr);
-      }
-      break;
-    // whole environment
-    case B_CLEAR:
-      vm_clear_values(vm);
-      break;
-    // number
-    case B_PUSH_NUM:
-      push(vm, i->u.num);
-      break;
-    case B_POP_NUM:
-      pop(vm);
-      break;
-    case B_GET_SIMPLE_NUM: {
-      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
-      get_numeric_simple(vm, sym);
-      break;
-    }
-    case B_SET_SIMPLE_NUM: {
-      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
-      set_numeric_simple(vm, sym, pop(vm));
-      break;
-    }
-    case B_DIM_NUM: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      assert(sym != NULL && sym->kind == SYM_ARRAY && sym->type == TYPE_NUM);
-      if (sym->val.numarr) {
-        assert(sym->defined);
-        delete_numeric_array(sym->val.numarr);
-        sym->val.numarr = NULL;
-        sym->defined = false;
-      }
-      unsigned max[MAX_DIMENSIONS];
-      pop_indexes(vm, max, i->u.param.params, sym->name);
-      dimension_numeric(vm, sym, i->u.param.params, max);
-      break;
-    }
-    case B_GET_PAREN_NUM: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      assert(sym != NULL && sym->type == TYPE_NUM);
-      // must be a parenthesised kind of symbol; not a builtin,
-      // which has its own opcodes; therefore array or user-defined function
-      if (sym->kind == SYM_ARRAY)
-        get_numeric_element(vm, sym, i->u.param.params);
-      else {
-        assert(sym->kind == SYM_DEF);
-        call_def(vm, sym, i->u.param.params);
-      }
-      break;
-    }
-    case B_SET_ARRAY_NUM: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_numeric_element(vm, sym, i->u.param.params, pop(vm));
-      break;
-    }
-    case B_NEG:
-      push(vm, - pop(vm));
-      break;
-    case B_ADD: {
-      double x = pop(vm);
-      push(vm, pop(vm) + x);
-      break;
-    }
-    case B_SUB: {
-      double x = pop(vm);
-      push(vm, pop(vm) - x);
-      break;
-    }
-    case B_MUL: {
-      double x = pop(vm);
-      push(vm, pop(vm) * x);
-      break;
-    }
-    case B_DIV: {
-      double x = pop(vm);
-      push(vm, pop(vm) / x);
-      break;
-    }
-    case B_POW: {
-      double x = pop(vm);
-      push(vm, pow(pop(vm), x));
-      break;
-    }
-    case B_EQ_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) == x);
-      break;
-    }
-    case B_LT_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) < x);
-      break;
-    }
-    case B_GT_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) > x);
-      break;
-    }
-    case B_NE_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) != x);
-      break;
-    }
-    case B_LE_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) <= x);
-      break;
-    }
-    case B_GE_NUM: {
-      double x = pop(vm);
-      push_logic(vm, pop(vm) >= x);
-      break;
-    }
-    case B_OR: {
-      int logic2 = pop_logic(vm);
-      int logic1 = pop_logic(vm);
-      push(vm, logic1 | logic2);
-      break;
-    }
-    case B_AND: {
-      int logic2 = pop_logic(vm);
-      int logic1 = pop_logic(vm);
-      push(vm, logic1 & logic2);
-      break;
-    }
-    case B_NOT: {
-      int logic = pop_logic(vm);
-      push(vm, ~logic);
-      break;
-    }
-    // string
-    case B_PUSH_STR:
-      push_str(vm, i->u.str);
-      break;
-    case B_POP_STR:
-      efree(pop_str(vm));
-      break;
-    case B_SET_SIMPLE_STR: {
-      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
-      set_string_simple(vm, sym, pop_str(vm));
-      break;
-    }
-    case B_GET_SIMPLE_STR: {
-      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
-      get_string_simple(vm, sym);
-      break;
-    }
-    case B_DIM_STR: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      assert(sym != NULL && sym->kind == SYM_ARRAY && sym->type == TYPE_STR);
-      if (sym->val.strarr) {
-        assert(sym->defined);
-        delete_string_array(sym->val.strarr);
-        sym->val.strarr = NULL;
-        sym->defined = false;
-      }
-      unsigned max[MAX_DIMENSIONS];
-      pop_indexes(vm, max, i->u.param.params, sym->name);
-      dimension_string(vm, sym, i->u.param.params, max);
-      break;
-    }
-    case B_GET_PAREN_STR: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      assert(sym != NULL && sym->type == TYPE_STR);
-      // must be a parenthesised kind of symbol; not a builtin,
-      // which has its own opcodes; therefore array or user-defined function
-      if (sym->kind == SYM_ARRAY)
-        get_string_element(vm, sym, i->u.param.params);
-      else {
-        assert(sym->kind == SYM_DEF);
-        call_def(vm, sym, i->u.param.params);
-      }
-      break;
-    }
-    case B_SET_ARRAY_STR: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_string_element(vm, sym, i->u.param.params, pop_str(vm));
-      break;
-    }
-    case B_EQ_STR:
-      push_logic(vm, compare_strings(vm) == 0);
-      break;
-    case B_NE_STR:
-      push_logic(vm, compare_strings(vm) != 0);
-      break;
-    case B_LT_STR:
-      push_logic(vm, compare_strings(vm) < 0);
-      break;
-    case B_GT_STR:
-      push_logic(vm, compare_strings(vm) > 0);
-      break;
-    case B_LE_STR:
-      push_logic(vm, compare_strings(vm) <= 0);
-      break;
-    case B_GE_STR:
-      push_logic(vm, compare_strings(vm) >= 0);
-      break;
-    case B_CONCAT: {
-      char* t = pop_str(vm);
-      char* s = pop_str(vm);
-      size_t sz = strlen(s) + strlen(t);
-      char buf[256];
-      if (sz + 1 > sizeof buf)
-        run_error(vm, "concatenated string would be too long: %lu characters\n", (unsigned long)sz);
-      strcpy(buf, s);
-      strcat(buf, t);
-      push_str(vm, buf);
-      efree(s);
-      efree(t);
-      break;
-    }
-    // control flow
-    case B_END:
-      vm->code_state.pc = vm->code_state.code->bcode->used;
-      return;
-    case B_STOP:
-      vm->stopped = true;
-      return;
-    case B_GOTO:
-      go_to_basic_line(vm, i->u.basic_line.lineno);
-      return;
-    case B_GOTRUE:
-      if (pop(vm)) {
-        go_to_basic_line(vm, i->u.basic_line.lineno);
-        return;
-      }
-      break;
-    case B_GOSUB:
-      push_return(vm, vm->code_state.pc + 1);
-      go_to_basic_line(vm, i->u.basic_line.lineno);
-      return;
-    case B_RETURN:
-      pop_return(vm); // pops PC to continue from
-      return;
-    case B_FOR: {
-      if (vm->trace_for)
-        dump_for(vm, "FOR");
-      SYMBOL* sym = symbol(vm->st, i->u.symbol_id);
-      assert(sym != NULL && sym->kind == SYM_VARIABLE && sym->type == TYPE_NUM);
-      int si = find_for(vm, i->u.symbol_id);
-      if (si >= 0) {
-        if (vm->strict_for)
-          run_error(vm, "already inside FOR loop controlled by this variable: %s\n", sym->name);
-        assert(vm->for_sp > 0);
-        if (si != vm->for_sp - 1) {
-          // bring inner loop to top of stack, for NEXT with no variable
-          struct for_loop inner = vm->for_stack[si];
-          for (unsigned k = si; k < vm->for_sp - 1; k++)
-            vm->for_stack[k] = vm->for_stack[k + 1];
-          vm->for_stack[vm->for_sp - 1] = inner;
-          si = vm->for_sp - 1;
-        }
-      }
-      else {
-        if (vm->for_sp >= MAX_FOR) {
-          dump_for_stack(vm, "overflow");
-          run_error(vm, "FOR is nested too deeply\n");
-        }
-        si = vm->for_sp++;
-      }
-      struct for_loop * f = &vm->for_stack[si];
-      f->code_state = vm->code_state;
-      f->symbol_id = i->u.symbol_id;
-      f->step = pop(vm);
-      f->limit = pop(vm);
-      sym->val.num = pop(vm);
-      sym->defined = true;
-      if (vm->trace_for)
-        dump_for_stack(vm, "final stack");
-      break;
-    }
-    case B_NEXT_VAR: {
-      if (vm->trace_for)
-        dump_for(vm, "NEXT-VARIABLE");
-      if (vm->for_sp == 0)
-        run_error(vm, "NEXT without FOR\n");
-      int si = vm->for_sp - 1;
-      struct for_loop * f = &vm->for_stack[si];
-      if (f->symbol_id != i->u.symbol_id) {
-        if (vm->strict_for) {
-          const char* for_name = sym_name(vm->st, f->symbol_id);
-          const char* next_name = sym_name(vm->st, i->u.symbol_id);
-          run_error(vm, "mismatched FOR variable: expecting %s, found %s\n", for_name, next_name);
-        }
-        si = find_for(vm, i->u.symbol_id);
-        if (si < 0)
-          run_error(vm, "NEXT without FOR: %s\n", sym_name(vm->st, i->u.symbol_id));
-        f = &vm->for_stack[si];
-      }
-      next(vm, si);
-      break;
-    }
-    case B_NEXT_IMP: {
-      if (vm->trace_for)
-        dump_for(vm, "NEXT-IMPLICIT");
-      if (vm->for_sp == 0)
-        run_error(vm, "NEXT without FOR\n");
-      next(vm, vm->for_sp - 1);
-      break;
-    }
-    case B_DEF: {
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      assert(sym != NULL && sym->kind == SYM_DEF);
-      if (sym->val.def) {
-        assert(sym->defined);
-        delete_def(sym->val.def);
-        sym->val.def = NULL;
-        sym->defined = false;
-      }
-      if (i->u.param.params != 1)
-        run_error(vm, "unexpected number of parameters: %s\n", sym->name);
-      const BCODE* bcode = vm->code_state.code->bcode;
-      SOURCE* source = NULL;
-      unsigned source_line = 0;
-      if (vm->code_state.code == &vm->stored_program) {
-        source = vm->stored_program.source;
-        source_line = vm->code_state.source_line;
-      }
-      sym->val.def = new_def(bcode_copy_def(bcode, vm->code_state.pc), source, source_line);
-      sym->defined = true;
-      do {
-        vm->code_state.pc++;
-      } while (vm->code_state.pc < bcode->used && bcode->inst[vm->code_state.pc].op != B_END_DEF);
-      break;
-    }
-    case B_PARAM:
-      run_error(vm, "internal error: run into parameter\n");
-      break;
-    case B_END_DEF:
-      end_def(vm);
-      break;
-    case B_ON_GOTO:
-    case B_ON_GOSUB: {
-      double x = pop(vm);
-      if (x != floor(x))
-        run_error(vm, "ON value is invalid: %g\n", x);
-      if (x < 1 || x > i->u.count) {
-        if (vm->strict_on)
-          run_error(vm, "ON value is out of range: %g\n", x);
-        vm->code_state.pc += i->u.count + 1;
-        return;
-      }
-      unsigned k = vm->code_state.pc + (unsigned) x;
-      if (k >= vm->code_state.code->bcode->used || vm->code_state.code->bcode->inst[k].op != B_ON_LINE)
-        run_error(vm, "internal error: ON-LINE expected\n");
-      if (i->op == B_ON_GOSUB)
-        push_return(vm, vm->code_state.pc + i->u.count + 1);
-      go_to_basic_line(vm, vm->code_state.code->bcode->inst[k].u.basic_line.lineno);
-      return;
-    }
-    case B_IF_THEN: // IF ... THEN statements  -- skip to next line if condition false
-      if (!pop(vm)) {
-        do {
-          vm->code_state.pc++;
-        } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_SOURCE_LINE);
-        return;
-      }
-      break;
-    case B_IF_ELSE: // IF ... THEN statements ELSE statements -- skip to ELSE statements if condition false
-      if (!pop(vm)) {
-        do {
-          vm->code_state.pc++;
-        } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_ELSE);
-      }
-      break;
-    case B_ELSE: // THEN statements ELSE statements -- skip to next line after executing THEN section
-      do {
-        vm->code_state.pc++;
-      } while (vm->code_state.pc < vm->code_state.code->bcode->used && vm->code_state.code->bcode->inst[vm->code_state.pc].op != B_SOURCE_LINE);
-      return;
-    // output
-    case B_PRINT_LN:
-      putchar('\n');
-      vm->col = 1;
-      break;
-    case B_PRINT_SPC: {
-      unsigned k = pop_unsigned(vm);
-      while (k--)
-        putchar(' '), vm->col++;
-      fflush(stdout);
-      break;
-    }
-    case B_PRINT_TAB: {
-      unsigned k = pop_unsigned(vm);
-      if (k < vm->col) {
-        putchar('\n');
-        vm->col = 1;
-      }
-      while (vm->col < k)
-        putchar(' '), vm->col++;
-      fflush(stdout);
-      break;
-    }
-    case B_PRINT_COMMA:
-      do {
-        putchar(' '), vm->col++;
-      } while (vm->col % TAB_SIZE != 1);
-      fflush(stdout);
-      break;
-    case B_PRINT_NUM:
-      vm->col += printf(" %g ", pop(vm));
-      fflush(stdout);
-      break;
-    case B_PRINT_STR: {
-      char* s = pop_str(vm);
-      for (const char* S = s; *S; S++) {
-        putchar(*S);
-        if (*S == '\n')
-          vm->col = 1;
-        else
-          vm->col++;
-      }
-      efree(s);
-      fflush(stdout);
-      break;
-    }
-    case B_CLS:
-      clear_screen();
-      vm->col = 1;
-      break;
-    // input
-    case B_INPUT_BUF:
-      if (i->u.str)
-        fputs(i->u.str, stdout);
-      if (vm->input_prompt)
-        fputs("? ", stdout);
-      fflush(stdout);
-      if (fgets(vm->input, sizeof vm->input, stdin) == NULL) {
-        if (ferror(stdin))
-          run_error(vm, "error reading input\n");
-      }
-      vm->inp = 0;
-      vm->input_pc = vm->code_state.pc;
-      break;
-    case B_INPUT_END: {
-      int c;
-      while ((c = vm->input[vm->inp]) == ' ' || c == '\t' || c == '\n' || c == '\r')
-        vm->inp++;
-      if (c != '\0')
-        puts("* Extra input was discarded *");
-      break;
-    }
-    case B_INPUT_SEP: {
-      int c;
-      while ((c = vm->input[vm->inp]) == ' ' || c == '\t')
-        vm->inp++;
-      if (c == ',') {
-        vm->inp++;
-        break;
-      }
-      puts("* More input items are expected *");
-      vm->code_state.pc = vm->input_pc;
-      return;
-    }
-    case B_INPUT_NUM: {
-      double x;
-      const char* t = convert(vm->input + vm->inp, &x);
-      if (t != NULL && (*t == '\0' || *t == '\n' || *t == ',')) {
-        SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-        set_numeric(vm, sym, i->u.param.params, x);
-        vm->inp = (int) (t - vm->input);
-        break;
-      }
-      puts("* Invalid input *");
-      vm->code_state.pc = vm->input_pc;
-      return;
-    }
-    case B_INPUT_STR: {
-      const char* s = vm->input + vm->inp;
-      int c;
-      while ((c = vm->input[vm->inp]) != '\0' && c != '\n' && c != ',')
-        vm->inp++;
-      vm->input[vm->inp] = '\0';
-      char* t = estrdup(s);
-      vm->input[vm->inp] = c;
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_string(vm, sym, i->u.param.params, t);
-      break;
-    }
-    case B_INPUT_LINE: {
-      char* s = strchr(vm->input, '\n');
-      if (s)
-        *s = '\0';
-      s = estrdup(vm->input);
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_string(vm, sym, i->u.param.params, s);
-      break;
-    }
-    // inline data
-    case B_DATA:
-      break;
-    case B_READ_NUM: {
-      const char* S = find_data(vm);
-      double x;
-      const char* t = convert(S, &x);
-      if (t == NULL || *t != '\0')
-        run_error(vm, "numeric data expected: %s\n", S);
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_numeric(vm, sym, i->u.param.params, x);
-      break;
-    }
-    case B_READ_STR: {
-      const char* S = find_data(vm);
-      SYMBOL* sym = symbol(vm->st, i->u.param.symbol_id);
-      set_string(vm, sym, i->u.param.params, estrdup(S));
-      break;
-    }
-    case B_RESTORE:
-      vm->program_data = 0;
-      vm->immediate_data = 0;
-      break;
-    case B_RESTORE_LINE:
-      vm->program_data = find_basic_line(vm, i->u.basic_line.lineno);
-      break;
-    // random
-    case B_RAND:
-      srand((unsigned)time(NULL));
-      break;
-    case B_SEED:
-      srand(pop_unsigned(vm));
-      break;
-    // builtins
-    case B_ASC: {
-      char* s = pop_str(vm);
-      push(vm, s[0]);
-      efree(s);
-      break;
-    }
-    case B_ABS:
-      push(vm, fabs(pop(vm)));
-      break;
-    case B_ATN:
-      push(vm, atan(pop(vm)));
-      break;
-    case B_CHR: {
-      double x = pop(vm);
-      if (x < 0 || x > 255 || x != floor(x))
-        run_error(vm, "invalid character code: %g\n", x);
-      char buf[2];
-      buf[0] = (char) x;
-      buf[1] = '\0';
-      push_str(vm, buf);
-      break;
-    }
-    case B_COS:
-      push(vm, cos(pop(vm)));
-      break;
-    case B_EXP:
-      push(vm, exp(pop(vm)));
-      break;
-    case B_INKEY:
-#if HAS_KBHIT && HAS_GETCH
-      if (_kbhit()) {
-        char buf[2];
-        buf[0] = _getch();
-        buf[1] = '\0';
-        push_str(vm, buf);
-      }
-      else
-        push_str(vm, "");
-#else
-      run_error(vm, "INKEY$ is not supported\n");
-#endif
-      break;
-    case B_INT:
-      push(vm, floor(pop(vm)));
-      break;
-    case B_LEFT: {
-      char* s = pop_str(vm);
-      unsigned u = pop_unsigned(vm);
-      size_t sz = strlen(s);
-      if (u > sz)
-        u = (unsigned long)sz;
-      char buf[256];
-      if (u + 1 > sizeof buf)
-        run_error(vm, STRING_TOO_LONG);
-      strncpy(buf, s, u);
-      buf[u] = '\0';
-      push_str(vm, buf);
-      efree(s);
-      break;
-    }
-    case B_LEN: {
-      char* s = pop_str(vm);
-      push(vm, (double) strlen(s));
-      efree(s);
-      break;
-    }
-    case B_LOG: {
-      double x = pop(vm);
-      if (x <= 0)
-        run_error(vm, "invalid logarithm\n");
-      push(vm, log(x));
-      break;
-    }
-    case B_MID3: {
-      char* s = pop_str(vm);
-      unsigned v = pop_unsigned(vm);
-      unsigned u = pop_unsigned(vm);
-      size_t sz = strlen(s);
-      if (u < 1 || u > sz)
-        run_error(vm, "string index out of range\n");
-      if (v > sz - u + 1)
-        v = (unsigned long)(sz - u + 1);
-      char buf[256];
-      if (v + 1 > sizeof buf)
-        run_error(vm, STRING_TOO_LONG);
-      strncpy(buf, s + u - 1, v);
-      buf[v] = '\0';
-      push_str(vm, buf);
-      efree(s);
-      break;
-    }
-    case B_STR: {
-      double x = pop(vm);
-      char buf[64];
-      sprintf(buf, "%g", x);
-      push_str(vm, buf);
-      break;
-    }
-    case B_RIGHT: {
-      char* s = pop_str(vm);
-      unsigned u = pop_unsigned(vm);
-      size_t sz = strlen(s);
-      if (u > sz)
-        u = (unsigned long)sz;
-      char buf[256];
-      if (u + 1 > sizeof buf)
-        run_error(vm, STRING_TOO_LONG);
-      strncpy(buf, s + sz - u, u);
-      buf[u] = '\0';
-      push_str(vm, buf);
-      efree(s);
-      break;
-    }
-    case B_RND: {
-      double x;
-      do {
-        x = (double) rand() / RAND_MAX;
-      } while (x >= 1);
-      push(vm, x);
-      break;
-    }
-    case B_SGN: {
-      double x = pop(vm);
-      if (x < 0)
-        x = -1;
-      else if (x > 0)
-        x = 1;
-      push(vm, x);
-      break;
-    }
-    case B_SIN:
-      push(vm, sin(pop(vm)));
-      break;
-     case B_SQR:
-      push(vm, sqrt(pop(vm)));
-      break;
-    case B_TAN:
-      push(vm, tan(pop(vm)));
-      break;
-    case B_TIME_STR: {
-      time_t t = time(NULL);
-      struct tm * tm = localtime(&t);
-      char buf[12];
-      sprintf(buf, "%02u:%02u:%02u", tm->tm_hour, tm->tm_min, tm->tm_sec);
-      push_str(vm, buf);
-      break;
-    }
-    case B_VAL: {
-      char* s = pop_str(vm);
-      double x;
-      const char* t = convert(s, &x);
-      if (t == NULL || *t != '\0')
-        run_error(vm, "invalid number: %s\n", s);
-      efree(s);
-      push(vm, x);
-      break;
-    }
-    // unknown opcode
-    default:
-      fputs("UNKNOWN OPCODE:\n", stderr);
-      print_binst(i, vm->code_state.pc, vm->code_state.code->source, vm->st, stderr);
-      run_error(vm, "unknown opcode: %u\n", i->op);
-  }
-  vm->code_state.pc++;
+#define EXECUTE execute
+#define TRACING 0
+#include "execute.h"
+#undef EXECUTE
+#undef TRACING
+
+#define EXECUTE execute_instruction_traced
+#define TRACING 1
+#include "execute.h"
+#undef EXECUTE
+#undef TRACING
+
+// Execute an instruction, tracing as selected. Print the numeric stack,
+// for --trace-log, if the instruction changed it.
+static void execute_traced(VM* vm) {
+  const unsigned sp = vm->sp;
+  const double top = sp ? vm->stack[sp - 1] : 0;
+  execute_instruction_traced(vm);
+  if (vm->trace_log && (vm->sp != sp || (vm->sp && vm->stack[vm->sp - 1] != top)))
+    print_stack(vm);
 }
 
 static void push(VM* vm, double num) {
   if (vm->sp >= MAX_NUM_STACK)
     run_error(vm, "numeric stack overflow\n");
   vm->stack[vm->sp++] = num;
-
-  if (vm->trace_log)
-    print_stack(vm);
 }
 
 static double pop(VM* vm) {
   if (vm->sp == 0)
     run_error(vm, "numeric stack empty\n");
   vm->sp--;
-
-  if (vm->trace_log)
-    print_stack(vm);
-
   return vm->stack[vm->sp];
 }
 
@@ -1230,7 +1697,11 @@ static void pop_indexes(VM* vm, unsigned* indexes, unsigned dimensions, const ch
 static void push_str(VM* vm, const char* s) {
   if (vm->ssp >= MAX_STR_STACK)
     run_error(vm, "string stack overflow\n");
-  vm->strstack[vm->ssp++] = estrdup(s ? s : "");
+  if (s == NULL)
+    s = "";
+  if (vm->stats)
+    stats_string(vm->stats, strlen(s) + 1);
+  vm->strstack[vm->ssp++] = heap_strdup(vm->st->strings, s);
 }
 
 static char* pop_str(VM* vm) {
@@ -1244,8 +1715,8 @@ static int compare_strings(VM* vm) {
   char* t = pop_str(vm);
   char* s = pop_str(vm);
   int r = strcmp(s, t);
-  efree(s);
-  efree(t);
+  heap_free(vm->st->strings, s);
+  heap_free(vm->st->strings, t);
   return r;
 }
 
@@ -1320,6 +1791,7 @@ static void set_numeric_element(VM* vm, SYMBOL* sym, unsigned ndim, double val)
     dimension_numeric_auto(vm, sym, ndim, indexes);
 
   assert(sym->val.numarr != NULL);
+  sym->val.numarr = unshare_numeric_array(sym->val.numarr);
   *numeric_element(vm, sym->val.numarr, sym->name, ndim, indexes) = val;
 }
 
@@ -1348,7 +1820,7 @@ static void set_string_simple(VM* vm, SYMBOL* sym, char* val) {
 
   if (sym->val.str) {
     assert(sym->defined);
-    efree(sym->val.str);
+    heap_free(vm->st->strings, sym->val.str);
   }
 
   sym->val.str = val;
@@ -1406,8 +1878,9 @@ static void set_string_element(VM* vm, SYMBOL* sym, unsigned ndim, char* val) {
     dimension_string_auto(vm, sym, ndim, indexes);
 
   assert(sym->val.strarr != NULL);
+  sym->val.strarr = unshare_string_array(sym->val.strarr, vm->st->strings);
   char* * addr = string_element(vm, sym->val.strarr, sym->name, ndim, indexes);
-  efree(*addr);
+  heap_free(vm->st->strings, *addr);
   *addr = val;
 }
 
@@ -1435,6 +1908,8 @@ static char* convert(const char* s, double *val) {
 
 static unsigned find_basic_line(VM* vm, unsigned basic_line) {
   unsigned bcode_line;
+  if (vm->stats)
+    stats_line_lookup(vm->stats);
   if (vm->stored_program.index == NULL ||
      !lookup_line_mapping(vm->stored_program.index, basic_line, &bcode_line))
     run_error(vm, "Line not found: %u\n", basic_line);
@@ -1525,8 +2000,6 @@ static void next(VM* vm, int si) {
     sym->val.num = x;
     vm->code_state = f->code_state;
   }
-  if (vm->trace_for)
-    dump_for_stack(vm, "final stack");
 }
 
 static void call_def(VM* vm, SYMBOL* sym, unsigned params) {
@@ -1586,6 +2059,91 @@ static void end_def(VM* vm) {
   param_sym->val.num = vm->fn.param_val;
 }
 
+static void append(struct buffer * b, const char* s, size_t len) {
+  if (b->len + len + 1 > b->allocated) {
+    b->allocated = b->allocated ? 2 * b->allocated : 256;
+    if (b->allocated < b->len + len + 1)
+      b->allocated = b->len + len + 1;
+    b->text = erealloc(b->text, b->allocated);
+  }
+  memcpy(b->text + b->len, s, len);
+  b->len += len;
+  b->text[b->len] = '\0';
+}
+
+static void consume(struct buffer * b, size_t len) {
+  assert(len <= b->len);
+  b->len -= len;
+  memmove(b->text, b->text + len, b->len + 1);
+}
+
+static void out_char(VM* vm, int c) {
+  if (vm->hosted) {
+    char ch = (char) c;
+    append(&vm->output, &ch, 1);
+    if (vm->output.len >= OUTPUT_READY_SIZE && vm->yield == RUNNING)
+      vm->yield = VM_OUTPUT_READY;
+  }
+  else
+    putchar(c);
+}
+
+static void out_str(VM* vm, const char* s) {
+  while (*s)
+    out_char(vm, *s++);
+}
+
+static int out_printf(VM* vm, const char* fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof buf, fmt, ap);
+  va_end(ap);
+  out_str(vm, buf);
+  return n < (int) sizeof buf ? n : (int) sizeof buf - 1;
+}
+
+static void out_flush(VM* vm) {
+  if (!vm->hosted)
+    fflush(stdout);
+}
+
+static void prompt_input(VM* vm, const char* prompt) {
+  if (prompt)
+    out_str(vm, prompt);
+  if (vm->input_prompt)
+    out_str(vm, "? ");
+  out_flush(vm);
+}
+
+// Move a complete line of provided input into the INPUT buffer, if there is one.
+static bool take_input_line(VM* vm) {
+  struct buffer * b = &vm->pending_input;
+  const char* nl = b->len ? memchr(b->text, '\n', b->len) : NULL;
+  if (nl == NULL)
+    return false;
+  size_t len = nl - b->text;
+  if (len > 0 && b->text[len-1] == '\r')
+    len--;
+  if (len > sizeof vm->input - 2)
+    len = sizeof vm->input - 2; // the rest of a long line is discarded
+  memcpy(vm->input, b->text, len);
+  vm->input[len] = '\n';
+  vm->input[len+1] = '\0';
+  consume(b, nl - b->text + 1);
+  return true;
+}
+
+// Take one character of provided input for INKEY$, or return -1 if there is none.
+static int take_key(VM* vm) {
+  struct buffer * b = &vm->pending_input;
+  if (b->len == 0)
+    return -1;
+  int c = (unsigned char) b->text[0];
+  consume(b, 1);
+  return c;
+}
+
 static void print_stack(const VM* vm) {
   fputs("STACK:", stderr);
   for (unsigned i = 0; i < vm->sp; i++)
@@ -1670,9 +2228,319 @@ static void test_new_vm(CuTest* tc) {
   delete_vm(vm);
 }
 
+static void test_step_input(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "INPUT \"NAME\"; N$");
+  vm_enter_source_line(vm, 20, "PRINT \"HELLO \"; N$");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+
+  CuAssertIntEquals(tc, VM_NEEDS_INPUT, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "NAME? ", vm_output(vm, NULL));
+  CuAssertIntEquals(tc, VM_NEEDS_INPUT, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "NAME? ", vm_output(vm, NULL));
+  vm_clear_output(vm);
+
+  vm_provide_input(vm, "WORLD");
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "HELLO WORLD\n", vm_output(vm, NULL));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+
+  delete_vm(vm);
+}
+
+static void test_step_budget(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "GOTO 10");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_BUDGET_EXHAUSTED, vm_step(vm, 100));
+  CuAssertIntEquals(tc, VM_BUDGET_EXHAUSTED, vm_step(vm, 100));
+  delete_vm(vm);
+}
+
+static void test_step_error(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "PRINT 1");
+  vm_enter_source_line(vm, 20, "RETURN");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_ERROR, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, " 1 \n", vm_output(vm, NULL));
+  CuAssertTrue(tc, strncmp(vm_error(vm), "Runtime error: ", 15) == 0);
+  CuAssertPtrNotNull(tc, strstr(vm_error(vm), "20 RETURN"));
+  CuAssertIntEquals(tc, VM_ERROR, vm_step(vm, 1000));
+  delete_vm(vm);
+}
+
+// A VM stepped by a host and then run directly is no longer hosted.
+static void test_step_then_run(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "A = A + 1");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  run_program(vm);
+  CuAssertIntEquals(tc, false, vm->hosted);
+  double a;
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 2, a, 0);
+  delete_vm(vm);
+}
+
+static void test_step_inkey(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "K$ = INKEY$");
+  vm_enter_source_line(vm, 20, "IF K$ = \"\" THEN 10");
+  vm_enter_source_line(vm, 30, "PRINT K$;");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_BUDGET_EXHAUSTED, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "", vm_output(vm, NULL));
+  vm_provide_keys(vm, "XY", 2);
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "X", vm_output(vm, NULL));
+  delete_vm(vm);
+}
+
+static void test_recompile(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "DEF FNA(X) = X * 2");
+  vm_enter_source_line(vm, 20, "PRINT FNA(3);");
+  vm_enter_source_line(vm, 30, "GOSUB 50: PRINT \"C\";: END");
+  vm_enter_source_line(vm, 50, "PRINT \"S\";: RETURN");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, " 6 SC", vm_output(vm, NULL));
+  vm_clear_output(vm);
+
+  // unchanged lines are copied, and follow the changed and inserted ones
+  vm_enter_source_line(vm, 20, "PRINT FNA(4);");
+  vm_enter_source_line(vm, 40, "PRINT \"X\";");
+  vm_enter_source_line(vm, 5, "PRINT \"F\";");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertPtrNotNull(tc, vm->stored_program.bcode->segments);
+  CuAssertIntEquals(tc, 6, vm->stored_program.bcode->segment_count);
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "F 8 SC", vm_output(vm, NULL));
+  vm_clear_output(vm);
+
+  // without its DEF, FNA is an array, as if the program were compiled afresh
+  vm_delete_source_line(vm, 10);
+  vm_enter_source_line(vm, 20, "PRINT FNA(4);");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "F 0 SC", vm_output(vm, NULL));
+  delete_vm(vm);
+}
+
+static void test_recompile_strings(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "PRINT \"KEPT\";");
+  vm_enter_source_line(vm, 20, "PRINT \"EDITED 0\";");
+  CuAssertIntEquals(tc, true, vm_compile(vm));
+  size_t used = arena_used(vm->stored_program.bcode->strings);
+
+  // strings of replaced lines are not carried into the recompiled code
+  char line[32];
+  for (int i = 1; i <= 100; i++) {
+    sprintf(line, "PRINT \"EDITED %d\";", i % 10);
+    vm_enter_source_line(vm, 20, line);
+    CuAssertIntEquals(tc, true, vm_compile(vm));
+    CuAssertPtrNotNull(tc, vm->stored_program.bcode->segments);
+    CuAssertTrue(tc, arena_used(vm->stored_program.bcode->strings) <= used);
+  }
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertStrEquals(tc, "KEPTEDITED 0", vm_output(vm, NULL));
+  delete_vm(vm);
+}
+
+static void test_immediate_cache(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "B = 1");
+  double a, z;
+  for (int i = 0; i < 3; i++)
+    run_immediate(vm, "A = A + 1");
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 3, a, 0);
+
+  run_immediate(vm, "CLEAR");
+  run_immediate(vm, "A = A + 1");
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 1, a, 0);
+
+  // a program compiled afresh gives names new ids, which a repeated line follows
+  vm_enter_source_line(vm, 10, "Z = 5");
+  run_program(vm);
+  run_immediate(vm, "A = A + 1");
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 1, a, 0);
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "Z", &z));
+  CuAssertDblEquals(tc, 5, z, 0);
+
+  // lines pushed out by others are compiled again
+  char line[32];
+  for (int i = 0; i <= IMMEDIATE_CACHE_LINES; i++) {
+    sprintf(line, "A = A + %d", i);
+    run_immediate(vm, line);
+  }
+  run_immediate(vm, "A = A + 0");
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 1 + IMMEDIATE_CACHE_LINES * (IMMEDIATE_CACHE_LINES + 1) / 2, a, 0);
+  run_immediate(vm, "A = A + 1");
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "A", &a));
+  CuAssertDblEquals(tc, 2 + IMMEDIATE_CACHE_LINES * (IMMEDIATE_CACHE_LINES + 1) / 2, a, 0);
+  delete_vm(vm);
+}
+
+static void test_clone(CuTest* tc) {
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "DIM A(3), B$(3)");
+  vm_enter_source_line(vm, 20, "A(1) = 5: B$(1) = \"B\": RANDOMIZE 7");
+  vm_enter_source_line(vm, 30, "FOR I = 1 TO 2");
+  vm_enter_source_line(vm, 40, "GOSUB 100");
+  vm_enter_source_line(vm, 50, "NEXT I");
+  vm_enter_source_line(vm, 60, "END");
+  vm_enter_source_line(vm, 100, "INPUT X");
+  vm_enter_source_line(vm, 110, "A(1) = A(1) + X: B$(1) = B$(1) + STR$(X)");
+  vm_enter_source_line(vm, 120, "PRINT A(1); B$(1); INT(RND * 1000)");
+  vm_enter_source_line(vm, 130, "RETURN");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_NEEDS_INPUT, vm_step(vm, 1000));
+  vm_clear_output(vm);
+
+  VM* clone = vm_clone(vm);
+  vm_provide_input(vm, "1");
+  vm_provide_input(vm, "2");
+  vm_provide_input(clone, "10");
+  vm_provide_input(clone, "20");
+  CuAssertIntEquals(tc, VM_DONE, vm_step(clone, 1000));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+
+  const char* out = vm_output(vm, NULL);
+  const char* clone_out = vm_output(clone, NULL);
+  CuAssertTrue(tc, strncmp(out, " 6 B1 ", 6) == 0);
+  CuAssertPtrNotNull(tc, strstr(out, "\n 8 B12 "));
+  CuAssertTrue(tc, strncmp(clone_out, " 15 B10 ", 8) == 0);
+  CuAssertPtrNotNull(tc, strstr(clone_out, "\n 35 B1020 "));
+  // the clone continues the same random number sequence
+  CuAssertStrEquals(tc, strrchr(out, 'B') + 3, strrchr(clone_out, 'B') + 5);
+  CuAssertTrue(tc, vm->rng == clone->rng);
+
+  double a;
+  CuAssertIntEquals(tc, true, vm_get_number(clone, "I", &a));
+  CuAssertDblEquals(tc, 2, a, 0);
+
+  delete_vm(vm);
+  delete_vm(clone);
+}
+
+static void test_snapshot(CuTest* tc) {
+  static const char NAME[] = "test-snapshot.snp";
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "DIM A(3): A(2) = 7: B$ = \"HI\"");
+  vm_enter_source_line(vm, 20, "DEF FNS(X) = X * X");
+  vm_enter_source_line(vm, 30, "FOR I = 1 TO 3");
+  vm_enter_source_line(vm, 40, "GOSUB 100");
+  vm_enter_source_line(vm, 50, "NEXT I");
+  vm_enter_source_line(vm, 60, "END");
+  vm_enter_source_line(vm, 100, "READ D: T = T + FNS(I) + D + A(2)");
+  vm_enter_source_line(vm, 110, "IF I = 2 THEN STOP");
+  vm_enter_source_line(vm, 120, "RETURN");
+  vm_enter_source_line(vm, 130, "DATA 100, 200, 300");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertIntEquals(tc, true, vm_can_continue(vm));
+  CuAssertIntEquals(tc, true, vm_save_snapshot(vm, NAME));
+  delete_vm(vm);
+
+  vm = new_vm(false, false, false, false);
+  CuAssertIntEquals(tc, true, vm_load_snapshot(vm, NAME));
+  remove(NAME);
+  CuAssertIntEquals(tc, true, vm_can_continue(vm));
+  CuAssertPtrEquals(tc, &vm->stored_program, (void*) vm->retstack[0].code);
+  CuAssertIntEquals(tc, true, vm_continue(vm));
+  CuAssertIntEquals(tc, false, vm_can_continue(vm));
+  double t;
+  CuAssertIntEquals(tc, true, vm_get_number(vm, "T", &t));
+  CuAssertDblEquals(tc, (1 + 4 + 9) + (100 + 200 + 300) + 3 * 7, t, 0);
+  CuAssertStrEquals(tc, "HI", vm_get_string(vm, "B$"));
+  delete_vm(vm);
+
+  vm = new_vm(false, false, false, false);
+  CuAssertIntEquals(tc, false, vm_load_snapshot(vm, NAME));
+  delete_vm(vm);
+}
+
+// A snapshot whose array bounds need more elements than it holds is rejected.
+static void test_snapshot_array_bounds(CuTest* tc) {
+  static const char NAME[] = "test-snapshot-bounds.snp";
+  static const unsigned char BOUNDS[] = { 1, 0, 1, 3, 0, 0, 0 };  // defined, base 0, A(3)
+  VM* vm = new_vm(false, false, false, false);
+  vm_enter_source_line(vm, 10, "DIM A(3): STOP");
+  CuAssertIntEquals(tc, true, vm_start_program(vm));
+  CuAssertIntEquals(tc, VM_DONE, vm_step(vm, 1000));
+  CuAssertIntEquals(tc, true, vm_save_snapshot(vm, NAME));
+  delete_vm(vm);
+
+  FILE* fp = fopen(NAME, "rb");
+  CuAssertPtrNotNull(tc, fp);
+  unsigned char data[4096];
+  size_t size = fread(data, 1, sizeof data, fp);
+  fclose(fp);
+  size_t pos = 0;
+  while (pos + sizeof BOUNDS <= size && memcmp(data + pos, BOUNDS, sizeof BOUNDS) != 0)
+    pos++;
+  CuAssertTrue(tc, pos + sizeof BOUNDS <= size);
+
+  for (int corrupt = 0; corrupt < 2; corrupt++) {
+    unsigned char copy[4096];
+    memcpy(copy, data, size);
+    if (corrupt == 0) {
+      copy[pos + 1] = 2;  // A(2 TO 5): as many elements, but base 2
+      copy[pos + 3] = 5;
+    }
+    else
+      memset(copy + pos + 3, 0xFF, 4);  // A(4294967295)
+    fp = fopen(NAME, "wb");
+    CuAssertPtrNotNull(tc, fp);
+    fwrite(copy, 1, size, fp);
+    fclose(fp);
+    vm = new_vm(false, false, false, false);
+    CuAssertIntEquals(tc, false, vm_load_snapshot(vm, NAME));
+    delete_vm(vm);
+  }
+  remove(NAME);
+}
+
+// Push strings to the given depth and pop them again, ops pairs in all,
+// for the microbenchmarks. Return the time taken in nanoseconds.
+unsigned long long bench_string_stack(unsigned depth, unsigned long ops) {
+  VM* vm = new_vm(false, false, false, false);
+  if (depth == 0 || depth > MAX_STR_STACK)
+    depth = MAX_STR_STACK;
+  const unsigned long long start = clock_nsec();
+  for (unsigned long n = 0; n < ops; n += depth) {
+    for (unsigned i = 0; i < depth; i++)
+      push_str(vm, "HELLO, WORLD");
+    for (unsigned i = 0; i < depth; i++)
+      heap_free(vm->st->strings, pop_str(vm));
+  }
+  const unsigned long long nsec = clock_nsec() - start;
+  delete_vm(vm);
+  return nsec;
+}
+
 CuSuite* run_test_suite(void) {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_new_vm);
+  SUITE_ADD_TEST(suite, test_step_input);
+  SUITE_ADD_TEST(suite, test_step_budget);
+  SUITE_ADD_TEST(suite, test_step_error);
+  SUITE_ADD_TEST(suite, test_step_inkey);
+  SUITE_ADD_TEST(suite, test_step_then_run);
+  SUITE_ADD_TEST(suite, test_recompile);
+  SUITE_ADD_TEST(suite, test_recompile_strings);
+  SUITE_ADD_TEST(suite, test_immediate_cache);
+  SUITE_ADD_TEST(suite, test_clone);
+  SUITE_ADD_TEST(suite, test_snapshot);
+  SUITE_ADD_TEST(suite, test_snapshot_array_bounds);
   return suite;
 }
 
@@ -3,34 +3,101 @@
 
 #pragma once
 
+#include <stdio.h>
 #include <stdbool.h>
 #include "bcode.h"
+#include "os.h"
 
 typedef struct vm VM;
 
 VM* new_vm(bool keywords_anywhere, bool trace_basic, bool trace_for, bool trace_log);
 void delete_vm(VM*);
 
+// Copy a VM, for example one waiting for input, to explore alternative continuations.
+// Clones share compiled code and arrays without locking: use them on one thread.
+VM* vm_clone(VM*);
+
+// Start the random number sequence from a seed, as a new VM does from rand().
+void vm_seed_random(VM*, unsigned seed);
+
 // Maintain a source program.
 void vm_new_program(VM*);
 void vm_delete_source_line(VM*, unsigned num);
 void vm_enter_source_line(VM*, unsigned num, const char* text);
 bool vm_save_source(VM*, const char* name);
 bool vm_load_source(VM*, const char* name);
+bool vm_load_source_string(VM*, const char* text, const char* name);
+bool vm_save_image(VM*, const char* name);
+bool vm_load_image(VM*, const char* name);
 
-SOURCE* vm_stored_source(vm);
+// Save, or restore, the stored program with the complete state of running it.
+bool vm_save_snapshot(VM*, const char* name);
+bool vm_load_snapshot(VM*, const char* name);
+
+SOURCE* vm_stored_source(const VM*);
 
 // Compile and run code.
-void vm_compile(VM*);
+bool vm_compile(VM*);
+#if HAS_TIMER
+// Times of parsing and indexing the stored program when last compiled.
+void vm_compile_timers(const VM*, TIMER* parse, TIMER* index);
+#endif
 
 void run_program(VM*);
 void run_immediate(VM*, const char* line);
 
 bool vm_continue(VM*);
+bool vm_can_continue(const VM*);
+
+// Profile the lines of the stored program when it runs: see profile.h for formats.
+void vm_set_profiling(VM*, bool);
+bool vm_print_profile(const VM*, int format, FILE*);
+void vm_set_call_profiling(VM*, bool);
+bool vm_print_call_profile(const VM*, FILE* table, FILE* folded);
+// Sample the stored program's lines and GOSUB stack at intervals, where supported.
+void vm_set_sampling(VM*, bool);
+bool vm_print_samples(const VM*, FILE* histogram, FILE* folded);
+// Trace instructions executed to a binary ring file: see trace.h.
+bool vm_set_trace_file(VM*, const char* file_name, unsigned long events, const char* program_name);
+// Collect and report execution statistics: see stats.h.
+void vm_set_stats(VM*, bool);
+bool vm_print_stats(const VM*, FILE*);
+
+// Run the stored program a step at a time, for a host that owns input and output.
+// Output is collected for vm_output instead of being printed, and INPUT waits
+// for vm_provide_input instead of reading stdin.
+enum vm_status {
+  VM_NEEDS_INPUT,      // waiting at INPUT for a line of input
+  VM_OUTPUT_READY,     // output buffer is full enough to be taken
+  VM_DONE,             // program ended or stopped
+  VM_ERROR,            // runtime error: see vm_error
+  VM_BUDGET_EXHAUSTED  // instruction budget used up, or INKEY$ found no key
+};
+
+bool vm_start_program(VM*);
+int vm_step(VM*, unsigned long budget);
+void vm_provide_input(VM*, const char* line);
+void vm_provide_keys(VM*, const char* keys, size_t len);
+const char* vm_output(const VM*, size_t* len);
+void vm_clear_output(VM*);
+const char* vm_error(const VM*);
+unsigned long vm_executed(const VM*);
 
 // Maintain an environment of variables and functions.
 void vm_clear_names(VM*);  // go back to builtin names only
 void vm_clear_values(VM*);  // clear values but keep names list so code remains valid
 
+// Inspect and set simple variables of the program.
+bool vm_get_number(VM*, const char* name, double*);
+bool vm_set_number(VM*, const char* name, double);
+const char* vm_get_string(VM*, const char* name);
+bool vm_set_string(VM*, const char* name, const char* value);
+
 // Flags
 bool vm_keywords_anywhere(const VM*);
+void vm_set_keywords_anywhere(VM*, bool);
+void vm_set_array_base(VM*, unsigned base);
+void vm_set_strict_dim(VM*, bool);
+void vm_set_strict_for(VM*, bool);
+void vm_set_strict_on(VM*, bool);
+void vm_set_strict_variables(VM*, bool);
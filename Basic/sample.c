@@ -0,0 +1,297 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Statistical profile of a program: samples of the line being executed
+// and the GOSUB lines leading to it, taken at intervals by a timer signal.
+
+// Samples are recorded by a signal handler into a ring buffer with one writer,
+// the handler, and one reader, the collector, on the same thread: the handler
+// only advances the head, and the collector only advances the tail,
+// so neither needs a lock. Collected samples are totalled per distinct stack
+// in a hash table.
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include "sample.h"
+#include "utils.h"
+
+#define RING_SIZE (1U << 14)
+
+typedef struct {
+  unsigned line;
+  unsigned depth;
+  unsigned callers[MAX_SAMPLE_DEPTH];
+} SAMPLE;
+
+typedef struct {
+  SAMPLE stack;
+  unsigned long count;  // 0 if the slot is empty
+} STACK_TOTAL;
+
+struct sampler {
+  volatile SAMPLE ring[RING_SIZE];
+  volatile sig_atomic_t head;  // next to write: advanced by sampler_record
+  volatile sig_atomic_t tail;  // next to read: advanced by sampler_collect
+  volatile unsigned long dropped;
+  unsigned long samples;
+  STACK_TOTAL* totals;
+  unsigned size;  // power of 2
+  unsigned used;
+};
+
+SAMPLER* new_sampler(void) {
+  SAMPLER* s = ecalloc(1, sizeof *s);
+  s->size = 64;
+  s->totals = ecalloc(s->size, sizeof s->totals[0]);
+  return s;
+}
+
+void delete_sampler(SAMPLER* s) {
+  if (s) {
+    efree(s->totals);
+    efree(s);
+  }
+}
+
+void sampler_record(SAMPLER* s, unsigned line, const unsigned* callers, unsigned depth) {
+  const unsigned head = s->head;
+  const unsigned next = (head + 1) % RING_SIZE;
+  if (next == (unsigned) s->tail) {
+    s->dropped++;
+    return;
+  }
+  if (depth > MAX_SAMPLE_DEPTH) {
+    // keep the innermost calls
+    callers += depth - MAX_SAMPLE_DEPTH;
+    depth = MAX_SAMPLE_DEPTH;
+  }
+  volatile SAMPLE* sample = s->ring + head;
+  sample->line = line;
+  sample->depth = depth;
+  for (unsigned i = 0; i < depth; i++)
+    sample->callers[i] = callers[i];
+  s->head = next;
+}
+
+bool sampler_filling(const SAMPLER* s) {
+  return ((unsigned) s->head - (unsigned) s->tail) % RING_SIZE >= RING_SIZE / 2;
+}
+
+static unsigned hash_stack(const SAMPLE* stack) {
+  unsigned h = stack->line * 2654435761U;
+  for (unsigned i = 0; i < stack->depth; i++)
+    h = (h ^ stack->callers[i]) * 2654435761U;
+  return h;
+}
+
+static bool same_stack(const SAMPLE* a, const SAMPLE* b) {
+  return a->line == b->line && a->depth == b->depth &&
+         memcmp(a->callers, b->callers, a->depth * sizeof a->callers[0]) == 0;
+}
+
+static STACK_TOTAL* find_total(STACK_TOTAL* totals, unsigned size, const SAMPLE* stack) {
+  unsigned i = hash_stack(stack) & (size - 1);
+  while (totals[i].count && !same_stack(&totals[i].stack, stack))
+    i = (i + 1) & (size - 1);
+  return totals + i;
+}
+
+static void grow_totals(SAMPLER* s) {
+  const unsigned size = s->size * 2;
+  STACK_TOTAL* totals = ecalloc(size, sizeof totals[0]);
+  for (unsigned i = 0; i < s->size; i++) {
+    if (s->totals[i].count)
+      *find_total(totals, size, &s->totals[i].stack) = s->totals[i];
+  }
+  efree(s->totals);
+  s->totals = totals;
+  s->size = size;
+}
+
+static void add_sample(SAMPLER* s, const SAMPLE* stack) {
+  if ((s->used + 1) * 4 > s->size * 3)
+    grow_totals(s);
+  STACK_TOTAL* t = find_total(s->totals, s->size, stack);
+  if (t->count == 0) {
+    t->stack = *stack;
+    s->used++;
+  }
+  t->count++;
+  s->samples++;
+}
+
+void sampler_collect(SAMPLER* s) {
+  assert(s != NULL);
+  const unsigned head = s->head;
+  unsigned tail = s->tail;
+  while (tail != head) {
+    const volatile SAMPLE* sample = s->ring + tail;
+    SAMPLE stack;
+    memset(&stack, 0, sizeof stack);
+    stack.line = sample->line;
+    stack.depth = sample->depth;
+    for (unsigned i = 0; i < stack.depth; i++)
+      stack.callers[i] = sample->callers[i];
+    add_sample(s, &stack);
+    tail = (tail + 1) % RING_SIZE;
+  }
+  s->tail = tail;
+}
+
+unsigned long sampler_samples(const SAMPLER* s) {
+  return s->samples;
+}
+
+unsigned long sampler_dropped(const SAMPLER* s) {
+  return s->dropped;
+}
+
+unsigned long sampler_line_samples(const SAMPLER* s, unsigned line) {
+  unsigned long n = 0;
+  for (unsigned i = 0; i < s->size; i++) {
+    if (s->totals[i].stack.line == line)
+      n += s->totals[i].count;
+  }
+  return n;
+}
+
+typedef struct {
+  unsigned line;
+  unsigned long count;
+} LINE_TOTAL;
+
+static int more_samples(const void* a, const void* b) {
+  const LINE_TOTAL* x = a;
+  const LINE_TOTAL* y = b;
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+void print_sample_histogram(const SAMPLER* s, const SOURCE* source, FILE* fp) {
+  assert(s != NULL && source != NULL && fp != NULL);
+  const unsigned lines = source_lines(source);
+  // one total per source line, and a last one for samples outside the program
+  LINE_TOTAL* hist = emalloc((lines + 1) * sizeof hist[0]);
+  for (unsigned i = 0; i <= lines; i++) {
+    hist[i].line = i;
+    hist[i].count = 0;
+  }
+  for (unsigned i = 0; i < s->size; i++) {
+    if (s->totals[i].count) {
+      const unsigned line = s->totals[i].stack.line;
+      hist[line < lines ? line : lines].count += s->totals[i].count;
+    }
+  }
+  qsort(hist, lines + 1, sizeof hist[0], more_samples);
+
+  fprintf(fp, "Samples: %lu", s->samples);
+  if (s->dropped)
+    fprintf(fp, ", %lu dropped", s->dropped);
+  fputs("\n   LINE      SAMPLES       %  SOURCE\n", fp);
+  for (unsigned i = 0; i <= lines && hist[i].count; i++) {
+    const double pc = 100.0 * hist[i].count / s->samples;
+    if (hist[i].line < lines)
+      fprintf(fp, "%7u %12lu %6.2f%%  %s\n", source_linenum(source, hist[i].line), hist[i].count, pc,
+              source_text(source, hist[i].line));
+    else
+      fprintf(fp, "%7s %12lu %6.2f%%  (outside the program)\n", "-", hist[i].count, pc);
+  }
+  efree(hist);
+}
+
+static void print_frame(const SOURCE* source, unsigned line, FILE* fp) {
+  if (line < source_lines(source))
+    fprintf(fp, ";%u", source_linenum(source, line));
+  else
+    fputs(";-", fp);
+}
+
+void print_sample_stacks(const SAMPLER* s, const SOURCE* source, FILE* fp) {
+  assert(s != NULL && source != NULL && fp != NULL);
+  for (unsigned i = 0; i < s->size; i++) {
+    const STACK_TOTAL* t = s->totals + i;
+    if (t->count == 0)
+      continue;
+    fputs("main", fp);
+    for (unsigned k = 0; k < t->stack.depth; k++)
+      print_frame(source, t->stack.callers[k], fp);
+    print_frame(source, t->stack.line, fp);
+    fprintf(fp, " %lu\n", t->count);
+  }
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_sampler(CuTest* tc) {
+  SAMPLER* s = new_sampler();
+  const unsigned callers[] = { 0, 2 };
+
+  for (unsigned i = 0; i < 3; i++)
+    sampler_record(s, 1, NULL, 0);
+  sampler_record(s, 3, callers, 1);
+  sampler_record(s, 3, callers, 2);
+  sampler_record(s, SAMPLE_NO_LINE, NULL, 0);
+  CuAssertTrue(tc, sampler_samples(s) == 0);
+  sampler_collect(s);
+  CuAssertTrue(tc, sampler_samples(s) == 6);
+  CuAssertTrue(tc, sampler_line_samples(s, 1) == 3);
+  CuAssertTrue(tc, sampler_line_samples(s, 3) == 2);
+  CuAssertTrue(tc, sampler_line_samples(s, 0) == 0);
+
+  // a full ring drops samples until collected
+  CuAssertIntEquals(tc, false, sampler_filling(s));
+  for (unsigned i = 0; i < RING_SIZE; i++)
+    sampler_record(s, i % 4, callers, 2);
+  CuAssertIntEquals(tc, true, sampler_filling(s));
+  CuAssertTrue(tc, sampler_dropped(s) == 1);
+  sampler_collect(s);
+  CuAssertTrue(tc, sampler_samples(s) == 6 + RING_SIZE - 1);
+
+  delete_sampler(s);
+  s = new_sampler();
+
+  SOURCE* source = load_source_string("10 GOSUB 100\n20 END\n100 LET A = A + 1\n110 RETURN\n", "test");
+  CuAssertPtrNotNull(tc, source);
+  const unsigned gosub[] = { 0 };
+  for (unsigned i = 0; i < 3; i++)
+    sampler_record(s, 2, gosub, 1);
+  sampler_record(s, 1, NULL, 0);
+  sampler_collect(s);
+
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  char buf[512];
+  print_sample_stacks(s, source, fp);
+  long len = ftell(fp);
+  rewind(fp);
+  size_t n = fread(buf, 1, (size_t) len, fp);
+  buf[n] = '\0';
+  CuAssertPtrNotNull(tc, strstr(buf, "main;10;100 3\n"));
+  CuAssertPtrNotNull(tc, strstr(buf, "main;20 1\n"));
+
+  rewind(fp);
+  print_sample_histogram(s, source, fp);
+  len = ftell(fp);
+  rewind(fp);
+  n = fread(buf, 1, (size_t) len, fp);
+  buf[n] = '\0';
+  CuAssertPtrNotNull(tc, strstr(buf, "Samples: 4\n"));
+  CuAssertPtrNotNull(tc, strstr(buf, "    100            3  75.00%  LET A = A + 1\n"));
+  CuAssertTrue(tc, strstr(buf, "    100 ") < strstr(buf, "     20 "));
+  fclose(fp);
+
+  delete_source(source);
+  delete_sampler(s);
+}
+
+CuSuite* sample_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_sampler);
+  return suite;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,43 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Statistical profile of a program: samples of the line being executed
+// and the GOSUB lines leading to it, taken at intervals by a timer signal.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "source.h"
+
+#define MAX_SAMPLE_DEPTH (8)
+#define SAMPLE_NO_LINE (~0U)
+
+typedef struct sampler SAMPLER;
+
+SAMPLER* new_sampler(void);
+void delete_sampler(SAMPLER*);
+
+// Record a sample: the source line being executed, or SAMPLE_NO_LINE if outside
+// the program, and the source lines of the GOSUBs active, outermost first.
+// Safe to call from a signal handler: it only stores into a ring buffer,
+// or counts the sample as dropped if the buffer is full.
+void sampler_record(SAMPLER*, unsigned line, const unsigned* callers, unsigned depth);
+
+// True if the ring buffer is filling, and should be collected.
+bool sampler_filling(const SAMPLER*);
+
+// Move samples from the ring buffer into the totals. Not to be called
+// from a signal handler, but safe to interrupt with sampler_record.
+void sampler_collect(SAMPLER*);
+
+unsigned long sampler_samples(const SAMPLER*);
+unsigned long sampler_dropped(const SAMPLER*);
+unsigned long sampler_line_samples(const SAMPLER*, unsigned line);
+
+// Report samples per line, the most sampled first.
+void print_sample_histogram(const SAMPLER*, const SOURCE*, FILE*);
+
+// Write the number of samples of each distinct stack in the collapsed stack
+// format of flame graph tools: "main;20;110 42" for line 110 in a subroutine
+// called from line 20.
+void print_sample_stacks(const SAMPLER*, const SOURCE*, FILE*);
@@ -8,26 +8,80 @@
 #include <stdarg.h>
 #include <assert.h>
 #include "source.h"
+#include "token.h"
 #include "utils.h"
 
 SOURCE* new_source(const char* name) {
-  SOURCE* p = ecalloc(1, sizeof (SOURCE));
-  p->name = name ? estrdup(name) : NULL;
+  SOURCE* p = ecalloc_in(MEM_SOURCE, 1, sizeof (SOURCE));
+  p->name = name ? estrdup_in(MEM_SOURCE, name) : NULL;
+  return p;
+}
+
+// The entry of the line at a given index, skipping the gap.
+static inline struct source_line * line_at(const SOURCE* src, unsigned i) {
+  return src->lines + (i < src->gap ? i : i + (src->allocated - src->used));
+}
+
+static bool in_text_buffer(const SOURCE* src, const char* text) {
+  return src->text != NULL && text >= src->text && text < src->text + src->text_size;
+}
+
+// Free the text of a line, or if it lies in the source's text buffer, count it unused.
+static void free_text(SOURCE* src, char* text) {
+  if (in_text_buffer(src, text))
+    src->slack += strlen(text) + 1;
+  else
+    efree(text);
+}
+
+// Copy the lines into one text buffer.
+SOURCE* copy_source(const SOURCE* src) {
+  assert(src != NULL);
+  SOURCE* p = new_source(src->name);
+  p->lines = emalloc_in(MEM_SOURCE, (src->used ? src->used : 1) * sizeof p->lines[0]);
+  p->allocated = src->used ? src->used : 1;
+  size_t size = 0;
+  for (unsigned i = 0; i < src->used; i++)
+    size += strlen(line_at(src, i)->text) + 1;
+  if (size) {
+    p->text = emalloc_in(MEM_SOURCE, size);
+    p->text_size = size;
+  }
+  char* text = p->text;
+  for (unsigned i = 0; i < src->used; i++) {
+    const struct source_line * sl = line_at(src, i);
+    const size_t len = strlen(sl->text);
+    memcpy(text, sl->text, len + 1);
+    p->lines[i].num = sl->num;
+    p->lines[i].id = sl->id;
+    p->lines[i].text = text;
+    p->lines[i].tokenized = sl->tokenized;
+    text += len + 1;
+  }
+  p->used = src->used;
+  p->gap = src->used;
+  p->token_mode = src->token_mode;
+  p->next_id = src->next_id;
   return p;
 }
 
 void clear_source(SOURCE* src) {
   assert(src != NULL);
   for (unsigned i = 0; i < src->used; i++)
-    efree(src->lines[i].text);
+    free_text(src, line_at(src, i)->text);
+  efree(src->text);
+  src->text = NULL;
+  src->text_size = 0;
+  src->slack = 0;
   src->used = 0;
+  src->gap = 0;
 }
 
 void delete_source(SOURCE* src) {
   if (src) {
+    clear_source(src);
+    efree(src->spelling);
     efree(src->name);
-    for (unsigned i = 0; i < src->used; i++)
-      efree(src->lines[i].text);
     efree(src->lines);
     efree(src);
   }
@@ -52,19 +106,35 @@ const char* source_text(const SOURCE* src, unsigned line) {
   assert(src != NULL);
   assert(line < src->used);
   check_line(src, line);
-  return src->lines[line].text;
+  const struct source_line * sl = line_at(src, line);
+  if (!sl->tokenized)
+    return sl->text;
+  // the spelling buffer is scratch space, not part of the source's value
+  SOURCE* scratch = (SOURCE*) src;
+  const size_t size = spelled_length(sl->text) + 1;
+  if (size > scratch->spelling_size) {
+    scratch->spelling = erealloc_in(MEM_SOURCE, scratch->spelling, size);
+    scratch->spelling_size = size;
+  }
+  spell_keywords(sl->text, scratch->spelling);
+  return scratch->spelling;
 }
 
 unsigned source_linenum(const SOURCE* src, unsigned line) {
   assert(src != NULL);
   check_line(src, line);
-  return src->lines[line].num;
+  return line_at(src, line)->num;
+}
+
+unsigned source_line_id(const SOURCE* src, unsigned line) {
+  check_line(src, line);
+  return line_at(src, line)->id;
 }
 
 void set_source_linenum(SOURCE* src, unsigned line, unsigned basic_lineno) {
   assert(src != NULL);
   check_line(src, line);
-  src->lines[line].num = basic_lineno;
+  line_at(src, line)->num = basic_lineno;
 }
 
 void print_source_line(const SOURCE* source, unsigned line, FILE* fp) {
@@ -75,115 +145,197 @@ void print_source_line(const SOURCE* source, unsigned line, FILE* fp) {
 static void source_error(const SOURCE* src, const char* fmt, ...) {
   assert(src != NULL);
   if (src->name)
-    fprintf(stderr, "%s(%u): ", src->name, src->used + 1);
+    fprintf(diagnostics(), "%s(%u): ", src->name, src->used + 1);
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
+  vfprintf(diagnostics(), fmt, ap);
   va_end(ap);
-  exit(EXIT_FAILURE);
 }
 
+// When the buffer is full the gap is empty, so the new space becomes the gap at the end.
 static void ensure_space(SOURCE* src) {
   assert(src->used <= src->allocated);
   if (src->used == src->allocated) {
     src->allocated = src->allocated ? 2 * src->allocated : 128;
-    src->lines = erealloc(src->lines, src->allocated * sizeof src->lines[0]);
+    src->lines = erealloc_in(MEM_SOURCE, src->lines, src->allocated * sizeof src->lines[0]);
+    src->gap = src->used;
   }
 }
 
-static void append(SOURCE* src, unsigned num, const char* text) {
+// Move the gap to a line index, moving only the lines between.
+static void move_gap(SOURCE* src, unsigned pos) {
+  assert(pos <= src->used);
+  const unsigned gap_len = src->allocated - src->used;
+  if (pos < src->gap)
+    memmove(src->lines + pos + gap_len, src->lines + pos, (src->gap - pos) * sizeof src->lines[0]);
+  else if (pos > src->gap)
+    memmove(src->lines + src->gap, src->lines + src->gap + gap_len, (pos - src->gap) * sizeof src->lines[0]);
+  src->gap = pos;
+}
+
+// Open an entry for a new line at an index.
+static struct source_line * insert_at(SOURCE* src, unsigned pos) {
+  ensure_space(src);
+  assert(src->used < src->allocated);
+  move_gap(src, pos);
+  src->gap++;
+  src->used++;
+  return src->lines + pos;
+}
+
+// Append a line whose text is owned by the source or lies in its text buffer.
+static bool append_text(SOURCE* src, unsigned num, char* text) {
   assert(src != NULL);
   assert(text != NULL);
-  if (num == 0)
+  if (num == 0) {
     source_error(src, "invalid line number: %u\n", num);
-  unsigned latest = src->used ? src->lines[src->used - 1].num : 0;
-  if (num <= latest)
+    return false;
+  }
+  unsigned latest = src->used ? line_at(src, src->used - 1)->num : 0;
+  if (num <= latest) {
     source_error(src, "line number is not in increasing order: %u\n", num);
-  ensure_space(src);
-  assert(src->used < src->allocated);
-  src->lines[src->used].num = num;
-  src->lines[src->used].text = estrdup(text);
-  src->used++;
+    return false;
+  }
+  struct source_line * sl = insert_at(src, src->used);
+  sl->num = num;
+  sl->id = src->next_id++;
+  sl->text = text;
+  sl->tokenized = false;
+  return true;
+}
+
+static bool append(SOURCE* src, unsigned num, const char* text) {
+  char* copy = estrdup_in(MEM_SOURCE, text);
+  if (!append_text(src, num, copy)) {
+    efree(copy);
+    return false;
+  }
+  return true;
 }
 
-static const char* parse_line_number(SOURCE* src, const char* line, unsigned *num) {
+static char* parse_line_number(SOURCE* src, char* line, unsigned *num) {
   assert(line != NULL);
   assert(num != NULL);
   *num = 0;
-  const char* s = line;
+  char* s = line;
   for (; isdigit(*s); s++)
     *num = *num * 10 + *s - '0';
-  if (s == line)
+  if (s == line) {
     source_error(src, "line has no line number\n");
+    return NULL;
+  }
   // treat one space as pure delimiter but preserve any other indenting
   if (*s == ' ')
     s++;
   return s;
 }
 
-static void spread(SOURCE* src, unsigned pos) {
-  assert(src != NULL);
-  assert(pos < src->used);
-  ensure_space(src);
-  assert(src->used < src->allocated);
-  src->used++;
-  for (unsigned i = src->used - 1; i > pos; i--)
-    src->lines[i] = src->lines[i-1];
-  src->lines[pos].num = 0;
-  src->lines[pos].text = NULL;
-}
-
 void enter_source_line(SOURCE* src, unsigned num, const char* text) {
   assert(text != NULL);
-  for (unsigned i = 0; i < src->used; i++) {
-    if (src->lines[i].num == num) {
-      efree(src->lines[i].text);
-      src->lines[i].text = estrdup(text);
-      return;
-    }
-    if (src->lines[i].num > num) {
-      spread(src, i);
-      src->lines[i].num = num;
-      src->lines[i].text = estrdup(text);
-      return;
-    }
+  const unsigned pos = find_source_position(src, num);
+  if (pos == src->used) {
+    append(src, num, text);
+    return;
   }
-  append(src, num, text);
+  struct source_line * sl = line_at(src, pos);
+  if (sl->num == num) {
+    free_text(src, sl->text);
+    sl->id = src->next_id++;
+    sl->text = estrdup_in(MEM_SOURCE, text);
+    sl->tokenized = false;
+    return;
+  }
+  sl = insert_at(src, pos);
+  sl->num = num;
+  sl->id = src->next_id++;
+  sl->text = estrdup_in(MEM_SOURCE, text);
+  sl->tokenized = false;
 }
 
 void delete_source_line(SOURCE* src, unsigned line) {
   assert(src != NULL);
   if (line < src->used) {
-    efree(src->lines[line].text);
+    // the line follows the gap, which takes it in
+    move_gap(src, line);
+    free_text(src, line_at(src, line)->text);
     src->used--;
-    for (unsigned i = line; i < src->used; i++)
-      src->lines[i] = src->lines[i+1];
   }
 }
 
+// Split the next line from a text buffer in place, dropping its newline
+// and any carriage return before it, and advance past it.
+static char* split_line(char** pos) {
+  char* line = *pos;
+  char* end = strchr(line, '\n');
+  if (end)
+    *pos = end + 1;
+  else
+    *pos = end = line + strlen(line);
+  if (end > line && end[-1] == '\r')
+    end--;
+  *end = '\0';
+  return line;
+}
+
+// Divide the source's text buffer into lines, or report errors and return false.
+// Line numbers and line ends are left unused.
+static bool load_text(SOURCE* src) {
+  assert(src->used == 0);
+  unsigned lines = 1;
+  for (const char* p = src->text; (p = strchr(p, '\n')) != NULL; p++)
+    lines++;
+  src->lines = erealloc_in(MEM_SOURCE, src->lines, lines * sizeof src->lines[0]);
+  src->allocated = lines;
+  size_t used = 0;
+  char* pos = src->text;
+  while (*pos) {
+    char* line = split_line(&pos);
+    if (*line == '\0') {
+      source_error(src, "source line is empty\n");
+      return false;
+    }
+    unsigned num;
+    char* text = parse_line_number(src, line, &num);
+    if (text == NULL || !append_text(src, num, text))
+      return false;
+    used += strlen(text) + 1;
+  }
+  src->slack = src->text_size - used;
+  return true;
+}
+
+// Load a source file, read whole into one buffer, or report errors and return NULL.
 SOURCE* load_source_file(const char* name) {
-  FILE* fp = fopen(name, "r");
+  FILE* fp = fopen(name, "rb");
   if (fp == NULL) {
-    fprintf(stderr, "Cannot open source file: %s\n", name);
+    fprintf(diagnostics(), "Cannot open source file: %s\n", name);
     return NULL;
   }
   SOURCE* src = new_source(name);
-  char buf[256];
-  while (fgets(buf, sizeof buf, fp)) {
-    size_t len = strlen(buf);
-    if (len > 0) {
-      if (buf[len-1] != '\n')
-        source_error(src, "source line is too long");
-      len--;
-      buf[len] = '\0';
+  size_t size = 0;
+  size_t allocated = 4096;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    // room for the file, a terminator, and a byte to find the end without growing
+    const long len = ftell(fp);
+    if (len > 0)
+      allocated = (size_t) len + 2;
+    rewind(fp);
+  }
+  src->text = emalloc_in(MEM_SOURCE, allocated);
+  size_t n;
+  while ((n = fread(src->text + size, 1, allocated - 1 - size, fp)) > 0) {
+    size += n;
+    if (size == allocated - 1) {
+      allocated *= 2;
+      src->text = erealloc(src->text, allocated);
     }
-    if (len == 0)
-      source_error(src, "source line is empty");
-    unsigned num;
-    const char* text = parse_line_number(src, buf, &num);
-    if (text == NULL)
-      exit(EXIT_FAILURE);
-    append(src, num, text);
+  }
+  fclose(fp);
+  src->text[size] = '\0';
+  src->text_size = size + 1;
+  if (!load_text(src)) {
+    delete_source(src);
+    return NULL;
   }
   return src;
 }
@@ -191,59 +343,29 @@ SOURCE* load_source_file(const char* name) {
 bool save_source_file(const SOURCE* src, const char* name) {
   FILE* fp = fopen(name, "w");
   if (fp == NULL) {
-    fprintf(stderr, "cannot create file: %s", name);
+    fprintf(diagnostics(), "cannot create file: %s", name);
     return false;
   }
   for (unsigned i = 0; i < src->used; i++)
-    fprintf(fp, "%u %s\n", src->lines[i].num, src->lines[i].text);
+    fprintf(fp, "%u %s\n", line_at(src, i)->num, source_text(src, i));
   fclose(fp);
   return true;
 }
 
-static unsigned line_length(const char* s) {
-  assert(s != NULL);
-
-  unsigned i;
-
-  for (i = 0; s[i] && s[i] != '\n'; i++)
-    ;
-
-  return i;
-}
-
-static unsigned get_line(SOURCE* src, const char* string, char* buf, unsigned bufsz) {
-  unsigned len = line_length(string);
-  if (len == 0)
-    source_error(src, "source line is empty");
-  if (len + 1 > bufsz)
-    source_error(src, "source line is too long");
-  strncpy(buf, string, len);
-  buf[len] = '\0';
-  return len;
-}
-
+// Load source from lines of text, or report errors and return NULL.
 SOURCE* load_source_string(const char* string, const char* name) {
   assert(string != NULL);
   assert(name != NULL);
 
   SOURCE* src = new_source(name);
-
-  for (;;) {
-    char buf[256];
-    unsigned len = get_line(src, string, buf, sizeof buf);
-
-    unsigned num;
-    const char* text = parse_line_number(src, buf, &num);
-    if (text == NULL)
-      exit(EXIT_FAILURE);
-    append(src, num, text);
-
-    if (string[len] == '\0' || string[len+1] == '\0')
-      break;
-
-    string += len + 1;
+  src->text = estrdup_in(MEM_SOURCE, string);
+  src->text_size = strlen(string) + 1;
+  if (*string == '\0')
+    source_error(src, "source line is empty\n");
+  if (*string == '\0' || !load_text(src)) {
+    delete_source(src);
+    return NULL;
   }
-
   return src;
 }
 
@@ -252,22 +374,37 @@ SOURCE* wrap_source_text(const char* text) {
 
   SOURCE* src = new_source(NULL);
 
-  src->lines = emalloc(sizeof src->lines[0]);
+  src->lines = emalloc_in(MEM_SOURCE, sizeof src->lines[0]);
   src->lines[0].num = 0;
-  src->lines[0].text = estrdup(text);
+  src->lines[0].id = src->next_id++;
+  src->lines[0].text = estrdup_in(MEM_SOURCE, text);
+  src->lines[0].tokenized = false;
   src->allocated = 1;
   src->used = 1;
+  src->gap = 1;
 
   return src;
 }
 
-bool find_source_linenum(const SOURCE* source, unsigned num, unsigned *index) {
+unsigned find_source_position(const SOURCE* source, unsigned num) {
   assert(source != NULL);
-  for (unsigned i = 0; i < source->used; i++) {
-    if (source->lines[i].num == num) {
-      *index = i;
-      return true;
-    }
+  unsigned lo = 0;
+  unsigned hi = source->used;
+  while (lo < hi) {
+    const unsigned mid = lo + (hi - lo) / 2;
+    if (line_at(source, mid)->num < num)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool find_source_linenum(const SOURCE* source, unsigned num, unsigned *index) {
+  const unsigned i = find_source_position(source, num);
+  if (i < source->used && line_at(source, i)->num == num) {
+    *index = i;
+    return true;
   }
   return false;
 }
@@ -275,17 +412,18 @@ bool find_source_linenum(const SOURCE* source, unsigned num, unsigned *index) {
 bool source_replace(SOURCE* source, unsigned line, unsigned pos, const char* from, const char* to) {
   assert(source != NULL && from != NULL && to != NULL);
   if (line < source->used) {
-    struct source_line * sl = source->lines + line;
+    struct source_line * sl = line_at(source, line);
     if (sl->text) {
       unsigned line_len = strlen(sl->text);
       unsigned from_len = strlen(from);
       unsigned to_len = strlen(to);
       if (pos <= line_len && line_len - pos >= from_len && strncmp(sl->text + pos, from, from_len) == 0) {
-        char* text = emalloc(line_len - from_len + to_len + 1);
+        char* text = emalloc_in(MEM_SOURCE, line_len - from_len + to_len + 1);
         strncpy(text, sl->text, pos);
         strncpy(text + pos, to, to_len);
         strcpy(text + pos + to_len, sl->text + pos + from_len);
-        efree(sl->text);
+        free_text(source, sl->text);
+        sl->id = source->next_id++;
         sl->text = text;
         return true;
       }
@@ -294,6 +432,72 @@ bool source_replace(SOURCE* source, unsigned line, unsigned pos, const char* fro
   return false;
 }
 
+const char* source_tokens(const SOURCE* src, unsigned line) {
+  check_line(src, line);
+  const struct source_line * sl = line_at(src, line);
+  return sl->tokenized ? sl->text : NULL;
+}
+
+// The tokenized text is no longer than the text it replaces,
+// so a line in the text buffer is overwritten, leaving the rest unused.
+void set_source_tokens(SOURCE* src, unsigned line, const char* tokens) {
+  check_line(src, line);
+  assert(tokens != NULL);
+  struct source_line * sl = line_at(src, line);
+  const size_t len = strlen(tokens);
+  const size_t old_len = strlen(sl->text);
+  assert(len <= old_len);
+  if (len < old_len && !in_text_buffer(src, sl->text)) {
+    efree(sl->text);
+    sl->text = estrdup_in(MEM_SOURCE, tokens);
+  }
+  else {
+    memcpy(sl->text, tokens, len + 1);
+    if (in_text_buffer(src, sl->text))
+      src->slack += old_len - len;
+  }
+  sl->tokenized = true;
+}
+
+void set_source_token_mode(SOURCE* src, int mode) {
+  assert(src != NULL);
+  if (mode != src->token_mode) {
+    for (unsigned i = 0; i < src->used; i++) {
+      struct source_line * sl = line_at(src, i);
+      if (sl->tokenized) {
+        char* text = emalloc_in(MEM_SOURCE, spelled_length(sl->text) + 1);
+        spell_keywords(sl->text, text);
+        free_text(src, sl->text);
+        sl->text = text;
+        sl->tokenized = false;
+      }
+    }
+    src->token_mode = mode;
+  }
+}
+
+void compact_source(SOURCE* src) {
+  assert(src != NULL);
+  if (src->slack == 0)
+    return;
+  size_t size = 0;
+  for (unsigned i = 0; i < src->used; i++)
+    size += strlen(line_at(src, i)->text) + 1;
+  char* text = size ? emalloc_in(MEM_SOURCE, size) : NULL;
+  char* p = text;
+  for (unsigned i = 0; i < src->used; i++) {
+    struct source_line * sl = line_at(src, i);
+    const size_t len = strlen(sl->text);
+    memcpy(p, sl->text, len + 1);
+    free_text(src, sl->text);
+    sl->text = p;
+    p += len + 1;
+  }
+  efree(src->text);
+  src->text = text;
+  src->text_size = size;
+  src->slack = 0;
+}
 
 #ifdef UNIT_TEST
 
@@ -326,10 +530,12 @@ static void test_clear(CuTest* tc) {
   p->lines[1].num = 110;
   p->lines[1].text = estrdup("hello again");
   p->used = 2;
+  p->gap = 2;
   CuAssertStrEquals(tc, NULL, source_name(p));
   CuAssertIntEquals(tc, 2, source_lines(p));
   clear_source(p);
   CuAssertIntEquals(tc, 0, p->used);
+  CuAssertIntEquals(tc, 0, p->gap);
   CuAssertIntEquals(tc, 4, p->allocated);
   efree(p->lines);
   efree(p);
@@ -347,6 +553,7 @@ static void test_ensure_space(CuTest* tc) {
   ensure_space(p);
   CuAssertPtrNotNull(tc, p->lines);
   CuAssertIntEquals(tc, 256, p->allocated);
+  CuAssertIntEquals(tc, 128, p->gap);
   CuAssertIntEquals(tc, 10, p->lines[127].num);
   p->lines[255].num = 20;
 
@@ -406,28 +613,80 @@ static void test_parse_line_number(CuTest* tc) {
   delete_source(p);
 }
 
-static void test_spread(CuTest* tc) {
+static void test_gap(CuTest* tc) {
   SOURCE* p = new_source(NULL);
 
   append(p, 100, "PRINT");
-  spread(p, 0);
-  CuAssertIntEquals(tc, 2, p->used);
-  CuAssertIntEquals(tc, 0, p->lines[0].num);
-  CuAssertPtrEquals(tc, NULL, p->lines[0].text);
-  CuAssertIntEquals(tc, 100, p->lines[1].num);
-  CuAssertStrEquals(tc, "PRINT", p->lines[1].text);
+  append(p, 300, "END");
+  CuAssertIntEquals(tc, 2, p->gap);
 
-  p->lines[0].num = 50;
-  p->lines[0].text = estrdup("REM TEST");
-  spread(p, 1);
+  // entering a line before others moves only the lines between
+  enter_source_line(p, 200, "REM");
   CuAssertIntEquals(tc, 3, p->used);
+  CuAssertIntEquals(tc, 2, p->gap);
+  CuAssertIntEquals(tc, 100, p->lines[0].num);
+  CuAssertIntEquals(tc, 200, p->lines[1].num);
+  CuAssertIntEquals(tc, 300, p->lines[p->allocated - 1].num);
+  CuAssertStrEquals(tc, "END", p->lines[p->allocated - 1].text);
+
+  enter_source_line(p, 50, "CLS");
+  CuAssertIntEquals(tc, 1, p->gap);
   CuAssertIntEquals(tc, 50, p->lines[0].num);
-  CuAssertStrEquals(tc, "REM TEST", p->lines[0].text);
-  CuAssertIntEquals(tc, 0, p->lines[1].num);
-  CuAssertPtrEquals(tc, NULL, p->lines[1].text);
-  CuAssertIntEquals(tc, 100, p->lines[2].num);
-  CuAssertStrEquals(tc, "PRINT", p->lines[2].text);
+  CuAssertIntEquals(tc, 100, p->lines[p->allocated - 3].num);
+  CuAssertIntEquals(tc, 200, p->lines[p->allocated - 2].num);
+
+  delete_source_line(p, 2);
+  CuAssertIntEquals(tc, 3, p->used);
+  CuAssertIntEquals(tc, 2, p->gap);
+
+  static const unsigned NUMS[] = { 50, 100, 300 };
+  static const char* const TEXTS[] = { "CLS", "PRINT", "END" };
+  for (unsigned i = 0; i < 3; i++) {
+    CuAssertIntEquals(tc, NUMS[i], source_linenum(p, i));
+    CuAssertStrEquals(tc, TEXTS[i], source_text(p, i));
+  }
+  CuAssertIntEquals(tc, 0, find_source_position(p, 10));
+  CuAssertIntEquals(tc, 1, find_source_position(p, 51));
+  CuAssertIntEquals(tc, 2, find_source_position(p, 300));
+  CuAssertIntEquals(tc, 3, find_source_position(p, 301));
+
+  // the copy has its gap at the end
+  SOURCE* q = copy_source(p);
+  CuAssertIntEquals(tc, 3, q->gap);
+  for (unsigned i = 0; i < 3; i++) {
+    CuAssertIntEquals(tc, NUMS[i], q->lines[i].num);
+    CuAssertStrEquals(tc, TEXTS[i], q->lines[i].text);
+  }
+  delete_source(q);
+
+  delete_source(p);
+}
 
+static void test_enter_random(CuTest* tc) {
+  SOURCE* p = new_source(NULL);
+  // 1000 lines numbered by 10s, entered in a scattered order
+  for (unsigned i = 0; i < 1000; i++) {
+    char text[16];
+    const unsigned k = (i * 337) % 1000;
+    sprintf(text, "REM %u", k);
+    enter_source_line(p, 10 * (k + 1), text);
+  }
+  CuAssertIntEquals(tc, 1000, source_lines(p));
+  for (unsigned i = 0; i < 1000; i++) {
+    char text[16];
+    sprintf(text, "REM %u", i);
+    CuAssertIntEquals(tc, 10 * (i + 1), source_linenum(p, i));
+    CuAssertStrEquals(tc, text, source_text(p, i));
+    unsigned index;
+    CuAssertIntEquals(tc, true, find_source_linenum(p, 10 * (i + 1), &index));
+    CuAssertIntEquals(tc, i, index);
+    CuAssertIntEquals(tc, false, find_source_linenum(p, 10 * (i + 1) + 5, &index));
+  }
+  for (unsigned i = 0; i < 500; i++)
+    delete_source_line(p, (i * 37) % source_lines(p));
+  CuAssertIntEquals(tc, 500, source_lines(p));
+  for (unsigned i = 1; i < 500; i++)
+    CuAssertTrue(tc, source_linenum(p, i - 1) < source_linenum(p, i));
   delete_source(p);
 }
 
@@ -436,27 +695,27 @@ static void test_enter_find_delete(CuTest* tc) {
 
   enter_source_line(p, 100, "PRINT");
   CuAssertIntEquals(tc, 1, p->used);
-  CuAssertIntEquals(tc, 100, p->lines[0].num);
-  CuAssertStrEquals(tc, "PRINT", p->lines[0].text);
+  CuAssertIntEquals(tc, 100, line_at(p, 0)->num);
+  CuAssertStrEquals(tc, "PRINT", line_at(p, 0)->text);
 
   enter_source_line(p, 200, "NEXT");
   CuAssertIntEquals(tc, 2, p->used);
-  CuAssertIntEquals(tc, 200, p->lines[1].num);
-  CuAssertStrEquals(tc, "NEXT", p->lines[1].text);
+  CuAssertIntEquals(tc, 200, line_at(p, 1)->num);
+  CuAssertStrEquals(tc, "NEXT", line_at(p, 1)->text);
 
   enter_source_line(p, 150, "FOR");
   CuAssertIntEquals(tc, 3, p->used);
-  CuAssertIntEquals(tc, 150, p->lines[1].num);
-  CuAssertStrEquals(tc, "FOR", p->lines[1].text);
-  CuAssertIntEquals(tc, 200, p->lines[2].num);
-  CuAssertStrEquals(tc, "NEXT", p->lines[2].text);
+  CuAssertIntEquals(tc, 150, line_at(p, 1)->num);
+  CuAssertStrEquals(tc, "FOR", line_at(p, 1)->text);
+  CuAssertIntEquals(tc, 200, line_at(p, 2)->num);
+  CuAssertStrEquals(tc, "NEXT", line_at(p, 2)->text);
 
   enter_source_line(p, 200, "GOSUB 2000");
   CuAssertIntEquals(tc, 3, p->used);
-  CuAssertIntEquals(tc, 150, p->lines[1].num);
-  CuAssertStrEquals(tc, "FOR", p->lines[1].text);
-  CuAssertIntEquals(tc, 200, p->lines[2].num);
-  CuAssertStrEquals(tc, "GOSUB 2000", p->lines[2].text);
+  CuAssertIntEquals(tc, 150, line_at(p, 1)->num);
+  CuAssertStrEquals(tc, "FOR", line_at(p, 1)->text);
+  CuAssertIntEquals(tc, 200, line_at(p, 2)->num);
+  CuAssertStrEquals(tc, "GOSUB 2000", line_at(p, 2)->text);
 
   unsigned i;
   CuAssertIntEquals(tc, false, find_source_linenum(p, 10, &i));
@@ -474,12 +733,12 @@ static void test_enter_find_delete(CuTest* tc) {
 
   delete_source_line(p, 1);
   CuAssertIntEquals(tc, 2, p->used);
-  CuAssertIntEquals(tc, 100, p->lines[0].num);
-  CuAssertIntEquals(tc, 200, p->lines[1].num);
+  CuAssertIntEquals(tc, 100, line_at(p, 0)->num);
+  CuAssertIntEquals(tc, 200, line_at(p, 1)->num);
 
   delete_source_line(p, 1);
   CuAssertIntEquals(tc, 1, p->used);
-  CuAssertIntEquals(tc, 100, p->lines[0].num);
+  CuAssertIntEquals(tc, 100, line_at(p, 0)->num);
 
   delete_source_line(p, 0);
   CuAssertIntEquals(tc, 0, p->used);
@@ -488,26 +747,16 @@ static void test_enter_find_delete(CuTest* tc) {
   efree(p);
 }
 
-static void test_line_length(CuTest* tc) {
-  CuAssertIntEquals(tc, 0, line_length(""));
-  CuAssertIntEquals(tc, 5, line_length("HELLO"));
-  CuAssertIntEquals(tc, 3, line_length("the\nman\n"));
-}
-
-static void test_get_line(CuTest* tc) {
-  SOURCE source;
-  char buf[16];
-  unsigned len;
-
-  memset(&source, 0, sizeof source);
-
-  len = get_line(&source, "null", buf, sizeof buf);
-  CuAssertIntEquals(tc, 4, len);
-  CuAssertStrEquals(tc, "null", buf);
-
-  len = get_line(&source, "newline\nnext\n", buf, sizeof buf);
-  CuAssertIntEquals(tc, 7, len);
-  CuAssertStrEquals(tc, "newline", buf);
+static void test_split_line(CuTest* tc) {
+  char text[] = "HELLO\nthe\r\nman\n\nend";
+  char* pos = text;
+  CuAssertStrEquals(tc, "HELLO", split_line(&pos));
+  CuAssertStrEquals(tc, "the", split_line(&pos));
+  CuAssertStrEquals(tc, "man", split_line(&pos));
+  CuAssertStrEquals(tc, "", split_line(&pos));
+  CuAssertStrEquals(tc, "end", split_line(&pos));
+  CuAssertIntEquals(tc, '\0', *pos);
+  CuAssertStrEquals(tc, "", split_line(&pos));
 }
 
 static void test_load_string(CuTest* tc) {
@@ -532,6 +781,84 @@ static void test_load_string(CuTest* tc) {
   delete_source(src);
 }
 
+static void test_load_long_lines(CuTest* tc) {
+  char code[1200];
+  strcpy(code, "10 REM ");
+  memset(code + 7, 'X', 1000);
+  strcpy(code + 1007, "\r\n20 PRINT\r\n30 END");
+
+  SOURCE* src = load_source_string(code, "long");
+  CuAssertPtrNotNull(tc, src);
+  CuAssertIntEquals(tc, 3, source_lines(src));
+  CuAssertIntEquals(tc, 1004, strlen(source_text(src, 0)));
+  CuAssertStrEquals(tc, "PRINT", source_text(src, 1));
+  CuAssertStrEquals(tc, "END", source_text(src, 2));
+  // lines are views into the loaded text until edited
+  CuAssertTrue(tc, source_text(src, 1) > src->text && source_text(src, 1) < src->text + src->text_size);
+  enter_source_line(src, 20, "PRINT 1");
+  enter_source_line(src, 25, "STOP");
+  CuAssertStrEquals(tc, "PRINT 1", source_text(src, 1));
+  CuAssertStrEquals(tc, "STOP", source_text(src, 2));
+  CuAssertTrue(tc, source_replace(src, 3, 0, "END", "REM"));
+  CuAssertStrEquals(tc, "REM", source_text(src, 3));
+
+  SOURCE* copy = copy_source(src);
+  CuAssertIntEquals(tc, 1005 + 8 + 5 + 4, copy->text_size);
+  for (unsigned i = 0; i < source_lines(src); i++) {
+    CuAssertIntEquals(tc, source_linenum(src, i), source_linenum(copy, i));
+    CuAssertStrEquals(tc, source_text(src, i), source_text(copy, i));
+  }
+  delete_source(copy);
+  delete_source(src);
+
+  CuAssertPtrEquals(tc, NULL, load_source_string("10 PRINT\n\n20 END\n", "empty"));
+  CuAssertPtrEquals(tc, NULL, load_source_string("", "empty"));
+}
+
+static void test_tokens(CuTest* tc) {
+  static const char CODE[] = "10 PRINT \"A\"\r\n20 GOTO 10\r\n30 print\r\n";
+  SOURCE* src = load_source_string(CODE, "tokens");
+  CuAssertPtrNotNull(tc, src);
+  CuAssertIntEquals(tc, sizeof CODE - (10 + 8 + 6), src->slack);
+  CuAssertPtrEquals(tc, NULL, (void*) source_tokens(src, 0));
+
+  const char print[] = { keyword_byte(TOK_PRINT), ' ', '"', 'A', '"', '\0' };
+  const char go_to[] = { keyword_byte(TOK_GOTO), ' ', '1', '0', '\0' };
+  set_source_tokens(src, 0, print);
+  set_source_tokens(src, 1, go_to);
+  set_source_tokens(src, 2, "print");
+  CuAssertStrEquals(tc, print, source_tokens(src, 0));
+  CuAssertStrEquals(tc, "PRINT \"A\"", source_text(src, 0));
+  CuAssertStrEquals(tc, "GOTO 10", source_text(src, 1));
+  CuAssertStrEquals(tc, "print", source_text(src, 2));
+
+  // renumbering patches the tokenized text
+  const unsigned id = source_line_id(src, 1);
+  CuAssertTrue(tc, source_replace(src, 1, 2, "10", "100"));
+  CuAssertTrue(tc, source_line_id(src, 1) != id);
+  CuAssertPtrNotNull(tc, source_tokens(src, 1));
+  CuAssertStrEquals(tc, "GOTO 100", source_text(src, 1));
+
+  // the tokenized lines are moved into a buffer of their own size
+  compact_source(src);
+  CuAssertIntEquals(tc, 0, src->slack);
+  CuAssertIntEquals(tc, sizeof print + sizeof go_to + 1 + sizeof "print", src->text_size);
+  CuAssertStrEquals(tc, "PRINT \"A\"", source_text(src, 0));
+  CuAssertStrEquals(tc, "GOTO 100", source_text(src, 1));
+
+  SOURCE* copy = copy_source(src);
+  CuAssertStrEquals(tc, print, source_tokens(copy, 0));
+  CuAssertStrEquals(tc, "GOTO 100", source_text(copy, 1));
+  delete_source(copy);
+
+  // lines tokenized in one mode are spelled out for another
+  set_source_token_mode(src, 1);
+  CuAssertPtrEquals(tc, NULL, (void*) source_tokens(src, 0));
+  CuAssertStrEquals(tc, "PRINT \"A\"", source_text(src, 0));
+  CuAssertStrEquals(tc, "GOTO 100", source_text(src, 1));
+  delete_source(src);
+}
+
 static void test_wrap(CuTest* tc) {
   SOURCE* p = wrap_source_text("immediate mode");
   CuAssertPtrNotNull(tc, p);
@@ -552,6 +879,14 @@ static void test_source_replace(CuTest* tc) {
   source.lines = NULL;
   source.allocated = 0;
   source.used = 0;
+  source.gap = 0;
+  source.text = NULL;
+  source.text_size = 0;
+  source.slack = 0;
+  source.token_mode = 0;
+  source.next_id = 0;
+  source.spelling = NULL;
+  source.spelling_size = 0;
   succ = source_replace(&source, 0, 0, "", "");
   CuAssertIntEquals(tc, false, succ);
 
@@ -559,6 +894,7 @@ static void test_source_replace(CuTest* tc) {
   source.lines = ecalloc(1, sizeof source.lines[0]);
   source.allocated = 1;
   source.used = 1;
+  source.gap = 1;
   succ = source_replace(&source, 1, 0, "", "");
   CuAssertIntEquals(tc, false, succ);
 
@@ -632,11 +968,13 @@ CuSuite* source_test_suite(void) {
   SUITE_ADD_TEST(suite, test_ensure_space);
   SUITE_ADD_TEST(suite, test_append);
   SUITE_ADD_TEST(suite, test_parse_line_number);
-  SUITE_ADD_TEST(suite, test_spread);
+  SUITE_ADD_TEST(suite, test_gap);
+  SUITE_ADD_TEST(suite, test_enter_random);
   SUITE_ADD_TEST(suite, test_enter_find_delete);
-  SUITE_ADD_TEST(suite, test_line_length);
-  SUITE_ADD_TEST(suite, test_get_line);
+  SUITE_ADD_TEST(suite, test_split_line);
   SUITE_ADD_TEST(suite, test_load_string);
+  SUITE_ADD_TEST(suite, test_load_long_lines);
+  SUITE_ADD_TEST(suite, test_tokens);
   SUITE_ADD_TEST(suite, test_wrap);
   SUITE_ADD_TEST(suite, test_source_replace);
   return suite;
@@ -8,22 +8,39 @@
 
 struct source_line {
   unsigned num;
+  unsigned id;  // changes whenever the text changes
   char* text;
+  bool tokenized;  // the text holds keyword bytes: see token.h
 };
 
+// Lines in order of line number, in a gap buffer: the unused entries
+// lie at position gap, where the latest line was entered or deleted.
+// Loaded lines are views into one text buffer; entered lines are copied.
+// Lines are stored tokenized once parsed, and spelled out again to be shown.
 typedef struct {
   char* name;
   struct source_line * lines;
   unsigned allocated;
   unsigned used;
+  unsigned gap;
+  char* text;
+  size_t text_size;
+  size_t slack;  // bytes of the text buffer no line uses
+  int token_mode;
+  unsigned next_id;
+  char* spelling;  // a tokenized line spelled out
+  size_t spelling_size;
 } SOURCE;
 
 SOURCE* new_source(const char* name);
+SOURCE* copy_source(const SOURCE*);
 void delete_source(SOURCE*);
 
 void clear_source(SOURCE*);
 
 bool find_source_linenum(const SOURCE*, unsigned num, unsigned *index);
+// Index of the first line numbered num or later, or the number of lines.
+unsigned find_source_position(const SOURCE*, unsigned num);
 void enter_source_line(SOURCE*, unsigned num, const char* text);
 void delete_source_line(SOURCE*, unsigned index);
 
@@ -35,8 +52,21 @@ bool save_source_file(const SOURCE*, const char* name);
 const char* source_name(const SOURCE*);
 unsigned source_lines(const SOURCE*);
 unsigned source_linenum(const SOURCE*, unsigned line);
+// Identifies a line's text within a source, unchanged by renumbering.
+unsigned source_line_id(const SOURCE*, unsigned line);
+// The text of a line as written. A tokenized line is spelled out
+// in a buffer kept by the source until the next call.
 const char* source_text(const SOURCE*, unsigned line);
 void print_source_line(const SOURCE*, unsigned line, FILE*);
 
 void set_source_linenum(SOURCE*, unsigned line, unsigned basic_lineno);
 bool source_replace(SOURCE*, unsigned line, unsigned pos, const char* from, const char* to);
+
+// The tokenized text of a line, or NULL if it has not been tokenized.
+const char* source_tokens(const SOURCE*, unsigned line);
+// Store a line tokenized by the lexer from its text, in place of the text.
+void set_source_tokens(SOURCE*, unsigned line, const char* tokens);
+// Spell out lines tokenized in a different keyword-recognition mode.
+void set_source_token_mode(SOURCE*, int mode);
+// Copy the lines into a new text buffer if they no longer use all of the old one.
+void compact_source(SOURCE*);
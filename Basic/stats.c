@@ -0,0 +1,215 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Execution statistics: B-code instructions dispatched, by opcode
+// and by adjacent pair, stack depths, and string and line-map use.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "stats.h"
+#include "bcode.h"
+#include "utils.h"
+
+#define TOP_PAIRS (20)
+
+struct exec_stats {
+  unsigned opcodes;
+  int prev;  // opcode of the previous instruction, or -1
+  unsigned long long instructions;
+  unsigned long long* count;  // per opcode
+  unsigned long long* pairs;  // per previous opcode, per opcode
+  unsigned max_num, max_str, max_ret, max_for;
+  unsigned long long strings;
+  unsigned long long string_bytes;
+  unsigned long long line_lookups;
+};
+
+EXEC_STATS* new_exec_stats(void) {
+  EXEC_STATS* s = ecalloc(1, sizeof *s);
+  while (bcode_valid(s->opcodes))
+    s->opcodes++;
+  s->prev = -1;
+  s->count = ecalloc(s->opcodes, sizeof s->count[0]);
+  s->pairs = ecalloc((size_t) s->opcodes * s->opcodes, sizeof s->pairs[0]);
+  return s;
+}
+
+void delete_exec_stats(EXEC_STATS* s) {
+  if (s) {
+    efree(s->count);
+    efree(s->pairs);
+    efree(s);
+  }
+}
+
+void stats_instruction(EXEC_STATS* s, int opcode) {
+  assert(s != NULL);
+  assert(opcode >= 0 && (unsigned) opcode < s->opcodes);
+  s->instructions++;
+  s->count[opcode]++;
+  if (s->prev >= 0)
+    s->pairs[(size_t) s->prev * s->opcodes + opcode]++;
+  s->prev = opcode;
+}
+
+void stats_break(EXEC_STATS* s) {
+  assert(s != NULL);
+  s->prev = -1;
+}
+
+void stats_stack_depths(EXEC_STATS* s, unsigned num, unsigned str, unsigned ret, unsigned loop) {
+  assert(s != NULL);
+  if (num > s->max_num)
+    s->max_num = num;
+  if (str > s->max_str)
+    s->max_str = str;
+  if (ret > s->max_ret)
+    s->max_ret = ret;
+  if (loop > s->max_for)
+    s->max_for = loop;
+}
+
+void stats_string(EXEC_STATS* s, size_t bytes) {
+  assert(s != NULL);
+  s->strings++;
+  s->string_bytes += bytes;
+}
+
+void stats_line_lookup(EXEC_STATS* s) {
+  assert(s != NULL);
+  s->line_lookups++;
+}
+
+unsigned long long stats_instructions(const EXEC_STATS* s) {
+  return s->instructions;
+}
+
+unsigned long long stats_opcode_count(const EXEC_STATS* s, int opcode) {
+  assert(opcode >= 0 && (unsigned) opcode < s->opcodes);
+  return s->count[opcode];
+}
+
+unsigned long long stats_pair_count(const EXEC_STATS* s, int first, int second) {
+  assert(first >= 0 && (unsigned) first < s->opcodes);
+  assert(second >= 0 && (unsigned) second < s->opcodes);
+  return s->pairs[(size_t) first * s->opcodes + second];
+}
+
+typedef struct {
+  unsigned long long count;
+  unsigned index;
+} COUNTED;
+
+static int more_frequent(const void* p1, const void* p2) {
+  const COUNTED* c1 = p1;
+  const COUNTED* c2 = p2;
+  if (c1->count != c2->count)
+    return c1->count < c2->count ? 1 : -1;
+  return c1->index < c2->index ? -1 : c1->index > c2->index;
+}
+
+// Gather the non-zero counts, most frequent first, and return how many.
+static unsigned sort_counts(const unsigned long long* counts, size_t n, COUNTED* sorted) {
+  unsigned used = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (counts[i]) {
+      sorted[used].count = counts[i];
+      sorted[used].index = (unsigned) i;
+      used++;
+    }
+  }
+  qsort(sorted, used, sizeof sorted[0], more_frequent);
+  return used;
+}
+
+static double percent(unsigned long long part, unsigned long long whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+void print_exec_stats(const EXEC_STATS* s, FILE* fp) {
+  assert(s != NULL);
+  assert(fp != NULL);
+
+  fprintf(fp, "Instructions: %llu\n", s->instructions);
+
+  COUNTED* sorted = emalloc(s->opcodes * sizeof sorted[0]);
+  unsigned n = sort_counts(s->count, s->opcodes, sorted);
+  fprintf(fp, "\n%-16s %12s %7s\n", "OPCODE", "COUNT", "%");
+  for (unsigned i = 0; i < n; i++)
+    fprintf(fp, "%-16s %12llu %7.2f\n", bcode_name(sorted[i].index), sorted[i].count,
+            percent(sorted[i].count, s->instructions));
+  efree(sorted);
+
+  const size_t pairs = (size_t) s->opcodes * s->opcodes;
+  sorted = emalloc(pairs * sizeof sorted[0]);
+  n = sort_counts(s->pairs, pairs, sorted);
+  fprintf(fp, "\n%-33s %12s %7s\n", "OPCODE PAIR", "COUNT", "%");
+  for (unsigned i = 0; i < n && i < TOP_PAIRS; i++) {
+    char pair[40];
+    snprintf(pair, sizeof pair, "%s %s", bcode_name(sorted[i].index / s->opcodes),
+             bcode_name(sorted[i].index % s->opcodes));
+    fprintf(fp, "%-33s %12llu %7.2f\n", pair, sorted[i].count, percent(sorted[i].count, s->instructions));
+  }
+  efree(sorted);
+
+  fprintf(fp, "\nMaximum stack depths: numeric %u, string %u, GOSUB %u, FOR %u\n",
+          s->max_num, s->max_str, s->max_ret, s->max_for);
+  fprintf(fp, "Strings allocated: %llu, %llu bytes\n", s->strings, s->string_bytes);
+  fprintf(fp, "Line lookups: %llu\n", s->line_lookups);
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_stats(CuTest* tc) {
+  EXEC_STATS* s = new_exec_stats();
+
+  const int ops[] = { B_PUSH_NUM, B_PUSH_NUM, B_ADD, B_PUSH_NUM, B_PUSH_NUM, B_ADD };
+  for (unsigned i = 0; i < sizeof ops / sizeof ops[0]; i++)
+    stats_instruction(s, ops[i]);
+  stats_break(s);
+  stats_instruction(s, B_ADD);
+
+  CuAssertTrue(tc, stats_instructions(s) == 7);
+  CuAssertTrue(tc, stats_opcode_count(s, B_PUSH_NUM) == 4);
+  CuAssertTrue(tc, stats_opcode_count(s, B_ADD) == 3);
+  CuAssertTrue(tc, stats_opcode_count(s, B_SUB) == 0);
+  CuAssertTrue(tc, stats_pair_count(s, B_PUSH_NUM, B_PUSH_NUM) == 2);
+  CuAssertTrue(tc, stats_pair_count(s, B_PUSH_NUM, B_ADD) == 2);
+  CuAssertTrue(tc, stats_pair_count(s, B_ADD, B_PUSH_NUM) == 1);
+  CuAssertTrue(tc, stats_pair_count(s, B_ADD, B_ADD) == 0);
+
+  stats_stack_depths(s, 2, 0, 1, 0);
+  stats_stack_depths(s, 1, 3, 0, 2);
+  stats_string(s, 4);
+  stats_string(s, 6);
+  stats_line_lookup(s);
+
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  print_exec_stats(s, fp);
+  rewind(fp);
+  char text[2048];
+  size_t len = fread(text, 1, sizeof text - 1, fp);
+  text[len] = '\0';
+  fclose(fp);
+
+  CuAssertPtrNotNull(tc, strstr(text, "Instructions: 7\n"));
+  CuAssertPtrNotNull(tc, strstr(text, "PUSH-NUM"));
+  CuAssertPtrNotNull(tc, strstr(text, "numeric 2, string 3, GOSUB 1, FOR 2\n"));
+  CuAssertPtrNotNull(tc, strstr(text, "Strings allocated: 2, 10 bytes\n"));
+  CuAssertPtrNotNull(tc, strstr(text, "Line lookups: 1\n"));
+  // the most frequent opcode is listed first
+  CuAssertTrue(tc, strstr(text, "PUSH-NUM") < strstr(text, "ADD"));
+
+  delete_exec_stats(s);
+}
+
+CuSuite* stats_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_stats);
+  return suite;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,33 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Execution statistics: B-code instructions dispatched, by opcode
+// and by adjacent pair, stack depths, and string and line-map use.
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct exec_stats EXEC_STATS;
+
+EXEC_STATS* new_exec_stats(void);
+void delete_exec_stats(EXEC_STATS*);
+
+// Count an instruction dispatched.
+void stats_instruction(EXEC_STATS*, int opcode);
+
+// Start a new sequence of instructions, not adjacent to the last one counted.
+void stats_break(EXEC_STATS*);
+
+// Record the depths of the numeric, string, GOSUB return and FOR stacks.
+void stats_stack_depths(EXEC_STATS*, unsigned num, unsigned str, unsigned ret, unsigned loop);
+
+void stats_string(EXEC_STATS*, size_t bytes);
+void stats_line_lookup(EXEC_STATS*);
+
+unsigned long long stats_instructions(const EXEC_STATS*);
+unsigned long long stats_opcode_count(const EXEC_STATS*, int opcode);
+unsigned long long stats_pair_count(const EXEC_STATS*, int first, int second);
+
+// Report the statistics, opcodes and pairs most frequent first.
+void print_exec_stats(const EXEC_STATS*, FILE*);
@@ -0,0 +1,156 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Heap for the string values of a running program.
+
+#include <string.h>
+#include <assert.h>
+#include "strheap.h"
+#include "arena.h"
+#include "utils.h"
+
+// Each block holds its size class in the byte before the string.
+// Classes are 16 to 256 bytes, doubling. Longer strings are allocated singly.
+enum { MIN_BLOCK = 16, CLASSES = 5, LARGE = 0xFF };
+
+struct string_heap {
+  ARENA* blocks;
+  unsigned char* free[CLASSES];  // linked through the first bytes of each block
+  unsigned long strings;
+  unsigned shares;
+};
+
+STRING_HEAP* new_string_heap(void) {
+  STRING_HEAP* h = ecalloc_in(MEM_STRINGS, 1, sizeof *h);
+  h->blocks = new_arena(MEM_STRINGS, 4096);
+  return h;
+}
+
+void delete_string_heap(STRING_HEAP* h) {
+  if (h && h->shares)
+    h->shares--;
+  else if (h) {
+    delete_arena(h->blocks);
+    efree(h);
+  }
+}
+
+STRING_HEAP* share_string_heap(STRING_HEAP* h) {
+  if (h)
+    h->shares++;
+  return h;
+}
+
+static unsigned size_class(size_t size) {
+  unsigned c = 0;
+  for (size_t block = MIN_BLOCK; block < size && c < CLASSES; block *= 2)
+    c++;
+  return c;
+}
+
+char* heap_strdup(STRING_HEAP* h, const char* s) {
+  assert(h != NULL);
+  if (s == NULL)
+    return NULL;
+  const size_t len = strlen(s);
+  const unsigned c = size_class(len + 2);
+  unsigned char* b;
+  if (c >= CLASSES) {
+    b = emalloc_in(MEM_STRINGS, len + 2);
+    b[0] = LARGE;
+  }
+  else {
+    b = h->free[c];
+    if (b)
+      memcpy(&h->free[c], b, sizeof h->free[c]);
+    else
+      b = arena_alloc(h->blocks, (size_t) MIN_BLOCK << c);
+    b[0] = (unsigned char) c;
+  }
+  memcpy(b + 1, s, len + 1);
+  h->strings++;
+  return (char*) b + 1;
+}
+
+void heap_free(STRING_HEAP* h, char* s) {
+  if (s == NULL)
+    return;
+  assert(h != NULL);
+  unsigned char* b = (unsigned char*) s - 1;
+  assert(h->strings > 0);
+  h->strings--;
+  if (b[0] == LARGE)
+    efree(b);
+  else {
+    assert(b[0] < CLASSES);
+    const unsigned c = b[0];
+    memcpy(b, &h->free[c], sizeof h->free[c]);
+    h->free[c] = b;
+  }
+}
+
+unsigned long heap_strings(const STRING_HEAP* h) {
+  return h->strings;
+}
+
+void release_string_heap(STRING_HEAP* h) {
+  assert(h != NULL);
+  if (h->strings == 0) {
+    arena_reset(h->blocks);
+    memset(h->free, 0, sizeof h->free);
+  }
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_string_heap(CuTest* tc) {
+  STRING_HEAP* h = new_string_heap();
+  CuAssertPtrEquals(tc, NULL, heap_strdup(h, NULL));
+  heap_free(h, NULL);
+  CuAssertIntEquals(tc, 0, heap_strings(h));
+
+  char* s = heap_strdup(h, "hello");
+  CuAssertStrEquals(tc, "hello", s);
+  char* e = heap_strdup(h, "");
+  CuAssertStrEquals(tc, "", e);
+  CuAssertIntEquals(tc, 2, heap_strings(h));
+
+  // a freed block is reused for a string of the same class
+  heap_free(h, s);
+  char* t = heap_strdup(h, "world");
+  CuAssertPtrEquals(tc, s, t);
+  CuAssertStrEquals(tc, "world", t);
+
+  char long_string[300];
+  memset(long_string, 'x', sizeof long_string - 1);
+  long_string[sizeof long_string - 1] = '\0';
+  char* u = heap_strdup(h, long_string);
+  CuAssertStrEquals(tc, long_string, u);
+  char* v = heap_strdup(h, long_string + 100);
+  CuAssertStrEquals(tc, long_string + 100, v);
+  CuAssertIntEquals(tc, 4, heap_strings(h));
+
+  release_string_heap(h);  // strings remain: nothing released
+  CuAssertStrEquals(tc, "world", t);
+
+  heap_free(h, e);
+  heap_free(h, t);
+  heap_free(h, u);
+  heap_free(h, v);
+  CuAssertIntEquals(tc, 0, heap_strings(h));
+  release_string_heap(h);
+  CuAssertStrEquals(tc, "again", heap_strdup(h, "again"));
+
+  CuAssertPtrEquals(tc, h, share_string_heap(h));
+  delete_string_heap(h);
+  delete_string_heap(h);
+}
+
+CuSuite* strheap_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_string_heap);
+  return suite;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,28 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Heap for the string values of a running program: blocks in size classes,
+// reused from free lists, and released together when no strings remain.
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct string_heap STRING_HEAP;
+
+STRING_HEAP* new_string_heap(void);
+void delete_string_heap(STRING_HEAP*);
+
+// Share the heap with a cloned symbol table. Clones must be used on one thread.
+STRING_HEAP* share_string_heap(STRING_HEAP*);
+
+// Copy a string into the heap. NULL is copied as NULL.
+char* heap_strdup(STRING_HEAP*, const char*);
+
+// Return a string to the heap. NULL is ignored.
+void heap_free(STRING_HEAP*, char*);
+
+// The number of strings allocated and not freed.
+unsigned long heap_strings(const STRING_HEAP*);
+
+// If no strings remain, release all blocks but one chunk.
+void release_string_heap(STRING_HEAP*);
@@ -2,10 +2,13 @@
 // Copyright (c) 2024 Nigel Perks
 // Symbol table used for both compiling and running.
 
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include "symbol.h"
 #include "utils.h"
-#include "os.h"
 #include "hash.h"
 
 const char* symbol_kind(int kind) {
@@ -19,43 +22,86 @@ const char* symbol_kind(int kind) {
   return "unknown kind of symbol";
 }
 
+// Distinguishes every set of names of every symbol table,
+// so code compiled against one is never taken for another's,
+// even when interpreters are created on several threads.
+static atomic_uint generations;
+
 SYMTAB* new_symbol_table(void) {
-  return ecalloc(1, sizeof (SYMTAB));
+  SYMTAB* st = ecalloc_in(MEM_SYMBOLS, 1, sizeof (SYMTAB));
+  st->generation = atomic_fetch_add(&generations, 1) + 1;
+  st->names = new_arena(MEM_SYMBOLS, 4096);
+  st->strings = new_string_heap();
+  return st;
 }
 
 void delete_symbol_table(SYMTAB* st) {
   if (st) {
-    clear_symbol_table_names(st);
+    clear_symbol_table_values(st);
+    delete_arena(st->names);
+    delete_string_heap(st->strings);
     efree(st->psym);
+    efree(st->slots);
     efree(st);
   }
 }
 
 void clear_symbol_table_names(SYMTAB* st) {
   clear_symbol_table_values(st);
-  for (unsigned i = 0; i < st->used; i++) {
-    efree(st->psym[i]->name);
-    efree(st->psym[i]);
-  }
+  arena_reset(st->names);
   st->used = 0;
   st->next_id = 0;
+  st->generation = atomic_fetch_add(&generations, 1) + 1;
+
+  if (st->slots)
+    memset(st->slots, 0, st->slot_count * sizeof st->slots[0]);
+}
 
-  for (unsigned h = 0; h < SYMBOL_HASH_SIZE; h++)
-    st->hash[h] = NULL;
+SYMTAB* copy_symbol_table(SYMTAB* st) {
+  SYMTAB* copy = new_symbol_table();
+  delete_string_heap(copy->strings);
+  copy->strings = share_string_heap(st->strings);
+  for (unsigned i = 0; i < st->used; i++) {
+    const SYMBOL* sym = st->psym[i];
+    SYMBOL* dup = sym_insert(copy, sym->name, sym->kind, sym->type);
+    assert(dup->id == sym->id);
+    dup->defined = sym->defined;
+    switch (sym->kind) {
+      case SYM_VARIABLE:
+        if (sym->type == TYPE_STR)
+          dup->val.str = heap_strdup(copy->strings, sym->val.str);
+        else
+          dup->val.num = sym->val.num;
+        break;
+      case SYM_ARRAY:
+        if (sym->type == TYPE_STR)
+          dup->val.strarr = share_string_array(sym->val.strarr);
+        else
+          dup->val.numarr = share_numeric_array(sym->val.numarr);
+        break;
+      case SYM_DEF:
+        dup->val.def = share_def(sym->val.def);
+        break;
+      default:
+        dup->val = sym->val;
+        break;
+    }
+  }
+  return copy;
 }
 
-static void undefine_value(SYMBOL*);
+static void undefine_value(SYMBOL*, STRING_HEAP*);
 
 // clear values/definitions but keep names so that bcode referencing them remains valid
 void clear_symbol_table_values(SYMTAB* st) {
   for (unsigned i = 0; i < st->used; i++) {
     SYMBOL* sym = st->psym[i];
     if (sym->defined)
-      undefine_value(sym);
+      undefine_value(sym, st->strings);
   }
 }
 
-static void undefine_value(SYMBOL* sym) {
+static void undefine_value(SYMBOL* sym, STRING_HEAP* strings) {
   if (sym->kind == SYM_BUILTIN)
     // not a value, should not be erased or marked undefined
     return;
@@ -67,7 +113,7 @@ static void undefine_value(SYMBOL* sym) {
           sym->val.num = 0;
           break;
         case TYPE_STR:
-          efree(sym->val.str);
+          heap_free(strings, sym->val.str);
           sym->val.str = NULL;
           break;
       }
@@ -79,7 +125,7 @@ static void undefine_value(SYMBOL* sym) {
           sym->val.numarr = NULL;
           break;
         case TYPE_STR:
-          delete_string_array(sym->val.strarr);
+          delete_string_array(sym->val.strarr, strings);
           sym->val.strarr = NULL;
           break;
       }
@@ -105,31 +151,92 @@ static bool match_paren(int kind, bool paren) {
   return false;
 }
 
-SYMBOL* sym_lookup(SYMTAB* st, const char* name, bool paren) {
-  unsigned h = hashpjw_upper(name) % SYMBOL_HASH_SIZE;
-  for (SYMBOL* sym = st->hash[h]; sym; sym = sym->next) {
-    if (match_paren(sym->kind, paren) && STRICMP(sym->name, name) == 0)
-      return sym;
+static unsigned key_hash(const char* key, size_t len) {
+  return (unsigned) hash_fnv1a(key, len, FNV1A_BASIS);
+}
+
+static SYMBOL* find(SYMTAB* st, const char* key, size_t len, bool paren) {
+  if (st->slots == NULL)
+    return NULL;
+  const unsigned h = key_hash(key, len);
+  const unsigned mask = st->slot_count - 1;
+  for (unsigned i = h & mask; st->slots[i].id; i = (i + 1) & mask) {
+    if (st->slots[i].hash == h) {
+      SYMBOL* sym = st->psym[st->slots[i].id - 1];
+      if (sym->len == len && memcmp(sym->key, key, len) == 0 && match_paren(sym->kind, paren))
+        return sym;
+    }
   }
   return NULL;
 }
 
+SYMBOL* sym_lookup_key(SYMTAB* st, const char* key, bool paren) {
+  return find(st, key, strlen(key), paren);
+}
+
+SYMBOL* sym_lookup(SYMTAB* st, const char* name, bool paren) {
+  char buf[128];
+  const size_t len = strlen(name);
+  char* key = len < sizeof buf ? buf : emalloc(len + 1);
+  for (size_t i = 0; i <= len; i++)
+    key[i] = (char) toupper((unsigned char) name[i]);
+  SYMBOL* sym = find(st, key, len, paren);
+  if (key != buf)
+    efree(key);
+  return sym;
+}
+
+static void insert_slot(struct sym_slot * slots, unsigned count, unsigned hash, unsigned id) {
+  unsigned i = hash & (count - 1);
+  while (slots[i].id)
+    i = (i + 1) & (count - 1);
+  slots[i].hash = hash;
+  slots[i].id = id;
+}
+
+// Keep the table at most half full, so that probe sequences stay short.
+static void grow_slots(SYMTAB* st) {
+  const unsigned count = st->slot_count ? 2 * st->slot_count : 256;
+  struct sym_slot * slots = ecalloc_in(MEM_SYMBOLS, count, sizeof slots[0]);
+  for (unsigned i = 0; i < st->slot_count; i++) {
+    if (st->slots[i].id)
+      insert_slot(slots, count, st->slots[i].hash, st->slots[i].id);
+  }
+  efree(st->slots);
+  st->slots = slots;
+  st->slot_count = count;
+}
+
 SYMBOL* sym_insert(SYMTAB* st, const char* name, int kind, int type) {
-  SYMBOL* sym = ecalloc(1, sizeof *sym);
-  sym->name = estrdup(name);
+  const size_t len = strlen(name);
+  assert(len <= USHRT_MAX);
+  SYMBOL* sym = arena_alloc(st->names, sizeof *sym);
+  memset(sym, 0, sizeof *sym);
+  sym->name = arena_strdup(st->names, name);
+  sym->key = sym->name;
+  for (size_t i = 0; i < len; i++) {
+    if (islower((unsigned char) name[i])) {
+      char* key = arena_strdup(st->names, name);
+      for (size_t j = i; j < len; j++)
+        key[j] = (char) toupper((unsigned char) key[j]);
+      sym->key = key;
+      break;
+    }
+  }
+  sym->len = (unsigned short) len;
   sym->id = st->next_id++;
   sym->kind = kind;
   sym->type = type;
   sym->defined = false;
 
-  unsigned h = hashpjw_upper(name) % SYMBOL_HASH_SIZE;
-  sym->next = st->hash[h];
-  st->hash[h] = sym;
+  if (2 * (st->used + 1) > st->slot_count)
+    grow_slots(st);
+  insert_slot(st->slots, st->slot_count, key_hash(sym->key, len), sym->id + 1u);
 
   assert(st->used <= st->allocated);
   if (st->used == st->allocated) {
     st->allocated = st->allocated ? 2 * st->allocated : 64;
-    st->psym = erealloc(st->psym, st->allocated * sizeof st->psym[0]);
+    st->psym = erealloc_in(MEM_SYMBOLS, st->psym, st->allocated * sizeof st->psym[0]);
   }
   assert(st->used < st->allocated);
   st->psym[st->used++] = sym;
@@ -331,6 +438,32 @@ static void test_lookup(CuTest* tc) {
   sym = sym_insert(st, "XY", SYM_UNKNOWN, TYPE_NUM);
   CuAssertPtrEquals(tc, NULL, sym_lookup(st, "xy", false));
   CuAssertPtrEquals(tc, sym, sym_lookup(st, "xy", true));
+  CuAssertPtrEquals(tc, sym, sym_lookup_key(st, "XY", true));
+  CuAssertPtrEquals(tc, NULL, sym_lookup_key(st, "xy", true));
+
+  delete_symbol_table(st);
+}
+
+static void test_many_symbols(CuTest* tc) {
+  SYMTAB* st = new_symbol_table();
+  char name[16];
+  for (unsigned i = 0; i < 3000; i++) {
+    sprintf(name, "v%u", i);
+    SYMBOL* sym = sym_insert(st, name, i % 2 ? SYM_ARRAY : SYM_VARIABLE, TYPE_NUM);
+    CuAssertIntEquals(tc, i, sym->id);
+  }
+  // a variable and an array of the same name
+  SYMBOL* array = sym_insert(st, "V0", SYM_ARRAY, TYPE_NUM);
+  CuAssertTrue(tc, st->slot_count >= 2 * st->used);
+
+  for (unsigned i = 0; i < 3000; i++) {
+    sprintf(name, "V%u", i);
+    SYMBOL* sym = sym_lookup_key(st, name, i % 2);
+    CuAssertPtrNotNull(tc, sym);
+    CuAssertIntEquals(tc, i, sym->id);
+    CuAssertPtrEquals(tc, i ? NULL : array, sym_lookup_key(st, name, i % 2 == 0));
+  }
+  CuAssertPtrEquals(tc, NULL, sym_lookup(st, "v3000", false));
 
   delete_symbol_table(st);
 }
@@ -338,6 +471,7 @@ static void test_lookup(CuTest* tc) {
 static void test_undefine(CuTest* tc) {
   const unsigned dim1[] = { 12 };
   const unsigned dim2[] = { 3, 5 };
+  STRING_HEAP* strings = new_string_heap();
   SYMBOL sym;
 
   sym.kind = SYM_ARRAY;
@@ -345,7 +479,7 @@ static void test_undefine(CuTest* tc) {
   sym.val.numarr = new_numeric_array(0, 2, dim2);
   CuAssertPtrNotNull(tc, sym.val.numarr);
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertPtrEquals(tc, NULL, sym.val.numarr);
   CuAssertIntEquals(tc, false, sym.defined);
 
@@ -354,7 +488,7 @@ static void test_undefine(CuTest* tc) {
   sym.val.strarr = new_string_array(1, 1, dim1);
   CuAssertPtrNotNull(tc, sym.val.strarr);
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertPtrEquals(tc, NULL, sym.val.strarr);
   CuAssertIntEquals(tc, false, sym.defined);
 
@@ -364,7 +498,7 @@ static void test_undefine(CuTest* tc) {
   sym.val.def = new_def(bc, NULL, 0);
   CuAssertPtrNotNull(tc, sym.val.def);
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertPtrEquals(tc, NULL, sym.val.def);
   CuAssertIntEquals(tc, false, sym.defined);
 
@@ -373,7 +507,7 @@ static void test_undefine(CuTest* tc) {
   sym.val.builtin.args = "snn";
   sym.val.builtin.opcode = B_MID3;
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertIntEquals(tc, true, sym.defined);
   CuAssertStrEquals(tc, "snn", sym.val.builtin.args);
   CuAssertIntEquals(tc, B_MID3, sym.val.builtin.opcode);
@@ -382,16 +516,18 @@ static void test_undefine(CuTest* tc) {
   sym.type = TYPE_NUM;
   sym.val.num = 321;
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertIntEquals(tc, false, sym.defined);
 
   sym.kind = SYM_VARIABLE;
   sym.type = TYPE_STR;
-  sym.val.str = estrdup("Henry");
+  sym.val.str = heap_strdup(strings, "Henry");
   sym.defined = true;
-  undefine_value(&sym);
+  undefine_value(&sym, strings);
   CuAssertPtrEquals(tc, NULL, sym.val.str);
   CuAssertIntEquals(tc, false, sym.defined);
+  CuAssertIntEquals(tc, 0, heap_strings(strings));
+  delete_string_heap(strings);
 }
 
 static void test_clear_values(CuTest* tc) {
@@ -403,7 +539,7 @@ static void test_clear_values(CuTest* tc) {
   sym->defined = true;
 
   sym = sym_insert(st, "X$", SYM_VARIABLE, TYPE_STR);
-  sym->val.str = estrdup("Custard");
+  sym->val.str = heap_strdup(st->strings, "Custard");
   sym->defined = true;
 
   const unsigned dim2[] = { 8, 3 };
@@ -460,7 +596,7 @@ static void test_clear_names(CuTest* tc) {
   sym->defined = true;
 
   sym = sym_insert(st, "X$", SYM_VARIABLE, TYPE_STR);
-  sym->val.str = estrdup("Custard");
+  sym->val.str = heap_strdup(st->strings, "Custard");
   sym->defined = true;
 
   const unsigned dim2[] = { 8, 3 };
@@ -503,6 +639,7 @@ CuSuite* symbol_test_suite(void) {
   SUITE_ADD_TEST(suite, test_new_symbol_table);
   SUITE_ADD_TEST(suite, test_insert);
   SUITE_ADD_TEST(suite, test_lookup);
+  SUITE_ADD_TEST(suite, test_many_symbols);
   SUITE_ADD_TEST(suite, test_undefine);
   SUITE_ADD_TEST(suite, test_clear_values);
   SUITE_ADD_TEST(suite, test_clear_names);
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include "arrays.h"
 #include "def.h"
+#include "arena.h"
 
 enum symbol_kind {
   SYM_UNKNOWN,  // parenthesised symbol used before defined
@@ -22,10 +23,12 @@ typedef unsigned short SYMID;
 
 typedef struct symbol {
   char* name;
+  const char* key;  // the name in upper case, for lookup
   SYMID id;
   char kind;
   char type;
   char defined;
+  unsigned short len;
   union {
     double num;
     char* str;
@@ -37,19 +40,27 @@ typedef struct symbol {
       short opcode;
     } builtin;
   } val;
-  struct symbol * next;
 } SYMBOL;
 
-#define SYMBOL_HASH_SIZE (293)
+// A slot of the open-addressing hash table: the hash of a key, and 1 + the symbol id,
+// or 0 if the slot is empty.
+struct sym_slot {
+  unsigned hash;
+  unsigned id;
+};
 
 // I want a particular symbol's address (SYMBOL* value) to be unchanged.
 // So the reallocatable array contains SYMBOL*, not SYMBOL.
 typedef struct {
-  SYMBOL* hash[SYMBOL_HASH_SIZE];
+  struct sym_slot * slots;
+  unsigned slot_count;  // a power of 2, at least twice the number of symbols
   SYMBOL* *psym;
   unsigned allocated;
   unsigned used;
   SYMID next_id;
+  unsigned generation;  // changes when names are cleared, and ids may be reused
+  ARENA* names;  // symbols and their names, freed together
+  STRING_HEAP* strings;  // string values, of variables and array elements
 } SYMTAB;
 
 SYMTAB* new_symbol_table(void);
@@ -57,7 +68,13 @@ void delete_symbol_table(SYMTAB*);
 void clear_symbol_table_values(SYMTAB*); // but keep names so that bcode referencing them remains valid
 void clear_symbol_table_names(SYMTAB*);
 
+// Copy names and values, with the same ids, for a cloned VM.
+// Arrays, DEF definitions and the string heap are shared, not copied.
+SYMTAB* copy_symbol_table(SYMTAB*);
+
+// Names are not case-sensitive. sym_lookup_key takes a name already in upper case.
 SYMBOL* sym_lookup(SYMTAB*, const char* name, bool paren);
+SYMBOL* sym_lookup_key(SYMTAB*, const char* key, bool paren);
 SYMBOL* sym_insert(SYMTAB*, const char* name, int kind, int type);
 SYMBOL* sym_insert_builtin(SYMTAB*, const char* name, int type, const char* args, int opcode);
 
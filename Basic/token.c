@@ -114,6 +114,38 @@ const char* keyword_name(int t) {
   return (t >= TOK_AND && t <= TOK_TO) ? keywords[t - TOK_AND].name : NULL;
 }
 
+char keyword_byte(int t) {
+  assert(t >= TOK_AND && t <= TOK_TO);
+  return (char) (KEYWORD_BYTE + t - TOK_AND);
+}
+
+int byte_keyword(char c) {
+  const unsigned char b = (unsigned char) c;
+  return (b >= KEYWORD_BYTE && b <= KEYWORD_BYTE + TOK_TO - TOK_AND) ? b - KEYWORD_BYTE + TOK_AND : TOK_NONE;
+}
+
+size_t spelled_length(const char* s) {
+  size_t len = 0;
+  for (; *s; s++) {
+    const int t = byte_keyword(*s);
+    len += t == TOK_NONE ? 1 : keywords[t - TOK_AND].len;
+  }
+  return len;
+}
+
+void spell_keywords(const char* s, char* text) {
+  for (; *s; s++) {
+    const int t = byte_keyword(*s);
+    if (t == TOK_NONE)
+      *text++ = *s;
+    else {
+      memcpy(text, keywords[t - TOK_AND].name, keywords[t - TOK_AND].len);
+      text += keywords[t - TOK_AND].len;
+    }
+  }
+  *text = '\0';
+}
+
 const KEYWORD* keyword_prefix(const char* s) {
   assert(keywords != NULL && s != NULL);
 
@@ -177,6 +209,19 @@ static void test_identifier_token(CuTest* tc) {
   CuAssertIntEquals(tc, TOK_TO, identifier_token("TO"));
 }
 
+static void test_keyword_bytes(CuTest* tc) {
+  CuAssertIntEquals(tc, TOK_AND, byte_keyword(keyword_byte(TOK_AND)));
+  CuAssertIntEquals(tc, TOK_TO, byte_keyword(keyword_byte(TOK_TO)));
+  CuAssertIntEquals(tc, TOK_NONE, byte_keyword('A'));
+  CuAssertIntEquals(tc, TOK_NONE, byte_keyword((char) (keyword_byte(TOK_TO) + 1)));
+
+  const char tokenized[] = { keyword_byte(TOK_FOR), 'I', '=', '1', keyword_byte(TOK_TO), '9', '\0' };
+  char text[16];
+  CuAssertIntEquals(tc, 9, spelled_length(tokenized));
+  spell_keywords(tokenized, text);
+  CuAssertStrEquals(tc, "FORI=1TO9", text);
+}
+
 static void test_keyword_prefix(CuTest* tc) {
   const KEYWORD * k;
 
@@ -207,6 +252,7 @@ CuSuite* token_test_suite(void) {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_token_name);
   SUITE_ADD_TEST(suite, test_identifier_token);
+  SUITE_ADD_TEST(suite, test_keyword_bytes);
   SUITE_ADD_TEST(suite, test_keyword_prefix);
   return suite;
 }
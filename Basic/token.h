@@ -58,5 +58,19 @@ void deinit_keywords(void);
 
 int identifier_token(const char*);
 const KEYWORD* keyword_prefix(const char* string);
+const char* keyword_name(int token);
+
+// Tokenized text holds each keyword spelled in upper case as one byte,
+// KEYWORD_BYTE plus the keyword's place in the table, and other characters
+// as they were written.
+#define KEYWORD_BYTE (0x80)
+
+char keyword_byte(int token);
+// The keyword a byte of tokenized text stands for, or TOK_NONE.
+int byte_keyword(char);
+// Tokenized text with its keywords spelled out: the length,
+// and the text, written to a buffer with room for the terminator.
+size_t spelled_length(const char* tokenized);
+void spell_keywords(const char* tokenized, char* text);
 
 void print_token(int token, FILE*);
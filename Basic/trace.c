@@ -0,0 +1,210 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Binary trace of instructions executed: fixed-size records in a ring
+// in a memory-mapped file, keeping the most recent events.
+
+// The file is a header followed by the ring of records. The header counts
+// all records written, so the oldest record kept is found after the ring wraps.
+// Records are in the byte order of the machine that wrote them; the magic
+// number and record size reject a file from a different build or machine.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "trace.h"
+#include "bcode.h"
+#include "source.h"
+#include "image.h"
+#include "os.h"
+#include "utils.h"
+
+#define TRACE_MAGIC (0x5254424C)  // "LBTR" little-endian
+#define TRACE_VERSION (1)
+#define MAX_PROGRAM_NAME (200)
+
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint64_t written;
+  char program[MAX_PROGRAM_NAME];
+};
+
+struct trace_record {
+  uint32_t pc;
+  uint16_t opcode;
+  uint8_t code;
+  uint8_t sp;
+  uint32_t line;
+  uint16_t ssp;
+  uint16_t rsp;
+  double top;
+};
+
+struct trace {
+  WRITABLE_FILE file;
+  struct trace_header * header;
+  struct trace_record * record;
+  uint32_t next;
+};
+
+TRACE* new_trace(const char* file_name, unsigned long events, const char* program_name) {
+  assert(file_name != NULL);
+  if (events == 0 || events > UINT32_MAX)
+    return NULL;
+  TRACE* t = ecalloc(1, sizeof *t);
+  const size_t size = sizeof *t->header + events * sizeof t->record[0];
+  if (!create_mapped_file(file_name, size, &t->file)) {
+    efree(t);
+    return NULL;
+  }
+  t->header = (struct trace_header *) t->file.data;
+  t->record = (struct trace_record *) (t->file.data + sizeof *t->header);
+  t->header->magic = TRACE_MAGIC;
+  t->header->version = TRACE_VERSION;
+  t->header->record_size = sizeof t->record[0];
+  t->header->capacity = (uint32_t) events;
+  if (program_name) {
+    strncpy(t->header->program, program_name, MAX_PROGRAM_NAME - 1);
+    t->header->program[MAX_PROGRAM_NAME - 1] = '\0';
+  }
+  return t;
+}
+
+void delete_trace(TRACE* t) {
+  if (t) {
+    close_mapped_file(&t->file);
+    efree(t);
+  }
+}
+
+void trace_instruction(TRACE* t, unsigned pc, int opcode, int code, unsigned basic_line,
+                       unsigned sp, unsigned ssp, unsigned rsp, double top) {
+  struct trace_record * r = t->record + t->next;
+  r->pc = pc;
+  r->opcode = (uint16_t) opcode;
+  r->code = (uint8_t) code;
+  r->sp = (uint8_t) sp;
+  r->line = basic_line;
+  r->ssp = (uint16_t) ssp;
+  r->rsp = (uint16_t) rsp;
+  r->top = top;
+  if (++t->next == t->header->capacity)
+    t->next = 0;
+  t->header->written++;
+}
+
+unsigned long long trace_written(const TRACE* t) {
+  return t->header->written;
+}
+
+static const char* const CODE_NAMES[] = { "", "immediate ", "DEF " };
+
+static void decode_record(const struct trace_record * r, const SOURCE* source, unsigned *line, FILE* fp) {
+  // the source line as it starts, as --trace-log prints it
+  if (r->opcode == B_SOURCE_LINE && r->code == TRACE_PROGRAM && r->line != *line) {
+    unsigned index;
+    if (source && find_source_linenum(source, r->line, &index))
+      print_source_line(source, index, fp);
+    else
+      fprintf(fp, "%u", r->line);
+    putc('\n', fp);
+  }
+  *line = r->line;
+  fprintf(fp, "  %s%u %s", r->code < 3 ? CODE_NAMES[r->code] : "? ", r->pc,
+          bcode_valid(r->opcode) ? bcode_name(r->opcode) : "?");
+  if (r->sp)
+    fprintf(fp, "  STACK(%u): %g", r->sp, r->top);
+  if (r->ssp)
+    fprintf(fp, "  STRINGS: %u", r->ssp);
+  if (r->rsp)
+    fprintf(fp, "  GOSUB: %u", r->rsp);
+  putc('\n', fp);
+}
+
+static SOURCE* load_program_source(const char* name) {
+  if (name == NULL || name[0] == '\0' || has_image_extension(name))
+    return NULL;
+  FILE* fp = fopen(name, "r");
+  if (fp == NULL)
+    return NULL;
+  fclose(fp);
+  return load_source_file(name);
+}
+
+bool decode_trace(const char* file_name, const char* program_name, FILE* fp) {
+  MAPPED_FILE mf;
+  if (!map_file(file_name, &mf)) {
+    error("Cannot open trace file: %s", file_name);
+    return false;
+  }
+  bool ok = false;
+  const struct trace_header * h = (const struct trace_header *) mf.data;
+  const struct trace_record * records = (const struct trace_record *) (mf.data + sizeof *h);
+  if (mf.size < sizeof *h || h->magic != TRACE_MAGIC || h->version != TRACE_VERSION ||
+      h->record_size != sizeof records[0] || h->capacity == 0 ||
+      mf.size < sizeof *h + (size_t) h->capacity * sizeof records[0])
+    error("Invalid trace file: %s", file_name);
+  else {
+    char program[MAX_PROGRAM_NAME];
+    memcpy(program, h->program, MAX_PROGRAM_NAME);
+    program[MAX_PROGRAM_NAME - 1] = '\0';
+    SOURCE* source = load_program_source(program_name ? program_name : program);
+
+    const uint64_t kept = h->written < h->capacity ? h->written : h->capacity;
+    const uint32_t first = (uint32_t) ((h->written - kept) % h->capacity);
+    fprintf(fp, "Trace of %s: %llu instructions, last %llu kept\n", program[0] ? program : "program",
+            (unsigned long long) h->written, (unsigned long long) kept);
+    unsigned line = 0;
+    for (uint64_t i = 0; i < kept; i++)
+      decode_record(&records[(first + i) % h->capacity], source, &line, fp);
+    delete_source(source);
+    ok = true;
+  }
+  unmap_file(&mf);
+  return ok;
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_trace(CuTest* tc) {
+  const char* const NAME = "test_trace.bin";
+  TRACE* t = new_trace(NAME, 4, "nonexistent.bas");
+  CuAssertPtrNotNull(tc, t);
+  for (unsigned i = 0; i < 6; i++)
+    trace_instruction(t, i, i % 2 ? B_PUSH_NUM : B_SOURCE_LINE, TRACE_PROGRAM, 10 * (i + 1), 1, 0, 0, i * 1.5);
+  CuAssertTrue(tc, trace_written(t) == 6);
+  delete_trace(t);
+
+  FILE* fp = tmpfile();
+  CuAssertPtrNotNull(tc, fp);
+  CuAssertIntEquals(tc, true, decode_trace(NAME, NULL, fp));
+  remove(NAME);
+  char buf[1024];
+  long len = ftell(fp);
+  rewind(fp);
+  size_t n = fread(buf, 1, (size_t) len, fp);
+  buf[n] = '\0';
+  fclose(fp);
+
+  CuAssertPtrNotNull(tc, strstr(buf, "6 instructions, last 4 kept\n"));
+  // the two oldest records are overwritten
+  CuAssertPtrEquals(tc, NULL, strstr(buf, "  1 PUSH-NUM"));
+  CuAssertPtrNotNull(tc, strstr(buf, "30\n  2 LINE  STACK(1): 3\n"));
+  CuAssertPtrNotNull(tc, strstr(buf, "  5 PUSH-NUM  STACK(1): 7.5\n"));
+  CuAssertTrue(tc, strstr(buf, "  2 LINE") < strstr(buf, "  5 PUSH-NUM"));
+
+  CuAssertIntEquals(tc, false, decode_trace("nonexistent.trace", NULL, stdout));
+}
+
+CuSuite* trace_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_trace);
+  return suite;
+}
+
+#endif // UNIT_TEST
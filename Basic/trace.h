@@ -0,0 +1,29 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Binary trace of instructions executed: fixed-size records in a ring
+// in a memory-mapped file, keeping the most recent events.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+
+enum trace_code { TRACE_PROGRAM, TRACE_IMMEDIATE, TRACE_DEF };
+
+typedef struct trace TRACE;
+
+// Create a trace file holding the last events records. Return NULL on failure.
+TRACE* new_trace(const char* file_name, unsigned long events, const char* program_name);
+void delete_trace(TRACE*);
+
+// Record an instruction about to be executed: where it is, its opcode, the BASIC
+// line being run, and the stack depths and top of the numeric stack before it,
+// so that an instruction failing with a runtime error is the last recorded.
+void trace_instruction(TRACE*, unsigned pc, int opcode, int code, unsigned basic_line,
+                       unsigned sp, unsigned ssp, unsigned rsp, double top);
+
+unsigned long long trace_written(const TRACE*);
+
+// Print a trace file as text, oldest record first, with the source lines
+// of the program traced, or of the named program if not NULL.
+bool decode_trace(const char* file_name, const char* program_name, FILE*);
@@ -0,0 +1,410 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Public interface for running BASIC programs inside another application,
+// implemented on the hosted, step-at-a-time VM interface.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include "legacybasic.h"
+#include "run.h"
+#include "image.h"
+#include "token.h"
+#include "utils.h"
+
+struct lb_interpreter {
+  VM* vm;
+  bool running;
+  LB_OUTPUT_CALLBACK* output;
+  void* output_context;
+  LB_INPUT_CALLBACK* input;
+  void* input_context;
+  LB_ERROR_CALLBACK* error;
+  void* error_context;
+  FILE* diagnostics;  // collects diagnostics for the error callback
+};
+
+static unsigned init_count;
+
+void lb_init(void) {
+  if (init_count++ == 0)
+    init_keywords();
+}
+
+void lb_deinit(void) {
+  assert(init_count > 0);
+  if (--init_count == 0)
+    deinit_keywords();
+}
+
+LB* lb_new(void) {
+  LB* lb = ecalloc(1, sizeof *lb);
+  lb->vm = new_vm(false, false, false, false);
+  return lb;
+}
+
+void lb_delete(LB* lb) {
+  if (lb) {
+    delete_vm(lb->vm);
+    if (lb->diagnostics)
+      fclose(lb->diagnostics);
+    efree(lb);
+  }
+}
+
+void lb_set_output(LB* lb, LB_OUTPUT_CALLBACK* output, void* context) {
+  lb->output = output;
+  lb->output_context = context;
+}
+
+void lb_set_input(LB* lb, LB_INPUT_CALLBACK* input, void* context) {
+  lb->input = input;
+  lb->input_context = context;
+}
+
+void lb_set_error(LB* lb, LB_ERROR_CALLBACK* error, void* context) {
+  lb->error = error;
+  lb->error_context = context;
+}
+
+void lb_set_keywords_anywhere(LB* lb, bool on) {
+  vm_set_keywords_anywhere(lb->vm, on);
+}
+
+void lb_set_array_base(LB* lb, unsigned base) {
+  if (base <= 1)
+    vm_set_array_base(lb->vm, base);
+}
+
+void lb_set_strict(LB* lb, unsigned flags) {
+  vm_set_strict_dim(lb->vm, (flags & LB_STRICT_DIM) != 0);
+  vm_set_strict_for(lb->vm, (flags & LB_STRICT_FOR) != 0);
+  vm_set_strict_on(lb->vm, (flags & LB_STRICT_ON) != 0);
+  vm_set_strict_variables(lb->vm, (flags & LB_STRICT_VARIABLES) != 0);
+}
+
+static void report_error(LB* lb, const char* message) {
+  if (lb->error)
+    lb->error(lb->error_context, message);
+  else
+    fputs(message, stderr);
+}
+
+// While the interpreter reports diagnostics, collect them for the error callback.
+static void begin_diagnostics(LB* lb) {
+  if (lb->error == NULL)
+    return;
+  if (lb->diagnostics == NULL)
+    lb->diagnostics = tmpfile();
+  else
+    rewind(lb->diagnostics);
+  set_diagnostics(lb->diagnostics);
+}
+
+static void end_diagnostics(LB* lb) {
+  if (lb->error == NULL || lb->diagnostics == NULL)
+    return;
+  set_diagnostics(NULL);
+  long len = ftell(lb->diagnostics);
+  if (len > 0) {
+    char* message = emalloc((size_t) len + 1);
+    rewind(lb->diagnostics);
+    size_t n = fread(message, 1, (size_t) len, lb->diagnostics);
+    message[n] = '\0';
+    report_error(lb, message);
+    efree(message);
+  }
+}
+
+bool lb_load_string(LB* lb, const char* text) {
+  begin_diagnostics(lb);
+  bool ok = vm_load_source_string(lb->vm, text, "program") && vm_compile(lb->vm);
+  end_diagnostics(lb);
+  lb->running = false;
+  return ok;
+}
+
+bool lb_load_file(LB* lb, const char* file_name) {
+  begin_diagnostics(lb);
+  bool ok = has_image_extension(file_name) ? vm_load_image(lb->vm, file_name) : vm_load_source(lb->vm, file_name);
+  ok = ok && vm_compile(lb->vm);
+  end_diagnostics(lb);
+  lb->running = false;
+  return ok;
+}
+
+static void deliver_output(LB* lb) {
+  size_t len;
+  const char* text = vm_output(lb->vm, &len);
+  if (len) {
+    if (lb->output)
+      lb->output(lb->output_context, text, len);
+    else {
+      fwrite(text, 1, len, stdout);
+      fflush(stdout);
+    }
+    vm_clear_output(lb->vm);
+  }
+}
+
+int lb_run_budget(LB* lb, unsigned long budget) {
+  begin_diagnostics(lb);
+  if (!lb->running) {
+    lb->running = vm_start_program(lb->vm);
+    if (!lb->running) {
+      end_diagnostics(lb);
+      return LB_ERROR;
+    }
+  }
+
+  unsigned long start = vm_executed(lb->vm);
+  int status;
+  for (;;) {
+    unsigned long used = vm_executed(lb->vm) - start;
+    if (used >= budget) {
+      status = LB_BUDGET_EXHAUSTED;
+      break;
+    }
+    status = vm_step(lb->vm, budget - used);
+    deliver_output(lb);
+    if (status == VM_OUTPUT_READY)
+      continue;
+    if (status == VM_NEEDS_INPUT) {
+      char line[256];
+      if (lb->input && lb->input(lb->input_context, line, sizeof line)) {
+        vm_provide_input(lb->vm, line);
+        continue;
+      }
+    }
+    // a program polling INKEY$ yields early: keep running it while budget remains
+    if (status == VM_BUDGET_EXHAUSTED && vm_executed(lb->vm) - start < budget)
+      continue;
+    break;
+  }
+  end_diagnostics(lb);
+
+  if (status == VM_ERROR)
+    report_error(lb, vm_error(lb->vm));
+  if (status == VM_DONE || status == VM_ERROR)
+    lb->running = false;
+  return status;
+}
+
+int lb_run(LB* lb) {
+  int status;
+  do
+    status = lb_run_budget(lb, ULONG_MAX);
+  while (status == LB_BUDGET_EXHAUSTED);
+  return status;
+}
+
+void lb_provide_input(LB* lb, const char* line) {
+  vm_provide_input(lb->vm, line);
+}
+
+void lb_provide_keys(LB* lb, const char* keys, size_t len) {
+  vm_provide_keys(lb->vm, keys, len);
+}
+
+bool lb_get_number(LB* lb, const char* name, double* val) {
+  begin_diagnostics(lb);
+  bool ok = vm_get_number(lb->vm, name, val);
+  end_diagnostics(lb);
+  return ok;
+}
+
+bool lb_set_number(LB* lb, const char* name, double val) {
+  begin_diagnostics(lb);
+  bool ok = vm_set_number(lb->vm, name, val);
+  end_diagnostics(lb);
+  return ok;
+}
+
+const char* lb_get_string(LB* lb, const char* name) {
+  begin_diagnostics(lb);
+  const char* val = vm_get_string(lb->vm, name);
+  end_diagnostics(lb);
+  return val;
+}
+
+bool lb_set_string(LB* lb, const char* name, const char* val) {
+  begin_diagnostics(lb);
+  bool ok = vm_set_string(lb->vm, name, val);
+  end_diagnostics(lb);
+  return ok;
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+typedef struct {
+  char output[256];
+  char error[512];
+  const char* input;
+} TEST_HOST;
+
+static void test_output(void* context, const char* text, size_t len) {
+  TEST_HOST* host = context;
+  size_t used = strlen(host->output);
+  if (used + len < sizeof host->output) {
+    memcpy(host->output + used, text, len);
+    host->output[used + len] = '\0';
+  }
+}
+
+static bool test_input(void* context, char* line, size_t size) {
+  TEST_HOST* host = context;
+  if (host->input == NULL)
+    return false;
+  strncpy(line, host->input, size - 1);
+  line[size - 1] = '\0';
+  host->input = NULL;
+  return true;
+}
+
+static void test_error(void* context, const char* message) {
+  TEST_HOST* host = context;
+  strncat(host->error, message, sizeof host->error - strlen(host->error) - 1);
+}
+
+static LB* new_test_lb(TEST_HOST* host) {
+  memset(host, 0, sizeof *host);
+  LB* lb = lb_new();
+  lb_set_output(lb, test_output, host);
+  lb_set_input(lb, test_input, host);
+  lb_set_error(lb, test_error, host);
+  return lb;
+}
+
+static void test_run(CuTest* tc) {
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  host.input = "3";
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 INPUT N\n20 PRINT N * 2\n30 LET A$ = \"ABC\"\n"));
+  CuAssertIntEquals(tc, LB_DONE, lb_run(lb));
+  CuAssertStrEquals(tc, "?  6 \n", host.output);
+  CuAssertStrEquals(tc, "", host.error);
+
+  double n;
+  CuAssertIntEquals(tc, true, lb_get_number(lb, "N", &n));
+  CuAssertDblEquals(tc, 3, n, 0);
+  CuAssertStrEquals(tc, "ABC", lb_get_string(lb, "A$"));
+  CuAssertIntEquals(tc, false, lb_get_number(lb, "Z", &n));
+  CuAssertPtrEquals(tc, NULL, (void*) lb_get_string(lb, "N"));
+  lb_delete(lb);
+}
+
+static void test_needs_input(CuTest* tc) {
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 INPUT A$\n20 PRINT A$\n"));
+  CuAssertIntEquals(tc, LB_NEEDS_INPUT, lb_run(lb));
+  lb_provide_input(lb, "HELLO");
+  CuAssertIntEquals(tc, LB_DONE, lb_run(lb));
+  CuAssertStrEquals(tc, "? HELLO\n", host.output);
+  lb_delete(lb);
+}
+
+static void test_budget(CuTest* tc) {
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 LET I = I + 1\n20 GOTO 10\n"));
+  CuAssertIntEquals(tc, LB_BUDGET_EXHAUSTED, lb_run_budget(lb, 1000));
+  double i;
+  CuAssertIntEquals(tc, true, lb_get_number(lb, "I", &i));
+  CuAssertTrue(tc, i > 0 && i < 1000);
+  CuAssertIntEquals(tc, true, lb_set_number(lb, "I", -1000000));
+  CuAssertIntEquals(tc, LB_BUDGET_EXHAUSTED, lb_run_budget(lb, 1000));
+  CuAssertIntEquals(tc, true, lb_get_number(lb, "I", &i));
+  CuAssertTrue(tc, i > -1000000 && i < -999000);
+  lb_delete(lb);
+}
+
+static void test_errors(CuTest* tc) {
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  CuAssertIntEquals(tc, false, lb_load_string(lb, "10 PRINT\n5 PRINT\n"));
+  CuAssertPtrNotNull(tc, strstr(host.error, "not in increasing order"));
+
+  host.error[0] = '\0';
+  CuAssertIntEquals(tc, false, lb_load_string(lb, "10 PRINT (\n"));
+  CuAssertPtrNotNull(tc, strstr(host.error, "Error"));
+  host.error[0] = '\0';
+  CuAssertIntEquals(tc, LB_ERROR, lb_run(lb));
+  CuAssertPtrNotNull(tc, strstr(host.error, "Error"));
+
+  host.error[0] = '\0';
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 DIM A(3)\n20 PRINT A(4)\n"));
+  CuAssertIntEquals(tc, LB_ERROR, lb_run(lb));
+  CuAssertPtrNotNull(tc, strstr(host.error, "Runtime error"));
+  CuAssertPtrNotNull(tc, strstr(host.error, "20 PRINT A(4)"));
+  lb_delete(lb);
+}
+
+// Changing how the program is compiled while it waits for input ends the run.
+static void test_changed_while_running(CuTest* tc) {
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 INPUT A\n20 PRINT A\n"));
+  CuAssertIntEquals(tc, LB_NEEDS_INPUT, lb_run(lb));
+  lb_set_keywords_anywhere(lb, true);
+  lb_provide_input(lb, "5");
+  CuAssertIntEquals(tc, LB_ERROR, lb_run(lb));
+  CuAssertPtrNotNull(tc, strstr(host.error, "program changed"));
+
+  // the next run starts again, and variables can be read while it waits
+  host.output[0] = '\0';
+  CuAssertIntEquals(tc, LB_DONE, lb_run(lb));
+  CuAssertStrEquals(tc, " 5 \n", host.output);
+  CuAssertIntEquals(tc, LB_NEEDS_INPUT, lb_run(lb));
+  double a;
+  CuAssertIntEquals(tc, true, lb_get_number(lb, "A", &a));
+  lb_provide_input(lb, "7");
+  CuAssertIntEquals(tc, LB_DONE, lb_run(lb));
+  CuAssertIntEquals(tc, true, lb_get_number(lb, "A", &a));
+  CuAssertDblEquals(tc, 7, a, 0);
+  lb_delete(lb);
+}
+
+// Errors the lexer cannot continue from are reported, and do not end the host.
+static void test_source_errors(CuTest* tc) {
+  static const char* const PROGRAMS[] = {
+    "10 PRINT \"\xc3\xa9\"\n",
+    "10 DATA \"ABC\n",
+    "10 DATA XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX\n",
+    "10 DATA \"XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX\"\n",
+  };
+  static const char* const MESSAGES[] = {
+    "invalid character", "unterminated string", "data is too long", "string is too long",
+  };
+  TEST_HOST host;
+  LB* lb = new_test_lb(&host);
+  for (unsigned i = 0; i < sizeof PROGRAMS / sizeof PROGRAMS[0]; i++) {
+    host.error[0] = '\0';
+    CuAssertIntEquals(tc, false, lb_load_string(lb, PROGRAMS[i]));
+    CuAssertPtrNotNull(tc, strstr(host.error, MESSAGES[i]));
+    host.error[0] = '\0';
+    CuAssertIntEquals(tc, LB_ERROR, lb_run(lb));
+    CuAssertPtrNotNull(tc, strstr(host.error, MESSAGES[i]));
+  }
+  CuAssertIntEquals(tc, true, lb_load_string(lb, "10 PRINT \"OK\"\n"));
+  CuAssertIntEquals(tc, LB_DONE, lb_run(lb));
+  CuAssertStrEquals(tc, "OK\n", host.output);
+  lb_delete(lb);
+}
+
+CuSuite* legacybasic_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_run);
+  SUITE_ADD_TEST(suite, test_needs_input);
+  SUITE_ADD_TEST(suite, test_budget);
+  SUITE_ADD_TEST(suite, test_errors);
+  SUITE_ADD_TEST(suite, test_changed_while_running);
+  SUITE_ADD_TEST(suite, test_source_errors);
+  return suite;
+}
+
+#endif // UNIT_TEST
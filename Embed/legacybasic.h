@@ -0,0 +1,93 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Public interface for running BASIC programs inside another application.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Marks the functions the library exports: every other symbol in it is hidden.
+#if defined _WIN32 && defined LB_BUILDING_LIBRARY
+#define LB_API __declspec(dllexport)
+#elif defined __GNUC__
+#define LB_API __attribute__((visibility("default")))
+#else
+#define LB_API
+#endif
+
+typedef struct lb_interpreter LB;
+
+// Result of running: the same values as the interpreter's vm_status.
+enum lb_status {
+  LB_NEEDS_INPUT,      // waiting at INPUT: see lb_provide_input
+  LB_OUTPUT_READY,     // not returned by lb_run or lb_run_budget, which deliver output as it comes
+  LB_DONE,             // program ended or stopped
+  LB_ERROR,            // compilation or runtime error, reported to the error callback
+  LB_BUDGET_EXHAUSTED  // instruction budget used up
+};
+
+// Strictness flags for lb_set_strict.
+enum {
+  LB_STRICT_DIM = 1,
+  LB_STRICT_FOR = 2,        // report FOR loops left without NEXT
+  LB_STRICT_ON = 4,         // ON GOTO/GOSUB index out of range is an error
+  LB_STRICT_VARIABLES = 8   // using a variable before assigning it is an error
+};
+
+// Program output. Without a callback, output goes to stdout.
+typedef void LB_OUTPUT_CALLBACK(void* context, const char* text, size_t len);
+
+// Fill line with the next line of input for INPUT, and return true,
+// or return false if none is available yet: running then returns LB_NEEDS_INPUT.
+typedef bool LB_INPUT_CALLBACK(void* context, char* line, size_t size);
+
+// A complete error report, possibly several lines. Without a callback, errors go to stderr.
+typedef void LB_ERROR_CALLBACK(void* context, const char* message);
+
+// Initialise and release global interpreter tables.
+// Call lb_init before creating the first interpreter, and lb_deinit after deleting the last.
+LB_API void lb_init(void);
+LB_API void lb_deinit(void);
+
+LB_API LB* lb_new(void);
+LB_API void lb_delete(LB*);
+
+LB_API void lb_set_output(LB*, LB_OUTPUT_CALLBACK*, void* context);
+LB_API void lb_set_input(LB*, LB_INPUT_CALLBACK*, void* context);
+LB_API void lb_set_error(LB*, LB_ERROR_CALLBACK*, void* context);
+
+LB_API void lb_set_keywords_anywhere(LB*, bool);
+LB_API void lb_set_array_base(LB*, unsigned base);  // 0 or 1
+LB_API void lb_set_strict(LB*, unsigned flags);
+
+// Load a program, replacing any previous one. Return false on error.
+LB_API bool lb_load_string(LB*, const char* text);
+LB_API bool lb_load_file(LB*, const char* file_name);
+
+// Run the program from the start, or continue it, until it ends or needs input
+// which the input callback cannot provide.
+LB_API int lb_run(LB*);
+
+// As lb_run, but return LB_BUDGET_EXHAUSTED after about budget instructions.
+// Call again to continue. A program can be continued on a different thread.
+LB_API int lb_run_budget(LB*, unsigned long budget);
+
+// Provide a line of input for INPUT, or keys for INKEY$.
+LB_API void lb_provide_input(LB*, const char* line);
+LB_API void lb_provide_keys(LB*, const char* keys, size_t len);
+
+// Inspect and set simple variables. Names include any $ suffix.
+// Return false, or NULL, if the program has no such variable.
+LB_API bool lb_get_number(LB*, const char* name, double*);
+LB_API bool lb_set_number(LB*, const char* name, double);
+LB_API const char* lb_get_string(LB*, const char* name);
+LB_API bool lb_set_string(LB*, const char* name, const char* value);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,265 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Microbenchmarks of the interpreter's core data structures, reported in
+// nanoseconds per operation. Run with substrings of benchmark names to
+// select some of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lexer.h"
+#include "token.h"
+#include "symbol.h"
+#include "linemap.h"
+#include "source.h"
+#include "arrays.h"
+#include "os.h"
+#include "utils.h"
+
+// Each benchmark repeats an operation ops times on a structure of the given size,
+// and returns the time taken in nanoseconds, excluding setting up the structure.
+typedef unsigned long long BENCHMARK(unsigned size, unsigned long ops);
+
+// in run.c
+unsigned long long bench_string_stack(unsigned depth, unsigned long ops);
+
+#define MIN_NSEC (100 * 1000 * 1000ULL)
+
+static unsigned long rand_state = 1;
+
+// Deterministic pseudo-random numbers, so that runs are comparable.
+static unsigned random_below(unsigned n) {
+  rand_state = rand_state * 1103515245 + 12345;
+  return (unsigned) ((rand_state >> 8) % n);
+}
+
+static char* const * selected;
+
+static bool is_selected(const char* name) {
+  if (*selected == NULL)
+    return true;
+  for (char* const * s = selected; *s; s++) {
+    if (strstr(name, *s))
+      return true;
+  }
+  return false;
+}
+
+// Run a benchmark with more operations until it takes long enough to time.
+static void measure(const char* name, BENCHMARK* bench, unsigned size, unsigned long ops) {
+  char title[64];
+  snprintf(title, sizeof title, "%s %u", name, size);
+  if (!is_selected(title))
+    return;
+  unsigned long long nsec = bench(size, ops);
+  while (nsec < MIN_NSEC && ops < 1000000000UL / 4) {
+    ops *= 4;
+    nsec = bench(size, ops);
+  }
+  printf("%-36s %12.1f ns/op %12lu ops\n", title, (double) nsec / ops, ops);
+  fflush(stdout);
+}
+
+static const char* const NORMAL_LINE = "FOR I = 1 TO 10: PRINT A$(I); TAB(5); X * 2 + Y: NEXT I";
+static const char* const CRUNCHED_LINE = "FORI=1TO10:PRINTA$(I);TAB(5);X*2+Y:NEXTI";
+
+static unsigned long long lex_bench(const char* text, bool crunched, unsigned long ops) {
+  LEX* lex = new_lex("bench", crunched);
+  unsigned long tokens = 0;
+  const unsigned long long start = clock_nsec();
+  while (tokens < ops) {
+    for (int t = lex_line(lex, 100, text); t != '\n' && t != TOK_EOF; t = lex_next(lex))
+      tokens++;
+  }
+  const unsigned long long nsec = clock_nsec() - start;
+  delete_lex(lex);
+  // report per token
+  return nsec * ops / tokens;
+}
+
+static unsigned long long lex_normal(unsigned size, unsigned long ops) {
+  (void) size;
+  return lex_bench(NORMAL_LINE, false, ops);
+}
+
+static unsigned long long lex_crunched(unsigned size, unsigned long ops) {
+  (void) size;
+  return lex_bench(CRUNCHED_LINE, true, ops);
+}
+
+static char* * symbol_names(unsigned size) {
+  char* * names = emalloc(size * sizeof names[0]);
+  for (unsigned i = 0; i < size; i++) {
+    char name[16];
+    sprintf(name, "V%u", i);
+    names[i] = estrdup(name);
+  }
+  return names;
+}
+
+static void delete_symbol_names(char* * names, unsigned size) {
+  for (unsigned i = 0; i < size; i++)
+    efree(names[i]);
+  efree(names);
+}
+
+static unsigned long long symbol_lookup(unsigned size, unsigned long ops) {
+  char* * names = symbol_names(size);
+  SYMTAB* st = new_symbol_table();
+  for (unsigned i = 0; i < size; i++)
+    sym_insert(st, names[i], SYM_VARIABLE, TYPE_NUM);
+  unsigned found = 0;
+  const unsigned long long start = clock_nsec();
+  for (unsigned long n = 0; n < ops; n++)
+    found += sym_lookup(st, names[random_below(size)], false) != NULL;
+  const unsigned long long nsec = clock_nsec() - start;
+  if (found != ops)
+    fatal("symbol lookup failed\n");
+  delete_symbol_table(st);
+  delete_symbol_names(names, size);
+  return nsec;
+}
+
+static unsigned long long symbol_insert(unsigned size, unsigned long ops) {
+  char* * names = symbol_names(size);
+  unsigned long long nsec = 0;
+  for (unsigned long n = 0; n < ops; n += size) {
+    SYMTAB* st = new_symbol_table();
+    const unsigned long long start = clock_nsec();
+    for (unsigned i = 0; i < size; i++)
+      sym_insert(st, names[i], SYM_VARIABLE, TYPE_NUM);
+    nsec += clock_nsec() - start;
+    delete_symbol_table(st);
+  }
+  delete_symbol_names(names, size);
+  return nsec;
+}
+
+static unsigned long long line_lookup(unsigned size, unsigned long ops, unsigned spacing) {
+  unsigned* lines = emalloc(size * sizeof lines[0]);
+  LINE_MAP* map = new_line_map(size);
+  unsigned num = 0;
+  for (unsigned i = 0; i < size; i++) {
+    num += spacing == 1 ? 1 : 1 + random_below(spacing);
+    lines[i] = num;
+    insert_line_mapping(map, num, i);
+  }
+  unsigned found = 0;
+  const unsigned long long start = clock_nsec();
+  for (unsigned long n = 0; n < ops; n++) {
+    unsigned value;
+    found += lookup_line_mapping(map, lines[random_below(size)], &value);
+  }
+  const unsigned long long nsec = clock_nsec() - start;
+  if (found != ops)
+    fatal("line lookup failed\n");
+  delete_line_map(map);
+  efree(lines);
+  return nsec;
+}
+
+static unsigned long long line_lookup_dense(unsigned size, unsigned long ops) {
+  return line_lookup(size, ops, 1);
+}
+
+static unsigned long long line_lookup_sparse(unsigned size, unsigned long ops) {
+  return line_lookup(size, ops, 1000);
+}
+
+static unsigned long long enter_source(unsigned size, unsigned long ops, bool random) {
+  unsigned* lines = emalloc(size * sizeof lines[0]);
+  for (unsigned i = 0; i < size; i++)
+    lines[i] = 10 * (i + 1);
+  if (random) {
+    for (unsigned i = size - 1; i > 0; i--) {
+      unsigned j = random_below(i + 1);
+      unsigned t = lines[i];
+      lines[i] = lines[j];
+      lines[j] = t;
+    }
+  }
+  unsigned long long nsec = 0;
+  for (unsigned long n = 0; n < ops; n += size) {
+    SOURCE* source = new_source("bench");
+    const unsigned long long start = clock_nsec();
+    for (unsigned i = 0; i < size; i++)
+      enter_source_line(source, lines[i], "PRINT \"HELLO\"; A; B$");
+    nsec += clock_nsec() - start;
+    delete_source(source);
+  }
+  efree(lines);
+  return nsec;
+}
+
+static unsigned long long enter_source_in_order(unsigned size, unsigned long ops) {
+  return enter_source(size, ops, false);
+}
+
+static unsigned long long enter_source_random(unsigned size, unsigned long ops) {
+  return enter_source(size, ops, true);
+}
+
+static unsigned long long array_element(unsigned size, unsigned long ops, unsigned dimensions) {
+  const unsigned max[MAX_DIMENSIONS] = { size, size };
+  struct numeric_array * a = new_numeric_array(0, dimensions, max);
+  double sum = 0;
+  const unsigned long long start = clock_nsec();
+  for (unsigned long n = 0; n < ops; n++) {
+    const unsigned indexes[MAX_DIMENSIONS] = { n % (size + 1), n / 7 % (size + 1) };
+    double* p;
+    if (!compute_numeric_element(a, dimensions, indexes, &p))
+      fatal("array element out of range\n");
+    sum += *p;
+  }
+  const unsigned long long nsec = clock_nsec() - start;
+  delete_numeric_array(a);
+  if (sum != 0)
+    fatal("array element not zero\n");
+  return nsec;
+}
+
+static unsigned long long array_1d(unsigned size, unsigned long ops) {
+  return array_element(size, ops, 1);
+}
+
+static unsigned long long array_2d(unsigned size, unsigned long ops) {
+  return array_element(size, ops, 2);
+}
+
+static unsigned long long string_stack(unsigned depth, unsigned long ops) {
+  return bench_string_stack(depth, ops);
+}
+
+int main(int argc, char* argv[]) {
+  (void) argc;  // the names of benchmarks to run end at the null argv[argc]
+  selected = argv + 1;
+  init_keywords();
+
+  measure("lex_next normal", lex_normal, 1, 10000);
+  measure("lex_next crunched", lex_crunched, 1, 10000);
+
+  static const unsigned SYMBOLS[] = { 10, 100, 1000, 10000 };
+  for (unsigned i = 0; i < sizeof SYMBOLS / sizeof SYMBOLS[0]; i++)
+    measure("sym_lookup", symbol_lookup, SYMBOLS[i], 10000);
+  for (unsigned i = 0; i < sizeof SYMBOLS / sizeof SYMBOLS[0]; i++)
+    measure("sym_insert", symbol_insert, SYMBOLS[i], SYMBOLS[i]);
+
+  static const unsigned LINES[] = { 100, 1000, 10000 };
+  for (unsigned i = 0; i < sizeof LINES / sizeof LINES[0]; i++)
+    measure("lookup_line_mapping dense", line_lookup_dense, LINES[i], 10000);
+  for (unsigned i = 0; i < sizeof LINES / sizeof LINES[0]; i++)
+    measure("lookup_line_mapping sparse", line_lookup_sparse, LINES[i], 10000);
+  for (unsigned i = 0; i < sizeof LINES / sizeof LINES[0]; i++)
+    measure("enter_source_line in order", enter_source_in_order, LINES[i], LINES[i]);
+  for (unsigned i = 0; i < sizeof LINES / sizeof LINES[0]; i++)
+    measure("enter_source_line random", enter_source_random, LINES[i], LINES[i]);
+
+  measure("compute_numeric_element 1D", array_1d, 1000, 10000);
+  measure("compute_numeric_element 2D", array_2d, 100, 10000);
+
+  measure("push_str/pop_str", string_stack, 1, 10000);
+  measure("push_str/pop_str", string_stack, 8, 10000);
+
+  deinit_keywords();
+  return EXIT_SUCCESS;
+}
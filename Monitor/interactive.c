@@ -28,10 +28,13 @@ enum command_tokens {
   CMD_HELP,
   CMD_LIST,
   CMD_LOAD,
+  CMD_MEMORY,
   CMD_NEW,
   CMD_RENUM,
+  CMD_RESUME,
   CMD_RUN,
   CMD_SAVE,
+  CMD_SNAPSHOT,
 };
 
 static const struct command {
@@ -45,11 +48,14 @@ static const struct command {
   { "HELP", 4, CMD_HELP },
   { "LIST", 4, CMD_LIST },
   { "LOAD", 4, CMD_LOAD },
+  { "MEMORY", 6, CMD_MEMORY },
   { "NEW", 3, CMD_NEW },
   { "RENUM", 5, CMD_RENUM },
   { "RENUMBER", 8, CMD_RENUM },
+  { "RESUME", 6, CMD_RESUME },
   { "RUN", 3, CMD_RUN },
   { "SAVE", 4, CMD_SAVE },
+  { "SNAPSHOT", 8, CMD_SNAPSHOT },
 };
 
 static int find_command(const char* cmd, unsigned len) {
@@ -68,10 +74,13 @@ static void help(void) {
   puts("HELP                      show this help");
   puts("LIST [[start]-[end]][P]   list current file");
   puts("LOAD \"program.bas\"        load source from file");
+  puts("MEMORY                    show memory in use by category");
   puts("NEW                       wipe current file from memory");
   puts("RENUM [new[,old[,inc]]]   renumber program lines");
+  puts("RESUME \"state.snp\"       restore program and state from snapshot and continue");
   puts("RUN                       run current file as a Basic program");
   puts("SAVE \"program.bas\"        save current file under given name");
+  puts("SNAPSHOT \"state.snp\"     save program and its running state");
   puts("*DIR                      run DIR or other operating system command");
 }
 
@@ -192,6 +201,10 @@ static void command(VM* vm, int cmd, char* line, bool *quit) {
     case CMD_HELP:
       help();
       break;
+    case CMD_MEMORY:
+      if (check_eol(line))
+        print_mem_stats(stdout);
+      break;
     case CMD_NEW:
       if (check_eol(line)) {
         vm_new_program(vm);
@@ -223,6 +236,24 @@ static void command(VM* vm, int cmd, char* line, bool *quit) {
         error("Quoted file name expected");
       break;
     }
+    case CMD_SNAPSHOT: {
+      const char* str;
+      if ((line = demarcate_string(line, &str)) && check_eol(line))
+        vm_save_snapshot(vm, str);
+      else
+        error("Quoted file name expected");
+      break;
+    }
+    case CMD_RESUME: {
+      const char* str;
+      if ((line = demarcate_string(line, &str)) && check_eol(line)) {
+        if (vm_load_snapshot(vm, str) && vm_can_continue(vm))
+          vm_continue(vm);
+      }
+      else
+        error("Quoted file name expected");
+      break;
+    }
     case CMD_RENUM: {
       unsigned new = 10, old = 1, inc = 10;
       line = get_renum_numbers(line, &new, &old, &inc);
@@ -309,18 +340,16 @@ static void list(const VM* vm, unsigned start, unsigned end, bool page) {
   if (src && source_lines(src)) {
     trap_interrupt();
     unsigned count = 0;
-    for (unsigned i = 0; i < source_lines(src) && !interrupted; i++) {
+    for (unsigned i = find_source_position(src, start); i < source_lines(src) && !interrupted; i++) {
       const unsigned lineno = source_linenum(src, i);
       if (lineno > end)
         break;
-      if (lineno >= start && lineno <= end) {
-        printf("%u %s", source_linenum(src, i), source_text(src, i));
-        count++;
-        if (page && count % PAGE == PAGE-1 && i + 1 < source_lines(src))
-          await_newline();
-        else
-          putchar('\n');
-      }
+      printf("%u %s", lineno, source_text(src, i));
+      count++;
+      if (page && count % PAGE == PAGE-1 && i + 1 < source_lines(src))
+        await_newline();
+      else
+        putchar('\n');
     }
     untrap_interrupt();
   }
@@ -359,9 +388,11 @@ static void renumber(VM* vm, unsigned new_start, unsigned old_start, unsigned in
     }
   }
 
-  // update line numbers in source text
+  // patch line numbers in the stored lines, lexing tokenized lines without spelling them out
+  set_source_token_mode(source, vm_keywords_anywhere(vm));
   for (unsigned line = 0; line < source_lines(source); line++) {
-    int tok = lex_line(lex, line, source_text(source, line));
+    const char* tokens = source_tokens(source, line);
+    int tok = tokens ? lex_tokenized_line(lex, line, tokens) : lex_line(lex, line, source_text(source, line));
     while (tok != TOK_EOF && tok != '\n') {
       if (takes_line_number(tok)) {
         tok = lex_next(lex);
@@ -377,7 +408,8 @@ static void renumber(VM* vm, unsigned new_start, unsigned old_start, unsigned in
                 error("internal error: renumbering: replacing line number in source line");
                 goto bail;
               }
-              tok = lex_refresh(lex, source_text(source, line));
+              tokens = source_tokens(source, line);
+              tok = lex_refresh(lex, tokens ? tokens : source_text(source, line));
               if (tok != TOK_NUM) {
                 error("internal error: renumbering: retokenising update source text");
                 goto bail;
@@ -0,0 +1,171 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Arena allocator.
+
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+#include "utils.h"
+
+enum { MAX_CHUNK = 64 * 1024 };
+
+typedef union {
+  long double d;
+  void* p;
+  long long n;
+} ALIGN;
+
+struct chunk {
+  struct chunk * prev;
+  size_t size;
+  union {
+    ALIGN align;
+    char bytes[1];
+  } data;
+};
+
+struct arena {
+  int category;
+  size_t first_chunk;
+  struct chunk * chunk;  // the current chunk, linked to earlier ones
+  size_t next;           // offset of free space in the current chunk
+  size_t used;
+  size_t size;           // total size of chunks
+};
+
+ARENA* new_arena(int category, size_t first_chunk) {
+  ARENA* a = ecalloc_in(category, 1, sizeof *a);
+  a->category = category;
+  a->first_chunk = first_chunk ? first_chunk : 1;
+  return a;
+}
+
+static void free_chunks(struct chunk * c) {
+  while (c) {
+    struct chunk * prev = c->prev;
+    efree(c);
+    c = prev;
+  }
+}
+
+void delete_arena(ARENA* a) {
+  if (a) {
+    free_chunks(a->chunk);
+    efree(a);
+  }
+}
+
+static void new_chunk(ARENA* a, size_t need) {
+  size_t size = a->chunk ? 2 * a->chunk->size : a->first_chunk;
+  if (size > MAX_CHUNK)
+    size = MAX_CHUNK;
+  if (size < need)
+    size = need;
+  struct chunk * c = emalloc_in(a->category, offsetof(struct chunk, data) + size);
+  c->prev = a->chunk;
+  c->size = size;
+  a->chunk = c;
+  a->next = 0;
+  a->size += size;
+}
+
+static void* alloc(ARENA* a, size_t n, size_t align) {
+  assert(a != NULL);
+  size_t start = a->chunk ? (a->next + align - 1) / align * align : 0;
+  if (a->chunk == NULL || start + n > a->chunk->size) {
+    new_chunk(a, n);
+    start = 0;
+  }
+  a->next = start + n;
+  a->used += n;
+  return a->chunk->data.bytes + start;
+}
+
+void* arena_alloc(ARENA* a, size_t n) {
+  return alloc(a, n ? n : 1, sizeof (ALIGN));
+}
+
+char* arena_strdup(ARENA* a, const char* s) {
+  if (s == NULL)
+    return NULL;
+  size_t n = strlen(s) + 1;
+  char* t = alloc(a, n, 1);
+  memcpy(t, s, n);
+  return t;
+}
+
+void arena_reset(ARENA* a) {
+  assert(a != NULL);
+  struct chunk * largest = NULL;
+  for (struct chunk * c = a->chunk; c; c = c->prev) {
+    if (largest == NULL || c->size > largest->size)
+      largest = c;
+  }
+  if (largest) {
+    // unlink the chunk to keep, and free the rest
+    struct chunk * * link = &a->chunk;
+    while (*link != largest)
+      link = &(*link)->prev;
+    *link = largest->prev;
+    free_chunks(a->chunk);
+    largest->prev = NULL;
+  }
+  a->chunk = largest;
+  a->size = largest ? largest->size : 0;
+  a->next = 0;
+  a->used = 0;
+}
+
+size_t arena_used(const ARENA* a) {
+  return a->used;
+}
+
+size_t arena_size(const ARENA* a) {
+  return a->size;
+}
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_arena(CuTest* tc) {
+  ARENA* a = new_arena(MEM_OTHER, 64);
+  CuAssertIntEquals(tc, 0, arena_used(a));
+  CuAssertIntEquals(tc, 0, arena_size(a));
+
+  char* s = arena_strdup(a, "hello");
+  CuAssertStrEquals(tc, "hello", s);
+  CuAssertPtrEquals(tc, NULL, arena_strdup(a, NULL));
+  CuAssertIntEquals(tc, 6, arena_used(a));
+  CuAssertIntEquals(tc, 64, arena_size(a));
+
+  double* d = arena_alloc(a, sizeof *d);
+  CuAssertIntEquals(tc, 0, (unsigned) ((size_t) d % sizeof (ALIGN)));
+  *d = 1.5;
+
+  // more than a chunk: the chunks grow
+  char* big = arena_alloc(a, 1000);
+  memset(big, 'x', 1000);
+  CuAssertTrue(tc, arena_size(a) >= 64 + 1000);
+  for (unsigned i = 0; i < 100; i++)
+    CuAssertStrEquals(tc, "abc", arena_strdup(a, "abc"));
+  CuAssertStrEquals(tc, "hello", s);
+  CuAssertDblEquals(tc, 1.5, *d, 0);
+
+  const size_t size = arena_size(a);
+  arena_reset(a);
+  CuAssertIntEquals(tc, 0, arena_used(a));
+  CuAssertTrue(tc, arena_size(a) >= 1000 && arena_size(a) < size);
+  CuAssertStrEquals(tc, "again", arena_strdup(a, "again"));
+
+  delete_arena(a);
+  delete_arena(NULL);
+}
+
+CuSuite* arena_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_arena);
+  return suite;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,28 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Arena allocator: many small blocks with a common lifetime,
+// allocated by advancing a pointer and all freed together.
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct arena ARENA;
+
+// Blocks are taken from chunks of the given category (enum mem_category),
+// starting at first_chunk bytes and growing as more are needed.
+ARENA* new_arena(int category, size_t first_chunk);
+void delete_arena(ARENA*);
+
+// Aligned for any type.
+void* arena_alloc(ARENA*, size_t);
+
+// Copy a string, without alignment. NULL is copied as NULL.
+char* arena_strdup(ARENA*, const char*);
+
+// Free all blocks, keeping the largest chunk for reuse.
+void arena_reset(ARENA*);
+
+// Bytes allocated from the arena, and bytes of chunks holding them.
+size_t arena_used(const ARENA*);
+size_t arena_size(const ARENA*);
@@ -3,6 +3,7 @@
 // Symbol hashing.
 
 #include "ctype.h"
+#include "hash.h"
 
 // Aho, Sethi, Ullman "Compilers: Principles, Techniques, and Tools" (1986) p. 436
 
@@ -29,3 +30,15 @@ unsigned hashpjw_upper_len(const char *s, unsigned len) {
     h = hash_in(h, toupper(*p));
   return h;
 }
+
+// Fowler, Noll, Vo: FNV-1a
+// http://www.isthe.com/chongo/tech/comp/fnv/
+
+unsigned long long hash_fnv1a(const void *data, size_t len, unsigned long long h) {
+  const unsigned char* p = data;
+  while (len--) {
+    h ^= *p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
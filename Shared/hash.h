@@ -4,5 +4,11 @@
 
 #pragma once
 
+#include <stddef.h>
+
 unsigned hashpjw_upper(const char *);
 unsigned hashpjw_upper_len(const char *, unsigned len);
+
+// 64-bit FNV-1a, for content hashing. Chain calls by passing the previous result.
+#define FNV1A_BASIS (14695981039346656037ULL)
+unsigned long long hash_fnv1a(const void *, size_t len, unsigned long long h);
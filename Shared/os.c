@@ -5,6 +5,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "os.h"
+#include "utils.h"
+
+#ifdef LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
 
 void clear_screen(void) {
   const char* CMD =
@@ -22,6 +34,238 @@ void clear_screen(void) {
   }
 }
 
+#ifdef LINUX
+// The terminal mode to restore after polling keys, while the terminal is raw.
+static struct termios cooked;
+static bool raw_keyboard;
+#endif
+
+// The terminal stays raw from the first poll until restored,
+// so that a program polling in a loop makes one system call per poll.
+int poll_key(void) {
+#if defined WINDOWS
+  return _kbhit() ? _getch() : -1;
+#elif defined LINUX
+  if (!raw_keyboard) {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &cooked) != 0)
+      return -1;
+    struct termios raw = cooked;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+      return -1;
+    static bool registered;
+    if (!registered) {
+      atexit(restore_keyboard);
+      registered = true;
+    }
+    raw_keyboard = true;
+  }
+  unsigned char ch;
+  return read(STDIN_FILENO, &ch, 1) == 1 ? ch : -1;
+#else
+  return -1;
+#endif
+}
+
+void restore_keyboard(void) {
+#ifdef LINUX
+  if (raw_keyboard) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &cooked);
+    raw_keyboard = false;
+  }
+#endif
+}
+
+static bool read_file(const char* name, MAPPED_FILE* mf) {
+  FILE* fp = fopen(name, "rb");
+  if (fp == NULL)
+    return false;
+  bool ok = false;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long size = ftell(fp);
+    if (size >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+      char* data = emalloc((size_t) size + 1);
+      if (fread(data, 1, (size_t) size, fp) == (size_t) size) {
+        data[size] = '\0';
+        mf->data = data;
+        mf->size = (size_t) size;
+        mf->mapped = false;
+        ok = true;
+      }
+      else
+        efree(data);
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+bool map_file(const char* name, MAPPED_FILE* mf) {
+  mf->data = NULL;
+  mf->size = 0;
+  mf->mapped = false;
+#ifdef LINUX
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      mf->data = p;
+      mf->size = (size_t) st.st_size;
+      mf->mapped = true;
+      return true;
+    }
+  }
+  close(fd);
+#endif
+  return read_file(name, mf);
+}
+
+void unmap_file(MAPPED_FILE* mf) {
+  if (mf->data) {
+#ifdef LINUX
+    if (mf->mapped)
+      munmap((void*) mf->data, mf->size);
+    else
+#endif
+      efree((void*) mf->data);
+  }
+  mf->data = NULL;
+  mf->size = 0;
+  mf->mapped = false;
+}
+
+bool create_mapped_file(const char* name, size_t size, WRITABLE_FILE* wf) {
+  wf->data = NULL;
+  wf->size = size;
+  wf->mapped = false;
+  wf->name = NULL;
+#ifdef LINUX
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  if (ftruncate(fd, (off_t) size) == 0) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      wf->data = p;
+      wf->mapped = true;
+      return true;
+    }
+  }
+  close(fd);
+  return false;
+#else
+  FILE* fp = fopen(name, "wb");
+  if (fp == NULL)
+    return false;
+  fclose(fp);
+  wf->data = ecalloc(1, size);
+  wf->name = estrdup(name);
+  return true;
+#endif
+}
+
+bool close_mapped_file(WRITABLE_FILE* wf) {
+  bool ok = true;
+  if (wf->data) {
+#ifdef LINUX
+    if (wf->mapped)
+      ok = munmap(wf->data, wf->size) == 0;
+    else
+#endif
+    {
+      FILE* fp = fopen(wf->name, "wb");
+      ok = fp && fwrite(wf->data, 1, wf->size, fp) == wf->size;
+      if (fp && fclose(fp) != 0)
+        ok = false;
+      efree(wf->data);
+    }
+  }
+  efree(wf->name);
+  wf->data = NULL;
+  wf->size = 0;
+  wf->mapped = false;
+  wf->name = NULL;
+  return ok;
+}
+
+#ifdef LINUX
+#include <time.h>
+
+unsigned long process_id(void) {
+  return (unsigned long) getpid();
+}
+
+bool replace_file(const char* from, const char* to) {
+  return rename(from, to) == 0;
+}
+
+unsigned long long clock_nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+unsigned long long cpu_nsec(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return 0;
+  const unsigned long long usec =
+    (unsigned long long) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+    (unsigned long long) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+  return usec * 1000;
+}
+
+void start_timer(TIMER* t) {
+  t->freq = 1000000000;
+  t->cpu_start = cpu_nsec();
+  t->start = (long long) clock_nsec();
+}
+
+void stop_timer(TIMER* t) {
+  t->stop = (long long) clock_nsec();
+  t->cpu_stop = cpu_nsec();
+}
+
+static void (*sample_handler)(void);
+
+static void on_sigprof(int sig) {
+  (void) sig;
+  if (sample_handler)
+    sample_handler();
+}
+
+bool start_sampling(unsigned interval_usec, void (*handler)(void)) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = on_sigprof;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sample_handler = handler;
+  if (sigaction(SIGPROF, &sa, NULL) != 0)
+    return false;
+  struct itimerval it;
+  it.it_interval.tv_sec = interval_usec / 1000000;
+  it.it_interval.tv_usec = interval_usec % 1000000;
+  it.it_value = it.it_interval;
+  return setitimer(ITIMER_PROF, &it, NULL) == 0;
+}
+
+void stop_sampling(void) {
+  struct itimerval it;
+  memset(&it, 0, sizeof it);
+  setitimer(ITIMER_PROF, &it, NULL);
+  signal(SIGPROF, SIG_IGN);
+  sample_handler = NULL;
+}
+#endif // LINUX
+
 #ifdef WINDOWS
 
 #pragma warning (disable: 5105)
@@ -29,12 +273,22 @@ void clear_screen(void) {
 #include <limits.h>
 #include <Windows.h>
 
+unsigned long process_id(void) {
+  return GetCurrentProcessId();
+}
+
+// rename fails on Windows if the new name exists
+bool replace_file(const char* from, const char* to) {
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
 // https://learn.microsoft.com/en-us/windows/win32/sysinfo/acquiring-high-resolution-time-stamps
 
 void start_timer(TIMER* t) {
   LARGE_INTEGER i;
   QueryPerformanceFrequency(&i);
   t->freq = i.QuadPart;
+  t->cpu_start = cpu_nsec();
   QueryPerformanceCounter(&i);
   t->start = i.QuadPart;
 }
@@ -43,14 +297,48 @@ void stop_timer(TIMER* t) {
   LARGE_INTEGER i;
   QueryPerformanceCounter(&i);
   t->stop = i.QuadPart;
+  t->cpu_stop = cpu_nsec();
 }
 
+unsigned long long cpu_nsec(void) {
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    return 0;
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  // 100-nanosecond units
+  return (k.QuadPart + u.QuadPart) * 100;
+}
+
+unsigned long long clock_nsec(void) {
+  static long long freq;
+  LARGE_INTEGER i;
+  if (freq == 0) {
+    QueryPerformanceFrequency(&i);
+    freq = i.QuadPart;
+  }
+  QueryPerformanceCounter(&i);
+  unsigned long long ticks = (unsigned long long) i.QuadPart;
+  return ticks / freq * 1000000000ULL + ticks % freq * 1000000000ULL / freq;
+}
+
+#endif // WINDOWS
+
+#if HAS_TIMER
 long long elapsed_usec(const TIMER* t) {
   const long long MILLION = 1000000;
   long long ticks = t->stop - t->start;
-  if (ticks < 0 || ticks > LLONG_MAX / MILLION)
+  if (ticks < 0 || t->freq <= 0)
     return 0;
-  ticks *= MILLION;
-  return ticks / t->freq;
+  return ticks / t->freq * MILLION + ticks % t->freq * MILLION / t->freq;
 }
-#endif // WINDOWS
+
+long long elapsed_cpu_usec(const TIMER* t) {
+  if (t->cpu_stop < t->cpu_start)
+    return 0;
+  return (long long) ((t->cpu_stop - t->cpu_start) / 1000);
+}
+#endif // HAS_TIMER
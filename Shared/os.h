@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <string.h>
 
 #ifndef LINUX
@@ -21,30 +22,87 @@
 #if defined LINUX
 #define STRICMP strcasecmp
 #define STRNICMP strncasecmp
-#define HAS_KBHIT 0
-#define HAS_GETCH 0
-#define HAS_TIMER 0
+#define HAS_TIMER 1
+#define HAS_SAMPLING 1
 #elif defined WINDOWS
 #include <conio.h>
-#define HAS_KBHIT 1
-#define HAS_GETCH 1
 #define HAS_TIMER 1
+#define HAS_SAMPLING 0
 #define STRICMP _stricmp
 #define STRNICMP _strnicmp
 #else
 #error unknown operating system
 #endif
 
+#if defined _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 void clear_screen(void);
 
+// Return the next key pressed, without waiting or echoing, or -1 if none.
+int poll_key(void);
+
+// End the raw terminal mode poll_key enters, before reading lines or on finishing.
+void restore_keyboard(void);
+
+// Read-only view of a whole file: memory-mapped where supported,
+// otherwise read into memory in one block. Not necessarily NUL-terminated.
+typedef struct {
+  const char* data;
+  size_t size;
+  bool mapped;
+} MAPPED_FILE;
+
+bool map_file(const char* name, MAPPED_FILE*);
+void unmap_file(MAPPED_FILE*);
+
+// Writable view of a new zero-filled file: memory-mapped where supported,
+// so that what is written survives the process ending abruptly,
+// otherwise kept in memory and written to the file when closed.
+typedef struct {
+  char* data;
+  size_t size;
+  bool mapped;
+  char* name;
+} WRITABLE_FILE;
+
+bool create_mapped_file(const char* name, size_t size, WRITABLE_FILE*);
+bool close_mapped_file(WRITABLE_FILE*);
+
+// Identifies the running process, for naming files only it writes.
+unsigned long process_id(void);
+
+// Rename a file, replacing in one step any file already having the new name.
+bool replace_file(const char* from, const char* to);
+
+// Monotonic clock for measuring intervals, in nanoseconds from an arbitrary start.
+unsigned long long clock_nsec(void);
+
+// CPU time used by the process, user and system, in nanoseconds.
+unsigned long long cpu_nsec(void);
+
+#if HAS_SAMPLING
+// Call handler from a signal, every interval of CPU time used by the process,
+// until stop_sampling.
+bool start_sampling(unsigned interval_usec, void (*handler)(void));
+void stop_sampling(void);
+#endif // HAS_SAMPLING
+
 #if HAS_TIMER
+// Wall clock and process CPU time of an interval.
 typedef struct {
   long long freq;
   long long start;
   long long stop;
+  unsigned long long cpu_start;
+  unsigned long long cpu_stop;
 } TIMER;
 
 void start_timer(TIMER*);
 void stop_timer(TIMER*);
 long long elapsed_usec(const TIMER*);
+long long elapsed_cpu_usec(const TIMER*);
 #endif // HAS_TIMER
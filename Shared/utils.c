@@ -8,9 +8,20 @@
 #include <stdarg.h>
 #include <assert.h>
 #include "utils.h"
+#include "os.h"
 
 const char* progname;
 
+static THREAD_LOCAL FILE* diagnostics_stream;
+
+FILE* diagnostics(void) {
+  return diagnostics_stream ? diagnostics_stream : stderr;
+}
+
+void set_diagnostics(FILE* fp) {
+  diagnostics_stream = fp;
+}
+
 void fatal(const char* fmt, ...) {
   fflush(stdout);
   va_list ap;
@@ -35,54 +46,152 @@ void error(const char* fmt, ...) {
 unsigned long malloc_count;
 unsigned long free_count;
 
-void* emalloc(size_t sz) {
-  void* p = malloc(sz);
-  if (p == NULL)
-    fatal("out of memory (emalloc)\n");
+// Each block is preceded by its size and category, so that freeing it can be accounted.
+typedef union {
+  struct {
+    size_t size;
+    unsigned char category;
+  } h;
+  long double align;
+} BLOCK_HEADER;
+
+static MEM_STATS stats[MEM_CATEGORIES];
+static size_t live_bytes, peak_bytes;
+
+// Size classes by powers of 4, from 16 bytes or fewer to more than 64K.
+static unsigned size_class(size_t size) {
+  unsigned c = 0;
+  for (size_t limit = 16; size > limit && c < MEM_SIZE_CLASSES - 1; limit *= 4)
+    c++;
+  return c;
+}
+
+static void* account_alloc(BLOCK_HEADER* b, int category, size_t size) {
+  assert(category >= 0 && category < MEM_CATEGORIES);
+  MEM_STATS* s = &stats[category];
+  b->h.size = size;
+  b->h.category = (unsigned char) category;
+  s->allocs++;
+  s->sizes[size_class(size)]++;
+  s->live += size;
+  if (s->live > s->peak)
+    s->peak = s->live;
+  live_bytes += size;
+  if (live_bytes > peak_bytes)
+    peak_bytes = live_bytes;
   malloc_count++;
-  return p;
+  return b + 1;
 }
 
-void* erealloc(void* p, size_t sz) {
-  if (p)
-    free_count++;
-  p = realloc(p, sz);
-  if (p == NULL)
+static void account_free(const BLOCK_HEADER* b) {
+  MEM_STATS* s = &stats[b->h.category];
+  s->frees++;
+  s->live -= b->h.size;
+  live_bytes -= b->h.size;
+  free_count++;
+}
+
+void* emalloc_in(int category, size_t sz) {
+  BLOCK_HEADER* b = malloc(sizeof *b + sz);
+  if (b == NULL)
+    fatal("out of memory (emalloc)\n");
+  return account_alloc(b, category, sz);
+}
+
+void* emalloc(size_t sz) {
+  return emalloc_in(MEM_OTHER, sz);
+}
+
+void* erealloc_in(int category, void* p, size_t sz) {
+  BLOCK_HEADER* b = NULL;
+  if (p) {
+    b = (BLOCK_HEADER*) p - 1;
+    account_free(b);
+  }
+  b = realloc(b, sizeof *b + sz);
+  if (b == NULL)
     fatal("out of memory (erealloc)\n");
-  malloc_count++;
-  return p;
+  return account_alloc(b, category, sz);
 }
 
-void* ecalloc(size_t count, size_t size) {
-  void* p = calloc(count, size);
-  if (p == NULL)
+void* erealloc(void* p, size_t sz) {
+  return erealloc_in(p ? ((BLOCK_HEADER*) p - 1)->h.category : MEM_OTHER, p, sz);
+}
+
+void* ecalloc_in(int category, size_t count, size_t size) {
+  if (size && count > ((size_t) -1 - sizeof (BLOCK_HEADER)) / size)
     fatal("out of memory (ecalloc)\n");
-  malloc_count++;
-  return p;
+  BLOCK_HEADER* b = calloc(1, sizeof *b + count * size);
+  if (b == NULL)
+    fatal("out of memory (ecalloc)\n");
+  return account_alloc(b, category, count * size);
 }
 
-char* estrdup(const char* s) {
+void* ecalloc(size_t count, size_t size) {
+  return ecalloc_in(MEM_OTHER, count, size);
+}
+
+char* estrdup_in(int category, const char* s) {
   char* t = NULL;
   if (s) {
-    if (s[0]) {
-      t = emalloc(strlen(s) + 1);
-      strcpy(t, s);
-    }
-    else {
-      t = emalloc(1);
-      t[0] = '\0';
-    }
+    size_t len = strlen(s);
+    t = emalloc_in(category, len + 1);
+    memcpy(t, s, len + 1);
   }
   return t;
 }
 
+char* estrdup(const char* s) {
+  return estrdup_in(MEM_OTHER, s);
+}
+
 void efree(void* p) {
   if (p) {
-    free_count++;
-    free(p);
+    BLOCK_HEADER* b = (BLOCK_HEADER*) p - 1;
+    account_free(b);
+    free(b);
   }
 }
 
+const MEM_STATS* mem_stats(int category) {
+  assert(category >= 0 && category < MEM_CATEGORIES);
+  return &stats[category];
+}
+
+size_t mem_peak(void) {
+  return peak_bytes;
+}
+
+static const char* const category_names[MEM_CATEGORIES] = {
+  "other", "source", "B-code", "symbols", "strings", "arrays", "DEF", "line map"
+};
+
+void print_mem_stats(FILE* fp) {
+  fprintf(fp, "%-9s %10s %10s %12s %12s", "MEMORY", "ALLOCS", "FREES", "LIVE", "PEAK");
+  static const char* const classes[MEM_SIZE_CLASSES] = {
+    "<=16", "<=64", "<=256", "<=1K", "<=4K", "<=16K", "<=64K", ">64K"
+  };
+  for (unsigned c = 0; c < MEM_SIZE_CLASSES; c++)
+    fprintf(fp, " %8s", classes[c]);
+  putc('\n', fp);
+  MEM_STATS total = { 0 };
+  for (int i = 0; i < MEM_CATEGORIES; i++) {
+    const MEM_STATS* s = &stats[i];
+    fprintf(fp, "%-9s %10lu %10lu %12zu %12zu", category_names[i], s->allocs, s->frees, s->live, s->peak);
+    for (unsigned c = 0; c < MEM_SIZE_CLASSES; c++) {
+      fprintf(fp, " %8lu", s->sizes[c]);
+      total.sizes[c] += s->sizes[c];
+    }
+    putc('\n', fp);
+    total.allocs += s->allocs;
+    total.frees += s->frees;
+  }
+  fprintf(fp, "%-9s %10lu %10lu %12zu %12zu", "total", total.allocs, total.frees, live_bytes, peak_bytes);
+  for (unsigned c = 0; c < MEM_SIZE_CLASSES; c++)
+    fprintf(fp, " %8lu", total.sizes[c]);
+  putc('\n', fp);
+}
+
 bool string_name(const char* name) {
   return name != NULL && name[0] && name[strlen(name) - 1] == '$';
 }
@@ -104,9 +213,43 @@ static void test_string_name(CuTest* tc) {
   CuAssertIntEquals(tc, false, string_name("a"));
 }
 
+static void test_mem_stats(CuTest* tc) {
+  const MEM_STATS* s = mem_stats(MEM_DEF);
+  const MEM_STATS before = *s;
+
+  char* p = emalloc_in(MEM_DEF, 10);
+  CuAssertIntEquals(tc, before.allocs + 1, s->allocs);
+  CuAssertIntEquals(tc, before.live + 10, s->live);
+  CuAssertIntEquals(tc, before.sizes[0] + 1, s->sizes[0]);
+  CuAssertTrue(tc, s->peak >= s->live);
+  CuAssertTrue(tc, mem_peak() >= s->live);
+
+  p = erealloc(p, 100);
+  CuAssertIntEquals(tc, before.frees + 1, s->frees);
+  CuAssertIntEquals(tc, before.live + 100, s->live);
+  CuAssertIntEquals(tc, before.sizes[2] + 1, s->sizes[2]);
+
+  char* t = estrdup_in(MEM_DEF, "hello");
+  CuAssertStrEquals(tc, "hello", t);
+  CuAssertIntEquals(tc, before.live + 106, s->live);
+
+  efree(p);
+  efree(t);
+  CuAssertIntEquals(tc, before.allocs + 3, s->allocs);
+  CuAssertIntEquals(tc, before.frees + 3, s->frees);
+  CuAssertIntEquals(tc, before.live, s->live);
+  CuAssertTrue(tc, s->peak >= before.live + 106);
+
+  CuAssertIntEquals(tc, 0, size_class(0));
+  CuAssertIntEquals(tc, 0, size_class(16));
+  CuAssertIntEquals(tc, 1, size_class(17));
+  CuAssertIntEquals(tc, 7, size_class(64 * 1024 + 1));
+}
+
 CuSuite* utils_test_suite(void) {
   CuSuite* suite = CuSuiteNew();
   SUITE_ADD_TEST(suite, test_string_name);
+  SUITE_ADD_TEST(suite, test_mem_stats);
   return suite;
 }
 
@@ -15,15 +15,55 @@ typedef unsigned short U16;
 void fatal(const char* fmt, ...);
 void error(const char* fmt, ...);
 
+// Stream for reporting errors in BASIC programs: stderr unless redirected,
+// per thread, by an embedding application. NULL restores stderr.
+FILE* diagnostics(void);
+void set_diagnostics(FILE*);
+
+// Categories of allocation, to report which parts of the interpreter use memory.
+enum mem_category {
+  MEM_OTHER,
+  MEM_SOURCE,
+  MEM_BCODE,
+  MEM_SYMBOLS,
+  MEM_STRINGS,
+  MEM_ARRAYS,
+  MEM_DEF,
+  MEM_LINEMAP,
+  MEM_CATEGORIES
+};
+
 void* emalloc(size_t);
-void* erealloc(void*, size_t);
+void* erealloc(void*, size_t);  // keeps the category of a block being resized
 void* ecalloc(size_t count, size_t size);
 char* estrdup(const char*);
 
+void* emalloc_in(int category, size_t);
+void* erealloc_in(int category, void*, size_t);
+void* ecalloc_in(int category, size_t count, size_t size);
+char* estrdup_in(int category, const char*);
+
 void efree(void*);
 
 extern unsigned long malloc_count, free_count;
 
+// Allocations, frees, live and peak bytes, and a histogram of block sizes, for a category.
+enum { MEM_SIZE_CLASSES = 8 };
+
+typedef struct {
+  unsigned long allocs;
+  unsigned long frees;
+  size_t live;
+  size_t peak;
+  unsigned long sizes[MEM_SIZE_CLASSES];
+} MEM_STATS;
+
+const MEM_STATS* mem_stats(int category);
+size_t mem_peak(void);
+
+// Report memory use by category.
+void print_mem_stats(FILE*);
+
 enum { TYPE_ERR, TYPE_NUM, TYPE_STR };
 
 bool string_name(const char*);
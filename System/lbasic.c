@@ -23,6 +23,10 @@
 #include "stringuniq.h"
 #include "symbol.h"
 #include "init.h"
+#include "image.h"
+#include "server.h"
+#include "profile.h"
+#include "trace.h"
 
 // These attributes are declared in C source instead of being generated
 // because it better supports both CMake and development builds.
@@ -72,7 +76,13 @@ int main(int argc, char* argv[]) {
   }
 #endif
 
-  if (opt.file_name == NULL) {
+  if (opt.decode_file) {
+    bool ok = decode_trace(opt.decode_file, opt.file_name, stdout);
+    deinit_keywords();
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  if (opt.file_name == NULL && opt.resume_file == NULL) {
     if (opt.mode != NO_MODE)
       fatal("invalid option for interactive mode\n");
     interact(opt.keywords_anywhere, opt.trace_basic, opt.trace_for, opt.quiet);
@@ -96,15 +106,33 @@ static void report_memory(void) {
   putchar('\n');
   printf("malloc: %10lu\n", malloc_count);
   printf("free:   %10lu\n", free_count);
+  putchar('\n');
+  print_mem_stats(stdout);
 }
 
 static void list_file(const char* file_name);
 static void list_names(const char* file_name, bool crunched);
+static void compile_file(const Options*);
+static void report_profile(const VM*, const char* file_name);
+static void report_call_profile(const VM*, const char* folded_name);
+static void report_samples(const VM*, const char* folded_name);
+#if HAS_TIMER
+static void report_phase(const char* name, const TIMER*);
+#endif
+static bool load_program(VM*, const Options*);
+static VM* new_session_vm(const Options*);
 
 static void process_file(const Options* opt) {
-  assert(opt != NULL && opt->file_name != NULL);
+  assert(opt != NULL && (opt->file_name != NULL || opt->resume_file != NULL));
+
+  if (opt->resume_file) {
+    if (opt->file_name != NULL)
+      fatal("a snapshot contains its program: unexpected argument: %s\n", opt->file_name);
+    if (opt->mode != NO_MODE && opt->mode != RUN_MODE)
+      fatal("invalid option for --resume\n");
+  }
 
-  // NO_MODE, LIST_MODE, LIST_NAMES_MODE, PARSE_MODE, CODE_MODE, RUN_MODE, TEST_MODE
+  // NO_MODE, LIST_MODE, LIST_NAMES_MODE, PARSE_MODE, CODE_MODE, COMPILE_MODE, RUN_MODE, SERVE_MODE, TEST_MODE
 
   if (opt->mode == LIST_MODE) {
     list_file(opt->file_name);
@@ -132,36 +160,204 @@ static void process_file(const Options* opt) {
       delete_symbol_table(st);
       delete_source(source);
     }
+    else
+      exit(EXIT_FAILURE);
+    return;
+  }
+
+  if (opt->mode == COMPILE_MODE) {
+    compile_file(opt);
+    return;
+  }
+
+  if (opt->mode == SERVE_MODE) {
+    serve(opt, new_session_vm);
     return;
   }
 
   assert(opt->mode == RUN_MODE || opt->mode == NO_MODE);
 
   VM* vm = new_vm(opt->keywords_anywhere, opt->trace_basic, opt->trace_for, opt->trace_log);
+  vm_set_profiling(vm, opt->profile);
+  vm_set_call_profiling(vm, opt->folded_file != NULL);
+  vm_set_sampling(vm, opt->sample_file != NULL);
+  vm_set_stats(vm, opt->report_stats);
+  if (opt->trace_file) {
+    const unsigned long events = (opt->trace_events ? opt->trace_events : 1) * 1000000UL;
+    if (!vm_set_trace_file(vm, opt->trace_file, events, opt->resume_file ? NULL : opt->file_name))
+      fatal("cannot create trace file: %s\n", opt->trace_file);
+  }
 
-  if (vm_load_source(vm, opt->file_name)) {
 #if HAS_TIMER
-    TIMER timer;
-    start_timer(&timer);
+  TIMER total_timer, load_timer, run_timer, teardown_timer;
+  memset(&run_timer, 0, sizeof run_timer);
+  start_timer(&total_timer);
+  start_timer(&load_timer);
 #endif
-    run_program(vm);
+  bool ok = opt->resume_file ? vm_load_snapshot(vm, opt->resume_file) : load_program(vm, opt);
 #if HAS_TIMER
-    stop_timer(&timer);
-    if (opt->report_time)
-      printf("Microseconds elapsed: %lld\n", elapsed_usec(&timer));
+  stop_timer(&load_timer);
 #endif
+  // compile before timing the run
+  if (ok && (opt->resume_file || vm_compile(vm))) {
+#if HAS_TIMER
+    start_timer(&run_timer);
+#endif
+    if (opt->resume_file) {
+      if (!vm_continue(vm))
+        error("Cannot continue: %s", opt->resume_file);
+    }
+    else
+      run_program(vm);
+#if HAS_TIMER
+    stop_timer(&run_timer);
+#endif
+    if (opt->profile)
+      report_profile(vm, opt->profile_file);
+    if (opt->folded_file)
+      report_call_profile(vm, opt->folded_file);
+    if (opt->sample_file)
+      report_samples(vm, opt->sample_file);
+    if (opt->report_stats) {
+      fflush(stdout);
+      vm_print_stats(vm, stderr);
+    }
+    // save a stopped or interrupted program to be continued later
+    if (opt->snapshot_file && vm_can_continue(vm))
+      ok = vm_save_snapshot(vm, opt->snapshot_file);
   }
 
+#if HAS_TIMER
+  TIMER parse_timer, index_timer;
+  vm_compile_timers(vm, &parse_timer, &index_timer);
+  start_timer(&teardown_timer);
+#endif
   delete_vm(vm);
+#if HAS_TIMER
+  stop_timer(&teardown_timer);
+  stop_timer(&total_timer);
+  if (opt->report_time) {
+    printf("%-10s %14s %14s\n", "PHASE", "WALL USEC", "CPU USEC");
+    report_phase("load", &load_timer);
+    report_phase("parse", &parse_timer);
+    report_phase("index", &index_timer);
+    report_phase("run", &run_timer);
+    report_phase("teardown", &teardown_timer);
+    report_phase("total", &total_timer);
+  }
+#endif
+
+  if (!ok)
+    exit(EXIT_FAILURE);
+}
+
+#if HAS_TIMER
+static void report_phase(const char* name, const TIMER* t) {
+  printf("%-10s %14lld %14lld\n", name, elapsed_usec(t), elapsed_cpu_usec(t));
+}
+#endif
+
+static void report_profile(const VM* vm, const char* file_name) {
+  if (file_name == NULL) {
+    fflush(stdout);
+    vm_print_profile(vm, PROFILE_TEXT, stderr);
+    return;
+  }
+  FILE* fp = fopen(file_name, "w");
+  if (fp == NULL) {
+    error("Cannot create profile file: %s", file_name);
+    return;
+  }
+  vm_print_profile(vm, profile_format(file_name), fp);
+  fclose(fp);
+}
+
+static void report_call_profile(const VM* vm, const char* folded_name) {
+  fflush(stdout);
+  FILE* fp = fopen(folded_name, "w");
+  if (fp == NULL)
+    error("Cannot create call profile file: %s", folded_name);
+  vm_print_call_profile(vm, stderr, fp);
+  if (fp)
+    fclose(fp);
+}
+
+static void report_samples(const VM* vm, const char* folded_name) {
+  fflush(stdout);
+  FILE* fp = fopen(folded_name, "w");
+  if (fp == NULL)
+    error("Cannot create sample file: %s", folded_name);
+  vm_print_samples(vm, stderr, fp);
+  if (fp)
+    fclose(fp);
+}
+
+static void compile_file(const Options* opt) {
+  if (has_image_extension(opt->file_name))
+    fatal("source file expected: %s\n", opt->file_name);
+  VM* vm = new_vm(opt->keywords_anywhere, false, false, false);
+  char* image_name = image_file_name(opt->file_name);
+  bool ok = vm_load_source(vm, opt->file_name) && vm_compile(vm) && vm_save_image(vm, image_name);
+  efree(image_name);
+  delete_vm(vm);
+  if (!ok)
+    exit(EXIT_FAILURE);
+}
+
+static bool file_exists(const char* name) {
+  FILE* fp = fopen(name, "rb");
+  if (fp)
+    fclose(fp);
+  return fp != NULL;
+}
+
+// Load the program to run: a precompiled image, or a source file.
+// If a cache directory is configured, use a cached image of the source file
+// if there is one, otherwise compile the source and cache its image.
+static bool load_program(VM* vm, const Options* opt) {
+  if (has_image_extension(opt->file_name))
+    return vm_load_image(vm, opt->file_name);
+
+  const char* cache_dir = getenv(IMAGE_CACHE_ENV);
+  if (cache_dir == NULL || cache_dir[0] == '\0')
+    return vm_load_source(vm, opt->file_name);
+
+  char* cache_name = image_cache_name(cache_dir, opt->file_name, opt->keywords_anywhere);
+  bool loaded = cache_name && file_exists(cache_name) && vm_load_image(vm, cache_name);
+  if (!loaded && vm_load_source(vm, opt->file_name)) {
+    loaded = vm_compile(vm);
+    if (loaded && cache_name) {
+      // Write under a name unique to this process and image, so that sessions
+      // caching the same program at once do not share a file, and other
+      // sessions never see a partial image.
+      static unsigned temp_count;
+      char* temp_name = emalloc(strlen(cache_name) + 48);
+      sprintf(temp_name, "%s.%lu.%u.tmp", cache_name, process_id(), temp_count++);
+      if (vm_save_image(vm, temp_name) && !replace_file(temp_name, cache_name))
+        remove(temp_name);
+      efree(temp_name);
+    }
+  }
+  efree(cache_name);
+  return loaded;
+}
+
+static VM* new_session_vm(const Options* opt) {
+  VM* vm = new_vm(opt->keywords_anywhere, opt->trace_basic, opt->trace_for, false);
+  if (!load_program(vm, opt)) {
+    delete_vm(vm);
+    return NULL;
+  }
+  return vm;
 }
 
 static void list_file(const char* file_name) {
   SOURCE* source = load_source_file(file_name);
-  if (source) {
-    for (unsigned i = 0; i < source_lines(source); i++)
-      printf("%5u %s\n", source_linenum(source, i), source_text(source, i));
-    delete_source(source);
-  }
+  if (source == NULL)
+    exit(EXIT_FAILURE);
+  for (unsigned i = 0; i < source_lines(source); i++)
+    printf("%5u %s\n", source_linenum(source, i), source_text(source, i));
+  delete_source(source);
 }
 
 static void print_name(const char* name);
@@ -188,6 +384,8 @@ static void list_names(const char* file_name, bool crunched) {
     delete_lex(lex);
     delete_source(source);
   }
+  else
+    exit(EXIT_FAILURE);
 }
 
 static void print_name(const char* name) {
@@ -204,6 +402,7 @@ static void print_name(const char* name) {
 #include "CuTest.h"
 
 CuSuite* utils_test_suite(void);
+CuSuite* arena_test_suite(void);
 CuSuite* token_test_suite(void);
 CuSuite* stringlist_test_suite(void);
 CuSuite* stringuniq_test_suite(void);
@@ -215,12 +414,21 @@ CuSuite* emit_test_suite(void);
 CuSuite* arrays_test_suite(void);
 CuSuite* symbol_test_suite(void);
 CuSuite* run_test_suite(void);
+CuSuite* profile_test_suite(void);
+CuSuite* sample_test_suite(void);
+CuSuite* stats_test_suite(void);
+CuSuite* strheap_test_suite(void);
+CuSuite* trace_test_suite(void);
+CuSuite* image_test_suite(void);
+CuSuite* server_test_suite(void);
+CuSuite* legacybasic_test_suite(void);
 
 static int unit_tests(void) {
   CuString* output = CuStringNew();
   CuSuite* suite = CuSuiteNew();
 
   CuSuiteAddSuite(suite, utils_test_suite());
+  CuSuiteAddSuite(suite, arena_test_suite());
   CuSuiteAddSuite(suite, token_test_suite());
   CuSuiteAddSuite(suite, stringlist_test_suite());
   CuSuiteAddSuite(suite, stringuniq_test_suite());
@@ -232,6 +440,14 @@ static int unit_tests(void) {
   CuSuiteAddSuite(suite, arrays_test_suite());
   CuSuiteAddSuite(suite, symbol_test_suite());
   CuSuiteAddSuite(suite, run_test_suite());
+  CuSuiteAddSuite(suite, profile_test_suite());
+  CuSuiteAddSuite(suite, sample_test_suite());
+  CuSuiteAddSuite(suite, stats_test_suite());
+  CuSuiteAddSuite(suite, strheap_test_suite());
+  CuSuiteAddSuite(suite, trace_test_suite());
+  CuSuiteAddSuite(suite, image_test_suite());
+  CuSuiteAddSuite(suite, server_test_suite());
+  CuSuiteAddSuite(suite, legacybasic_test_suite());
 
   CuSuiteRun(suite);
   int failed = suite->failCount;
@@ -15,6 +15,8 @@ void init_options(Options* opt) {
 }
 
 static void help(bool full);
+static const char* argument(const char* option, const char* arg);
+static unsigned long number_argument(const char* option, const char* arg);
 
 void parse_options(Options* opt, const char* argv[]) {
   for (const char* arg = *argv; arg; arg = *++argv) {
@@ -32,27 +34,61 @@ void parse_options(Options* opt, const char* argv[]) {
       opt->mode = PARSE_MODE;
     else if (strcmp(arg, "--code") == 0 || strcmp(arg, "-c") == 0)
       opt->mode = CODE_MODE;
+    else if (strcmp(arg, "--compile") == 0 || strcmp(arg, "-b") == 0)
+      opt->mode = COMPILE_MODE;
     else if (strcmp(arg, "--run") == 0 || strcmp(arg, "-r") == 0)
       opt->mode = RUN_MODE;
+    else if (strcmp(arg, "--serve") == 0 || strcmp(arg, "-s") == 0) {
+      opt->mode = SERVE_MODE;
+      opt->serve_address = argument(arg, *++argv);
+    }
 #ifdef UNIT_TEST
     else if (strcmp(arg, "--unit-tests") == 0 || strcmp(arg, "-unittest") == 0)
       opt->mode = TEST_MODE;
 #endif
     // Other options
+    else if (strcmp(arg, "--budget") == 0 || strcmp(arg, "-u") == 0)
+      opt->budget = number_argument(arg, *++argv);
+    else if (strcmp(arg, "--decode-trace") == 0 || strcmp(arg, "-dt") == 0)
+      opt->decode_file = argument(arg, *++argv);
+    else if (strcmp(arg, "--idle-timeout") == 0 || strcmp(arg, "-e") == 0)
+      opt->idle_timeout = number_argument(arg, *++argv);
     else if (strcmp(arg, "--keywords-anywhere") == 0 || strcmp(arg, "-k") == 0)
       opt->keywords_anywhere = true;
+    else if (strcmp(arg, "--profile") == 0 || strcmp(arg, "-a") == 0)
+      opt->profile = true;
+    else if (strcmp(arg, "--profile-calls") == 0 || strcmp(arg, "-j") == 0)
+      opt->folded_file = argument(arg, *++argv);
+    else if (strcmp(arg, "--profile-output") == 0 || strcmp(arg, "-w") == 0) {
+      opt->profile = true;
+      opt->profile_file = argument(arg, *++argv);
+    }
     else if (strcmp(arg, "--quiet") == 0 || strcmp(arg, "-q") == 0)
       opt->quiet = true;
     else if (strcmp(arg, "--randomize") == 0 || strcmp(arg, "-z") == 0)
       srand((unsigned)time(NULL));
     else if (strcmp(arg, "--report-memory") == 0 || strcmp(arg, "-m") == 0)
       opt->report_memory = true;
+    else if (strcmp(arg, "--resume") == 0 || strcmp(arg, "-y") == 0)
+      opt->resume_file = argument(arg, *++argv);
+#if HAS_SAMPLING
+    else if (strcmp(arg, "--sample") == 0 || strcmp(arg, "-d") == 0)
+      opt->sample_file = argument(arg, *++argv);
+#endif
+    else if (strcmp(arg, "--snapshot") == 0 || strcmp(arg, "-x") == 0)
+      opt->snapshot_file = argument(arg, *++argv);
+    else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "-o") == 0)
+      opt->report_stats = true;
 #if HAS_TIMER
     else if (strcmp(arg, "--time") == 0 || strcmp(arg, "-i") == 0)
       opt->report_time = true;
 #endif
     else if (strcmp(arg, "--trace-basic") == 0 || strcmp(arg, "-t") == 0)
       opt->trace_basic = true;
+    else if (strcmp(arg, "--trace-events") == 0 || strcmp(arg, "-te") == 0)
+      opt->trace_events = number_argument(arg, *++argv);
+    else if (strcmp(arg, "--trace-file") == 0 || strcmp(arg, "-tf") == 0)
+      opt->trace_file = argument(arg, *++argv);
     else if (strcmp(arg, "--trace-for") == 0 || strcmp(arg, "-f") == 0)
       opt->trace_for = true;
     else if (strcmp(arg, "--trace-log") == 0 || strcmp(arg, "-g") == 0)
@@ -68,13 +104,43 @@ void parse_options(Options* opt, const char* argv[]) {
   }
 }
 
+static const char* argument(const char* option, const char* arg) {
+  if (arg == NULL)
+    fatal("option requires an argument: %s\n", option);
+  return arg;
+}
+
+static unsigned long number_argument(const char* option, const char* arg) {
+  argument(option, arg);
+  char* end;
+  unsigned long n = strtoul(arg, &end, 10);
+  if (end == arg || *end != '\0' || arg[0] == '-')
+    fatal("option requires a number: %s\n", option);
+  return n;
+}
+
 static void help(bool full) {
   printf("Usage: %s [options] name.bas\n\n", progname);
 
+  puts("--budget, -u N");
+  if (full)
+    puts("    With --serve, the number of B-code instructions a session runs\n"
+         "    before other sessions have a turn. Default 10000.\n");
+
   puts("--code, -c");
   if (full)
     puts("    List translated intermediate code (B-code) program.\n");
 
+  puts("--compile, -b");
+  if (full)
+    puts("    Compile the specified BASIC program to a B-code image file, name.bbc,\n"
+         "    which can be run like a source file but starts without parsing.\n");
+
+  puts("--decode-trace, -dt FILE");
+  if (full)
+    puts("    Print a binary trace file written by --trace-file as text. The source\n"
+         "    lines are read from the program traced, or the program named.\n");
+
   puts("--help, -h");
   if (full)
     puts("    Show program usage and list options.\n");
@@ -83,6 +149,11 @@ static void help(bool full) {
   if (full)
     puts("    Show program usage and explain all options.\n");
 
+  puts("--idle-timeout, -e SECONDS");
+  if (full)
+    puts("    With --serve, end a session which has waited this long for input.\n"
+         "    By default sessions never time out.\n");
+
   puts("--keywords-anywhere, -k");
   if (full)
     puts("    Recognise BASIC keywords anywhere outside a string, crunched with\n"
@@ -106,6 +177,22 @@ static void help(bool full) {
     puts("    Parse the specified BASIC program without running it, to find\n"
          "    syntax errors or unsupported constructs.\n");
 
+  puts("--profile, -a");
+  if (full)
+    puts("    Count the executions of each line of the BASIC program, and the\n"
+         "    time spent in it, and on exit report the lines that took most time.\n");
+
+  puts("--profile-calls, -j FILE");
+  if (full)
+    puts("    Time the GOSUB subroutines of the BASIC program, including and\n"
+         "    excluding the subroutines they call. On exit report them on stderr,\n"
+         "    and write FILE in the folded stack format of flame graph tools.\n");
+
+  puts("--profile-output, -w FILE");
+  if (full)
+    puts("    Profile as --profile, writing the report to FILE instead of stderr:\n"
+         "    CSV if FILE ends .csv, JSON if it ends .json, otherwise text.\n");
+
   puts("--quiet, -q");
   if (full)
     puts("    Suppress version information when running a BASIC program.\n");
@@ -117,18 +204,68 @@ static void help(bool full) {
 
   puts("--report-memory, -m");
   if (full)
-    puts("    On exit, print the number of memory blocks allocated and released.\n"
-         "    For debugging the interpreter.\n");
+    puts("    On exit, print the number of memory blocks allocated and released,\n"
+         "    and memory use by category: source, B-code, symbols, strings, arrays...\n");
+
+  puts("--resume, -y SNAPSHOT");
+  if (full)
+    puts("    Restore a program and its state from a snapshot file, saved by\n"
+         "    --snapshot or the SNAPSHOT command, and continue running it.\n"
+         "    No program file is named: the snapshot contains the program.\n");
 
   puts("--run, -r");
   if (full)
     puts("    Run the specified BASIC program. This is the default option.\n");
 
+#if HAS_SAMPLING
+  puts("--sample, -d FILE");
+  if (full)
+    puts("    Profile the BASIC program by sampling the line being executed\n"
+         "    every millisecond of CPU time. On exit report the lines sampled most\n"
+         "    on stderr, and write FILE in the folded stack format of flame graph\n"
+         "    tools. Linux only.\n");
+#endif
+
+  puts("--serve, -s ADDRESS");
+  if (full)
+    puts("    Serve sessions of the specified BASIC program. Each connection to\n"
+         "    ADDRESS runs the program with the connection as its terminal.\n"
+         "    ADDRESS is a TCP port number on localhost, or a Unix socket path.\n"
+         "    Linux only.\n");
+
+  puts("--snapshot, -x SNAPSHOT");
+  if (full)
+    puts("    If the program stops at STOP or is interrupted, save it and the\n"
+         "    state of running it to a snapshot file, to be continued later\n"
+         "    with --resume.\n");
+
+  puts("--stats, -o");
+  if (full)
+    puts("    On exit, report on stderr the B-code instructions executed, by opcode\n"
+         "    and by adjacent pair, the deepest stacks, strings allocated, and\n"
+         "    line number lookups. For tuning the interpreter.\n");
+
+#if HAS_TIMER
+  puts("--time, -i");
+  if (full)
+    puts("    On exit, report the wall clock and CPU time taken to load, parse\n"
+         "    and index the program, run it, and release it.\n");
+#endif
+
   puts("--trace-basic, -t");
   if (full)
     puts("    Trace BASIC line numbers executed at runtime. Equivalent to TRON and\n"
          "    TRACE ON in some BASICs.\n");
 
+  puts("--trace-events, -te MILLIONS");
+  if (full)
+    puts("    With --trace-file, the number of events kept, in millions. Default 1.\n");
+
+  puts("--trace-file, -tf FILE");
+  if (full)
+    puts("    Record each B-code instruction executed in FILE, a memory-mapped ring\n"
+         "    keeping the latest events, for decoding with --decode-trace.\n");
+
   puts("--trace-for, -f");
   if (full)
     puts("    Print information about FOR loops at runtime.\n"
@@ -7,15 +7,28 @@
 
 #include <stdbool.h>
 
-enum mode { NO_MODE, LIST_MODE, LIST_NAMES_MODE, PARSE_MODE, CODE_MODE, RUN_MODE, TEST_MODE };
+enum mode { NO_MODE, LIST_MODE, LIST_NAMES_MODE, PARSE_MODE, CODE_MODE, COMPILE_MODE, RUN_MODE, SERVE_MODE, TEST_MODE };
 
 typedef struct {
   int mode;
   const char* file_name;
+  const char* serve_address;
+  const char* snapshot_file;
+  const char* resume_file;
+  const char* profile_file;
+  const char* folded_file;
+  const char* sample_file;
+  const char* trace_file;
+  const char* decode_file;
+  unsigned long budget;
+  unsigned long idle_timeout;
+  unsigned long trace_events;
   bool keywords_anywhere;
   bool print_version;
+  bool profile;
   bool quiet;
   bool report_memory;
+  bool report_stats;
   bool report_time;
   bool trace_basic;
   bool trace_for;
@@ -0,0 +1,485 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Serve sessions of a BASIC program to connected terminals,
+// multiplexed in one process by a poll loop over non-blocking sockets.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <assert.h>
+#include "server.h"
+#include "interrupt.h"
+#include "os.h"
+#include "utils.h"
+
+#ifdef LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#define DEFAULT_BUDGET (10000)
+#define OUTPUT_LIMIT (64 * 1024)  // stop running a session until its client takes this much output
+#define MAX_SESSIONS (256)
+#define KEY_POLL_MSEC (10)  // interval to run sessions polling INKEY$ while no key arrives
+
+bool is_port_number(const char* address) {
+  if (address[0] == '\0')
+    return false;
+  for (const char* p = address; *p; p++) {
+    if (!isdigit((unsigned char) *p))
+      return false;
+  }
+  return true;
+}
+
+#ifdef LINUX
+
+typedef struct {
+  int fd;
+  VM* vm;
+  int status;         // last result of vm_step
+  bool polling_keys;  // yielded at INKEY$ finding no key
+  bool closing;       // program finished: close when output is written
+  time_t last_active; // when input last arrived or output was last taken
+  char* out;
+  size_t out_len;
+  size_t out_allocated;
+} SESSION;
+
+// The sessions being served, and how they are run.
+typedef struct {
+  SESSION* sessions;
+  unsigned count;
+  struct pollfd* fds;
+  unsigned long budget;        // instructions each session runs per round
+  unsigned long idle_timeout;  // seconds without activity before closing, or 0
+  int max_wait_msec;           // longest wait for the network with nothing to run
+} SERVER;
+
+static int listen_on(const char* address);
+static bool serve_round(SERVER*, int listener, VM* program);
+static void accept_sessions(int listener, SERVER*, VM* program);
+static bool add_session(SERVER*, int fd, VM* program);
+static void close_session(SESSION*);
+static void run_session(SESSION*, unsigned long budget);
+static void read_session(SESSION*);
+static void write_session(SESSION*);
+static void queue_output(SESSION*, const char*, size_t len);
+
+static bool runnable(const SESSION* s) {
+  return !s->closing && s->status != VM_NEEDS_INPUT && s->out_len < OUTPUT_LIMIT;
+}
+
+static void init_server(SERVER* srv, unsigned long budget, unsigned long idle_timeout) {
+  srv->sessions = ecalloc(MAX_SESSIONS, sizeof srv->sessions[0]);
+  srv->count = 0;
+  srv->fds = ecalloc(MAX_SESSIONS + 1, sizeof srv->fds[0]);
+  srv->budget = budget ? budget : DEFAULT_BUDGET;
+  srv->idle_timeout = idle_timeout;
+  srv->max_wait_msec = 1000;
+}
+
+static void end_server(SERVER* srv) {
+  for (unsigned i = 0; i < srv->count; i++)
+    close_session(&srv->sessions[i]);
+  efree(srv->fds);
+  efree(srv->sessions);
+}
+
+void serve(const Options* opt, NEW_SESSION_VM* new_session_vm) {
+  assert(opt != NULL && opt->serve_address != NULL);
+
+  // Load and compile the program once, reporting its errors before accepting connections.
+  // Each session runs a clone sharing the compiled program.
+  VM* program = new_session_vm(opt);
+  if (program == NULL || !vm_compile(program))
+    exit(EXIT_FAILURE);
+
+  // a client closing its connection must not end the server
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = listen_on(opt->serve_address);
+  if (!opt->quiet)
+    printf("Serving %s on %s\n", opt->file_name, opt->serve_address);
+  fflush(stdout);
+
+  SERVER srv;
+  init_server(&srv, opt->budget, opt->idle_timeout);
+  trap_interrupt();
+  while (!interrupted && serve_round(&srv, listener, program))
+    ;
+  untrap_interrupt();
+
+  end_server(&srv);
+  delete_vm(program);
+  close(listener);
+  if (!is_port_number(opt->serve_address))
+    unlink(opt->serve_address);
+}
+
+// Run each runnable session for its budget, then exchange data with clients,
+// close finished and idle sessions, and accept new connections.
+// Return false if the network cannot be polled.
+static bool serve_round(SERVER* srv, int listener, VM* program) {
+  SESSION* const sessions = srv->sessions;
+  struct pollfd* const fds = srv->fds;
+  const unsigned count = srv->count;
+
+  bool busy = false;
+  bool polling_keys = false;
+  for (unsigned i = 0; i < count; i++) {
+    if (runnable(&sessions[i])) {
+      run_session(&sessions[i], srv->budget);
+      if (runnable(&sessions[i])) {
+        if (sessions[i].polling_keys)
+          polling_keys = true;
+        else
+          busy = true;
+      }
+    }
+  }
+
+  fds[0].fd = listener;
+  fds[0].events = count < MAX_SESSIONS ? POLLIN : 0;
+  fds[0].revents = 0;
+  for (unsigned i = 0; i < count; i++) {
+    fds[i+1].fd = sessions[i].fd;
+    fds[i+1].events = (sessions[i].closing ? 0 : POLLIN) | (sessions[i].out_len ? POLLOUT : 0);
+    fds[i+1].revents = 0;
+  }
+
+  // Wait for the network only when no session has work to do,
+  // and only briefly while a session polls for keys, to let it run on without spinning.
+  int wait = busy ? 0 : polling_keys && KEY_POLL_MSEC < srv->max_wait_msec ? KEY_POLL_MSEC : srv->max_wait_msec;
+  if (poll(fds, count + 1, wait) < 0) {
+    if (errno == EINTR)
+      return true;
+    error("poll: %s\n", strerror(errno));
+    return false;
+  }
+
+  // A session is idle when it has neither received input nor had output taken,
+  // whether it waits for input, polls for keys, or waits for its client to read.
+  time_t now = time(NULL);
+  for (unsigned i = 0; i < count; i++) {
+    SESSION* s = &sessions[i];
+    short revents = fds[i+1].revents;
+    if (revents & (POLLIN | POLLHUP | POLLERR))
+      read_session(s);
+    if (s->fd >= 0 && (revents & POLLOUT))
+      write_session(s);
+    if (s->fd >= 0 && s->closing && s->out_len == 0)
+      close_session(s);
+    if (s->fd >= 0 && srv->idle_timeout && now - s->last_active > (time_t) srv->idle_timeout) {
+      static const char TIMEOUT[] = "\n* Idle timeout *\n";
+      if (write(s->fd, TIMEOUT, sizeof TIMEOUT - 1) < 0) {
+        // closing anyway
+      }
+      close_session(s);
+    }
+  }
+
+  // compact the session array over closed sessions
+  unsigned live = 0;
+  for (unsigned i = 0; i < count; i++) {
+    if (sessions[i].fd >= 0)
+      sessions[live++] = sessions[i];
+  }
+  srv->count = live;
+
+  if (fds[0].revents & POLLIN)
+    accept_sessions(listener, srv, program);
+  return true;
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    fatal("cannot make socket non-blocking: %s\n", strerror(errno));
+}
+
+static int listen_on(const char* address) {
+  int fd;
+  if (is_port_number(address)) {
+    unsigned long port = strtoul(address, NULL, 10);
+    if (port == 0 || port > 65535)
+      fatal("invalid port number: %s\n", address);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+      fatal("cannot create socket: %s\n", strerror(errno));
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &sin, sizeof sin) != 0)
+      fatal("cannot bind to port %s: %s\n", address, strerror(errno));
+  }
+  else {
+    struct sockaddr_un sun;
+    if (strlen(address) >= sizeof sun.sun_path)
+      fatal("socket path too long: %s\n", address);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      fatal("cannot create socket: %s\n", strerror(errno));
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, address);
+    unlink(address);
+    if (bind(fd, (struct sockaddr*) &sun, sizeof sun) != 0)
+      fatal("cannot bind to %s: %s\n", address, strerror(errno));
+  }
+  if (listen(fd, 16) != 0)
+    fatal("cannot listen on %s: %s\n", address, strerror(errno));
+  set_nonblocking(fd);
+  return fd;
+}
+
+static void accept_sessions(int listener, SERVER* srv, VM* program) {
+  while (srv->count < MAX_SESSIONS) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+      return;
+    set_nonblocking(fd);
+    add_session(srv, fd, program);
+  }
+}
+
+// Start a session of the program on a connected socket, or close the socket.
+static bool add_session(SERVER* srv, int fd, VM* program) {
+  assert(srv->count < MAX_SESSIONS);
+  VM* vm = vm_clone(program);
+  vm_seed_random(vm, (unsigned) rand());
+  if (!vm_start_program(vm)) {
+    static const char FAILED[] = "* Cannot start program *\n";
+    if (write(fd, FAILED, sizeof FAILED - 1) < 0) {
+      // closing anyway
+    }
+    delete_vm(vm);
+    close(fd);
+    return false;
+  }
+  SESSION* s = &srv->sessions[srv->count++];
+  memset(s, 0, sizeof *s);
+  s->fd = fd;
+  s->vm = vm;
+  s->status = VM_BUDGET_EXHAUSTED;
+  s->last_active = time(NULL);
+  return true;
+}
+
+static void close_session(SESSION* s) {
+  close(s->fd);
+  s->fd = -1;
+  delete_vm(s->vm);
+  s->vm = NULL;
+  efree(s->out);
+  s->out = NULL;
+  s->out_len = s->out_allocated = 0;
+}
+
+static void run_session(SESSION* s, unsigned long budget) {
+  unsigned long executed = vm_executed(s->vm);
+  s->status = vm_step(s->vm, budget);
+  s->polling_keys = s->status == VM_BUDGET_EXHAUSTED && vm_executed(s->vm) - executed < budget;
+  size_t len;
+  const char* out = vm_output(s->vm, &len);
+  queue_output(s, out, len);
+  vm_clear_output(s->vm);
+  if (s->status == VM_ERROR) {
+    const char* message = vm_error(s->vm);
+    queue_output(s, message, strlen(message));
+  }
+  if (s->status == VM_DONE || s->status == VM_ERROR)
+    s->closing = true;
+  if (s->out_len)
+    write_session(s);
+}
+
+static void read_session(SESSION* s) {
+  char buf[1024];
+  ssize_t n = read(s->fd, buf, sizeof buf);
+  if (n > 0) {
+    vm_provide_keys(s->vm, buf, (size_t) n);
+    s->last_active = time(NULL);
+    if (s->status == VM_NEEDS_INPUT)
+      s->status = VM_BUDGET_EXHAUSTED;
+  }
+  else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    close_session(s);
+}
+
+static void write_session(SESSION* s) {
+  ssize_t n = write(s->fd, s->out, s->out_len);
+  if (n > 0) {
+    s->out_len -= (size_t) n;
+    memmove(s->out, s->out + n, s->out_len);
+    s->last_active = time(NULL);
+  }
+  else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    close_session(s);
+}
+
+static void queue_output(SESSION* s, const char* text, size_t len) {
+  if (s->out_len + len > s->out_allocated) {
+    s->out_allocated = s->out_len + len + 1024;
+    s->out = erealloc(s->out, s->out_allocated);
+  }
+  memcpy(s->out + s->out_len, text, len);
+  s->out_len += len;
+}
+
+#else // LINUX
+
+void serve(const Options* opt, NEW_SESSION_VM* new_session_vm) {
+  fatal("--serve is not supported on this platform\n");
+}
+
+#endif // LINUX
+
+#ifdef UNIT_TEST
+
+#include "CuTest.h"
+
+static void test_is_port_number(CuTest* tc) {
+  CuAssertIntEquals(tc, true, is_port_number("8080"));
+  CuAssertIntEquals(tc, true, is_port_number("0"));
+  CuAssertIntEquals(tc, false, is_port_number(""));
+  CuAssertIntEquals(tc, false, is_port_number("/tmp/basic.sock"));
+  CuAssertIntEquals(tc, false, is_port_number("80a"));
+  CuAssertIntEquals(tc, false, is_port_number("basic"));
+}
+
+#ifdef LINUX
+
+static VM* test_program(CuTest* tc, const char* text) {
+  VM* vm = new_vm(false, false, false, false);
+  CuAssertIntEquals(tc, true, vm_load_source_string(vm, text, "test"));
+  CuAssertIntEquals(tc, true, vm_compile(vm));
+  return vm;
+}
+
+// Connect a session of the program to a socket pair, returning the client end.
+static int test_session(CuTest* tc, SERVER* srv, VM* program) {
+  int sv[2];
+  CuAssertIntEquals(tc, 0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  set_nonblocking(sv[0]);
+  set_nonblocking(sv[1]);
+  CuAssertIntEquals(tc, true, add_session(srv, sv[0], program));
+  return sv[1];
+}
+
+// Read what the server has sent the client so far.
+static const char* client_read(int fd, char* buf, size_t size) {
+  size_t len = 0;
+  ssize_t n;
+  while (len + 1 < size && (n = read(fd, buf + len, size - 1 - len)) > 0)
+    len += (size_t) n;
+  buf[len] = '\0';
+  return buf;
+}
+
+static void test_session_input(CuTest* tc) {
+  VM* program = test_program(tc, "10 INPUT \"NAME\"; N$\n20 PRINT \"HELLO \"; N$\n");
+  SERVER srv;
+  init_server(&srv, 0, 0);
+  srv.max_wait_msec = 0;
+  int client = test_session(tc, &srv, program);
+  char buf[256];
+
+  serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, VM_NEEDS_INPUT, srv.sessions[0].status);
+  CuAssertStrEquals(tc, "NAME? ", client_read(client, buf, sizeof buf));
+
+  // the session runs again once the input arrives, then finishes and closes
+  CuAssertIntEquals(tc, 4, (int) write(client, "BOB\n", 4));
+  for (int i = 0; i < 10 && srv.count; i++)
+    serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, 0, srv.count);
+  CuAssertStrEquals(tc, "HELLO BOB\n", client_read(client, buf, sizeof buf));
+
+  close(client);
+  end_server(&srv);
+  delete_vm(program);
+}
+
+static void test_session_budget(CuTest* tc) {
+  VM* program = test_program(tc, "10 FOR I = 1 TO 100\n20 NEXT I\n30 PRINT \"DONE\"\n");
+  SERVER srv;
+  init_server(&srv, 50, 0);
+  srv.max_wait_msec = 0;
+  int a = test_session(tc, &srv, program);
+  int b = test_session(tc, &srv, program);
+  char buf[256];
+
+  // each session yields after its budget, letting the other run
+  serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, 2, srv.count);
+  for (unsigned i = 0; i < srv.count; i++) {
+    CuAssertIntEquals(tc, VM_BUDGET_EXHAUSTED, srv.sessions[i].status);
+    CuAssertTrue(tc, vm_executed(srv.sessions[i].vm) == 50);
+  }
+  serve_round(&srv, -1, program);
+  for (unsigned i = 0; i < srv.count; i++)
+    CuAssertTrue(tc, vm_executed(srv.sessions[i].vm) == 100);
+
+  for (int i = 0; i < 100 && srv.count; i++)
+    serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, 0, srv.count);
+  CuAssertStrEquals(tc, "DONE\n", client_read(a, buf, sizeof buf));
+  CuAssertStrEquals(tc, "DONE\n", client_read(b, buf, sizeof buf));
+
+  close(a);
+  close(b);
+  end_server(&srv);
+  delete_vm(program);
+}
+
+static void test_session_idle(CuTest* tc) {
+  VM* program = test_program(tc, "10 IF INKEY$ = \"\" THEN 10\n");
+  SERVER srv;
+  init_server(&srv, 100, 60);
+  srv.max_wait_msec = 0;
+  int client = test_session(tc, &srv, program);
+  char buf[256];
+
+  serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, 1, srv.count);
+  CuAssertIntEquals(tc, true, srv.sessions[0].polling_keys);
+
+  // polling for keys is not activity: the session times out without input
+  srv.sessions[0].last_active -= 61;
+  serve_round(&srv, -1, program);
+  CuAssertIntEquals(tc, 0, srv.count);
+  CuAssertStrEquals(tc, "\n* Idle timeout *\n", client_read(client, buf, sizeof buf));
+
+  close(client);
+  end_server(&srv);
+  delete_vm(program);
+}
+
+#endif // LINUX
+
+CuSuite* server_test_suite(void) {
+  CuSuite* suite = CuSuiteNew();
+  SUITE_ADD_TEST(suite, test_is_port_number);
+#ifdef LINUX
+  SUITE_ADD_TEST(suite, test_session_input);
+  SUITE_ADD_TEST(suite, test_session_budget);
+  SUITE_ADD_TEST(suite, test_session_idle);
+#endif
+  return suite;
+}
+
+#endif // UNIT_TEST
@@ -0,0 +1,21 @@
+// Legacy BASIC
+// Copyright (c) 2024 Nigel Perks
+// Serve sessions of a BASIC program to connected terminals.
+
+#pragma once
+
+#include <stdbool.h>
+#include "options.h"
+#include "run.h"
+
+// Create a VM with the program loaded, or return NULL.
+// Each session runs a clone of it, sharing the compiled program.
+typedef VM* NEW_SESSION_VM(const Options*);
+
+// Listen on opt->serve_address: a TCP port number on localhost, or a Unix-domain socket path.
+// Each connection runs a session of the program in the same process until it ends,
+// the connection closes, or it is idle longer than the idle timeout: neither
+// receiving input nor having output taken, whatever the program is doing.
+void serve(const Options*, NEW_SESSION_VM*);
+
+bool is_port_number(const char* address);
@@ -0,0 +1,22 @@
+10 REM TWO-DIMENSIONAL ARRAYS: MATRIX MULTIPLICATION
+20 N = 40
+30 DIM A(40,40), B(40,40), C(40,40)
+40 FOR I = 1 TO N
+50 FOR J = 1 TO N
+60 A(I,J) = I + J
+70 B(I,J) = I - J
+80 NEXT J
+90 NEXT I
+100 FOR R = 1 TO 10
+110 FOR I = 1 TO N
+120 FOR J = 1 TO N
+130 S = 0
+140 FOR K = 1 TO N
+150 S = S + A(I,K) * B(K,J)
+160 NEXT K
+170 C(I,J) = S
+180 NEXT J
+190 NEXT I
+200 NEXT R
+210 PRINT C(1,1); C(N,N)
+220 END
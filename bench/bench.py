@@ -0,0 +1,160 @@
+#!/usr/bin/python3
+
+# Legacy BASIC benchmarks: run each BASIC program in the bench directory
+# several times, and report the median wall time and the B-code instructions
+# executed per second, as a table and as JSON for comparing builds.
+
+import os
+import sys
+import json
+import time
+import platform
+import subprocess
+import statistics
+from glob import glob
+
+
+def fatal(msg):
+  print("FATAL:", msg)
+  sys.exit(1)
+
+
+def usage():
+  print("Usage:   bench.py --exe=INTERPRETER [--runs=N] [--output=FILE.json] [--baseline=FILE.json] [NAME...]")
+  print("Example: bench.py --exe=build/Release/LegacyBasic --output=bench.json bm1 sieve")
+  sys.exit(1)
+
+
+# A program of many lines, each run once, to stress loading and compiling.
+def generate_large_program(name, lines):
+  with open(name, "w") as f:
+    f.write("10 REM GENERATED PROGRAM FOR COMPILE-TIME STRESS\n")
+    num = 20
+    for i in range(lines):
+      v = i % 26
+      w = (i * 7) % 26
+      kind = i % 5
+      if kind == 0:
+        text = "LET %s = %s + %d * 2" % (chr(65 + v), chr(65 + w), i)
+      elif kind == 1:
+        text = "IF %s > %d THEN %s = %s - 1" % (chr(65 + v), i, chr(65 + v), chr(65 + v))
+      elif kind == 2:
+        text = "%s$ = LEFT$(\"ABCDEFGHIJ\", %d)" % (chr(65 + v), i % 10 + 1)
+      elif kind == 3:
+        text = "%s = INT(SQR(%d) + ABS(%s - %s))" % (chr(65 + w), i, chr(65 + v), chr(65 + w))
+      else:
+        text = "REM LINE %d OF %d" % (i, lines)
+      f.write("%d %s\n" % (num, text))
+      num += 10
+    f.write("%d END\n" % num)
+
+
+def run(exe, options, source):
+  return subprocess.run([exe, "-q"] + options + [source], stdin=subprocess.DEVNULL,
+                        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+
+
+# The number of instructions executed, from the statistics of one run.
+def count_instructions(exe, source):
+  r = run(exe, ["--stats"], source)
+  for line in r.stderr.splitlines():
+    if line.startswith("Instructions:"):
+      return int(line.split(":")[1])
+  fatal("no statistics from " + source + ":\n" + r.stderr)
+
+
+def bench(exe, source, runs):
+  name = os.path.splitext(os.path.basename(source))[0]
+  instructions = count_instructions(exe, source)
+  times = []
+  for i in range(runs):
+    start = time.perf_counter()
+    r = run(exe, [], source)
+    times.append(time.perf_counter() - start)
+    if r.returncode != 0:
+      fatal(source + " failed:\n" + r.stderr)
+  median = statistics.median(times)
+  return {
+    "name": name,
+    "runs": runs,
+    "median_sec": round(median, 6),
+    "min_sec": round(min(times), 6),
+    "max_sec": round(max(times), 6),
+    "instructions": instructions,
+    "instructions_per_sec": round(instructions / median) if median > 0 else 0,
+  }
+
+
+def load_baseline(name):
+  with open(name) as f:
+    report = json.load(f)
+  return { b["name"]: b for b in report["benchmarks"] }
+
+
+# MAIN
+
+BenchDir = os.path.dirname(os.path.abspath(__file__))
+Exe = None
+Runs = 5
+Output = None
+Baseline = None
+Names = []
+
+for arg in sys.argv[1:]:
+  if arg in ["--help","-h","-?","/?"]:
+    usage()
+  elif arg.startswith("--exe="):
+    Exe = arg[len("--exe="):]
+  elif arg.startswith("--runs="):
+    Runs = int(arg[len("--runs="):])
+  elif arg.startswith("--output="):
+    Output = arg[len("--output="):]
+  elif arg.startswith("--baseline="):
+    Baseline = load_baseline(arg[len("--baseline="):])
+  elif arg[0] == '-':
+    fatal("bench.py unknown option: " + arg)
+  else:
+    Names.append(arg)
+
+if Exe is None:
+  usage()
+if not os.path.isfile(Exe):
+  fatal("Interpreter not found: " + Exe)
+if Runs < 1:
+  fatal("At least one run is needed")
+
+Sources = sorted(glob(os.path.join(BenchDir, "*.bas")))
+WorkDir = os.path.dirname(os.path.abspath(Output)) if Output else os.getcwd()
+Large = os.path.join(WorkDir, "large.bas")
+generate_large_program(Large, 20000)
+Sources.append(Large)
+
+if Names:
+  Sources = [s for s in Sources if os.path.splitext(os.path.basename(s))[0] in Names]
+
+Results = []
+print("%-10s %10s %10s %14s %14s" % ("NAME", "MEDIAN S", "MIN S", "INSTRUCTIONS", "INSTR/SEC"), end="")
+print("  VS BASELINE" if Baseline else "")
+for source in Sources:
+  b = bench(Exe, source, Runs)
+  Results.append(b)
+  print("%-10s %10.4f %10.4f %14d %14d" % (b["name"], b["median_sec"], b["min_sec"], b["instructions"], b["instructions_per_sec"]), end="")
+  if Baseline and b["name"] in Baseline and b["median_sec"] > 0:
+    print("  %10.2fx" % (Baseline[b["name"]]["median_sec"] / b["median_sec"]))
+  else:
+    print()
+  sys.stdout.flush()
+
+os.remove(Large)
+
+if Output:
+  report = {
+    "interpreter": os.path.abspath(Exe),
+    "platform": platform.platform(),
+    "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+    "benchmarks": Results,
+  }
+  with open(Output, "w") as f:
+    json.dump(report, f, indent=2)
+    f.write("\n")
+  print("Report written to", Output)
@@ -0,0 +1,7 @@
+10 REM RUGG/FELDMAN BENCHMARK 1: EMPTY FOR LOOP
+20 REM LOOP COUNTS ARE SCALED UP FROM THE ORIGINAL 1000
+100 PRINT "S"
+200 FOR K=1 TO 5000000
+300 NEXT K
+400 PRINT "E"
+500 END
@@ -0,0 +1,7 @@
+10 REM RUGG/FELDMAN BENCHMARK 2: LOOP BY IF AND GOTO
+100 PRINT "S"
+200 K=0
+300 K=K+1
+400 IF K<2000000 THEN 300
+500 PRINT "E"
+600 END
@@ -0,0 +1,8 @@
+10 REM RUGG/FELDMAN BENCHMARK 3: ARITHMETIC ON VARIABLES
+100 PRINT "S"
+200 K=0
+300 K=K+1
+340 A=K/K*K+K-K
+400 IF K<1000000 THEN 300
+500 PRINT "E"
+600 END
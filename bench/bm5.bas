@@ -0,0 +1,10 @@
+10 REM RUGG/FELDMAN BENCHMARK 5: SUBROUTINE CALL
+100 PRINT "S"
+200 K=0
+300 K=K+1
+340 A=K/2*3+4-5
+350 GOSUB 700
+400 IF K<1000000 THEN 300
+500 PRINT "E"
+600 END
+700 RETURN
@@ -0,0 +1,13 @@
+10 REM RUGG/FELDMAN BENCHMARK 6: INNER FOR LOOP
+100 PRINT "S"
+200 K=0
+250 DIM M(5)
+300 K=K+1
+340 A=K/2*3+4-5
+350 GOSUB 700
+360 FOR L=1 TO 5
+380 NEXT L
+400 IF K<400000 THEN 300
+500 PRINT "E"
+600 END
+700 RETURN
@@ -0,0 +1,10 @@
+10 REM RUGG/FELDMAN BENCHMARK 8: BUILT-IN FUNCTIONS
+100 PRINT "S"
+200 K=0
+300 K=K+1
+330 A=K^2
+340 B=LOG(K)
+350 C=SIN(K)
+400 IF K<500000 THEN 300
+500 PRINT "E"
+600 END
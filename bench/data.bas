@@ -0,0 +1,12 @@
+10 REM READING DATA REPEATEDLY
+20 FOR K = 1 TO 100000
+30 RESTORE
+40 FOR I = 1 TO 10
+50 READ A, B$
+60 S = S + A
+70 NEXT I
+80 NEXT K
+90 PRINT S
+100 END
+1000 DATA 1, ONE, 2, TWO, 3, THREE, 4, FOUR, 5, FIVE
+1010 DATA 6, SIX, 7, SEVEN, 8, EIGHT, 9, NINE, 10, TEN
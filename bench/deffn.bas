@@ -0,0 +1,8 @@
+10 REM USER-DEFINED FUNCTIONS
+20 DEF FNS(X) = X * X
+30 DEF FNH(X) = X / 2 + 1
+40 FOR K = 1 TO 300000
+50 T = T + FNS(K / 1000) + FNH(K)
+60 NEXT K
+70 PRINT T
+80 END
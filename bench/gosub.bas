@@ -0,0 +1,12 @@
+10 REM NESTED SUBROUTINE CALLS
+20 FOR K = 1 TO 1000000
+30 GOSUB 100
+40 NEXT K
+50 PRINT T
+60 END
+100 GOSUB 200
+110 RETURN
+200 GOSUB 300
+210 RETURN
+300 T = T + 1
+310 RETURN
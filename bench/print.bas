@@ -0,0 +1,5 @@
+10 REM FORMATTED OUTPUT
+20 FOR K = 1 TO 20000
+30 PRINT K; TAB(10); "LINE"; K * 3.5, "END"
+40 NEXT K
+50 END
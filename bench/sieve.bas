@@ -0,0 +1,19 @@
+10 REM SIEVE OF ERATOSTHENES, REPEATED
+20 MAX = 20000
+30 DIM SIEVE(MAX)
+40 FOR R = 1 TO 10
+50 FOR I = 2 TO MAX
+60 SIEVE(I) = 0
+70 NEXT I
+80 C = 0
+100 FOR N = 2 TO MAX
+110 IF SIEVE(N) THEN 160
+120 C = C + 1
+125 IF N * N > MAX THEN 160
+130 FOR I = N * N TO MAX STEP N
+140 SIEVE(I) = 1
+150 NEXT I
+160 NEXT N
+170 NEXT R
+180 PRINT C; "PRIMES"
+190 END
@@ -0,0 +1,10 @@
+10 REM STRING CONCATENATION AND SLICING
+20 A$ = ""
+30 FOR K = 1 TO 500000
+40 A$ = A$ + CHR$(65 + K - INT(K / 26) * 26)
+50 IF LEN(A$) < 200 THEN 100
+60 B$ = LEFT$(A$, 10) + MID$(A$, 50, 10) + RIGHT$(A$, 10)
+70 A$ = ""
+100 NEXT K
+110 PRINT LEN(B$); B$
+120 END